@@ -0,0 +1,81 @@
+#include "nbhashmap.c"
+#include "murmurhash.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// analyse how some common hash functions spread a sample of keys; run as: ./analyze [hash] < keys
+// keys are read one per line, and should be distinct; without a hash name, all hashes are analysed
+
+static unsigned int murmur(void *key) { return murmurhash2a(key, strlen(key)); }
+
+static unsigned int fnv1a(void *key) {
+    unsigned int h = 2166136261u;
+    for (const unsigned char *s = key; *s; s++) { h ^= *s; h *= 16777619; }
+    return h;
+}
+
+static unsigned int djb2(void *key) {
+    unsigned int h = 5381;
+    for (const unsigned char *s = key; *s; s++) h = h * 33 + *s;
+    return h;
+}
+
+// like java's String.hashCode
+static unsigned int java(void *key) {
+    unsigned int h = 0;
+    for (const unsigned char *s = key; *s; s++) h = h * 31 + *s;
+    return h;
+}
+
+static struct { const char *name; hashmap_key_hash *hash; } hashes[] = {
+    { "murmur2a", murmur },
+    { "fnv1a", fnv1a },
+    { "djb2", djb2 },
+    { "java", java },
+};
+#define HASHES (sizeof(hashes) / sizeof(hashes[0]))
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [murmur2a|fnv1a|djb2|java] < keys\n", argv[0]);
+        return 1;
+    }
+
+    long n = 0, cap = 1024;
+    void **keys = malloc(sizeof(void *) * cap);
+    char *line = null;
+    size_t linecap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &linecap, stdin)) > 0) {
+        if (line[len - 1] == '\n') line[--len] = 0;
+        if (!len) continue;
+        if (n == cap) { cap *= 2; keys = realloc(keys, sizeof(void *) * cap); }
+        keys[n++] = strdup(line);
+    }
+    free(line);
+    if (!n) {
+        fprintf(stderr, "no keys on stdin\n");
+        return 1;
+    }
+
+    int found = 0;
+    for (unsigned i = 0; i < HASHES; i++) {
+        if (argc == 2 && strcmp(argv[1], hashes[i].name)) continue;
+        found = 1;
+        HashAnalysis a;
+        hashmap_analyze_keys(hashes[i].hash, keys, n, &a);
+        printf("** %s **\n", hashes[i].name);
+        hashmap_analysis_print(&a);
+        printf("\n");
+    }
+    if (!found) {
+        fprintf(stderr, "unknown hash: %s\n", argv[1]);
+        return 1;
+    }
+
+    for (long i = 0; i < n; i++) free(keys[i]);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,772 @@
+#include "nbhashmap.c"
+#include "murmurhash.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// benchmarks; run as: ./bench <name>
+
+static unsigned int makehash(void *key) { return murmurhash2a(key, strlen(key)); }
+static int keyequals(void *left, void *right) { return strcmp((const char *)left, (const char *)right) == 0; }
+
+static double now() {
+    struct timeval t;
+    gettimeofday(&t, 0);
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+// zipfian distribution over [0, n) using a precomputed cdf
+typedef struct zipf zipf;
+struct zipf { int n; double *cdf; };
+
+static zipf * zipf_new(int n, double s) {
+    zipf *z = malloc(sizeof(zipf));
+    z->n = n;
+    z->cdf = malloc(sizeof(double) * n);
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += 1.0 / pow(i + 1, s);
+    double acc = 0;
+    for (int i = 0; i < n; i++) {
+        acc += 1.0 / pow(i + 1, s) / sum;
+        z->cdf[i] = acc;
+    }
+    return z;
+}
+
+static int zipf_next(zipf *z) {
+    double u = random() / (double)RAND_MAX;
+    int lo = 0, hi = z->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (z->cdf[mid] < u) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static void zipf_free(zipf *z) { free(z->cdf); free(z); }
+
+
+// ** cache: hit ratio of the admission filter on a scan polluted zipfian trace **
+
+#define CACHE_KEYS     100000
+#define CACHE_OPS      1000000
+#define CACHE_SCANEVERY 50000   // every so many operations, a scan starts
+#define CACHE_SCANLEN  20000    // of this many keys that are never seen again
+
+static void noevict(void *val) { }
+
+static double cache_run(long capacity, int admit, double s, int scans) {
+    HashMap *map = hashmap_new(keyequals, makehash, free);
+    hashmap_set_cache(map, capacity, noevict);
+    map->cache->admit = admit;
+
+    srandom(42);
+    zipf *z = zipf_new(CACHE_KEYS, s);
+    char buf[64];
+    long hits = 0, lookups = 0, scanned = 0;
+    for (long i = 0; i < CACHE_OPS; i++) {
+        if (scans && i % CACHE_SCANEVERY == 0) {
+            for (int j = 0; j < CACHE_SCANLEN; j++) {
+                snprintf(buf, sizeof(buf), "scan-%ld", scanned++);
+                if (!hashmap_get(map, buf)) hashmap_putif(map, strdup(buf), "v", IGNORE);
+            }
+        }
+        snprintf(buf, sizeof(buf), "key-%d", zipf_next(z));
+        lookups++;
+        if (hashmap_get(map, buf)) hits++;
+        else hashmap_putif(map, strdup(buf), "v", IGNORE);
+    }
+    zipf_free(z);
+    hashmap_free(map);
+    return hits / (double)lookups;
+}
+
+static void bench_cache() {
+    long capacities[] = { 1000, 5000, 20000 };
+    print("zipf   scans  capacity  always-admit  tinylfu");
+    for (int s = 0; s < 2; s++) {
+        double skew = s ? 0.99 : 0.8;
+        for (int scans = 0; scans < 2; scans++) {
+            for (int c = 0; c < 3; c++) {
+                double off = cache_run(capacities[c], 0, skew, scans);
+                double on = cache_run(capacities[c], 1, skew, scans);
+                print("%.2f   %-5s  %8ld  %11.2f%%  %6.2f%%", skew, scans? "yes" : "no", capacities[c], off * 100, on * 100);
+            }
+        }
+    }
+}
+
+
+// ** ordered: insert overhead of the ordered index, against the speedup of range queries **
+
+#define ORDERED_KEYS    1000000
+#define ORDERED_THREADS 4
+#define ORDERED_QUERIES 1000
+
+typedef struct { HashMap *map; int tid; } ordered_arg;
+
+static void * ordered_insert(void *data) {
+    ordered_arg *a = data;
+    for (long i = a->tid; i < ORDERED_KEYS; i += ORDERED_THREADS) {
+        unsigned long k = 1 + ((unsigned long)i * 2654435761UL) % (ORDERED_KEYS * 16UL); // spread out, unique
+        hashmap_putif(a->map, (void *)k, (void *)k, IGNORE);
+    }
+    return null;
+}
+
+static double ordered_fill(HashMap *map) {
+    pthread_t threads[ORDERED_THREADS];
+    ordered_arg args[ORDERED_THREADS];
+    double start = now();
+    for (int i = 0; i < ORDERED_THREADS; i++) {
+        args[i].map = map; args[i].tid = i;
+        pthread_create(&threads[i], null, ordered_insert, &args[i]);
+    }
+    for (int i = 0; i < ORDERED_THREADS; i++) pthread_join(threads[i], null);
+    return now() - start;
+}
+
+// what a user without an index has to do: look at every slot
+static long scan_range(HashMap *map, unsigned long from, unsigned long to) {
+    header *kvs = getkvs(map);
+    long count = 0;
+    for (int i = 0; i < kvs->len; i++) {
+        entry *e = _load(kvs, i);
+        unsigned long k = (unsigned long)getkey(e);
+        void *v = getval(e);
+        if (k >= from && k < to && v && v != SIZED) count++;
+    }
+    return count;
+}
+
+static void bench_ordered() {
+    HashMap *plain = hashmap_new(null, null, null);
+    HashMap *ordered = hashmap_new(null, null, null);
+    hashmap_set_ordered(ordered);
+
+    double tplain = ordered_fill(plain);
+    double tordered = ordered_fill(ordered);
+    print("insert %d keys, %d threads: plain %.3fs, ordered %.3fs (%.2fx)",
+            ORDERED_KEYS, ORDERED_THREADS, tplain, tordered, tordered / tplain);
+
+    unsigned long space = ORDERED_KEYS * 16UL;
+    unsigned long widths[] = { space / 10000, space / 1000, space / 100 };
+    for (int w = 0; w < 3; w++) {
+        // scanning is so slow, we only do a hundredth of the queries, both see the same keys
+        srandom(7);
+        long c1 = 0, c2 = 0, c2first = 0;
+        double start = now();
+        for (int q = 0; q < ORDERED_QUERIES / 100; q++) {
+            unsigned long from = random() % (space - widths[w]);
+            c1 += scan_range(plain, from, from + widths[w]);
+        }
+        double tscan = (now() - start) * 100;
+        srandom(7);
+        start = now();
+        for (int q = 0; q < ORDERED_QUERIES; q++) {
+            unsigned long from = random() % (space - widths[w]);
+            c2 += hashmap_range(ordered, from, from + widths[w], null, null);
+            if (q == ORDERED_QUERIES / 100 - 1) c2first = c2;
+        }
+        double trange = now() - start;
+        print("%d range queries of %.2f%% (~%ld keys): scan %.3fs, index %.4fs (%.0fx)",
+                ORDERED_QUERIES, 100.0 * widths[w] / space, c2 / ORDERED_QUERIES, tscan, trange, tscan / trange);
+        assert(c1 == c2first);
+    }
+    hashmap_free(plain);
+    hashmap_free(ordered);
+}
+
+// ** slot handles **
+// repeated updates of the same keys: putif must hash, probe, and free the duplicate key; a handle does none of that
+
+#define HANDLE_KEYS 1000
+#define HANDLE_ROUNDS 2000
+
+static void bench_handles() {
+    HashMap *map = hashmap_new(keyequals, makehash, free);
+    char buf[100];
+    char *keys[HANDLE_KEYS];
+    HashHandle handles[HANDLE_KEYS];
+    for (int i = 0; i < HANDLE_KEYS; i++) {
+        snprintf(buf, 100, "connection-state-%d", i);
+        keys[i] = strdup(buf);
+        hashmap_putif(map, strdup(buf), (void *)1, IGNORE);
+        hashmap_pin(map, keys[i], &handles[i]);
+    }
+
+    double start = now();
+    for (long r = 0; r < HANDLE_ROUNDS; r++) {
+        for (int i = 0; i < HANDLE_KEYS; i++) hashmap_putif(map, strdup(keys[i]), (void *)r, IGNORE);
+    }
+    double tputif = now() - start;
+
+    start = now();
+    for (long r = 0; r < HANDLE_ROUNDS; r++) {
+        for (int i = 0; i < HANDLE_KEYS; i++) hashmap_handle_cas(&handles[i], (void *)r, IGNORE);
+    }
+    double thandle = now() - start;
+    print("%d updates: putif %.3fs, handle %.3fs (%.1fx)",
+            HANDLE_KEYS * HANDLE_ROUNDS, tputif, thandle, tputif / thandle);
+
+    for (int i = 0; i < HANDLE_KEYS; i++) free(keys[i]);
+    hashmap_free(map);
+}
+
+// ** random sampling **
+// cost of a sample at a high load, and at a 1% load; linear probing with REPROBE_LIMIT doubles the table long before
+// a 90% load, so high is as full as a table gets before it doubles
+
+#define SAMPLE_LEN (1024 * 1024)
+#define SAMPLE_COUNT 1000000
+
+// how many keys fit in a table of SAMPLE_LEN, before it doubles
+static long sample_fit() {
+    HashMap *map = hashmap_new(null, null, null);
+    long n = 0;
+    while (getkvs(map)->len <= SAMPLE_LEN) hashmap_putif(map, (void *)++n, (void *)1, IGNORE);
+    hashmap_free(map);
+    return n - 1;
+}
+
+static double sample_time(HashMap *map) {
+    void *out[2 * 16];
+    double start = now();
+    for (int i = 0; i < SAMPLE_COUNT / 16; i++) hashmap_sample(map, 16, out);
+    return (now() - start) * 1e9 / SAMPLE_COUNT;
+}
+
+static void bench_sample() {
+    long n = sample_fit();
+    const char *names[2] = { "scanning", "sampled" };
+    for (int m = 0; m < 2; m++) {
+        HashMap *map = hashmap_new(null, null, null);
+        if (m) hashmap_set_sampled(map);
+        double start = now();
+        for (long i = 1; i <= n; i++) hashmap_putif(map, (void *)i, (void *)1, IGNORE);
+        double tfill = now() - start;
+        assert(getkvs(map)->len == SAMPLE_LEN);
+        print("%s: insert %ld keys: %.3fs", names[m], n, tfill);
+        print("%s: load %.2f: %.0fns per sample", names[m], hashmap_size(map) / (double)SAMPLE_LEN, sample_time(map));
+        for (long i = SAMPLE_LEN / 100 + 1; i <= n; i++) hashmap_putif(map, (void *)i, null, IGNORE);
+        print("%s: load %.2f: %.0fns per sample", names[m], hashmap_size(map) / (double)SAMPLE_LEN, sample_time(map));
+        hashmap_free(map);
+    }
+}
+// ** windowed maps **
+// starting a new window: rotating, against deleting every mapping of the last window
+
+#define WINDOW_KEYS (4 * 1000 * 1000)
+
+static void bench_window() {
+    HashMap *map = hashmap_new(null, null, null);
+    for (long i = 1; i <= WINDOW_KEYS; i++) hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+    double start = now();
+    for (long i = 1; i <= WINDOW_KEYS; i++) hashmap_putif(map, (void *)i, null, IGNORE);
+    double tclear = now() - start;
+
+    for (long i = 1; i <= WINDOW_KEYS; i++) hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+    start = now();
+    hashmap_rotate(map);
+    double trotate = now() - start;
+    print("new window after %d keys: delete all %.3fs, rotate %.6fs", WINDOW_KEYS, tclear, trotate);
+
+    // the first writes in a new window touch fresh pages
+    start = now();
+    for (long i = 1; i <= WINDOW_KEYS; i++) hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+    print("refill rotated window: %.3fs", now() - start);
+    hashmap_free(map);
+}
+
+// ** delegation **
+// counting on a few hot keys from many threads: cas loops with hashmap_putif, against sending updates to owners
+
+#define DELEGATE_THREADS 8
+#define DELEGATE_OWNERS 2
+#define DELEGATE_KEYS 8
+#define DELEGATE_OPS 1000000
+
+static void * add_one(void *val, void *arg) { return (void *)((long)val + 1); }
+
+typedef struct { HashMap *map; HashDelegate *d; int client; } delegate_arg;
+
+static void * delegate_plain(void *data) {
+    delegate_arg *a = data;
+    for (long i = 0; i < DELEGATE_OPS; i++) {
+        void *key = (void *)(1 + i % DELEGATE_KEYS);
+        while (1) {
+            void *v = hashmap_get(a->map, key);
+            if (hashmap_putif(a->map, key, (void *)((long)v + 1), v) == v) break;
+        }
+    }
+    return null;
+}
+
+static void * delegate_client(void *data) {
+    delegate_arg *a = data;
+    for (long i = 0; i < DELEGATE_OPS; i++) hashdelegate_update(a->d, a->client, (void *)(1 + i % DELEGATE_KEYS), add_one, null);
+    hashdelegate_flush(a->d, a->client);
+    return null;
+}
+
+static double delegate_run(HashMap *map, HashDelegate *d, void *(*fn)(void *)) {
+    pthread_t threads[DELEGATE_THREADS];
+    delegate_arg args[DELEGATE_THREADS];
+    double start = now();
+    for (int i = 0; i < DELEGATE_THREADS; i++) {
+        args[i].map = map; args[i].d = d; args[i].client = i;
+        pthread_create(&threads[i], null, fn, &args[i]);
+    }
+    for (int i = 0; i < DELEGATE_THREADS; i++) pthread_join(threads[i], null);
+    double t = now() - start;
+    long total = 0;
+    for (long k = 1; k <= DELEGATE_KEYS; k++) total += (long)hashmap_get(map, (void *)k);
+    assert(total == (long)DELEGATE_THREADS * DELEGATE_OPS);
+    return t;
+}
+
+static void bench_delegate() {
+    HashMap *map = hashmap_new(null, null, null);
+    double tplain = delegate_run(map, null, delegate_plain);
+    hashmap_free(map);
+
+    map = hashmap_new(null, null, null);
+    HashDelegate *d = hashdelegate_new(map, DELEGATE_OWNERS, DELEGATE_THREADS);
+    double tdelegate = delegate_run(map, d, delegate_client);
+    hashdelegate_free(d);
+    hashmap_free(map);
+
+    double ops = (double)DELEGATE_THREADS * DELEGATE_OPS;
+    print("%d threads, %d keys, %.0f increments on %ld cores: putif %.3fs (%.1fM/s), delegated to %d owners %.3fs (%.1fM/s)",
+            DELEGATE_THREADS, DELEGATE_KEYS, ops, sysconf(_SC_NPROCESSORS_ONLN),
+            tplain, ops / tplain / 1e6, DELEGATE_OWNERS, tdelegate, ops / tdelegate / 1e6);
+}
+
+// ** teardown **
+// freeing a large map with string keys: one thread, several threads, or keys free'd in bulk
+
+#define TEARDOWN_KEYS (4 * 1000 * 1000)
+
+static void nofree(void *key) { }
+
+static HashMap * teardown_fill(char *arena) {
+    HashMap *map = hashmap_new(keyequals, makehash, arena? nofree : free);
+    char buf[32];
+    for (long i = 0; i < TEARDOWN_KEYS; i++) {
+        char *key = arena? arena + i * 32 : buf;
+        snprintf(key, 32, "teardown-%ld", i);
+        hashmap_putif(map, arena? key : strdup(key), (void *)1, IGNORE);
+    }
+    return map;
+}
+
+static void bench_teardown() {
+    HashMap *map = teardown_fill(null);
+    double start = now();
+    hashmap_free(map);
+    double tfree = now() - start;
+
+    map = teardown_fill(null);
+    start = now();
+    hashmap_free_parallel(map, 4);
+    double tparallel = now() - start;
+
+    char *arena = malloc(32L * TEARDOWN_KEYS);
+    map = teardown_fill(arena);
+    hashmap_set_bulk_keys(map);
+    start = now();
+    hashmap_free(map);
+    free(arena);
+    double tbulk = now() - start;
+
+    map = teardown_fill(null);
+    start = now();
+    hashmap_free_async(map);
+    double tasync = now() - start;
+    print("free %d keys: %.3fs, 4 threads %.3fs, bulk keys %.4fs, async returns after %.6fs",
+            TEARDOWN_KEYS, tfree, tparallel, tbulk, tasync);
+    sleep(2); // let the background thread finish
+}
+
+
+#define WARM_KEYS 4000000
+#define WARM_HOT 1000000
+
+// load the hottest quarter of a map, one putif at a time into a growing table, or imported into a presized table
+static void bench_warm() {
+    const char *path = "/tmp/nbhashmap-bench.hot";
+    HashMap *map = hashmap_new(null, null, null);
+    hashmap_track_hot(map, WARM_HOT);
+    for (long i = 1; i <= WARM_KEYS; i++) hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+    for (long i = 1; i <= WARM_KEYS; i += 4) {
+        for (int r = 0; r < 8; r++) hashmap_get(map, (void *)i);
+    }
+    double start = now();
+    long n = hashmap_export_hot(map, WARM_HOT, path, null, null);
+    double texport = now() - start;
+    hashmap_free(map);
+
+    HashMap *cold = hashmap_new(null, null, null);
+    start = now();
+    for (long i = 1; i <= WARM_KEYS; i += 4) hashmap_putif(cold, (void *)i, (void *)i, IGNORE);
+    double tput = now() - start;
+    hashmap_free(cold);
+
+    HashMap *warm = hashmap_new(null, null, null);
+    start = now();
+    long loaded = hashmap_import(warm, path, null, null, 4);
+    double timport = now() - start;
+    hashmap_free(warm);
+    unlink(path);
+    print("warm %ld of %d keys: export %.3fs, putif %.3fs, import %ld in %.3fs", n, WARM_KEYS, texport, tput, loaded, timport);
+}
+
+#define TLB_KEYS 4000000
+#define TLB_LOOKUPS 4000000
+
+// open a counter of dTLB read misses of this thread, -1 if perf events are not available
+static int tlb_counter() {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+// random lookups in a large table, with dTLB misses per lookup when perf events are available
+static void tlb_run(const char *name, int shift, int paged) {
+    HashMap *map = hashmap_new(null, null, null);
+    if (shift) hashmap_set_huge_pages(map, shift, paged);
+    hashmap_reserve(map, TLB_KEYS);
+    for (long i = 1; i <= TLB_KEYS; i++) hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+
+    int fd = tlb_counter();
+#ifdef __linux__
+    if (fd >= 0) { ioctl(fd, PERF_EVENT_IOC_RESET, 0); ioctl(fd, PERF_EVENT_IOC_ENABLE, 0); }
+#endif
+    unsigned int r = 42;
+    long found = 0;
+    double start = now();
+    for (long i = 0; i < TLB_LOOKUPS; i++) {
+        r = r * 1103515245 + 12345;
+        if (hashmap_get(map, (void *)(long)(1 + r % TLB_KEYS))) found++;
+    }
+    double t = now() - start;
+    long long misses = -1;
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+        close(fd);
+    }
+#endif
+    assert(found == TLB_LOOKUPS);
+    if (misses >= 0) {
+        print("%s: %.1f ns per lookup, %.2f dTLB misses per lookup, %ldKB pages",
+                name, t * 1e9 / TLB_LOOKUPS, misses / (double)TLB_LOOKUPS, hashmap_page_size(map) / 1024);
+    } else {
+        print("%s: %.1f ns per lookup, dTLB misses not available (perf events), %ldKB pages",
+                name, t * 1e9 / TLB_LOOKUPS, hashmap_page_size(map) / 1024);
+    }
+    hashmap_free(map);
+}
+
+static void bench_tlb() {
+    tlb_run("4KB pages", 0, 0);
+    tlb_run("2MB pages", HASHMAP_PAGES_2M, 0);
+    tlb_run("2MB pages, paged probing", HASHMAP_PAGES_2M, 1);
+}
+
+#define WB_UPDATES 2000000
+
+static int wb_sink(void **pairs, long n, void *data) {
+    return fwrite(pairs, sizeof(void *) * 2, n, (FILE *)data) != n;
+}
+
+// updates written through to a file by the updating thread, or written behind in batches
+static void bench_write_behind() {
+    FILE *f = fopen("/dev/null", "w");
+    HashMap *map = hashmap_new(null, null, null);
+    double start = now();
+    for (long i = 0; i < WB_UPDATES; i++) {
+        void *kv[2] = { (void *)(1 + i % 100000), (void *)(i * 2) };
+        hashmap_putif(map, kv[0], kv[1], IGNORE);
+        wb_sink(kv, 1, f);
+    }
+    double tthrough = now() - start;
+    hashmap_free(map);
+
+    map = hashmap_new(null, null, null);
+    hashmap_set_write_behind(map, wb_sink, f, 10);
+    start = now();
+    for (long i = 0; i < WB_UPDATES; i++) hashmap_putif(map, (void *)(1 + i % 100000), (void *)(i * 2), IGNORE);
+    double tbehind = now() - start;
+    hashmap_free(map);
+    fclose(f);
+    print("%d updates: write-through %.3fs, write-behind %.3fs", WB_UPDATES, tthrough, tbehind);
+}
+
+#define FLIGHT_PUTS 4000000
+
+// the cost of recording state transitions
+static void bench_flight() {
+    double t[2];
+    for (int on = 0; on < 2; on++) {
+        if (on) hashmap_flight_start("/tmp/nbhashmap-bench.flight");
+        HashMap *map = hashmap_new(null, null, null);
+        double start = now();
+        for (long i = 1; i <= FLIGHT_PUTS; i++) hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+        t[on] = now() - start;
+        hashmap_free(map);
+    }
+    hashmap_flight_stop();
+    print("%d inserts: %.3fs, recording %.3fs", FLIGHT_PUTS, t[0], t[1]);
+}
+
+#define FIFO_PUTS 2000000
+#define FIFO_LIMIT 100000
+
+// a fifo cache of at most FIFO_LIMIT mappings, against inserts into a plain map
+static void bench_fifo() {
+    double t[2];
+    for (int ordered = 0; ordered < 2; ordered++) {
+        HashMap *map = hashmap_new(null, null, null);
+        if (ordered) hashmap_set_insertion_ordered(map);
+        double start = now();
+        for (long i = 1; i <= FIFO_PUTS; i++) {
+            hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+            if (ordered && i % 1024 == 0 && hashmap_size(map) > FIFO_LIMIT) hashmap_evict_oldest(map, hashmap_size(map) - FIFO_LIMIT, null, null);
+        }
+        t[ordered] = now() - start;
+        if (ordered) assert(hashmap_visit_insertion_order(map, null, null) == hashmap_size(map));
+        hashmap_free(map);
+    }
+    print("%d inserts: %.3fs, insertion ordered, evicting down to %d: %.3fs", FIFO_PUTS, t[0], FIFO_LIMIT, t[1]);
+}
+
+// the cost of tuning at process start, against loading a profile
+static void bench_tune() {
+    const char *path = "/tmp/nbhashmap-bench.tuning";
+    unlink(path);
+    double start = now();
+    hashmap_tune(path);
+    double measure = now() - start;
+    start = now();
+    hashmap_tune(path);
+    double load = now() - start;
+    unlink(path);
+    const HashTuning *t = hashmap_tuning();
+    print("tuning: measured in %.3fs, loaded in %.6fs", measure, load);
+    print("%s: block size %d, spin %d, reprobe limit %d, prefetch %d", t->cpu, t->block_size, t->spin, t->reprobe_limit, t->prefetch);
+}
+
+#define SEED_KEYS 4000
+
+static int seedequals(void *l, void *r) { return l == r; }
+static unsigned int seedhash(void *key) { return (unsigned int)(long)key << 12; } // clusters in any table
+static void seedfree(void *key) { }
+
+// inserting and reading keys that all share the low bits of their hash, unseeded and seeded
+static void bench_reseed() {
+    double t[2];
+    unsigned long len[2];
+    for (int seeded = 0; seeded < 2; seeded++) {
+        HashMap *map = hashmap_new(seedequals, seedhash, seedfree);
+        if (seeded) hashmap_reseed(map);
+        double start = now();
+        for (long i = 1; i <= SEED_KEYS; i++) hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+        for (int r = 0; r < 100; r++) {
+            for (long i = 1; i <= SEED_KEYS; i++) hashmap_get(map, (void *)i);
+        }
+        t[seeded] = now() - start;
+        len[seeded] = getkvs(map)->len;
+        hashmap_free(map);
+    }
+    print("%d clustered keys: %.3fs, table %lu; seeded: %.3fs, table %lu", SEED_KEYS, t[0], len[0], t[1], len[1]);
+}
+
+#define FC_URLS 200000
+
+static void fc_url(char *buf, long len, long i) {
+    snprintf(buf, len, "https://cdn.example.com/assets/v2/%s/%ld/thumbnail-%ld.jpg", i % 2? "products" : "users", i % 1000, i);
+}
+
+// key bytes and lookups of url keys, as given and front coded
+static void bench_front_coded() {
+    char key[128];
+    long raw = 0;
+    for (long i = 0; i < FC_URLS; i++) { fc_url(key, sizeof(key), i); raw += strlen(key) + 1; }
+    double t[2];
+    long bytes = 0;
+    for (int fc = 0; fc < 2; fc++) {
+        HashMap *map = hashmap_new(keyequals, makehash, free);
+        if (fc) hashmap_set_front_coded(map);
+        for (long i = 0; i < FC_URLS; i++) { fc_url(key, sizeof(key), i); hashmap_putif(map, strdup(key), (void *)(i + 1), IGNORE); }
+        hashmap_compact(map);
+        for (fc_chunk *c = getkvs(map)->keys; c; c = c->next) bytes += 1L << c->shift;
+        double start = now();
+        for (int r = 0; r < 5; r++) {
+            for (long i = 0; i < FC_URLS; i++) { fc_url(key, sizeof(key), i); hashmap_get(map, key); }
+        }
+        t[fc] = now() - start;
+        hashmap_free(map);
+    }
+    print("%d urls: %ld key bytes, %.3fs lookups; front coded: %ld bytes in chunks, %.3fs", FC_URLS, raw, t[0], bytes, t[1]);
+}
+
+#define BATCH_KEYS (1 << 22)
+
+// random lookups in a table much larger than the caches, one by one and in batches
+static void bench_get_many() {
+    HashMap *map = hashmap_new(null, null, null);
+    for (long i = 1; i <= BATCH_KEYS; i++) hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+    void *keys[64], *vals[64];
+    unsigned int r = 1;
+    double t[2];
+    for (int batched = 0; batched < 2; batched++) {
+        double start = now();
+        for (long n = 0; n < BATCH_KEYS; n += 64) {
+            for (int i = 0; i < 64; i++) { r = r * 1103515245 + 12345; keys[i] = (void *)(long)(r % BATCH_KEYS + 1); }
+            if (batched) hashmap_get_many(map, keys, 64, vals);
+            else for (int i = 0; i < 64; i++) vals[i] = hashmap_get(map, keys[i]);
+        }
+        t[batched] = now() - start;
+    }
+    hashmap_free(map);
+    print("%d random lookups: %.3fs one by one, %.3fs in batches", BATCH_KEYS, t[0], t[1]);
+}
+
+#define DENSE_KEYS (1 << 22)
+
+// nearly contiguous integer keys, hashed and dense: inserting, random lookups and memory
+static void bench_dense() {
+    double put[2], get[2];
+    unsigned long bytes[2];
+    for (int dense = 0; dense < 2; dense++) {
+        HashMap *map = hashmap_new(null, null, null);
+        if (dense) hashmap_set_dense(map);
+        double start = now();
+        for (long i = 1; i <= DENSE_KEYS; i++) if (i % 16) hashmap_putif(map, (void *)i, (void *)i, IGNORE);
+        put[dense] = now() - start;
+        unsigned int r = 1;
+        start = now();
+        for (long n = 0; n < DENSE_KEYS; n++) { r = r * 1103515245 + 12345; hashmap_get(map, (void *)(long)(r % DENSE_KEYS + 1)); }
+        get[dense] = now() - start;
+        bytes[dense] = hashmap_memory(map);
+        hashmap_free(map);
+    }
+    print("%d keys, 1 in 16 missing: hashed %.3fs puts, %.3fs gets, %lu bytes; dense %.3fs puts, %.3fs gets, %lu bytes",
+            DENSE_KEYS, put[0], get[0], bytes[0], put[1], get[1], bytes[1]);
+}
+
+#define LATENCY_OPS (1 << 21)
+#define LATENCY_ROUNDS 3
+
+// inserts and lookups without latency sampling, sampling 1 in 64, and sampling all; then the histograms
+// the settings take turns, and each gets its best of LATENCY_ROUNDS, so none pays for warming up the allocator alone
+static void bench_latency() {
+    static const unsigned int every[3] = { 0, 64, 1 };
+    double t[3] = { 0, 0, 0 };
+    for (int r = 0; r < LATENCY_ROUNDS; r++) {
+        for (int i = 0; i < 3; i++) {
+            if (every[i]) hashmap_latency_start(every[i]);
+            else hashmap_latency_stop();
+            HashMap *map = hashmap_new(null, null, null);
+            double start = now();
+            for (long k = 1; k <= LATENCY_OPS; k++) hashmap_putif(map, (void *)k, (void *)k, IGNORE);
+            for (long k = 1; k <= LATENCY_OPS; k++) hashmap_get(map, (void *)k);
+            double took = now() - start;
+            if (!r || took < t[i]) t[i] = took;
+            hashmap_free(map);
+        }
+    }
+    hashmap_latency_stop();
+    print("%d inserts and lookups: %.3fs, sampling 1 in 64 %.3fs, sampling all %.3fs", LATENCY_OPS, t[0], t[1], t[2]);
+    HashLatency *lat = malloc(sizeof(HashLatency));
+    hashmap_latency(lat);
+    hashmap_latency_print(lat);
+    free(lat);
+}
+
+#define OVERLAY_BASE (1 << 20)
+#define OVERLAY_OVERRIDES 1000
+
+// a new version of a large map with a few overrides: copying the base, against an overlay; then lookups in both
+static void bench_overlay() {
+    HashMap *base = hashmap_new(null, null, null);
+    for (long k = 1; k <= OVERLAY_BASE; k++) hashmap_putif(base, (void *)k, (void *)k, IGNORE);
+
+    double start = now();
+    HashMap *copy = hashmap_new(null, null, null);
+    hashmap_reserve(copy, OVERLAY_BASE);
+    for (long k = 1; k <= OVERLAY_BASE; k++) hashmap_putif(copy, (void *)k, hashmap_get(base, (void *)k), IGNORE);
+    for (long k = 1; k <= OVERLAY_OVERRIDES; k++) hashmap_putif(copy, (void *)(k * 997), (void *)k, IGNORE);
+    double copied = now() - start;
+
+    start = now();
+    HashOverlay *o = hashmap_overlay_new(base);
+    for (long k = 1; k <= OVERLAY_OVERRIDES; k++) hashmap_overlay_put(o, (void *)(k * 997), (void *)k);
+    double layered = now() - start;
+
+    unsigned int r = 1;
+    start = now();
+    for (long n = 0; n < OVERLAY_BASE; n++) { r = r * 1103515245 + 12345; hashmap_get(copy, (void *)(long)(r % OVERLAY_BASE + 1)); }
+    double get_copy = now() - start;
+    r = 1;
+    start = now();
+    for (long n = 0; n < OVERLAY_BASE; n++) { r = r * 1103515245 + 12345; hashmap_overlay_get(o, (void *)(long)(r % OVERLAY_BASE + 1)); }
+    double get_overlay = now() - start;
+
+    start = now();
+    hashmap_overlay_compact(o);
+    double compact = now() - start;
+    print("%d mappings, %d overrides: copy %.3fs, overlay %.5fs; %d lookups: copy %.3fs, overlay %.3fs; compact %.3fs",
+            OVERLAY_BASE, OVERLAY_OVERRIDES, copied, layered, OVERLAY_BASE, get_copy, get_overlay, compact);
+    hashmap_free(copy);
+    hashmap_overlay_free(o);
+}
+
+int main(int argc, char **argv) {
+    const char *name = argc > 1 ? argv[1] : "all";
+    int all = strcmp(name, "all") == 0;
+    double start = now();
+
+    if (all || !strcmp(name, "cache")) bench_cache();
+    if (all || !strcmp(name, "ordered")) bench_ordered();
+    if (all || !strcmp(name, "handles")) bench_handles();
+    if (all || !strcmp(name, "sample")) bench_sample();
+    if (all || !strcmp(name, "window")) bench_window();
+    if (all || !strcmp(name, "delegate")) bench_delegate();
+    if (all || !strcmp(name, "teardown")) bench_teardown();
+    if (all || !strcmp(name, "warm")) bench_warm();
+    if (all || !strcmp(name, "tlb")) bench_tlb();
+    if (all || !strcmp(name, "writebehind")) bench_write_behind();
+    if (all || !strcmp(name, "flight")) bench_flight();
+    if (all || !strcmp(name, "fifo")) bench_fifo();
+    if (all || !strcmp(name, "tune")) bench_tune();
+    if (all || !strcmp(name, "reseed")) bench_reseed();
+    if (all || !strcmp(name, "frontcoded")) bench_front_coded();
+    if (all || !strcmp(name, "batch")) bench_get_many();
+    if (all || !strcmp(name, "dense")) bench_dense();
+    if (all || !strcmp(name, "latency")) bench_latency();
+    if (all || !strcmp(name, "overlay")) bench_overlay();
+
+    print("bench: %s done in %.2fs", name, now() - start);
+    return 0;
+}
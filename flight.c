@@ -0,0 +1,76 @@
+#include "nbhashmap.c"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// decode a flight recorder dump into one timeline of all threads; run as: ./flight dump [last]
+// with last, only the last that many events are printed
+
+static const char *flight_names[] = {
+    "?", "claim", "hash", "value", "lost", "copy", "sized", "promise", "publish", "help",
+};
+#define FLIGHT_NAMES (sizeof(flight_names) / sizeof(flight_names[0]))
+
+typedef struct timeline_event timeline_event;
+struct timeline_event {
+    flight_event ev;
+    unsigned long thread;
+};
+
+static int by_time(const void *l, const void *r) {
+    unsigned long long a = ((const timeline_event *)l)->ev.tsc, b = ((const timeline_event *)r)->ev.tsc;
+    return a < b? -1 : a > b;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s dump [last]\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open: %s\n", argv[1]);
+        return 1;
+    }
+    flight_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, FLIGHT_MAGIC, sizeof(h.magic)) || h.version != 1) {
+        fprintf(stderr, "not a flight recorder dump: %s\n", argv[1]);
+        return 1;
+    }
+
+    // a ring holds its last FLIGHT_EVENTS events, in order from pos onwards
+    timeline_event *events = malloc(sizeof(timeline_event) * FLIGHT_EVENTS * (h.rings + 1));
+    flight_event *ring = malloc(sizeof(flight_event) * FLIGHT_EVENTS);
+    assert(events); assert(ring);
+    long n = 0;
+    unsigned int rings = 0;
+    for (; rings < h.rings; rings++) {
+        unsigned long meta[2];
+        if (fread(meta, sizeof(meta), 1, f) != 1 || fread(ring, sizeof(flight_event), FLIGHT_EVENTS, f) != FLIGHT_EVENTS) break;
+        unsigned long pos = meta[1], count = pos < FLIGHT_EVENTS? pos : FLIGHT_EVENTS;
+        for (unsigned long i = pos - count; i < pos; i++) {
+            events[n].ev = ring[i & (FLIGHT_EVENTS - 1)];
+            events[n].thread = meta[0];
+            n++;
+        }
+    }
+    fclose(f);
+    if (rings < h.rings) fprintf(stderr, "truncated dump, read %u of %u threads\n", rings, h.rings);
+
+    qsort(events, n, sizeof(timeline_event), by_time);
+    long from = 0;
+    if (argc == 3 && atol(argv[2]) < n) from = n - atol(argv[2]);
+    unsigned long long start = n? events[0].ev.tsc : 0;
+    printf("%ld events of %u threads\n", n, rings);
+    printf("%14s %8s %-8s %6s %10s\n", "us", "thread", "event", "table", "arg");
+    for (long i = from; i < n; i++) {
+        flight_event *ev = &events[i].ev;
+        unsigned int event = ev->tag >> 24;
+        printf("%14.3f %8lu %-8s %06x %10u\n", (ev->tsc - start) / h.ticks_per_us, events[i].thread,
+                flight_names[event < FLIGHT_NAMES? event : 0], ev->tag & 0xffffff, ev->arg);
+    }
+    free(ring);
+    free(events);
+    return 0;
+}
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define HAVE_DEBUG
+#include "debug.h"
+
+// a load generator for the server; run as: ./loadgen address [connections] [depth] [seconds] [-b]
+// every connection sends depth requests at once, 9 in 10 gets, and waits for all responses before sending more; with
+// -b it speaks the binary protocol. Start the server first, e.g. ./server 127.0.0.1:11311 & ./loadgen 127.0.0.1:11311
+
+#define KEYS 100000
+#define VALUE_LEN 32
+#define MAX_DEPTH 1024
+
+static const char *address;
+static int depth = 32;
+static int binary;
+static double deadline;
+
+static double now() {
+    struct timeval t;
+    gettimeofday(&t, 0);
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+static int connect_to(const char *address) {
+    int fd;
+    if (!strncmp(address, "unix:", 5)) {
+        struct sockaddr_un un = { .sun_family = AF_UNIX };
+        snprintf(un.sun_path, sizeof(un.sun_path), "%s", address + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&un, sizeof(un)) < 0) return -1;
+        return fd;
+    }
+    const char *colon = strrchr(address, ':');
+    if (!colon) return -1;
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai;
+    if (getaddrinfo(host[0]? host : "127.0.0.1", colon + 1, &hints, &ai)) return -1;
+    fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    int ok = fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+    freeaddrinfo(ai);
+    if (!ok) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+typedef struct client client;
+struct client {
+    pthread_t thread;
+    int fd;
+    unsigned int random;
+    char *out;
+    long outlen;
+    char *in;
+    long inlen, incap;
+    int gets[MAX_DEPTH];    // which requests in flight are gets
+    long ops, hits;
+};
+
+static void put_request(client *c, int get, long key) {
+    char k[32];
+    int klen = snprintf(k, sizeof(k), "key:%ld", key);
+    char *o = c->out + c->outlen;
+    if (!binary) {
+        if (get) c->outlen += sprintf(o, "get %s\r\n", k);
+        else c->outlen += sprintf(o, "set %s 0 0 %d\r\n%0*d\r\n", k, VALUE_LEN, VALUE_LEN, 0);
+        return;
+    }
+    const int extlen = get? 0 : 8, vlen = get? 0 : VALUE_LEN;
+    const unsigned int body = extlen + klen + vlen;
+    unsigned char *h = (unsigned char *)o;
+    memset(h, 0, 24 + extlen);
+    h[0] = 0x80;
+    h[1] = get? 0x0c : 0x01; // getk, set
+    h[2] = klen >> 8; h[3] = klen;
+    h[4] = extlen;
+    h[8] = body >> 24; h[9] = body >> 16; h[10] = body >> 8; h[11] = body;
+    memcpy(o + 24 + extlen, k, klen);
+    memset(o + 24 + extlen + klen, 'x', vlen);
+    c->outlen += 24 + body;
+}
+
+// the size of the first response in the buffer, 0 if it is not complete yet; sets *hit for a found get
+static long response(client *c, char *p, char *end, int get, int *hit) {
+    *hit = 0;
+    if (binary) {
+        if (end - p < 24) return 0;
+        const unsigned char *h = (const unsigned char *)p;
+        if (h[0] != 0x81) fatal("bad response magic %d", h[0]);
+        long body = (long)h[8] << 24 | h[9] << 16 | h[10] << 8 | h[11];
+        if (end - p < 24 + body) return 0;
+        *hit = get && h[6] == 0 && h[7] == 0;
+        return 24 + body;
+    }
+    char *q = p;
+    while (1) {
+        char *eol = memchr(q, '\n', end - q);
+        if (!eol) return 0;
+        if (!get) {
+            if (strncmp(q, "STORED\r\n", 8)) fatal("bad response: %.*s", (int)(eol - q), q);
+            return eol + 1 - p;
+        }
+        if (!strncmp(q, "END\r\n", 5)) return eol + 1 - p;
+        if (strncmp(q, "VALUE ", 6)) fatal("bad response: %.*s", (int)(eol - q), q);
+        char *bytes = eol;
+        while (bytes > q && bytes[-1] != ' ') bytes--;
+        long skip = atol(bytes) + 2;
+        if (end - (eol + 1) < skip) return 0;
+        *hit = 1;
+        q = eol + 1 + skip;
+    }
+}
+
+// send one round of requests, all in one write, then read until every response is in
+static void round_trip(client *c, int n, int preload, long first) {
+    c->outlen = 0;
+    for (int i = 0; i < n; i++) {
+        c->random = c->random * 1103515245 + 12345;
+        c->gets[i] = !preload && (c->random >> 16) % 10 != 0;
+        put_request(c, c->gets[i], preload? first + i : (c->random >> 8) % KEYS);
+    }
+    for (long off = 0; off < c->outlen;) {
+        ssize_t w = send(c->fd, c->out + off, c->outlen - off, MSG_NOSIGNAL);
+        if (w < 0) fatal("send: %s", strerror(errno));
+        off += w;
+    }
+    int done = 0;
+    long used = 0;
+    while (done < n) {
+        int hit;
+        long size = response(c, c->in + used, c->in + c->inlen, c->gets[done], &hit);
+        if (size) {
+            used += size;
+            c->hits += hit;
+            done++;
+            continue;
+        }
+        memmove(c->in, c->in + used, c->inlen - used);
+        c->inlen -= used;
+        used = 0;
+        if (c->inlen == c->incap) { c->incap *= 2; c->in = realloc(c->in, c->incap); }
+        ssize_t r = recv(c->fd, c->in + c->inlen, c->incap - c->inlen, 0);
+        if (r <= 0) fatal("recv: %s", r? strerror(errno) : "closed");
+        c->inlen += r;
+    }
+    memmove(c->in, c->in + used, c->inlen - used);
+    c->inlen -= used;
+    c->ops += n;
+}
+
+static void client_init(client *c, int seed) {
+    memset(c, 0, sizeof(client));
+    c->fd = connect_to(address);
+    if (c->fd < 0) fatal("cannot connect to %s: %s", address, strerror(errno));
+    c->random = seed;
+    c->out = malloc(MAX_DEPTH * (64 + VALUE_LEN));
+    c->incap = 64 * 1024;
+    c->in = malloc(c->incap);
+}
+
+static void client_free(client *c) {
+    close(c->fd);
+    free(c->out);
+    free(c->in);
+}
+
+static void * client_run(void *arg) {
+    client *c = arg;
+    while (now() < deadline) round_trip(c, depth, 0, 0);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int connections = 4;
+    double seconds = 5;
+    int args = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-b")) { binary = 1; continue; }
+        switch (args++) {
+            case 0: address = argv[i]; break;
+            case 1: connections = atoi(argv[i]); break;
+            case 2: depth = atoi(argv[i]); break;
+            case 3: seconds = atof(argv[i]); break;
+        }
+    }
+    if (!address || connections <= 0 || depth <= 0 || depth > MAX_DEPTH || seconds <= 0) {
+        fprintf(stderr, "usage: %s address [connections] [depth 1-%d] [seconds] [-b]\n", argv[0], MAX_DEPTH);
+        return 1;
+    }
+
+    // every key is set once, so gets hit
+    client *clients = calloc(connections, sizeof(client));
+    client_init(&clients[0], 1);
+    for (long k = 0; k < KEYS; k += 100) round_trip(&clients[0], 100, 1, k);
+    client_free(&clients[0]);
+
+    for (int i = 0; i < connections; i++) client_init(&clients[i], i + 1);
+    double start = now();
+    deadline = start + seconds;
+    for (int i = 0; i < connections; i++) pthread_create(&clients[i].thread, NULL, client_run, &clients[i]);
+    long ops = 0, hits = 0;
+    for (int i = 0; i < connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        ops += clients[i].ops;
+        hits += clients[i].hits;
+        client_free(&clients[i]);
+    }
+    double took = now() - start;
+    print("%s, %d connections, depth %d: %.0f ops/s, %ld hits in %ld ops",
+          binary? "binary" : "text", connections, depth, ops / took, hits, ops);
+    free(clients);
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _murmurhash_h_
+#define _murmurhash_h_
+
+// murmurhash2a, the string hash the tests, the benchmarks and the tools share; nbhashmap.hpp has a constexpr twin
+
+#define mmix(h,k) { k *= m; k ^= k >> r; k *= m; h *= m; h ^= k; }
+static unsigned int murmurhash2a(const void * key, int len) {
+    const unsigned int seed = 33;
+    const unsigned int m = 0x5bd1e995;
+    const int r = 24;
+    unsigned int l = len;
+    const unsigned char * data = (const unsigned char *)key;
+    unsigned int h = seed;
+    while(len >= 4) {
+        unsigned int k = *(unsigned int*)data;
+        mmix(h,k);
+        data += 4;
+        len -= 4;
+    }
+    unsigned int t = 0;
+    switch(len) {
+        case 3: t ^= data[2] << 16;
+        case 2: t ^= data[1] << 8;
+        case 1: t ^= data[0];
+    }
+    mmix(h,t);
+    mmix(h,l);
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+}
+#undef mmix
+
+#endif
@@ -28,11 +28,9 @@
 // * when helping zeroing or copying, we yield to wait until all other helpers are done
 // * after resize, we yield until new map is promoted to current map (by the winner of the second case)
 //
-// One danger! When resizing a map, we delete (and free) keys mapping to null. However another thread using the old
-// table might still do equals() on the key we just free'd. The result of this equals doesn't matter (as long as it
-// finishes somehow), since it will read a SIZED for the value. But, if the free also unmaps the page the key resides
-// on, we will generate a page fault. (Plus the equals function might get passed in a corrupt key, which might not be
-// expected and cause trouble on its own.) Maybe something needs to be done about this ...
+// When resizing a map, we delete keys mapping to null. However another thread using the old table might still do
+// equals() on such a key, or even be about to put it in the new table, since it claimed the slot just before the
+// copy. So the keys are only free'd with the old table, after the grace period, see drops.
 //
 //
 // TODO some false sharing might be going on, especially _btodo and _bdone fields
@@ -41,7 +39,7 @@
 // TODO a shrinking map might want to resize into something smaller, how and when and why?
 // TODO add more public api, iterators and such, and a delete that doesn't own the key ... (pass in free function to _putif?)
 // TODO allow null functions for hash/equals/free when: key == hash, equals == value compare, free == nop
-// TODO add support for garbage collectors and fixed Values or such... as compile time option/macros maybe?
+// TODO add support for fixed Values or such... as compile time option/macros maybe?
 // TODO refactor _zero_block and _copy_block; they share a lot of code
 // TODO handle out of memory ... but we really cannot do anything sensible
 // TODO think about how to handle deleted keys that we free, it is not truly safe this way
@@ -52,8 +50,18 @@
 #include <unistd.h>
 #include <atomic_ops.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <strings.h>
+#include <errno.h>
 #include <sched.h>
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #define HAVE_DEBUG
 #define HAVE_STRACE
@@ -65,12 +73,33 @@
 
 // threading primitives
 static void yield() { sched_yield(); }
+
+// tell the processor we are spinning
+inline static void relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ volatile ("pause" ::: "memory");
+#elif defined(__aarch64__)
+    __asm__ volatile ("yield" ::: "memory");
+#else
+    __asm__ volatile ("" ::: "memory");
+#endif
+}
 static void read_barrier() { AO_nop_read(); }
 static void write_barrier() { AO_nop_write(); }
 static int cas(void *addr, const void *nval, const void *oval) {
     return AO_compare_and_swap(addr, (AO_t)oval, (AO_t)nval);
 }
 
+// a cheap per thread random generator, good enough to pick victims and such
+static __thread unsigned int random_state;
+static unsigned int fast_random() {
+    unsigned int x = random_state;
+    if (!x) x = (unsigned int)(unsigned long)&x | 1; // seed from the stack address, differs per thread
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    random_state = x;
+    return x;
+}
+
 
 // ** actual implementation **
 
@@ -81,11 +110,58 @@ struct entry {
     volatile unsigned int _hash;
 };
 
+// tables come in different layouts, the map picks one per table, when resizing
+// plain:       entries of key, value and hash
+// fingerprint: plain, plus an array of 8 bit hash fingerprints; readers skip slots of other keys without loading them
+// compact:     entries of key and value, and a separate array of hashes; a third less memory
+#define HASHMAP_LAYOUT_ADAPTIVE   -1
+#define HASHMAP_LAYOUT_PLAIN       0
+#define HASHMAP_LAYOUT_FINGERPRINT 1
+#define HASHMAP_LAYOUT_COMPACT     2
+#define HASHMAP_LAYOUT_DENSE       3 // not for hashmap_set_layout, see hashmap_set_dense
+
+// huge page sizes, as log2 of the bytes, see hashmap_set_huge_pages
+#define HASHMAP_PAGES_2M          21
+#define HASHMAP_PAGES_1G          30
+
+// a compact entry, the first fields must be the same as entry
+typedef struct centry centry;
+struct centry {
+    volatile void *_key;
+    volatile void *_val;
+};
+
 typedef struct header header;
 struct header {
     volatile AO_t _btodo;   // unsigned long; _btodo and _bdone are placed apart to prevent false cachline sharing
     unsigned long len;      // final unsigned long
     header *prev;           // a linked list of older maps to free later
+    int layout;             // final; a HASHMAP_LAYOUT_*
+    unsigned int stride;    // final; bytes per entry
+    volatile unsigned int *hashes; // final; where the hashes live, every hstride unsigned ints
+    unsigned int hstride;   // final
+    volatile unsigned char *fps;   // final; the fingerprints, only in the fingerprint layout
+    volatile struct inode *_garbage; // index nodes removed while this table was current, free'd with it
+    volatile AO_t _ngarbage;         // how many
+    struct drops *volatile _drops;   // slots whose keys a copy left behind, free'd with the table; see drops
+    volatile AO_t *live;    // final; a bitmap of live slots per group, then counts per super group; only when sampled
+    header *window;         // the previous generation of a windowed map, null once it is free'd; see hashmap_rotate
+    int dropped;            // a dropped generation; unlike a resized table it still owns its keys
+    int compacted;          // final; a compaction produced this table, see hashmap_compact
+    unsigned long claimed;  // slots whose key was claimed; counted without atomics, so about, see _compactable
+    int mapped;             // final; log2 of the page size if allocated using mmap, so it starts out zeroed; else 0
+    int pages;              // final; log2 of the page size, larger than mapped when mapped on huge pages
+    int advised;            // final; log2 of the transparent huge pages asked for, 0 if none; see hashmap_page_size
+    unsigned long probemask; // final; probes wrap around within probemask + 1 slots, see hashmap_set_huge_pages
+    unsigned long block;    // final; slots per block when resizing, see hashmap_tune
+    unsigned long seed;     // final; mixed into the hashes of keys, 0 if not; see hashmap_reseed
+    struct fc_chunk *volatile keys;  // the coded keys copied in, see hashmap_set_front_coded
+    struct fc_dict *volatile dict;   // the prefixes of the coded keys
+    struct olog *log;       // final; the insertion order, only when insertion ordered
+    unsigned long base;     // final; the key of the first slot of a dense table, see hashmap_set_dense
+    volatile AO_t *present; // final; a bitmap of slots holding a value, only in a dense table
+    volatile AO_t _kmin, _kmax, _kcount; // the integer keys copied in, counted only for maps that can go dense
+    volatile unsigned long *order; // final; per slot, the position in the log of its mapping, plus one
     volatile AO_t _bdone;   // unsigned long
     entry kvs[0];           // the actual entries
 };
@@ -96,7 +172,121 @@ typedef int (hashmap_key_equals)(void *left, void *right);
 typedef unsigned int (hashmap_key_hash)(void *key);
 typedef void (hashmap_key_free)(void *key);
 
+// when used as a cache, the map drops values on its own, and tells the user through this function
+typedef void (hashmap_value_evict)(void *val);
+
+// bounded cache state, with a count-min sketch to decide if a new key may evict an older one
+typedef struct cache cache;
+struct cache {
+    long capacity;
+    int admit;                     // use the admission filter; if not, always evict a victim
+    hashmap_value_evict *evict_func;
+    unsigned long mask;            // sketch length - 1
+    unsigned long reset_at;        // after this many increments the sketch is aged
+    volatile AO_t _additions;      // unsigned long
+    volatile AO_t *sketch;         // 4 bit counters, packed into words
+};
+
+// a process wide memory budget, shared by many maps; maps register a budget_node to account their tables
+// all nodes of all budgets form one process wide registry, so memory pressure can reach every registered map
+typedef struct HashBudget HashBudget;
+typedef struct budget_node budget_node;
+struct budget_node {
+    volatile struct HashMap *_map; // null when the node is free for reuse
+    HashBudget *budget;            // final while _map is set
+    volatile AO_t _bytes;          // bytes in tables of this map, including retired tables
+    volatile AO_t _busy;           // set while memory pressure works on the map; hashmap_free waits for it
+    budget_node *next;             // final once linked in
+};
+
+struct HashBudget {
+    unsigned long limit;           // in bytes
+    volatile AO_t _used;           // bytes in all tables of all registered maps
+    volatile AO_t _deferred;       // resizes that compacted instead of doubled, because of the budget
+    volatile AO_t _overruns;       // resizes that had to double, even though over budget
+};
+
+static volatile budget_node *_registry; // nodes are never free'd, only reused
+
 typedef struct HashMap HashMap;
+// to visit mappings
+typedef void (hashmap_visit)(void *key, void *val, void *data);
+typedef int (hashmap_key_alive)(void *key, void *data);
+// to write dirty mappings to a backing store, see hashmap_set_write_behind
+typedef int (hashmap_sink)(void **pairs, long n, void *data);
+// to export and import mappings, see hashmap_export_hot
+typedef long (hashmap_encode)(void *key, void *val, char *buf, long len, void *data);
+typedef int (hashmap_decode)(const char *buf, long len, void **key, void **val, void *data);
+// a handle to the slot of a mapping, see hashmap_pin
+typedef struct HashHandle HashHandle;
+struct HashHandle {
+    HashMap *map;
+    header *kvs;       // the table the handle points into; its generation
+    entry *entry;      // null when the mapping was dropped by a resize
+    void *key;         // the key as owned by the map, the same pointer in every table
+    unsigned int hash;
+};
+
+// the result of a hash analysis, see hashmap_analyze
+#define HASHMAP_ANALYSIS_PROBES 32
+#define HASHMAP_ANALYSIS_SIZES 6
+typedef struct HashAnalysis HashAnalysis;
+struct HashAnalysis {
+    long keys;
+    long garbage;                  // slots taken by deleted mappings
+    long duplicate_hashes;
+    unsigned long len;
+    long probes[HASHMAP_ANALYSIS_PROBES];
+    double mean_probe;
+    long max_probe;
+    long clusters;
+    double mean_cluster;
+    long max_cluster;
+    double occupancy_variance;
+    double expected_variance;
+    double mixed_occupancy_variance;
+    unsigned long sizes[HASHMAP_ANALYSIS_SIZES];
+    long reprobe_hits[HASHMAP_ANALYSIS_SIZES];
+    long mixed_reprobe_hits[HASHMAP_ANALYSIS_SIZES];
+    unsigned long recommended_len;
+    const char *recommendation;
+};
+
+// the parameters a process tuned for its machine, see hashmap_tune
+#define HASHMAP_TUNING_DEFAULT 0
+#define HASHMAP_TUNING_MEASURED 1
+#define HASHMAP_TUNING_LOADED 2
+typedef struct HashTuning HashTuning;
+struct HashTuning {
+    int block_size;                // slots a thread claims at once when resizing
+    int spin;                      // spins before yielding, when waiting for another thread
+    int reprobe_limit;             // probes an insert makes before it resizes the table
+    int prefetch;                  // mappings a resize looks ahead to prefetch their new slot; 0 if it does not
+    int source;                    // HASHMAP_TUNING_*
+    char cpu[64];                  // the processors tuned for
+};
+
+// sampled latencies, by operation and by cause, see hashmap_latency_start
+#define HASHMAP_LATENCY_GET 0
+#define HASHMAP_LATENCY_PUT 1
+#define HASHMAP_LATENCY_RESIZE 2
+#define HASHMAP_LATENCY_OPS 3
+#define HASHMAP_CAUSE_NONE 0
+#define HASHMAP_CAUSE_CAS 1
+#define HASHMAP_CAUSE_WAIT_HASH 2
+#define HASHMAP_CAUSE_WAIT 3
+#define HASHMAP_CAUSE_RESIZE 4
+#define HASHMAP_CAUSES 5
+#define HASHMAP_LATENCY_BUCKETS 496
+typedef struct HashLatency HashLatency;
+struct HashLatency {
+    double ticks_per_ns;
+    unsigned long count[HASHMAP_LATENCY_OPS][HASHMAP_CAUSES][HASHMAP_LATENCY_BUCKETS];
+};
+
+// to visit all maps using a budget
+typedef void (hashbudget_visit)(HashMap *map, unsigned long bytes, void *data);
+
 struct HashMap {
     volatile AO_t _size;           // unsigned long
     volatile unsigned int changes; // counting all map modifications; but dropping some read/writes is ok
@@ -106,31 +296,760 @@ struct HashMap {
     hashmap_key_equals *equals_func;
     hashmap_key_hash   *hash_func;
     hashmap_key_free   *free_func;
+
+    cache              *cache;     // only when used as a bounded cache, see hashmap_set_cache
+
+    volatile AO_t _bytes;          // bytes in tables, including retired tables
+    HashBudget         *budget;    // only when registered with a budget, see hashmap_set_budget
+    budget_node        *budget_node;
+    volatile AO_t _reclaiming;     // set while a thread frees retired tables
+    volatile int _compact;         // set to ask the next resize to shrink sparse tables
+    volatile unsigned long _reserve; // set to ask the next resize for at least this length, see hashmap_reserve
+    volatile unsigned long seed;   // the seed of new tables, see hashmap_reseed
+    cache              *hot;       // tracks reads when not a cache, see hashmap_track_hot
+
+    struct oindex      *index;     // only for ordered maps, see hashmap_set_ordered
+    int weak;                      // keys are weak references, see hashmap_set_weak
+    int bulk_keys;                 // the user frees all keys at once, see hashmap_set_bulk_keys
+    int sampled;                   // tables track live slots, see hashmap_set_sampled
+    int insertion_ordered;         // tables log their insertions, see hashmap_set_insertion_ordered
+    int front_coded;               // resizes copy keys into shared prefix chunks, see hashmap_set_front_coded
+    int dense;                     // tables may be dense arrays of values, see hashmap_set_dense
+    volatile unsigned long _dense_miss; // the last key that did not fit a dense table, for the next resize
+    int huge;                      // log2 of the huge page size for large tables, or 0, see hashmap_set_huge_pages
+    int paged;                     // probes of large tables stay within a huge page
+    hashmap_sink       *sink;      // only in write-behind mode, see hashmap_set_write_behind
+    void               *sink_data;
+    struct flusher     *flusher;   // the thread flushing dirty mappings, if any
+    volatile AO_t _flushing;       // set while a thread flushes
+
+    int layout;                    // layout for new tables, or HASHMAP_LAYOUT_ADAPTIVE, see hashmap_set_layout
+    const char *layout_reason;     // why the current table has its layout
+    volatile AO_t _reads;          // sampled operations, only counted when adaptive; decay at every resize
+    volatile AO_t _writes;
+    volatile AO_t _misses;
+    volatile AO_t _contention;     // lost races and resizes helped
 };
 
+#define HASHMAP_PRESSURE_MODERATE 1
+#define HASHMAP_PRESSURE_CRITICAL 2
+
 #define INITIAL_SIZE 4
 #define REPROBE_LIMIT 17
 #define BLOCK_SIZE (1024 * 8)
+#define BLOCK_MIN 256               // block sizes a tuning may set, powers of two in between
+#define BLOCK_MAX (1024 * 64)
+#define GET_BATCH 16 // hashmap_get_many prefetches this many keys ahead
+
+// defaults, until hashmap_tune measures better ones; inserts read the reprobe limit, tables take the block size
+static HashTuning tuning = { BLOCK_SIZE, 0, REPROBE_LIMIT, 0, HASHMAP_TUNING_DEFAULT, "" };
+
+// the slow paths the current operation ran into, a bit per HASHMAP_CAUSE_*; see latency histograms
+static __thread unsigned int latency_causes;
+#define latency_cause(cause) (latency_causes |= 1 << ((cause) - 1))
+
+// wait for another thread to finish its part; spin a while first, if tuned to, since yielding takes a syscall
+inline static void backoff(int *spins) {
+    latency_cause(HASHMAP_CAUSE_WAIT);
+    if (*spins < tuning.spin) { (*spins)++; relax(); return; }
+    yield();
+}
 
 #define null 0                        // indicates value is deleted
        void *IGNORE  = "__IGNORE__";  // marker to indicate old map value is to be ignored
+       void *REJECTED = "__REJECTED__"; // marker returned when a full cache did not admit a new mapping
 static void *SIZED   = "__SIZED__";   // marker to indicate map is or has resized
 static void *DELETED = "__DELETED__"; // marker to indicate key is to be deleted (when resizing)
+static void *CLEARED = "__CLEARED__"; // marker to indicate a weak key was cleared by the collector
+
+// ** flight recorder **
+//
+// To debug races without hiding them, like strace does, every thread can record the state transitions it makes into
+// its own ring of small binary events. Recording is a clock read and a few stores into memory only this thread
+// writes, so no locks and no shared cache lines. Rings are never free'd; when a thread exits, the next thread to
+// record takes over its ring, so a dump still shows the last events of threads that are gone.
+//
+// A dump writes the rings as they are, using only write(2), so it is safe in a signal handler; a fatal error aborts,
+// and SIGABRT, SIGSEGV and SIGBUS dump before the process dies, SIGUSR1 dumps a live process. Handlers the program
+// had installed for these still run, after the dump. The flight tool merges the rings of a dump into one timeline.
+
+#define FLIGHT_EVENTS 4096         // per thread, a power of two
+#define FLIGHT_MAGIC "nbhm-flt"
+
+// the transitions recorded; the argument is a slot index, unless noted
+enum {
+    FLIGHT_CLAIM = 1,              // claimed an empty slot for a key
+    FLIGHT_HASH,                   // published the hash of a claimed slot
+    FLIGHT_VALUE,                  // value cas succeeded
+    FLIGHT_VALUE_LOST,             // value cas lost a race
+    FLIGHT_COPY,                   // value cas while copying into a new table
+    FLIGHT_SIZED,                  // marked a slot SIZED while copying
+    FLIGHT_PROMISE,                // won the resize promise; argument is the old length
+    FLIGHT_PUBLISH,                // published a new table; argument is its length
+    FLIGHT_HELP,                   // started helping a resize; argument is the old length
+};
+
+typedef struct flight_event flight_event;
+struct flight_event {
+    unsigned long long tsc;
+    unsigned int arg;
+    unsigned int tag;              // event << 24 | 24 bits of the table address, to tell tables apart
+};
+
+typedef struct flight_ring flight_ring;
+struct flight_ring {
+    flight_ring *next;             // all rings ever made, for the dump
+    volatile AO_t owned;           // a thread records into it
+    unsigned long id;              // thread id of the last owner
+    volatile unsigned long pos;    // events recorded, only written by the owner
+    flight_event events[FLIGHT_EVENTS];
+};
+
+// the dump file starts with this, then for every ring its id and pos, and its events
+typedef struct flight_header flight_header;
+struct flight_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int rings;
+    double ticks_per_us;           // to convert timestamps
+};
+
+static volatile int flight_on;
+static flight_ring *volatile flight_rings;
+static volatile AO_t flight_nrings;
+static double flight_ticks_per_us;
+static char flight_path[256];
+static pthread_key_t flight_key;
+static __thread flight_ring *flight_mine;
+
+inline static unsigned long long flight_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// calibrate the clock to microseconds; takes 10ms
+static double clock_ticks_per_us() {
+    struct timeval t0, t1;
+    gettimeofday(&t0, null);
+    unsigned long long c0 = flight_clock();
+    usleep(10000);
+    gettimeofday(&t1, null);
+    unsigned long long c1 = flight_clock();
+    return (c1 - c0) / (double)((t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+}
+
+static void flight_release(void *ring) { ((flight_ring *)ring)->owned = 0; }
+static void flight_init() { pthread_key_create(&flight_key, flight_release); }
+
+static flight_ring * flight_ring_get() {
+    flight_ring *r;
+    for (r = flight_rings; r; r = r->next) {
+        if (!r->owned && AO_compare_and_swap(&r->owned, 0, 1)) break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(flight_ring));
+        assert(r);
+        r->owned = 1;
+        while (1) {
+            r->next = flight_rings;
+            if (cas((void *)&flight_rings, r, r->next)) break;
+        }
+        AO_fetch_and_add1(&flight_nrings);
+    }
+#ifdef SYS_gettid
+    r->id = syscall(SYS_gettid);
+#else
+    r->id = (unsigned long)pthread_self();
+#endif
+    flight_mine = r;
+    pthread_setspecific(flight_key, r);
+    return r;
+}
+
+static void _flight(int event, const void *table, unsigned long arg) {
+    flight_ring *r = flight_mine;
+    if (!r) r = flight_ring_get();
+    unsigned long pos = r->pos;
+    flight_event *ev = &r->events[pos & (FLIGHT_EVENTS - 1)];
+    ev->tsc = flight_clock();
+    ev->arg = arg;
+    ev->tag = (unsigned int)event << 24 | (((unsigned long)table >> 4) & 0xffffff);
+    r->pos = pos + 1;
+}
+
+// record a transition, if the recorder is on
+#define flight(event, table, arg) do { if (flight_on) _flight(event, table, arg); } while (0)
+
+// write all of @buf, in a signal handler too
+static int flight_write(int fd, const void *buf, unsigned long len) {
+    while (len > 0) {
+        long n = write(fd, buf, len);
+        if (n <= 0) return -1;
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/// write the rings of all threads to the file at @path, see hashmap_flight_start; safe to call in a signal handler
+/// @returns 0, or -1 if the file could not be written
+int hashmap_flight_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    flight_header h = { FLIGHT_MAGIC, 1, flight_nrings, flight_ticks_per_us };
+    int res = flight_write(fd, &h, sizeof(h));
+    unsigned int n = 0;
+    for (flight_ring *r = flight_rings; r && n < h.rings && !res; r = r->next, n++) {
+        unsigned long meta[2] = { r->id, r->pos };
+        res = flight_write(fd, meta, sizeof(meta)) || flight_write(fd, r->events, sizeof(r->events));
+    }
+    close(fd);
+    return res;
+}
+
+// the signals that dump, and the handlers they had before hashmap_flight_start, to chain to and to restore
+static const int flight_signals[] = { SIGABRT, SIGSEGV, SIGBUS, SIGUSR1 };
+#define FLIGHT_SIGNALS (sizeof(flight_signals) / sizeof(flight_signals[0]))
+static struct sigaction flight_saved[FLIGHT_SIGNALS];
+static int flight_installed;
+
+static void flight_signal(int sig, siginfo_t *info, void *context) {
+    hashmap_flight_dump(flight_path);
+    struct sigaction *prev = null;
+    for (unsigned int i = 0; i < FLIGHT_SIGNALS; i++) if (flight_signals[i] == sig) prev = &flight_saved[i];
+    if (prev->sa_flags & SA_SIGINFO) { prev->sa_sigaction(sig, info, context); return; }
+    if (prev->sa_handler == SIG_IGN) return;
+    if (prev->sa_handler != SIG_DFL) { prev->sa_handler(sig); return; }
+    if (sig == SIGUSR1) return; // asked for a dump, not to die
+    sigaction(sig, prev, null); // die as we would have
+    raise(sig);
+}
+
+/// start recording map state transitions of all threads, to dump to the file at @path on a crash or SIGUSR1
+/// Installs handlers for SIGABRT, SIGSEGV, SIGBUS and SIGUSR1; so fatal errors dump. Those handlers then call the ones
+/// they replaced. Decode a dump with ./flight.
+/// @returns 0, or -1 if @path is too long
+int hashmap_flight_start(const char *path) {
+    if (strlen(path) >= sizeof(flight_path)) return -1;
+    strcpy(flight_path, path);
+
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, flight_init);
+    flight_ticks_per_us = clock_ticks_per_us();
+
+    if (!flight_installed) { // once; started again, we would save our own handlers
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = flight_signal;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        for (unsigned int i = 0; i < FLIGHT_SIGNALS; i++) sigaction(flight_signals[i], &sa, &flight_saved[i]);
+        flight_installed = 1;
+    }
+    write_barrier();
+    flight_on = 1;
+    return 0;
+}
+
+/// stop recording, and restore the signal handlers hashmap_flight_start replaced; the rings keep their events
+void hashmap_flight_stop() {
+    flight_on = 0;
+    if (!flight_installed) return;
+    for (unsigned int i = 0; i < FLIGHT_SIGNALS; i++) sigaction(flight_signals[i], &flight_saved[i], null);
+    flight_installed = 0;
+}
+
+// ** latency histograms **
+//
+// Throughput does not show the tail, and a benchmark does not run in production. With latency sampling on, every
+// thread times 1 in N of its gets and puts with the cycle counter, and all its resize work, into histograms only it
+// writes. Histograms are log-linear: 8 buckets per power of two, so a bucket is at most 1/8 of its latency wide.
+//
+// An operation also notes the slow paths it ran into, and its sample goes into the histogram of the worst one; so the
+// tail can be blamed on lost cas races, waiting for a hash to be published, waiting for other threads to finish
+// their part of a resize, or helping a resize. Like flight recorder rings, histograms are handed on when a thread
+// exits, and never free'd; hashmap_latency merges them on demand. A histogram row of an operation and cause is only
+// allocated with its first sample, most threads only ever fill a few of them.
+//
+// Only the owner writes its counts, so a reset does not zero them: it starts a new epoch, and a thread zeroes its
+// own counts when it samples in a new epoch. Until then, merging skips them.
+
+#define LATENCY_SUB 3              // log2 of the buckets per power of two
+
+typedef struct latency_hists latency_hists;
+struct latency_hists {
+    latency_hists *next;           // all histograms ever made, to merge
+    volatile AO_t owned;           // a thread samples into it
+    volatile AO_t epoch;           // the reset the counts are from
+    unsigned long *volatile count[HASHMAP_LATENCY_OPS][HASHMAP_CAUSES]; // HASHMAP_LATENCY_BUCKETS each, or null
+};
+
+static volatile unsigned int latency_every; // sample 1 in this many operations; 0 when off
+static volatile AO_t latency_epoch;         // counts the resets
+static latency_hists *volatile latency_all;
+static double latency_ticks_per_ns;
+static pthread_key_t latency_key;
+static __thread latency_hists *latency_mine;
+static __thread unsigned int latency_countdown;
+static __thread int latency_helping;       // in _help_resize, which times the resize it might start
+
+static void latency_release(void *hists) { ((latency_hists *)hists)->owned = 0; }
+static void latency_init() { pthread_key_create(&latency_key, latency_release); }
+
+static latency_hists * latency_hists_get() {
+    latency_hists *h;
+    for (h = latency_all; h; h = h->next) {
+        if (!h->owned && AO_compare_and_swap(&h->owned, 0, 1)) break;
+    }
+    if (!h) {
+        h = calloc(1, sizeof(latency_hists));
+        assert(h);
+        h->owned = 1;
+        while (1) {
+            h->next = latency_all;
+            if (cas((void *)&latency_all, h, h->next)) break;
+        }
+    }
+    latency_mine = h;
+    pthread_setspecific(latency_key, h);
+    return h;
+}
+
+// the bucket of a latency of @ticks; exact below 8, then 8 per power of two
+static unsigned int latency_bucket(unsigned long long ticks) {
+    if (ticks < 1 << LATENCY_SUB) return ticks;
+    const unsigned int e = 63 - __builtin_clzll(ticks);
+    return (e - LATENCY_SUB + 1) << LATENCY_SUB | ((ticks >> (e - LATENCY_SUB)) & ((1 << LATENCY_SUB) - 1));
+}
+
+// the first latency in ticks beyond @bucket
+static double latency_bucket_end(unsigned int bucket) {
+    if (bucket < 1 << LATENCY_SUB) return bucket + 1;
+    const unsigned int e = (bucket >> LATENCY_SUB) + LATENCY_SUB - 1;
+    return ((1 << LATENCY_SUB | (bucket & ((1 << LATENCY_SUB) - 1))) + 1) * (double)(1ULL << (e - LATENCY_SUB));
+}
+
+// start timing an operation if it is sampled; returns the start time, or 0 if not
+inline static unsigned long long latency_begin() {
+    const unsigned int every = latency_every;
+    if (__builtin_expect(!every, 1)) return 0;
+    if (latency_countdown > 1) { latency_countdown--; return 0; }
+    latency_countdown = every;
+    latency_causes = 0;
+    return flight_clock();
+}
+
+// count an operation @op that started at @start, under the worst cause it ran into
+static void latency_end(int op, unsigned long long start) {
+    long long ticks = flight_clock() - start;
+    if (ticks < 0) ticks = 0; // migrated to a processor with a clock behind
+    latency_hists *h = latency_mine;
+    if (!h) h = latency_hists_get();
+    const AO_t epoch = latency_epoch;
+    if (h->epoch != epoch) { // reset since our last sample
+        for (int o = 0; o < HASHMAP_LATENCY_OPS; o++) {
+            for (int c = 0; c < HASHMAP_CAUSES; c++) {
+                if (h->count[o][c]) memset(h->count[o][c], 0, sizeof(unsigned long) * HASHMAP_LATENCY_BUCKETS);
+            }
+        }
+        write_barrier(); // zeroed before merging may count them again
+        h->epoch = epoch;
+    }
+    const int cause = latency_causes? 32 - __builtin_clz(latency_causes) : HASHMAP_CAUSE_NONE;
+    unsigned long *row = h->count[op][cause];
+    if (!row) {
+        row = calloc(HASHMAP_LATENCY_BUCKETS, sizeof(unsigned long));
+        assert(row);
+        write_barrier();
+        h->count[op][cause] = row;
+    }
+    row[latency_bucket(ticks)]++;
+}
+
+/// time 1 in @every gets and puts of all maps in every thread, and all resize work; see hashmap_latency
+void hashmap_latency_start(unsigned int every) {
+    api_assert(every > 0, "sample 1 in %u operations", every);
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, latency_init);
+    if (!latency_ticks_per_ns) latency_ticks_per_ns = clock_ticks_per_us() / 1000;
+    write_barrier();
+    latency_every = every;
+}
+
+/// stop sampling; the histograms keep their counts
+void hashmap_latency_stop() {
+    latency_every = 0;
+}
+
+/// zero the histograms of all threads; samples counted meanwhile might be lost
+/// Each thread zeroes its own histogram when it samples next, see latency_end.
+void hashmap_latency_reset() {
+    AO_fetch_and_add1(&latency_epoch);
+}
+
+/// merge the histograms of all threads into @lat; other threads can go on sampling meanwhile
+void hashmap_latency(HashLatency *lat) {
+    memset(lat, 0, sizeof(HashLatency));
+    lat->ticks_per_ns = latency_ticks_per_ns;
+    const AO_t epoch = latency_epoch;
+    for (latency_hists *h = latency_all; h; h = h->next) {
+        if (h->epoch != epoch) continue; // counts from before a reset
+        read_barrier();
+        for (int op = 0; op < HASHMAP_LATENCY_OPS; op++) {
+            for (int c = 0; c < HASHMAP_CAUSES; c++) {
+                const unsigned long *row = h->count[op][c];
+                if (!row) continue;
+                for (int b = 0; b < HASHMAP_LATENCY_BUCKETS; b++) lat->count[op][c][b] += row[b];
+            }
+        }
+    }
+}
+
+// the samples of @op in @bucket, of all causes
+static unsigned long latency_at(const HashLatency *lat, int op, int bucket) {
+    unsigned long n = 0;
+    for (int c = 0; c < HASHMAP_CAUSES; c++) n += lat->count[op][c][bucket];
+    return n;
+}
+
+// the bucket holding quantile @q of @op, or -1 without samples
+static int latency_quantile_bucket(const HashLatency *lat, int op, double q) {
+    unsigned long total = 0;
+    for (int b = 0; b < HASHMAP_LATENCY_BUCKETS; b++) total += latency_at(lat, op, b);
+    if (!total) return -1;
+    unsigned long rank = (unsigned long)(q * total);
+    if (rank >= total) rank = total - 1;
+    unsigned long seen = 0;
+    for (int b = 0; b < HASHMAP_LATENCY_BUCKETS; b++) {
+        seen += latency_at(lat, op, b);
+        if (seen > rank) return b;
+    }
+    return HASHMAP_LATENCY_BUCKETS - 1;
+}
+
+/// the number of samples of @op in @lat
+unsigned long hashmap_latency_samples(const HashLatency *lat, int op) {
+    api_assert(op >= 0 && op < HASHMAP_LATENCY_OPS, "no such operation: %d", op);
+    unsigned long total = 0;
+    for (int b = 0; b < HASHMAP_LATENCY_BUCKETS; b++) total += latency_at(lat, op, b);
+    return total;
+}
+
+/// the latency in nanoseconds that a fraction @q of the samples of @op in @lat stay below, rounded up to the end of
+/// its bucket; 0 without samples
+double hashmap_latency_quantile(const HashLatency *lat, int op, double q) {
+    api_assert(op >= 0 && op < HASHMAP_LATENCY_OPS, "no such operation: %d", op);
+    const int b = latency_quantile_bucket(lat, op, q);
+    if (b < 0) return 0;
+    return latency_bucket_end(b) / (lat->ticks_per_ns > 0? lat->ticks_per_ns : 1);
+}
+
+/// blame the samples of @op in @lat from quantile @q up: set @share[cause] to the fraction of those samples that ran
+/// into that cause, as the worst; all 0 without samples
+void hashmap_latency_tail(const HashLatency *lat, int op, double q, double *share) {
+    api_assert(op >= 0 && op < HASHMAP_LATENCY_OPS, "no such operation: %d", op);
+    for (int c = 0; c < HASHMAP_CAUSES; c++) share[c] = 0;
+    const int from = latency_quantile_bucket(lat, op, q);
+    if (from < 0) return;
+    unsigned long total = 0;
+    for (int c = 0; c < HASHMAP_CAUSES; c++) {
+        for (int b = from; b < HASHMAP_LATENCY_BUCKETS; b++) share[c] += lat->count[op][c][b];
+        total += share[c];
+    }
+    for (int c = 0; c < HASHMAP_CAUSES; c++) share[c] /= total;
+}
+
+/// print the percentiles of every operation in @lat, and what the samples beyond the 99th ran into
+void hashmap_latency_print(const HashLatency *lat) {
+    static const char *ops[HASHMAP_LATENCY_OPS] = { "get", "put", "resize" };
+    static const char *causes[HASHMAP_CAUSES] = { "none", "cas retry", "wait hash", "wait resize", "help resize" };
+    for (int op = 0; op < HASHMAP_LATENCY_OPS; op++) {
+        unsigned long n = hashmap_latency_samples(lat, op);
+        if (!n) continue;
+        printf("%s: %lu samples, p50 %.0fns, p99 %.0fns, p99.9 %.0fns, max %.0fns\n", ops[op], n,
+                hashmap_latency_quantile(lat, op, 0.5), hashmap_latency_quantile(lat, op, 0.99),
+                hashmap_latency_quantile(lat, op, 0.999), hashmap_latency_quantile(lat, op, 1));
+        double share[HASHMAP_CAUSES];
+        hashmap_latency_tail(lat, op, 0.99, share);
+        printf("  beyond p99:");
+        for (int c = 0; c < HASHMAP_CAUSES; c++) if (share[c] > 0) printf(" %s %.1f%%", causes[c], share[c] * 100);
+        printf("\n");
+    }
+}
 
 
 // when racing to resize, the winner must succesfully cas this into map->nkvs
 static header * kvs_promise = (header *)1;
 
-static header * header_new(unsigned int len) {
-    header *h = malloc(sizeof(header) + sizeof(entry) * len);
+#define PAGE_SHIFT 12 // log2 of the size of normal pages
+
+static unsigned long header_bytes(unsigned long len, int layout) {
+    switch (layout) {
+        case HASHMAP_LAYOUT_FINGERPRINT: return sizeof(header) + (sizeof(entry) + 1) * len;
+        case HASHMAP_LAYOUT_COMPACT:     return sizeof(header) + (sizeof(centry) + sizeof(unsigned int)) * len;
+        case HASHMAP_LAYOUT_DENSE:       return sizeof(header) + sizeof(void *) * len;
+        default:                         return sizeof(header) + sizeof(entry) * len;
+    }
+}
+
+// account for allocated or freed table memory, in the map, and in its budget (if any)
+static void _account(HashMap *map, long bytes) {
+    AO_fetch_and_add(&map->_bytes, bytes);
+    if (map->budget) {
+        if (map->budget_node) AO_fetch_and_add(&map->budget_node->_bytes, bytes);
+        AO_fetch_and_add(&map->budget->_used, bytes);
+    }
+}
+
+// would allocating another @bytes push the budget of @map over its limit
+static int budget_exceeded(HashMap *map, unsigned long bytes) {
+    HashBudget *b = map->budget;
+    if (!b) return 0;
+    return b->_used + bytes > b->limit;
+}
+
+#define LIVE_GROUP (sizeof(AO_t) * 8) // slots per bitmap of live slots, see hashmap_sample
+#define LIVE_SUPER 4096               // slots per count of live slots
+
+static unsigned long live_count(unsigned long len) { return (len + LIVE_GROUP - 1) / LIVE_GROUP + (len + LIVE_SUPER - 1) / LIVE_SUPER; }
+static unsigned long present_count(unsigned long len) { return (len + LIVE_GROUP - 1) / LIVE_GROUP; }
+
+// the insertion order of an insertion ordered map, an append only log in segments that double in size, so appending
+// never moves entries; see hashmap_set_insertion_ordered
+#define OLOG_FIRST 1024            // entries in the first segment
+#define OLOG_SEGMENTS 40
+
+typedef struct olog_entry olog_entry;
+struct olog_entry {
+    void *volatile key;            // written last; null while the entry is being written
+    unsigned long seq;             // insertion sequence, increasing with the position, and kept by compaction
+    unsigned int hash;
+};
+
+typedef struct olog olog;
+struct olog {
+    volatile AO_t head;            // entries before it are evicted or dead
+    char _pad[64];
+    volatile AO_t tail;            // positions handed out to appenders
+    unsigned long base;            // seq of the entry at position 0, of those appended
+    unsigned long compacted;       // entries copied in by a resize, they keep their seq
+    struct olog_job *volatile job; // the compaction of this log into the next table, see olog_compact
+    olog_entry *volatile segments[OLOG_SEGMENTS];
+};
+
+// a compaction of a log, shared by the threads helping a resize; free'd with the log
+typedef struct olog_job olog_job;
+struct olog_job {
+    unsigned long head, tail;      // the positions to compact
+    unsigned long bsize, blocks;   // positions per block, and blocks
+    volatile AO_t _ctodo, _cdone;  // blocks claimed and done counting their live entries
+    volatile AO_t _wtodo, _wdone;  // blocks claimed and done copying them
+    unsigned long *counts;         // live entries per block
+    AO_t *alive;                   // a bit per position from head, set if live
+};
+
+static unsigned long olog_job_bytes(olog_job *j) {
+    return sizeof(olog_job) + j->blocks * sizeof(unsigned long) + (j->blocks * j->bsize / 8);
+}
+
+// the entry at @pos of @log; allocates its segment if @create, otherwise null if it has none yet
+static olog_entry * olog_at(HashMap *map, olog *log, unsigned long pos, int create) {
+    unsigned long x = pos / OLOG_FIRST + 1;
+    int seg = 63 - __builtin_clzl(x);
+    olog_entry *s = log->segments[seg];
+    if (!s) {
+        if (!create) return null;
+        unsigned long bytes = sizeof(olog_entry) * (OLOG_FIRST << seg);
+        s = calloc(1, bytes);
+        assert(s);
+        if (cas((void *)&log->segments[seg], s, null)) {
+            _account(map, bytes);
+        } else {
+            free(s);
+            s = log->segments[seg];
+        }
+    }
+    return &s[pos - OLOG_FIRST * ((1UL << seg) - 1)];
+}
+
+// append @key to @log, and link slot @idx of @kvs to it
+static void olog_append(HashMap *map, header *kvs, unsigned long idx, void *key, unsigned int hash) {
+    olog *log = kvs->log;
+    unsigned long pos = AO_fetch_and_add1(&log->tail);
+    olog_entry *le = olog_at(map, log, pos, 1);
+    le->hash = hash;
+    le->seq = log->base + pos;
+    kvs->order[idx] = pos + 1;
+    write_barrier();
+    le->key = key;
+}
+
+static void olog_free(HashMap *map, olog *log) {
+    for (int seg = 0; seg < OLOG_SEGMENTS && log->segments[seg]; seg++) {
+        _account(map, -(long)(sizeof(olog_entry) * (OLOG_FIRST << seg)));
+        free(log->segments[seg]);
+    }
+    if (log->job) {
+        _account(map, -(long)olog_job_bytes(log->job));
+        free(log->job->counts);
+        free(log->job->alive);
+        free(log->job);
+    }
+    free(log);
+}
+
+static header * header_init(HashMap *map, header *h, unsigned int len, int layout) {
     assert(h);
     h->len = len;
     h->_btodo = 0;
     h->_bdone = 0;
     h->prev = 0;
+    h->layout = layout;
+    h->fps = 0;
+    h->_garbage = 0;
+    h->_ngarbage = 0;
+    h->_drops = 0;
+    h->live = 0;
+    h->window = 0;
+    h->dropped = 0;
+    h->compacted = 0;
+    h->claimed = 0;
+    h->probemask = len - 1;
+    h->block = tuning.block_size;
+    h->seed = map->seed;
+    h->keys = 0;
+    h->dict = 0;
+    h->base = 0;
+    h->present = 0;
+    h->_kmin = ~(AO_t)0;
+    h->_kmax = 0;
+    h->_kcount = 0;
+    const int pages = h->advised? h->advised : h->pages;
+    if (map->paged && pages > PAGE_SHIFT) {
+        // probe within the largest power of two slots that fits in a huge page, one we have or the kernel might give us
+        unsigned long span = 1;
+        while (span * 2 * (layout == HASHMAP_LAYOUT_COMPACT? sizeof(centry) : sizeof(entry)) <= (1UL << pages)) span *= 2;
+        if (span < len) h->probemask = span - 1;
+    }
+    if (map->sampled) {
+        h->live = calloc(live_count(len), sizeof(AO_t));
+        assert(h->live);
+        _account(map, live_count(len) * sizeof(AO_t));
+    }
+    h->log = 0;
+    h->order = 0;
+    if (map->insertion_ordered) {
+        h->log = calloc(1, sizeof(olog));
+        h->order = calloc(len, sizeof(unsigned long));
+        assert(h->log); assert(h->order);
+        _account(map, sizeof(olog) + len * sizeof(unsigned long));
+    }
+    if (layout == HASHMAP_LAYOUT_DENSE) {
+        h->stride = sizeof(void *);
+        h->hashes = 0;
+        h->hstride = 0;
+        h->present = calloc(present_count(len), sizeof(AO_t));
+        assert(h->present);
+        _account(map, present_count(len) * sizeof(AO_t));
+    } else if (layout == HASHMAP_LAYOUT_COMPACT) {
+        h->stride = sizeof(centry);
+        h->hashes = (unsigned int *)((char *)h->kvs + sizeof(centry) * len);
+        h->hstride = 1;
+    } else {
+        h->stride = sizeof(entry);
+        h->hashes = &h->kvs[0]._hash;
+        h->hstride = sizeof(entry) / sizeof(unsigned int);
+        if (layout == HASHMAP_LAYOUT_FINGERPRINT) h->fps = (unsigned char *)h->kvs + sizeof(entry) * len;
+    }
+    _account(map, header_bytes(len, layout));
+    return h;
+}
+
+#define HEADER_MMAP (1024 * 1024) // tables of this many bytes or more are mapped, not malloc'd
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+inline static unsigned long header_mapped_bytes(unsigned long bytes, int shift) {
+    unsigned long page = 1UL << shift;
+    return (bytes + page - 1) & ~(page - 1);
+}
+
+// large tables are mapped directly, so freeing them is a single munmap, and they start out zeroed
+// if asked, they are mapped on huge pages; falling back to transparent huge pages when none are reserved
+static header * header_alloc(HashMap *map, unsigned long bytes, int zeroed) {
+    if (bytes < HEADER_MMAP) {
+        header *h = zeroed? calloc(1, bytes) : malloc(bytes);
+        assert(h);
+        h->mapped = h->pages = h->advised = 0;
+        return h;
+    }
+    header *h = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (map->huge) {
+        h = mmap(null, header_mapped_bytes(bytes, map->huge), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (map->huge << MAP_HUGE_SHIFT), -1, 0);
+        if (h != MAP_FAILED) { h->mapped = h->pages = map->huge; h->advised = 0; return h; }
+        strace("no huge pages of 2^%d bytes for a table of %lu bytes", map->huge, bytes);
+    }
+#endif
+    h = mmap(null, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (h == MAP_FAILED) fatal("mapping table of %lu bytes", bytes);
+    h->mapped = h->pages = PAGE_SHIFT;
+    h->advised = 0;
+#ifdef MADV_HUGEPAGE
+    if (map->huge && !madvise(h, bytes, MADV_HUGEPAGE)) h->advised = HASHMAP_PAGES_2M; // 2MB pages, if the kernel can
+#endif
     return h;
 }
 
+// notice the entries are not zeroed, see _zero_block
+static header * header_new(HashMap *map, unsigned int len, int layout) {
+    return header_init(map, header_alloc(map, header_bytes(len, layout), 0), len, layout);
+}
+
+static void index_free_garbage(HashMap *map, header *kvs);
+static void free_keys(HashMap *map, header *kvs, int threads);
+static void fc_free_table(HashMap *map, header *kvs);
+static void free_drops(HashMap *map, header *kvs);
+
+static void header_free(HashMap *map, header *kvs) {
+    if (kvs->_garbage) index_free_garbage(map, kvs);
+    if (kvs->_drops) free_drops(map, kvs);
+    if (kvs->dropped) free_keys(map, kvs, 1);
+    _account(map, -(long)header_bytes(kvs->len, kvs->layout));
+    if (kvs->live) {
+        _account(map, -(long)(live_count(kvs->len) * sizeof(AO_t)));
+        free((void *)kvs->live);
+    }
+    if (kvs->log) {
+        _account(map, -(long)(sizeof(olog) + kvs->len * sizeof(unsigned long)));
+        olog_free(map, kvs->log);
+        free((void *)kvs->order);
+    }
+    if (kvs->keys || kvs->dict) fc_free_table(map, kvs);
+    if (kvs->present) {
+        _account(map, -(long)(present_count(kvs->len) * sizeof(AO_t)));
+        free((void *)kvs->present);
+    }
+    if (kvs->mapped) munmap(kvs, header_mapped_bytes(header_bytes(kvs->len, kvs->layout), kvs->mapped));
+    else free(kvs);
+}
+
+// zero @n entries starting at @from; including their hashes and fingerprints
+static void header_zero(header *kvs, unsigned long from, unsigned long n) {
+    bzero((char *)kvs->kvs + kvs->stride * from, kvs->stride * n);
+    if (kvs->layout == HASHMAP_LAYOUT_COMPACT) bzero((void *)(kvs->hashes + from), sizeof(unsigned int) * n);
+    if (kvs->fps) bzero((void *)(kvs->fps + from), n);
+}
+
 static unsigned long current_time() { // return time in seconds
     struct timeval time;
     gettimeofday(&time, 0);
@@ -143,417 +1062,4213 @@ static void push_old_kvs(header *nkvs, header *okvs) {
     okvs->_btodo = current_time(); // we just reuse this field
 }
 
-// free all kvs older than cutoff
-static int free_old_kvs2(header *kvs, unsigned long cutoff) {
+// a dropped generation @drop is about to be free'd; the tables from @top on, and its window, no longer point to it
+static void unwindow(header *top, header *drop) {
+    if (top->window && top->window->window == drop) top->window->window = null;
+    for (header *kvs = top->prev; kvs; kvs = kvs->prev) if (kvs->window == drop) kvs->window = null;
+}
+
+// free all kvs older than cutoff, retired from @top on
+static int free_old_kvs2(HashMap *map, header *top, header *kvs, unsigned long cutoff) {
     if (!kvs) return 1;
-    if (free_old_kvs2(kvs->prev, cutoff)) {
+    if (free_old_kvs2(map, top, kvs->prev, cutoff)) {
         kvs->prev = 0;
         if (kvs->_btodo < cutoff) {
-            free(kvs);
+            if (kvs->dropped) unwindow(top, kvs);
+            header_free(map, kvs);
             return 1;
         }
     }
     return 0;
 }
 
-// try to free some older maps
-static void free_old_kvs(header *nkvs) {
-    unsigned long cutoff = current_time() - 30; // seconds
-    if (free_old_kvs2(nkvs->prev, cutoff)) {
+#define RETIRE_GRACE 30    // seconds a retired table is kept; nothing tracks the threads that might still read it
+
+// try to free some older maps, that have been retired for at least @grace seconds
+// the resize winner and memory pressure both do this, so only one thread at a time may walk the list
+static void free_old_kvs(HashMap *map, header *nkvs, unsigned long grace) {
+    if (!AO_compare_and_swap(&map->_reclaiming, 0, 1)) return; // somebody else is at it
+    unsigned long cutoff = current_time() - grace;
+    if (free_old_kvs2(map, nkvs, nkvs->prev, cutoff)) {
         nkvs->prev = 0;
     }
+    write_barrier();
+    map->_reclaiming = 0;
 }
 
 // these functions read from volatile memory, we should really do that only once per "need"
 inline static entry * _load(header *kvs, int idx) {
     assert(idx >= 0);
     assert(idx < kvs->len);
-    return kvs->kvs + idx;
+    return (entry *)((char *)kvs->kvs + kvs->stride * idx); // notice, do not touch e->_hash, use gethash
 }
 
 inline static header * getkvs(HashMap *map) { return (header *)map->_kvs; }
 
 inline static void * getkey(entry *e) { return (void *)e->_key; }
 inline static void * getval(entry *e) { return (void *)e->_val; }
-inline static unsigned int gethash(entry *e) {
-    unsigned int h = e->_hash;
+// a write-behind map tags values not yet written to its sink; a dirty delete is DIRTY alone
+#define DIRTY ((AO_t)1)
+// the value of a slot, without its dirty tag
+inline static void * _value(HashMap *map, void *v) {
+    if (!map->sink || v == SIZED) return v;
+    return (void *)((AO_t)v & ~DIRTY);
+}
+// the index of entry @e in @kvs
+inline static unsigned long _slot(header *kvs, entry *e) { return ((char *)e - (char *)kvs->kvs) / kvs->stride; }
+
+// track a mapping at @idx becoming live (1) or deleted (-1); see hashmap_sample
+inline static void _live(header *kvs, unsigned long idx, long delta) {
+    if (!kvs->live) return;
+    AO_fetch_and_add(&kvs->live[(kvs->len + LIVE_GROUP - 1) / LIVE_GROUP + idx / LIVE_SUPER], delta);
+
+    // set the bit to what the value is now, until the value no longer changes; racing updates end up agreeing
+    volatile AO_t *w = &kvs->live[idx / LIVE_GROUP];
+    const AO_t bit = (AO_t)1 << (idx % LIVE_GROUP);
+    entry *e = _load(kvs, idx);
+    while (1) {
+        void *v = getval(e);
+        AO_t o = *w;
+        AO_t n = (v && v != SIZED)? o | bit : o & ~bit;
+        if (n != o && !cas((void *)w, (void *)n, (void *)o)) continue;
+        if (getval(e) == v) return;
+    }
+}
+
+inline static unsigned int gethash(header *kvs, int idx) {
+    volatile unsigned int *hp = kvs->hashes + kvs->hstride * idx;
+    unsigned int h = *hp;
     // this corresponds to the "wait hash" transition:
     // another thread just claimed a key, but did not yet come around to writing the hash for it
     while (!h) {
-        yield(); h = e->_hash; // since these fields are volatile, this will go read from main memory
+        latency_cause(HASHMAP_CAUSE_WAIT_HASH);
+        yield(); h = *hp; // since these fields are volatile, this will go read from main memory
     }
     return h;
 }
 
-/// create a new map
-HashMap * hashmap_new(hashmap_key_equals *equals_func, hashmap_key_hash *hash_func, hashmap_key_free *free_func) {
-    assert(sizeof(unsigned long) <= sizeof(AO_t));
+// the home slot of table hash @hash in @kvs, where its probe starts
+inline static unsigned long _home(header *kvs, unsigned int hash) { return hash & (kvs->len - 1); }
 
-    HashMap *map = malloc(sizeof(HashMap));
-    map->_size = 0;
-    map->changes = 0;
-    map->equals_func = equals_func;
-    map->hash_func = hash_func;
-    map->free_func = free_func;
+// the slot to probe after @idx; usually the next, but large paged tables wrap around within a huge page
+inline static unsigned long _next(header *kvs, unsigned long idx) {
+    return (idx & ~kvs->probemask) | ((idx + 1) & kvs->probemask);
+}
 
-    header *kvs = header_new(INITIAL_SIZE);
-    bzero(kvs->kvs, sizeof(entry) * INITIAL_SIZE);
+// read the hash without waiting, 0 means the slot is partial
+inline static unsigned int peekhash(header *kvs, int idx) { return kvs->hashes[kvs->hstride * idx]; }
 
-    map->_kvs = kvs;
-    map->_nkvs = 0;
-    return map;
+inline static unsigned char fingerprint(unsigned int hash) {
+    unsigned char f = hash >> 24; // the index uses the low bits
+    return f? f : 1;              // 0 means not yet written
 }
 
-static void free_kvs2(header *kvs) { // just free all old kvs
-    if (kvs == 0) return;
-    free_kvs2(kvs->prev);
-    free(kvs);
+inline static void sethash(header *kvs, int idx, unsigned int hash) {
+    kvs->hashes[kvs->hstride * idx] = hash;
+    if (kvs->fps) kvs->fps[idx] = fingerprint(hash); // always after the hash
 }
 
-// freeing the top level map; notice we cannot free the values
-static void free_kvs(HashMap *map, header *kvs) {
-    free_kvs2(kvs->prev);
-    for (int i = kvs->len - 1; i >= 0; i--) {
-        entry *e = _load(kvs, i);
-        void *k = getkey(e);
-        assert(k != SIZED);
-        if (k) map->free_func(k);
-    }
-    free(kvs);
+// can we skip this slot, because its fingerprint tells it holds another key
+// notice the fingerprint is written after the hash, so 0 only means we must look at the entry itself
+inline static int skipslot(header *kvs, int idx, unsigned char fp) {
+    if (!kvs->fps) return 0;
+    unsigned char f = kvs->fps[idx];
+    return f && f != fp;
 }
 
-/// free a @map, be careful not to free a map still in use
-/// Also note the values will not be free'd, they never belong to the hashmap in the first place.
-void hashmap_free(HashMap *map) {
-    strace("freeing hashmap: %p", map);
-    free_kvs(map, getkvs(map));
-    free(map);
+// ** integer keys **
+//
+// Created with null functions, a map uses the keys themselves as integers: no hashing beyond mixing the bits, equals
+// is ==, and nothing is free'd. Notice 0 cannot be a key.
+
+static unsigned int int_hash(void *key) {
+    unsigned long long k = (unsigned long)key; // murmur3 finalizer
+    k ^= k >> 33; k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (unsigned int)k;
 }
+static int int_equals(void *left, void *right) { return left == right; }
+static void int_free(void *key) { }
 
-/// return the current size of the @map
-long hashmap_size(HashMap *map) {
-    long res = map->_size;
-    // notice it is "normal" for size to drop below zero sometimes (temporarily):
-    // if we just had many deletes and adds, but more _size_updates are still "in flight" for the latter
-    if (res < 0) return 0;
-    return res;
+inline static int intkeys(HashMap *map) { return map->hash_func == int_hash; }
+
+// the hash of a key, as the map passes it around; the same in every table
+inline static unsigned int _keyhash(HashMap *map, void *key) {
+    unsigned int hash = map->hash_func(key);
+    return hash? hash : 1; // we cannot have 0 as a hash value
 }
 
-static void _size_update(HashMap *map, int n) {
-    AO_fetch_and_add(&map->_size, n);
+// the hash of a key in @kvs, which probes and memoizes it; a seeded table mixes in its seed, see hashmap_reseed
+inline static unsigned int tablehash(header *kvs, unsigned int hash) {
+    if (!kvs->seed) return hash;
+    unsigned int h = int_hash((void *)(kvs->seed ^ hash));
+    return h? h : 1;
 }
 
-static void * _putif(HashMap *map, int resizing, header *kvs, void *key, const unsigned int hash, void *val, void *oldval);
+// ** front coded keys **
+//
+// Keys like urls and paths share long prefixes, and a map owning millions of them spends most of its memory on the
+// same bytes over and over. A front coded map copies its string keys into chunks of the new table when it resizes:
+// every key is split at its last '/', the table keeps one copy of every prefix in a dictionary, and a key becomes a
+// short record: the id of its prefix, its length, and its suffix. Keys inserted since the last resize stay as they
+// were given, until the next resize. The threads copying a table intern prefixes concurrently, like the map claims
+// slots: claim an id, write the prefix, then cas the id into a free dictionary slot.
+//
+// A coded key is a pointer to its record with the top bit set; on 64 bit platforms no user space pointer has that
+// bit, not even a key passed to a lookup, which could point anywhere. The bits below it hold the size of the chunk,
+// chunks are aligned to their size, so the record leads to its chunk, and the chunk to the dictionary. The byte
+// below that holds the fingerprint of the key's hash in its table, so a probe passes most other keys on the key
+// pointer alone, without loading their hash, let alone their record; user space pointers have 48 bits. Records and
+// prefixes never move; chunks are free'd with their table, and the malloc'd keys a copy replaced are free'd with the
+// old table, since other threads might still compare them. The map hashes and compares keys itself, walking the
+// prefix and then the suffix, so a key is never decoded into a buffer. Hashes and fingerprints in the table reject
+// most slots before a compare, and the length in a record rejects most of the rest.
 
-// when resizing, any thread can claim the next block of the new map and zero it
-int _zero_block(header *nkvs) {
-    assert(nkvs); assert(nkvs->len);
-    unsigned long len = nkvs->len;
-    unsigned int todo = 1 + (len - 1) / BLOCK_SIZE;
-    assert(todo > 0);
-    if (len <= BLOCK_SIZE) assert(todo == 1);
+#define FC_CODED ((AO_t)1 << 63)
+#define FC_SHIFT 56                // where a coded key holds the log2 of its chunk size
+#define FC_FP_SHIFT 48             // where a coded key holds its fingerprint, see fingerprint
+#define FC_MAX 4096                // longer keys are left as they are
+#define FC_MIN_PREFIX 8            // shorter prefixes are not worth sharing
+#define FC_FIRST_CHUNK 12          // log2 of bytes; chunks of a copy double, up to FC_LAST_CHUNK
+#define FC_LAST_CHUNK 16
+#define FC_PREFIXES 65535          // at most, per table; ids are 16 bits
 
-    // assign ourselves a next block to work on
-    unsigned long block = AO_fetch_and_add(&nkvs->_btodo, 1);
-    if (block >= todo) { // done with work, wait for all workers to finish
-        while (nkvs->_bdone < todo) yield(); // yield while waiting
-        return 0;        // done
-    }
+// the prefixes of a table
+typedef struct fc_dict fc_dict;
+struct fc_dict {
+    unsigned long mask;            // slots - 1
+    unsigned long cap;             // prefix ids, the first is not used
+    volatile AO_t count;           // ids claimed
+    volatile AO_t spare;           // an id claimed, but given back unused; 0 if none
+    const char *volatile *prefixes;
+    volatile AO_t *slots;          // ids, 0 if free
+};
 
-    unsigned int blen = BLOCK_SIZE;
-    if (block * BLOCK_SIZE + BLOCK_SIZE > len) blen = len - block * BLOCK_SIZE;
+typedef struct fc_chunk fc_chunk;
+struct fc_chunk {
+    fc_chunk *next;
+    fc_dict *dict;
+    const char *volatile *prefixes; // of the dictionary, saving a load when comparing
+    int shift;                     // log2 of its size, and alignment
+    char data[];
+};
 
-    //strace("[%p]: zeroing(%lu): %p: %lu - %u", pthread_self(), block, nkvs, block * BLOCK_SIZE, blen);
-    bzero(nkvs->kvs + block * BLOCK_SIZE, sizeof(entry) * blen);
+typedef struct fc_record fc_record;
+struct fc_record {
+    unsigned short prefix;         // id, 0 if none
+    unsigned short len;            // of the whole key
+    char suffix[];
+};
 
-    // make known that we finished a block; since the order doesn't we just count until all blocks are done
-    unsigned long bdone = AO_fetch_and_add(&nkvs->_bdone, 1);
-    if (bdone >= todo) return 0; // done
-    return 1;                    // more work todo
+inline static int coded(void *key) { return ((AO_t)key & FC_CODED) != 0; }
+inline static fc_record * fc_rec(void *key) { return (fc_record *)((AO_t)key & (((AO_t)1 << FC_FP_SHIFT) - 1)); }
+inline static fc_chunk * fc_chunk_of(void *key) {
+    int shift = ((AO_t)key >> FC_SHIFT) & 0x1f;
+    return (fc_chunk *)((AO_t)fc_rec(key) & ~(((AO_t)1 << shift) - 1));
 }
 
-// when resizing, any thread can claim the next block of the old map and copy it
-static int _copy_block(HashMap *map, header *okvs, header *nkvs) {
-    assert(map); assert(okvs); assert(nkvs); assert(nkvs != kvs_promise);
-    unsigned long len = okvs->len;
-    unsigned int todo = 1 + (len - 1) / BLOCK_SIZE;
-    assert(todo > 0);
-    if (len <= BLOCK_SIZE) assert(todo == 1);
+// walks the bytes of a key, coded or not
+typedef struct fc_cursor fc_cursor;
+struct fc_cursor { const char *p, *q; };
 
-    unsigned long block = AO_fetch_and_add(&okvs->_btodo, 1);
+inline static void fc_open(fc_cursor *c, void *key) {
+    if (!coded(key)) { c->p = key; c->q = null; return; }
+    fc_record *r = fc_rec(key);
+    if (r->prefix) { c->p = fc_chunk_of(key)->prefixes[r->prefix]; c->q = r->suffix; }
+    else { c->p = r->suffix; c->q = null; }
+}
+
+// can a probe for fingerprint @fp pass key @k of @kvs, because it is coded with another fingerprint
+// only tables a front coded copy built hold coded keys; keys of other maps might have any bits set
+inline static int fc_skip(header *kvs, void *k, unsigned char fp) {
+    return kvs->keys && coded(k) && (unsigned char)((AO_t)k >> FC_FP_SHIFT) != fp;
+}
+
+inline static char fc_next(fc_cursor *c) {
+    if (!*c->p) {
+        if (!c->q) return 0;
+        c->p = c->q; c->q = null;
+    }
+    return *c->p++;
+}
+
+// hashes 8 bytes at a time, however the key is split in pieces
+static unsigned int fc_hash(void *key) {
+    fc_cursor c; fc_open(&c, key);
+    const char *pieces[2] = { c.p, c.q };
+    unsigned long long h = 0x9e3779b97f4a7c15ULL, w = 0, total = 0;
+    int k = 0;
+    for (int i = 0; i < 2 && pieces[i]; i++) {
+        const char *p = pieces[i];
+        unsigned long len = strlen(p);
+        total += len;
+        while (len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            if (!k && len >= 8) {
+                memcpy(&w, p, 8); p += 8; len -= 8;
+                h = (h ^ w) * 0xff51afd7ed558ccdULL; h ^= h >> 29; w = 0;
+                continue;
+            }
+#endif
+            w |= (unsigned long long)(unsigned char)*p++ << (8 * k); len--;
+            if (++k == 8) { h = (h ^ w) * 0xff51afd7ed558ccdULL; h ^= h >> 29; w = 0; k = 0; }
+        }
+    }
+    if (k) { h = (h ^ w) * 0xff51afd7ed558ccdULL; h ^= h >> 29; }
+    return int_hash((void *)(unsigned long)(h ^ total));
+}
+
+static int fc_equals(void *left, void *right) {
+    if (coded(left) && coded(right) && fc_rec(left)->len != fc_rec(right)->len) return 0;
+    if (coded(left) != coded(right)) {
+        // the common case, a stored key against a lookup; compare piece by piece
+        if (coded(right)) { void *t = left; left = right; right = t; }
+        fc_cursor l; fc_open(&l, left);
+        const char *r = right;
+        if (l.q) {
+            unsigned long plen = strlen(l.p);
+            if (strncmp(l.p, r, plen)) return 0;
+            r += plen; l.p = l.q;
+        }
+        return !strcmp(l.p, r);
+    }
+    fc_cursor l, r; fc_open(&l, left); fc_open(&r, right);
+    while (1) {
+        char a = fc_next(&l);
+        if (a != fc_next(&r)) return 0;
+        if (!a) return 1;
+    }
+}
+
+static void fc_free(void *key) { if (!coded(key)) free(key); }
+
+// the dictionary of @kvs, created by the first thread to copy a key into it; sized to the table it is copied from
+static fc_dict * fc_dict_of(HashMap *map, header *kvs, unsigned long keys) {
+    fc_dict *d = kvs->dict;
+    if (d) return d;
+    unsigned long cap = keys / 4 < 16? 16 : keys / 4 > FC_PREFIXES? FC_PREFIXES : keys / 4;
+    unsigned long slots = 1;
+    while (slots < cap * 2) slots *= 2;
+    d = calloc(1, sizeof(fc_dict));
+    assert(d);
+    d->mask = slots - 1;
+    d->cap = cap;
+    d->count = 1;
+    d->prefixes = calloc(cap + 1, sizeof(char *));
+    d->slots = calloc(slots, sizeof(AO_t));
+    assert(d->prefixes); assert(d->slots);
+    if (cas((void *)&kvs->dict, d, null)) {
+        _account(map, sizeof(fc_dict) + (cap + 1) * sizeof(char *) + slots * sizeof(AO_t));
+        return d;
+    }
+    free((void *)d->prefixes); free((void *)d->slots); free(d);
+    return kvs->dict;
+}
+
+// the bytes of a key, in at most two pieces, as a cursor walks them
+typedef struct fc_span fc_span;
+struct fc_span {
+    const char *p[2];
+    unsigned long n[2];
+};
+
+// copy @len bytes of @s from @at to @dst
+static void fc_span_copy(const fc_span *s, unsigned long at, unsigned long len, char *dst) {
+    for (int i = 0; i < 2 && len; i++) {
+        if (at >= s->n[i]) { at -= s->n[i]; continue; }
+        unsigned long n = s->n[i] - at < len? s->n[i] - at : len;
+        memcpy(dst, s->p[i] + at, n);
+        dst += n; len -= n; at = 0;
+    }
+}
+
+// are the first @len bytes of @s those of the string @str, and no more
+static int fc_span_is(const fc_span *s, unsigned long len, const char *str) {
+    for (int i = 0; i < 2 && len; i++) {
+        unsigned long n = s->n[i] < len? s->n[i] : len;
+        if (memcmp(s->p[i], str, n)) return 0;
+        str += n; len -= n;
+    }
+    return !*str;
+}
+
+// the chunk being filled by one _copy_block
+typedef struct fc_builder fc_builder;
+struct fc_builder {
+    HashMap *map;
+    header *okvs, *kvs;
+    fc_chunk *chunk;
+    unsigned long used;
+};
+
+static void fc_new_chunk(fc_builder *b, unsigned long need) {
+    int shift = b->chunk? b->chunk->shift + 1 : FC_FIRST_CHUNK;
+    if (shift > FC_LAST_CHUNK) shift = FC_LAST_CHUNK;
+    while ((1UL << shift) < need + sizeof(fc_chunk)) shift++;
+    fc_chunk *c = aligned_alloc(1UL << shift, 1UL << shift);
+    assert(c);
+    c->dict = fc_dict_of(b->map, b->kvs, b->okvs->len);
+    c->prefixes = c->dict->prefixes;
+    c->shift = shift;
+    _account(b->map, 1L << shift);
+    while (1) {
+        c->next = b->kvs->keys;
+        if (cas((void *)&b->kvs->keys, c, c->next)) break;
+    }
+    b->chunk = c;
+    b->used = 0;
+}
+
+// claim a prefix id of @d, preferring one given back; 0 if the dictionary is full
+static unsigned int fc_claim(fc_dict *d) {
+    AO_t spare = d->spare;
+    if (spare && AO_compare_and_swap(&d->spare, spare, 0)) return spare;
+    if (d->count > d->cap) return 0;
+    unsigned int id = AO_fetch_and_add1(&d->count);
+    return id > d->cap? 0 : id;
+}
+
+// give back prefix id @id of @d, which no slot holds; lost only if another id is given back at the same time, and
+// yet another claimed since
+static void fc_unclaim(fc_dict *d, unsigned int id) {
+    if (!AO_compare_and_swap(&d->spare, 0, id)) AO_compare_and_swap(&d->count, id + 1, id);
+}
+
+// the id of the first @len bytes of @key, adding them to the dictionary, in the current chunk; 0 if it is full
+static unsigned int fc_intern(fc_builder *b, const fc_span *key, unsigned long len) {
+    fc_dict *d = b->chunk->dict;
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < 2; i++) {
+        unsigned long n = key->n[i] < len - (i? key->n[0] : 0)? key->n[i] : len - (i? key->n[0] : 0);
+        for (unsigned long j = 0; j < n; j++) { h ^= (unsigned char)key->p[i][j]; h *= 16777619u; }
+    }
+    unsigned int mine = 0; // claimed, with the prefix written, but in no slot yet
+    for (unsigned long i = 0, idx = h & d->mask; i <= d->mask; i++, idx = (idx + 1) & d->mask) {
+        unsigned int id = d->slots[idx];
+        if (!id) {
+            if (!mine) {
+                if (!(mine = fc_claim(d))) return 0;
+                char *p = b->chunk->data + b->used;
+                fc_span_copy(key, 0, len, p);
+                p[len] = 0;
+                d->prefixes[mine] = p;
+                write_barrier();
+            }
+            if (cas((void *)&d->slots[idx], (void *)(AO_t)mine, null)) { b->used += len + 1; return mine; }
+            // another thread took the slot; if its prefix is not ours, we try the next free slot with our id
+            id = d->slots[idx];
+        }
+        read_barrier();
+        if (fc_span_is(key, len, d->prefixes[id])) {
+            if (mine) fc_unclaim(d, mine);
+            return id;
+        }
+    }
+    if (mine) fc_unclaim(d, mine);
+    return 0;
+}
+
+// the coded copy of @key with hash @hash, in the table being built; or @key itself if it is too long
+// the pieces of the key are copied straight into the chunk, a key is never decoded into a buffer
+static void * fc_encode(fc_builder *b, void *key, unsigned int hash) {
+    fc_cursor c; fc_open(&c, key);
+    fc_span s = { { c.p, c.q }, { strlen(c.p), c.q? strlen(c.q) : 0 } };
+    unsigned long len = s.n[0] + s.n[1], split = 0;
+    if (len >= FC_MAX) return key;
+    for (int i = 1; i >= 0 && !split; i--) { // split after the last '/'
+        for (unsigned long j = s.n[i]; j > 0; j--) {
+            if (s.p[i][j - 1] == '/') { split = (i? s.n[0] : 0) + j; break; }
+        }
+    }
+    if (split < FC_MIN_PREFIX) split = 0;
+
+    unsigned long room = sizeof(fc_record) + len + 3; // the record, maybe its prefix, and aligning
+    if (!b->chunk || sizeof(fc_chunk) + b->used + room > (1UL << b->chunk->shift)) fc_new_chunk(b, room);
+    unsigned int id = split? fc_intern(b, &s, split) : 0;
+    if (!id) split = 0;
+    b->used = (b->used + 1) & ~1UL; // records are aligned for their fields
+    fc_record *r = (fc_record *)(b->chunk->data + b->used);
+    r->prefix = id;
+    r->len = len;
+    fc_span_copy(&s, split, len - split, r->suffix);
+    r->suffix[len - split] = 0;
+    b->used += sizeof(fc_record) + len - split + 1;
+    const unsigned char fp = fingerprint(tablehash(b->kvs, hash));
+    return (void *)((AO_t)r | FC_CODED | (AO_t)b->chunk->shift << FC_SHIFT | (AO_t)fp << FC_FP_SHIFT);
+}
+
+static void fc_free_table(HashMap *map, header *kvs) {
+    for (fc_chunk *c = kvs->keys, *next; c; c = next) {
+        next = c->next;
+        _account(map, -(1L << c->shift));
+        free(c);
+    }
+    fc_dict *d = kvs->dict;
+    if (d) {
+        _account(map, -(long)(sizeof(fc_dict) + (d->cap + 1) * sizeof(char *) + (d->mask + 1) * sizeof(AO_t)));
+        free((void *)d->prefixes); free((void *)d->slots); free(d);
+    }
+}
+
+/// make the empty @map store its string keys front coded, see hashmap_decode_key
+/// Keys must be malloc'd, nul terminated strings; the map hashes, compares and frees them itself from now on.
+void hashmap_set_front_coded(HashMap *map) {
+    api_assert(sizeof(void *) == 8, "front coding needs 64 bit pointers");
+    api_assert(!intkeys(map), "integer keys cannot be front coded");
+    api_assert(!map->weak && !map->sink && !map->insertion_ordered, "weak, write-behind and insertion ordered maps cannot front code keys");
+    api_assert(map->_size == 0, "map must be empty");
+    map->equals_func = fc_equals;
+    map->hash_func = fc_hash;
+    map->free_func = fc_free;
+    map->front_coded = 1;
+}
+
+/// the string of a @key the front coded @map handed out, decoded into @buf of @len bytes if needed
+/// @returns the string, or @buf holding as much of it as fits
+const char * hashmap_decode_key(HashMap *map, void *key, char *buf, long len) {
+    if (!coded(key)) return key;
+    fc_cursor c; fc_open(&c, key);
+    long n = 0;
+    for (char ch = fc_next(&c); ch && n < len - 1; ch = fc_next(&c)) buf[n++] = ch;
+    if (len > 0) buf[n] = 0;
+    return buf;
+}
+
+
+// ** ordered index **
+//
+// An ordered map keeps a lock free skip list of its integer keys next to the table, so range queries don't need a
+// full scan. Point lookups never use it. It is a Herlihy-Shavit skip list: a node is deleted by marking its next
+// pointers (the low bit), and any thread that finds a marked node on its way, snips it out.
+//
+// The index holds the keys that map to a value: a key enters the index when a slot is claimed for it, and it leaves
+// when it is deleted, or when a resize drops the slot because it maps to null. A claim inserts the key before it writes
+// the hash, and _copy_block waits for the hash, so a copy never races the insert of the same key. A delete and a put
+// of the same key do race on the index, so after changing the index, either looks at the map again, until the two
+// agree, see index_sync; a put that claimed a slot only does so when a key was removed meanwhile. Range queries still
+// look up every key they find, for its value. Removed nodes are free'd together with the table that was current, but
+// only after we once more make sure they are unlinked; when a table collects more of them than it has slots, a
+// compaction retires it.
+
+#define INDEX_HEIGHT 24
+#define MARKED(p) ((AO_t)(p) & 1)
+#define UNMARK(p) ((inode *)((AO_t)(p) & ~(AO_t)1))
+
+typedef struct inode inode;
+struct inode {
+    unsigned long key;     // final
+    int height;            // final
+    inode *garbage;        // link in the garbage list of a table
+    volatile AO_t next[0]; // marked pointers to the next node on every level
+};
+
+typedef struct oindex oindex;
+struct oindex {
+    inode *head;           // a sentinel, it is before every key
+    volatile AO_t _nodes;
+    volatile AO_t _removes; // nodes removed ever, see index_sync
+};
+
+static inode * inode_new(unsigned long key, int height) {
+    inode *n = malloc(sizeof(inode) + sizeof(AO_t) * height);
+    assert(n);
+    n->key = key;
+    n->height = height;
+    n->garbage = null;
+    for (int l = 0; l < height; l++) n->next[l] = 0;
+    return n;
+}
+
+static int index_height() {
+    int h = 1;
+    unsigned int r = fast_random();
+    while ((r & 1) && h < INDEX_HEIGHT) { h++; r >>= 1; }
+    return h;
+}
+
+// find the nodes before and at-or-after @key on every level, snipping marked nodes along the way
+// returns true if a node for @key is in the index
+static int index_find(oindex *ix, unsigned long key, inode **preds, inode **succs) {
+    while (1) {
+        int retry = 0;
+        inode *pred = ix->head;
+        for (int level = INDEX_HEIGHT - 1; level >= 0 && !retry; level--) {
+            inode *curr = UNMARK(pred->next[level]);
+            while (curr) {
+                AO_t succ = curr->next[level];
+                if (MARKED(succ)) { // curr is deleted, snip it; if pred changed meanwhile, start over
+                    if (!AO_compare_and_swap(&pred->next[level], (AO_t)curr, (AO_t)UNMARK(succ))) { retry = 1; break; }
+                    curr = UNMARK(succ);
+                    continue;
+                }
+                if (curr->key >= key) break;
+                pred = curr;
+                curr = UNMARK(succ);
+            }
+            preds[level] = pred;
+            succs[level] = curr;
+        }
+        if (!retry) return succs[0] && succs[0]->key == key;
+    }
+}
+
+static void index_insert(oindex *ix, unsigned long key) {
+    inode *preds[INDEX_HEIGHT], *succs[INDEX_HEIGHT];
+    inode *node = null;
+    while (1) {
+        if (index_find(ix, key, preds, succs)) { free(node); return; } // a claimed slot can be reused
+        if (!node) node = inode_new(key, index_height());
+        for (int l = 0; l < node->height; l++) node->next[l] = (AO_t)succs[l];
+        if (AO_compare_and_swap(&preds[0]->next[0], (AO_t)succs[0], (AO_t)node)) break;
+    }
+    AO_fetch_and_add1(&ix->_nodes);
+
+    // the node is in; now link in the higher levels, nobody removes it meanwhile (see above)
+    for (int level = 1; level < node->height; level++) {
+        while (1) {
+            if (AO_compare_and_swap(&preds[level]->next[level], (AO_t)succs[level], (AO_t)node)) break;
+            index_find(ix, key, preds, succs);
+            node->next[level] = (AO_t)succs[level];
+        }
+    }
+}
+
+static void index_remove(oindex *ix, unsigned long key, header *okvs) {
+    inode *preds[INDEX_HEIGHT], *succs[INDEX_HEIGHT];
+    if (!index_find(ix, key, preds, succs)) return;
+    inode *node = succs[0];
+
+    // mark from the top down; marking the bottom level is what deletes the node
+    for (int level = node->height - 1; level >= 0; level--) {
+        while (1) {
+            AO_t next = node->next[level];
+            if (MARKED(next)) break;
+            if (AO_compare_and_swap(&node->next[level], next, next | 1)) break;
+        }
+    }
+    AO_fetch_and_add1(&ix->_removes);
+    index_find(ix, key, preds, succs); // snip it out
+    AO_fetch_and_add(&ix->_nodes, -1);
+
+    while (1) {
+        node->garbage = (inode *)okvs->_garbage;
+        if (cas(&okvs->_garbage, node, node->garbage)) break;
+    }
+    AO_fetch_and_add1(&okvs->_ngarbage);
+}
+
+// free the nodes removed while copying @kvs; by now, only an insert that started before a node was marked, could
+// have linked it in again, so after one more find, nobody can reach it
+static void index_free_garbage(HashMap *map, header *kvs) {
+    inode *preds[INDEX_HEIGHT], *succs[INDEX_HEIGHT];
+    inode *n = (inode *)kvs->_garbage;
+    while (n) {
+        inode *next = n->garbage;
+        index_find(map->index, n->key, preds, succs);
+        free(n);
+        n = next;
+    }
+    kvs->_garbage = null;
+    kvs->_ngarbage = 0;
+}
+
+static void index_free(oindex *ix) {
+    inode *n = ix->head;
+    while (n) {
+        inode *next = UNMARK(n->next[0]);
+        free(n);
+        n = next;
+    }
+    free(ix);
+}
+
+/// make @map, which must use integer keys, keep an ordered index of its keys for @hashmap_range
+/// Call this before putting anything in the map.
+void hashmap_set_ordered(HashMap *map) {
+    api_assert(intkeys(map), "only maps with integer keys can be ordered");
+    api_assert(!map->index, "map is already ordered");
+    api_assert(!map->dense, "dense maps cannot be ordered");
+    api_assert(map->_size == 0, "map must be empty");
+
+    oindex *ix = malloc(sizeof(oindex));
+    assert(ix);
+    ix->head = inode_new(0, INDEX_HEIGHT);
+    ix->_nodes = 0;
+    ix->_removes = 0;
+    write_barrier();
+    map->index = ix;
+}
+
+/// create a new map
+/// if @equals_func, @hash_func and @free_func are all null, the map uses integer keys, see @hashmap_new
+/// @free_func is not called when a mapping is deleted: the next resize drops the key, and it is free'd with the old
+/// table, after the grace period; see drops
+HashMap * hashmap_new(hashmap_key_equals *equals_func, hashmap_key_hash *hash_func, hashmap_key_free *free_func) {
+    assert(sizeof(unsigned long) <= sizeof(AO_t));
+    assert(sizeof(entry) / sizeof(unsigned int) * sizeof(unsigned int) == sizeof(entry)); // see header_new
+
+    api_assert((equals_func && hash_func && free_func) || (!equals_func && !hash_func && !free_func), "either all or no key functions");
+    if (!hash_func) {
+        equals_func = int_equals;
+        hash_func = int_hash;
+        free_func = int_free;
+    }
+
+    HashMap *map = malloc(sizeof(HashMap));
+    map->_size = 0;
+    map->changes = 0;
+    map->equals_func = equals_func;
+    map->hash_func = hash_func;
+    map->free_func = free_func;
+    map->cache = 0;
+    map->index = 0;
+    map->weak = 0;
+    map->bulk_keys = 0;
+    map->sampled = 0;
+    map->insertion_ordered = 0;
+    map->front_coded = 0;
+    map->dense = 0;
+    map->_dense_miss = 0;
+    map->huge = 0;
+    map->paged = 0;
+    map->sink = 0;
+    map->sink_data = 0;
+    map->flusher = 0;
+    map->_flushing = 0;
+    map->_bytes = 0;
+    map->budget = 0;
+    map->budget_node = 0;
+    map->_reclaiming = 0;
+    map->_compact = 0;
+    map->_reserve = 0;
+    map->seed = 0;
+    map->hot = 0;
+    map->layout = HASHMAP_LAYOUT_PLAIN;
+    map->layout_reason = "initial";
+    map->_reads = map->_writes = map->_misses = map->_contention = 0;
+
+    header *kvs = header_new(map, INITIAL_SIZE, HASHMAP_LAYOUT_PLAIN);
+    header_zero(kvs, 0, INITIAL_SIZE);
+
+    map->_kvs = kvs;
+    map->_nkvs = 0;
+    return map;
+}
+
+// ** teardown **
+//
+// Freeing a huge map is mostly calling free_func for every key. We do that over blocks, like a resize copies, using
+// as many threads as asked for; or skip it entirely when the user frees all keys at once (or they are integers).
+// Large tables are mapped, so releasing them is a single munmap.
+
+typedef struct teardown teardown;
+struct teardown {
+    HashMap *map;
+    header *kvs;
+    volatile AO_t block;
+};
+
+static void _free_key_blocks(teardown *t) {
+    header *kvs = t->kvs;
+    assert(kvs->layout != HASHMAP_LAYOUT_DENSE); // only integer keys are dense, see free_keys
+    unsigned long blocks = 1 + (kvs->len - 1) / kvs->block;
+    while (1) {
+        unsigned long block = AO_fetch_and_add1(&t->block);
+        if (block >= blocks) return;
+        unsigned long end = (block + 1) * kvs->block;
+        if (end > kvs->len) end = kvs->len;
+        for (unsigned long i = block * kvs->block; i < end; i++) {
+            void *k = getkey(_load(kvs, i));
+            assert(k != SIZED);
+            if (k && k != CLEARED) t->map->free_func(k);
+        }
+    }
+}
+
+static void * _free_keys_thread(void *data) {
+    _free_key_blocks(data);
+    return null;
+}
+
+// free the keys of the current table, or of a dropped generation, using up to @threads threads
+static void free_keys(HashMap *map, header *kvs, int threads) {
+    if (map->bulk_keys || map->free_func == int_free) return; // integer keys own nothing; only they can be dense
+    teardown t = { map, kvs, 0 };
+    long blocks = 1 + (kvs->len - 1) / kvs->block;
+    if (threads > blocks) threads = blocks;
+    pthread_t helpers[threads];
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&helpers[started], null, _free_keys_thread, &t)) break; // do with fewer
+        started++;
+    }
+    _free_key_blocks(&t);
+    for (int i = 0; i < started; i++) pthread_join(helpers[i], null);
+}
+
+static void write_behind_stop(HashMap *map);
+
+// freeing the top level map; notice we cannot free the values
+static void free_kvs(HashMap *map, header *kvs, int threads) {
+    header *old = kvs->prev;
+    while (old) { // retired tables; only a dropped generation still has keys
+        header *prev = old->prev;
+        if (old->dropped) free_keys(map, old, threads);
+        old->dropped = 0;
+        header_free(map, old);
+        old = prev;
+    }
+    if (kvs->window) {
+        free_keys(map, kvs->window, threads);
+        header_free(map, kvs->window);
+    }
+    free_keys(map, kvs, threads);
+    header_free(map, kvs);
+}
+
+/// declare that the user frees all keys of @map at once, after freeing the map, like keys in an arena
+/// Freeing the map then skips calling free_func for every key. The map still frees keys it drops while in use.
+void hashmap_set_bulk_keys(HashMap *map) {
+    map->bulk_keys = 1;
+}
+
+/// free a @map using up to @threads threads to free its keys
+/// Like hashmap_free, be careful not to free a map still in use.
+void hashmap_free_parallel(HashMap *map, int threads) {
+    api_assert(threads > 0, "need at least one thread: %d", threads);
+    strace("freeing hashmap: %p", map);
+    if (map->budget_node) { // unregister first, and wait if memory pressure is working on this map
+        budget_node *n = map->budget_node;
+        n->budget = null;
+        if (!cas(&n->_map, null, map)) fatal("unregistering map");
+        while (n->_busy) yield();
+        map->budget_node = null; // the node can be reused now; the tables free'd below still leave the budget
+    }
+    if (map->sink) write_behind_stop(map);
+    free_kvs(map, getkvs(map), threads);
+    if (map->index) index_free(map->index);
+    if (map->cache) {
+        free((void *)map->cache->sketch);
+        free(map->cache);
+    }
+    if (map->hot) {
+        free((void *)map->hot->sketch);
+        free(map->hot);
+    }
+    free(map);
+}
+
+/// free a @map, be careful not to free a map still in use
+/// Also note the values will not be free'd, they never belong to the hashmap in the first place.
+void hashmap_free(HashMap *map) {
+    hashmap_free_parallel(map, 1);
+}
+
+static void * _free_async(void *data) {
+    hashmap_free(data);
+    return null;
+}
+
+/// free a @map in a background thread; returns right away
+/// Like hashmap_free, the map must not be in use anymore. Free functions are called from the background thread.
+void hashmap_free_async(HashMap *map) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, _free_async, map)) hashmap_free(map); // no thread, do it now
+    pthread_attr_destroy(&attr);
+}
+
+/// return the current size of the @map
+long hashmap_size(HashMap *map) {
+    long res = map->_size;
+    // notice it is "normal" for size to drop below zero sometimes (temporarily):
+    // if we just had many deletes and adds, but more _size_updates are still "in flight" for the latter
+    if (res < 0) return 0;
+    return res;
+}
+
+static void _size_update(HashMap *map, int n) {
+    AO_fetch_and_add(&map->_size, n);
+}
+
+static void * _putif(HashMap *map, int resizing, header *kvs, void *key, const unsigned int keyhash, void *val, void *oldval);
+void * _resize(HashMap *map, header *okvs);
+static int _cache_admit(HashMap *map, header *kvs, const unsigned int keyhash);
+
+// ** dense integer keys **
+//
+// An integer keyed map holding nearly contiguous keys spends its time hashing and probing, and its memory on keys and
+// hashes it does not need. A dense table is just an array of values, the key of a slot is the base of the table plus
+// its index, with a bitmap of the slots holding a value. A value goes through the same states as in any table: null,
+// a value updated using cas, and SIZED once a resize copied it. A key outside the array has no mapping; inserting one
+// resizes into a dense table wide enough for it, or back into a hashed table when the keys would be too sparse. A
+// delete that leaves the table too sparse resizes it back into a hashed table too.
+//
+// Copies into a hashed table count the keys they move, with the smallest and largest. Until it is published no other
+// thread can write the new table; so the winner of the resize can look at the keys it got, and convert it into a
+// dense table when they are dense, or a dense table into a hashed one when most of its slots are empty.
+
+#define DENSE_MIN 64            // fewer keys than this stay hashed
+#define DENSE_FILL 2            // a hashed table goes dense when its keys fill at least half their range
+#define DENSE_SPARSE 8          // a dense table goes hashed when fewer than 1 in 8 slots hold a value
+#define DENSE_MAX (1UL << 30)   // slots in a dense table
+
+inline static volatile void ** dense_slot(header *kvs, unsigned long idx) {
+    assert(idx < kvs->len);
+    return (volatile void **)kvs->kvs + idx;
+}
+
+// set the present bit of @idx to what its value is now; like _live, until the value no longer changes
+inline static void dense_mark(header *kvs, unsigned long idx) {
+    volatile AO_t *w = &kvs->present[idx / LIVE_GROUP];
+    const AO_t bit = (AO_t)1 << (idx % LIVE_GROUP);
+    volatile void **slot = dense_slot(kvs, idx);
+    while (1) {
+        void *v = (void *)*slot;
+        AO_t o = *w;
+        AO_t n = (v && v != SIZED)? o | bit : o & ~bit;
+        if (n != o && !cas((void *)w, (void *)n, (void *)o)) continue;
+        if (*slot == v) return;
+    }
+}
+
+inline static void * _get_dense(header *kvs, void *key) {
+    const unsigned long idx = (unsigned long)key - kvs->base; // keys below the base wrap around to large indexes
+    if (idx >= kvs->len) return null;
+    return (void *)*dense_slot(kvs, idx);
+}
+
+static void * _putif_dense(HashMap *map, int resizing, header *kvs, void *key, void *val, void *oldval) {
+    const unsigned long idx = (unsigned long)key - kvs->base;
+    if (idx >= kvs->len) {
+        if (resizing) fatal("resize: key %lu outside dense table [%lu, %lu)", (unsigned long)key, kvs->base, kvs->base + kvs->len);
+        if (val == null || (oldval != IGNORE && oldval != null)) return null; // it maps to null, nothing to do
+        map->_dense_miss = (unsigned long)key; // the next table must have room for it
+        return _resize(map, kvs);
+    }
+    if (resizing && val == null) return DELETED;
+
+    volatile void **slot = dense_slot(kvs, idx);
+    void *v = (void *)*slot;
+    while (1) {
+        if (v == SIZED) return SIZED;
+        if (oldval != IGNORE && v != oldval) {
+            if (resizing) fatal("resize: %lu = %p != %p new: %p", (unsigned long)key, v, oldval, val);
+            return v;
+        }
+        if (v == null && val == null) return null;
+        if (cas((void *)slot, val, v)) {
+            flight(resizing? FLIGHT_COPY : FLIGHT_VALUE, kvs, idx);
+            if ((v == null) != (val == null)) dense_mark(kvs, idx);
+            if (!resizing && v == null) _size_update(map, 1);
+            if (!resizing && val == null) _size_update(map, -1);
+            if (!resizing) map->changes++;
+            if (!resizing && val == null && (unsigned long)hashmap_size(map) * DENSE_SPARSE < kvs->len) {
+                _resize(map, kvs); // too sparse now; the resize turns it hashed, see dense_next
+            }
+            return v;
+        }
+        flight(FLIGHT_VALUE_LOST, kvs, idx);
+        if (!resizing) latency_cause(HASHMAP_CAUSE_CAS);
+        v = (void *)*slot;
+    }
+}
+
+// mark slot @idx of a dense table as copied, returning its value
+static void * dense_seal(header *kvs, unsigned long idx) {
+    volatile void **slot = dense_slot(kvs, idx);
+    while (1) {
+        void *v = (void *)*slot;
+        if (cas((void *)slot, SIZED, v)) return v;
+        strace("we lost race for dense slot: %lu; retry", idx);
+    }
+}
+
+// add the keys a copy moved into hashed table @kvs: @n keys, from @lo to @hi
+static void dense_count(header *kvs, unsigned long lo, unsigned long hi, unsigned long n) {
+    if (!n) return;
+    AO_fetch_and_add(&kvs->_kcount, n);
+    AO_t o;
+    while ((o = kvs->_kmin) > lo && !cas((void *)&kvs->_kmin, (void *)lo, (void *)o));
+    while ((o = kvs->_kmax) < hi && !cas((void *)&kvs->_kmax, (void *)hi, (void *)o));
+}
+
+// the table to copy dense table @okvs into: wider, if a key did not fit; hashed, if it would get too sparse
+static header * dense_next(HashMap *map, header *okvs, long size, int layout) {
+    unsigned long lo = okvs->base, hi = okvs->base + okvs->len; // keys in [lo, hi)
+    const unsigned long miss = map->_dense_miss;
+    map->_dense_miss = 0;
+    if (miss && miss - lo >= okvs->len) {
+        // grow towards the key, at least doubling, so keys appended one after the other resize rarely
+        if (miss >= hi) {
+            hi = hi + okvs->len > miss + 1? hi + okvs->len : miss + 1;
+        } else {
+            lo = lo > okvs->len + 1? lo - okvs->len : 1;
+            if (miss < lo) lo = miss;
+        }
+    }
+    // racing inserts can still land anywhere in the old table, so the new table covers all of it
+    if (hi - lo <= DENSE_MAX && (unsigned long)size * DENSE_SPARSE >= hi - lo) {
+        strace("dense resize: [%lu, %lu) -> [%lu, %lu)", okvs->base, okvs->base + okvs->len, lo, hi);
+        header *nkvs = header_new(map, hi - lo, HASHMAP_LAYOUT_DENSE);
+        nkvs->base = lo;
+        return nkvs;
+    }
+    unsigned long len = INITIAL_SIZE;
+    while (len < size * 4) len *= 2;
+    strace("dense resize: too sparse, hashing %ld keys in %lu", size, len);
+    header *nkvs = header_new(map, len, layout == HASHMAP_LAYOUT_DENSE? HASHMAP_LAYOUT_PLAIN : layout);
+    if (miss) nkvs->_kmin = nkvs->_kmax = miss; // so the copy does not turn dense again, without room for the miss
+    return nkvs;
+}
+
+// a copy is finished but not yet published, only we can touch @nkvs; convert it if its keys ask for it
+static header * dense_convert(HashMap *map, header *nkvs) {
+    if (nkvs->layout == HASHMAP_LAYOUT_DENSE) {
+        unsigned long count = 0;
+        for (unsigned long w = 0; w < present_count(nkvs->len); w++) count += __builtin_popcountl(nkvs->present[w]);
+        if (count * DENSE_SPARSE >= nkvs->len) return nkvs;
+
+        unsigned long len = INITIAL_SIZE;
+        while (len < count * 4) len *= 2;
+        header *h = header_new(map, len, map->layout == HASHMAP_LAYOUT_ADAPTIVE? HASHMAP_LAYOUT_PLAIN : map->layout);
+        if (!h->mapped) header_zero(h, 0, len);
+        for (unsigned long i = 0; i < nkvs->len; i++) {
+            void *v = (void *)*dense_slot(nkvs, i);
+            if (!v) continue;
+            void *k = (void *)(nkvs->base + i);
+            _putif(map, 1, h, k, _keyhash(map, k), v, null);
+        }
+        strace("dense table of %lu slots holds %lu keys, hashing them", nkvs->len, count);
+        return h;
+    }
+
+    const unsigned long count = nkvs->_kcount, lo = nkvs->_kmin, hi = nkvs->_kmax;
+    if (count < DENSE_MIN || hi < lo || hi - lo >= count * DENSE_FILL || hi - lo >= DENSE_MAX) return nkvs;
+    unsigned long len = DENSE_MIN;
+    while (len < hi - lo + 1) len *= 2; // room to grow at the top
+    header *d = header_new(map, len, HASHMAP_LAYOUT_DENSE);
+    d->base = lo;
+    if (!d->mapped) header_zero(d, 0, len);
+    for (unsigned long i = 0; i < nkvs->len; i++) {
+        entry *e = _load(nkvs, i);
+        void *k = getkey(e), *v = getval(e);
+        if (!k || !v) continue;
+        unsigned long idx = (unsigned long)k - lo;
+        *dense_slot(d, idx) = v;
+        d->present[idx / LIVE_GROUP] |= (AO_t)1 << (idx % LIVE_GROUP);
+    }
+    strace("%lu keys in [%lu, %lu], going dense", count, lo, hi);
+    return d;
+}
+
+/// let @map, which has integer keys, switch to dense tables when its keys are nearly contiguous
+/// At every resize the map checks how dense the keys are, and picks a dense or hashed table for them. Dense maps
+/// cannot be caches, ordered, sampled, insertion ordered, write-behind, windowed, pinned or track hot keys.
+void hashmap_set_dense(HashMap *map) {
+    api_assert(intkeys(map), "only maps with integer keys can be dense");
+    api_assert(!map->cache && !map->index && !map->sampled && !map->insertion_ordered && !map->sink && !map->hot,
+            "caches, ordered, sampled, insertion ordered, write-behind and hot tracking maps cannot be dense");
+    api_assert(!getkvs(map)->window, "windowed maps cannot be dense");
+    map->dense = 1;
+}
+
+// when resizing, any thread can claim the next block of the new map and zero it
+int _zero_block(header *nkvs) {
+    assert(nkvs); assert(nkvs->len);
+    unsigned long len = nkvs->len, bsize = nkvs->block;
+    unsigned int todo = 1 + (len - 1) / bsize;
+    assert(todo > 0);
+    if (len <= bsize) assert(todo == 1);
+
+    // assign ourselves a next block to work on
+    unsigned long block = AO_fetch_and_add(&nkvs->_btodo, 1);
     if (block >= todo) { // done with work, wait for all workers to finish
-        while (okvs->_bdone < todo) yield(); // yield while waiting
+        int spins = 0;
+        while (nkvs->_bdone < todo) backoff(&spins); // yield while waiting
         return 0;        // done
     }
 
-    unsigned long blen = BLOCK_SIZE;
-    if (block * BLOCK_SIZE + BLOCK_SIZE > len) blen = len - block * BLOCK_SIZE;
-    blen = block * BLOCK_SIZE + blen;
-
-    //strace("[%p]: copying: %p: %lu - %lu", pthread_self(), okvs, block * BLOCK_SIZE, blen);
-    for (int i = block * BLOCK_SIZE; i < blen; i++) {
-        entry *e = _load(okvs, i);
-        while (1) {
-            void *k = getkey(e);
-            if (k) {
-                // found a key to move, mark it as SIZED, and copy it to new map, or delete it if it maps to null
-                void *old = getval(e);
-                if (cas(&e->_val, SIZED, old)) {
-                    if (DELETED == _putif(map, 1, nkvs, k, gethash(e), old, null)) {
-                        // deleted key; we no longer need this key; some threads might still want to compare it, so first mark the slot as sized
-                        if (!cas(&e->_key, SIZED, k)) fatal("marking deleted key");
-                        // aha; we would like this to be perfectly safe, but it really isn't ... it is 99.9999% safe ...
-                        // if the free also unmaps the page the key resides in, another thread still doing a key compare will segfault
-                        // other than that it hardly matters, since results of such racy equals_func don't matter
-                        map->free_func(k);
-                    }
-                    break;
-                } else {
-                    strace("we lost race for: %d; retry", i);
-                }
-            } else {
-                if (cas(&e->_key, SIZED, null)) {
-                    break;
-                } else {
-                    strace("we lost race for empty slot: %d; retry", i);
-                }
-            }
+    unsigned int blen = bsize;
+    if (block * bsize + bsize > len) blen = len - block * bsize;
+
+    //strace("[%p]: zeroing(%lu): %p: %lu - %u", pthread_self(), block, nkvs, block * bsize, blen);
+    if (!nkvs->mapped) header_zero(nkvs, block * bsize, blen); // fresh mapped pages are zero already
+
+    // make known that we finished a block; since the order doesn't we just count until all blocks are done
+    unsigned long bdone = AO_fetch_and_add(&nkvs->_bdone, 1);
+    if (bdone >= todo) return 0; // done
+    return 1;                    // more work todo
+}
+
+static void * _find_pinned(header *kvs, void *key, const unsigned int keyhash, unsigned long *slot);
+static void olog_compact(HashMap *map, header *okvs, header *nkvs);
+static int olog_compact_block(HashMap *map, header *okvs, header *nkvs);
+
+// A copy drops the mappings that map to null, and a front coded copy replaces keys by coded copies, but it cannot
+// free those keys right away: another thread might still compare them, and a put that just claimed the slot, and has
+// yet to write its value, retries with the same key in the new table. So a copy only notes the slots it drops; their
+// keys are free'd with the table, after the grace period. A put that finds its claimed slot SIZED takes the key back
+// first, by marking the key SIZED, see _putif.
+typedef struct drops drops;
+struct drops {
+    drops *next;
+    unsigned long count;
+    unsigned long slots[];
+};
+
+// note slot @i, whose key the old table keeps, in the notes of the block being copied, sized @bsize
+static void drop_slot(drops **d, unsigned long i, unsigned long bsize) {
+    if (!*d) {
+        *d = malloc(sizeof(drops) + bsize * sizeof(unsigned long));
+        assert(*d);
+        (*d)->count = 0;
+    }
+    (*d)->slots[(*d)->count++] = i;
+}
+
+static void free_drops(HashMap *map, header *kvs) {
+    for (drops *d = kvs->_drops, *next; d; d = next) {
+        next = d->next;
+        for (unsigned long i = 0; i < d->count; i++) {
+            void *k = getkey(_load(kvs, d->slots[i]));
+            if (k != SIZED && k != CLEARED) map->free_func(k); // unless a put took it back
+        }
+        free(d);
+    }
+    kvs->_drops = null;
+}
+
+// when resizing, any thread can claim the next block of the old map and copy it
+static int _copy_block(HashMap *map, header *okvs, header *nkvs) {
+    assert(map); assert(okvs); assert(nkvs); assert(nkvs != kvs_promise);
+    unsigned long len = okvs->len, bsize = okvs->block;
+    unsigned int todo = 1 + (len - 1) / bsize;
+    assert(todo > 0);
+    if (len <= bsize) assert(todo == 1);
+
+    unsigned long block = AO_fetch_and_add(&okvs->_btodo, 1);
+    if (block >= todo) { // done with work, wait for all workers to finish
+        int spins = 0;
+        while (okvs->_bdone < todo) backoff(&spins); // yield while waiting
+        return 0;        // done
+    }
+
+    unsigned long blen = bsize;
+    if (block * bsize + bsize > len) blen = len - block * bsize;
+    blen = block * bsize + blen;
+
+    //strace("[%p]: copying: %p: %lu - %lu", pthread_self(), okvs, block * bsize, blen);
+    const int hashed = okvs->layout != HASHMAP_LAYOUT_DENSE && nkvs->layout != HASHMAP_LAYOUT_DENSE;
+    const int ahead = hashed && okvs->seed == nkvs->seed? tuning.prefetch : 0;
+    const int counting = map->dense && nkvs->layout != HASHMAP_LAYOUT_DENSE;
+    unsigned long kmin = ~0UL, kmax = 0, kcount = 0;
+    fc_builder fcb = { map, okvs, nkvs, null, 0 };
+    drops *dropped = null;
+    for (int i = block * bsize; i < blen; i++) {
+        if (okvs->layout == HASHMAP_LAYOUT_DENSE) {
+            // a dense slot has no key to claim, sealing the value is all
+            void *old = dense_seal(okvs, i);
+            flight(FLIGHT_SIZED, okvs, i);
+            if (!old) continue;
+            void *k = (void *)(okvs->base + i);
+            _putif(map, 1, nkvs, k, _keyhash(map, k), old, null);
+            if (counting) {
+                if (okvs->base + i < kmin) kmin = okvs->base + i;
+                if (okvs->base + i > kmax) kmax = okvs->base + i;
+                kcount++;
+            }
+            continue;
+        }
+        if (ahead && i + ahead < blen) {
+            // the new slot is a cache miss for sure, start loading it early; a zero hash is an empty slot
+            unsigned int h = okvs->hashes[okvs->hstride * (i + ahead)];
+            if (h) __builtin_prefetch(_load(nkvs, h & (nkvs->len - 1)), 1);
+        }
+        entry *e = _load(okvs, i);
+        while (1) {
+            void *k = getkey(e);
+            if (k) {
+                // found a key to move, mark it as SIZED, and copy it to new map, or delete it if it maps to null
+                void *old = getval(e);
+                if (cas(&e->_val, SIZED, old)) {
+                    flight(FLIGHT_SIZED, okvs, i);
+                    if (k == CLEARED) {
+                        // cleared weak key; the collector already reclaimed it, we just drop the slot
+                        if (!cas(&e->_key, SIZED, k)) fatal("marking cleared key");
+                        break;
+                    }
+                    // a seeded table memoizes mixed hashes, hash the key again; the new table might mix another seed
+                    unsigned int hash = okvs->seed? _keyhash(map, k) : gethash(okvs, i);
+                    if (map->front_coded && old != null) {
+                        void *c = fc_encode(&fcb, k, hash);
+                        // the old table still holds the malloc'd key, free it with that table
+                        if (c != k && !coded(k)) drop_slot(&dropped, i, blen - block * bsize);
+                        k = c;
+                    }
+                    if (DELETED == _putif(map, 1, nkvs, k, hash, old, null)) {
+                        // deleted key; we no longer need this key, but others might, it is free'd with the table
+                        if (map->index) index_remove(map->index, (unsigned long)k, okvs);
+                        if (map->free_func != int_free) drop_slot(&dropped, i, blen - block * bsize);
+                    } else if (okvs->order) {
+                        // the mapping keeps its place in the insertion order, until the log is compacted
+                        unsigned long slot;
+                        if (_find_pinned(nkvs, k, hash, &slot) == (void *)1) nkvs->order[slot] = okvs->order[i];
+                    } else if (counting) {
+                        if ((unsigned long)k < kmin) kmin = (unsigned long)k;
+                        if ((unsigned long)k > kmax) kmax = (unsigned long)k;
+                        kcount++;
+                    }
+                    break;
+                } else {
+                    strace("we lost race for: %d; retry", i);
+                }
+            } else {
+                if (cas(&e->_key, SIZED, null)) {
+                    break;
+                } else {
+                    strace("we lost race for empty slot: %d; retry", i);
+                }
+            }
+        }
+    }
+
+    while (dropped) {
+        dropped->next = okvs->_drops;
+        if (cas((void *)&okvs->_drops, dropped, dropped->next)) break;
+    }
+    if (kcount) dense_count(nkvs, kmin, kmax, kcount);
+
+    unsigned long bdone = AO_fetch_and_add(&okvs->_bdone, 1);
+    if (bdone >= todo) return 0; // done
+    return 1;                    // more work todo
+}
+
+void * _resize(HashMap *map, header *okvs);
+
+static void _help(HashMap *map, header *okvs) {
+    strace("help resize: %p, %p", map->_kvs, okvs);
+    header *nkvs = (header *)map->_nkvs;
+    int spins = 0;
+    while (nkvs == 0 || nkvs == kvs_promise) {
+        if (map->_kvs != okvs) return;
+        if (nkvs == 0) { // try to start a resize ourselves; this compensates for late promises
+            _resize(map, okvs);
+            return;
+        }
+        backoff(&spins); nkvs = (header *)map->_nkvs;
+    }
+
+    flight(FLIGHT_HELP, okvs, okvs->len);
+    while (map->_kvs == okvs && _zero_block(nkvs));
+    while (map->_kvs == okvs && _copy_block(map, okvs, nkvs));
+    if (okvs->log) {
+        // the winner starts compacting the log once every block is copied
+        spins = 0;
+        while (map->_kvs == okvs && !okvs->log->job) backoff(&spins);
+        while (map->_kvs == okvs && olog_compact_block(map, okvs, nkvs));
+    }
+    spins = 0;
+    while (map->_kvs == okvs) backoff(&spins); // yield until a new map is promoted to current
+    strace("done: %p, %p", map->_kvs, okvs);
+}
+
+// when a resize is detected, try to help it along
+void _help_resize(HashMap *map, header *okvs) {
+    if (map->_kvs != okvs) return;
+
+    // while sampling latencies, time every help, not 1 in N; helps are rare, and they make the tail
+    const unsigned int causes = latency_causes;
+    const unsigned long long start = latency_every? flight_clock() : 0;
+    latency_causes = 0;
+    latency_helping = 1;
+    _help(map, okvs);
+    latency_helping = 0;
+    if (start) latency_end(HASHMAP_LATENCY_RESIZE, start);
+    latency_causes = causes;
+    latency_cause(HASHMAP_CAUSE_RESIZE);
+}
+
+// ** adaptive layout **
+//
+// An adaptive map samples about 1 in 64 reads and writes, and counts misses and contention (lost races, and resizes
+// helped). At every resize the winner picks the layout of the new table from those counts, and halves them, so the
+// decision follows the current phase of the workload:
+// * when the budget is nearly used up, the compact layout; unless writers contend, the compact layout packs more
+//   entries in a cache line, so more writers race on the same lines
+// * when reads dominate, or reads miss a lot, the fingerprint layout; a miss probes until an empty slot, and
+//   fingerprints let it skip most entries without loading them
+// * otherwise, the plain layout; a write touches only one cache line
+
+#define SAMPLE_MASK 63
+#define SAMPLE_MIN 64      // below this many samples, keep the layout we have
+
+static __thread unsigned int sample_tick;
+#define HOT_SAMPLE_MASK 7  // a map tracking hot keys counts 1 in 8 reads, see hashmap_track_hot
+
+inline static void _sample(HashMap *map, int write, int miss) {
+    if (map->layout != HASHMAP_LAYOUT_ADAPTIVE) return;
+    if ((++sample_tick & SAMPLE_MASK) != 0) return;
+    if (write) AO_fetch_and_add1(&map->_writes);
+    else AO_fetch_and_add1(&map->_reads);
+    if (miss) AO_fetch_and_add1(&map->_misses);
+}
+
+inline static void _contended(HashMap *map) {
+    if (map->layout == HASHMAP_LAYOUT_ADAPTIVE) AO_fetch_and_add1(&map->_contention);
+}
+
+// pick a layout for the next table of @map; notice @reason must be a constant string
+static int _decide_layout(HashMap *map, header *okvs, const char **reason) {
+    if (map->layout != HASHMAP_LAYOUT_ADAPTIVE) { *reason = "fixed"; return map->layout; }
+
+    unsigned long reads = map->_reads, writes = map->_writes, misses = map->_misses, contention = map->_contention;
+    if (reads + writes < SAMPLE_MIN) { *reason = "too few samples"; return okvs->layout; }
+    if (map->budget && budget_exceeded(map, map->budget->limit / 4)) {
+        if (contention * 8 <= writes * SAMPLE_MASK) { *reason = "memory bound"; return HASHMAP_LAYOUT_COMPACT; }
+        *reason = "memory bound, but contended"; return HASHMAP_LAYOUT_PLAIN;
+    }
+    if (reads >= writes * 4) { *reason = "read heavy"; return HASHMAP_LAYOUT_FINGERPRINT; }
+    if (misses * 2 >= reads && reads >= writes) { *reason = "many misses"; return HASHMAP_LAYOUT_FINGERPRINT; }
+    *reason = "write heavy"; return HASHMAP_LAYOUT_PLAIN;
+}
+
+static int _choose_layout(HashMap *map, header *okvs) {
+    const char *reason;
+    int layout = _decide_layout(map, okvs, &reason);
+    if (layout != okvs->layout) strace("layout: %d -> %d: %s", okvs->layout, layout, reason);
+    map->layout_reason = reason;
+    // decay; we might drop some concurrent increments, that is ok
+    map->_reads /= 2; map->_writes /= 2; map->_misses /= 2; map->_contention /= 2;
+    return layout;
+}
+
+// whether at least a sixteenth of the slots of @kvs, and at least one, hold a deleted key, given it has @size live
+// ones; every claimed slot holds a live mapping or garbage, a claim lost in the count only makes us compact later
+static int _compactable(header *kvs, int size) {
+    long garbage = (long)kvs->claimed - size;
+    return garbage > 0 && garbage >= (long)(kvs->len / 16);
+}
+
+// when we need to resize
+void * _resize(HashMap *map, header *okvs) {
+    assert(map);
+    strace("maybe resize: %p, %p, %p", map->_kvs, okvs, map->_nkvs);
+    if (map->_nkvs != null) return SIZED; // somebody else already produced a new map
+    if (map->_kvs != okvs) return SIZED;  // somebody else alreay promoted a new map
+
+    if (cas(&map->_nkvs, kvs_promise, null)) {
+        if (map->_kvs != okvs) {
+            if (!cas(&map->_nkvs, null, kvs_promise)) fatal("unpublising late promise");
+            return SIZED; // we are so late: we didn't actually win the race; the winner already moved on
+        }
+
+        // we won the race to produce new map
+        flight(FLIGHT_PROMISE, okvs, okvs->len);
+        const unsigned int causes = latency_causes; // timed like _help_resize, unless it is helping
+        const unsigned long long start = latency_every && !latency_helping? flight_clock() : 0;
+        latency_causes = 0;
+        int size = hashmap_size(map);
+        unsigned int len = okvs->len;
+        int layout = _choose_layout(map, okvs);
+
+        // calculate how large we want next map to be
+        header *nkvs = null;
+        int compacting = 0;
+        if (okvs->layout == HASHMAP_LAYOUT_DENSE) {
+            // a dense table only resizes when a key did not fit, or when asked to; it turns hashed when sparse
+            compacting = map->_compact;
+            nkvs = dense_next(map, okvs, size, layout);
+        } else if (map->_reserve > len) {
+            // asked to make room for many mappings at once, see hashmap_reserve
+            strace("resizing to reserve: %d -> %lu", len, map->_reserve);
+            nkvs = header_new(map, map->_reserve, layout);
+        } else if (map->_compact) {
+            // asked to compact; shrink a sparse table, but leave plenty of room for inserts racing this resize
+            unsigned int nlen = len;
+            while (nlen > INITIAL_SIZE && nlen / 2 >= size * 4) nlen /= 2;
+            strace("resizing to shrink: %d -> %d", len, nlen);
+            compacting = 1;
+            nkvs = header_new(map, nlen, layout);
+        } else if (map->changes > (len / 4) && size / (float)len < 0.3f) {
+            // if there have been plenty mutations, and our full ration is pretty bad, just copy to remove garbage
+            strace("resizing to remove garbage: %d", len);
+            nkvs = header_new(map, len, layout);
+        } else if (budget_exceeded(map, header_bytes(len * 2, layout)) && _compactable(okvs, size)) {
+            // growing would push us over the memory budget, but a sixteenth of the slots are garbage, so compact
+            // (a cache will then evict on insert, instead of growing, see _cache_admit); a sparse table without
+            // garbage must grow, compacting it would hit the reprobe limit again right away
+            strace("resizing to remove garbage, over budget: %d", len);
+            AO_fetch_and_add1(&map->budget->_deferred);
+            nkvs = header_new(map, len, layout);
+        } else {
+            strace("resizing: %d (%d <= %d && %.2f >= 0.3)", len * 2, map->changes, (len / 4), size / (float)len);
+            if (budget_exceeded(map, header_bytes(len * 2, layout))) AO_fetch_and_add1(&map->budget->_overruns);
+            nkvs = header_new(map, len * 2, layout);
+        }
+        assert(nkvs); assert(nkvs->len);
+        nkvs->window = okvs->window;
+        // when racing on many resizes, some threads doing _zero_block might loop until _bdone >= todo
+        // and we reset it to zero here; not such a big deal, since it will become >= todo after _copy_block
+        okvs->_btodo = 0;
+        okvs->_bdone = 0;
+
+        write_barrier();  // publish results
+        map->_nkvs = nkvs; // expose new map so others can help
+
+        while (_zero_block(nkvs));
+        while (_copy_block(map, okvs, nkvs));
+        if (okvs->log) olog_compact(map, okvs, nkvs);
+        header *next = map->dense? dense_convert(map, nkvs) : nkvs;
+        if (next->layout == HASHMAP_LAYOUT_DENSE) map->layout_reason = "dense integer keys";
+        next->compacted = compacting;
+
+        // here we could free the map, but many threads might still need to read the SIZED markers
+        // so we keep all old lists and free only the really old; with a gc this is much better
+        // over budget or not: going over budget beats freeing a table a thread is still reading
+        push_old_kvs(nkvs, okvs);
+        if (next != nkvs) push_old_kvs(next, nkvs); // helpers might still look at the table we converted
+        free_old_kvs(map, next, RETIRE_GRACE);
+
+        // this is the required order: otherwise another thread might attempt to resize (when compensating for late promise)
+        // notice we compensate that we can now observe nkvs == kvs (in _putif)
+        if (!cas(&map->_kvs, next, okvs))  fatal("publishing new map");
+        flight(FLIGHT_PUBLISH, next, next->len);
+        if (!cas(&map->_nkvs, null, nkvs)) fatal("unpublising resize in progress");
+        map->changes = 0;
+        map->_compact = 0;
+        map->_reserve = 0;
+        strace("done resizing: %p[%lu].size: %ld", next, next->len, hashmap_size(map));
+        if (start) latency_end(HASHMAP_LATENCY_RESIZE, start);
+        latency_causes = causes;
+        latency_cause(HASHMAP_CAUSE_RESIZE);
+        return SIZED; // always indicate we need to retry after resize
+    }
+
+    // we lost the race to produce new map
+    return SIZED;
+}
+
+static void * _get(HashMap *map, header *kvs, void *key, const unsigned int keyhash) {
+    if (kvs->layout == HASHMAP_LAYOUT_DENSE) return _get_dense(kvs, key);
+    const unsigned int hash = tablehash(kvs, keyhash);
+    const unsigned char fp = fingerprint(hash);
+    int idx = _home(kvs, hash);
+
+    int reprobe_try = 0;
+    while (1) {
+        if (!skipslot(kvs, idx, fp)) {
+            entry *e = _load(kvs, idx);
+            void *k = getkey(e);
+            if (k == 0) return 0;         // finding an empty slot indicates the mapping doesn't exist
+            if (k == SIZED) return SIZED; // finding a SIZED slot indicates a map resize is in flight
+
+            // first check the fingerprint of a coded key, then the memoized hash, before doing full key compare
+            unsigned int h = fc_skip(kvs, k, fp)? 0 : gethash(kvs, idx);
+            if (h == hash && k != CLEARED) {
+                read_barrier();           // needed to ensure we can read the other key fully
+                if (map->equals_func(k, key)) {
+                    return _value(map, getval(e)); // keys are equal, we found our mapping
+                }
+            }
+        }
+
+        if (++reprobe_try > kvs->probemask) return 0; // going full circle, we know the mapping does not exist
+        idx = _next(kvs, idx);              // try next slot
+    }
+}
+
+static void index_sync(HashMap *map, void *key, const unsigned int keyhash);
+void hashmap_compact(HashMap *map);
+
+// a copy took the value of slot @e before we wrote ours; if we claimed the slot, we take @key back, so we can retry
+// with it, see drops
+inline static void * _unclaim(int resizing, entry *e, void *key, int mustfreekey) {
+    if (!resizing && !mustfreekey) cas(&e->_key, SIZED, key);
+    return SIZED;
+}
+
+static void * _putif(HashMap *map, int resizing, header *kvs, void *key, const unsigned int keyhash, void *val, void *oldval) {
+    assert(map); assert(kvs);
+    if (kvs->layout == HASHMAP_LAYOUT_DENSE) return _putif_dense(map, resizing, kvs, key, val, oldval);
+    const unsigned int len = kvs->len;
+    const unsigned int hash = tablehash(kvs, keyhash);
+    const unsigned char fp = fingerprint(hash);
+    int idx = _home(kvs, hash);
+    int mustfreekey = 0; // used to mark if passed in key must be freed; if we return SIZED, we want to reuse the key...
+    // a new mapping in a cache must be admitted first, see _cache_admit; updates and deletes need not
+    int admit = map->cache && !resizing && val != null;
+    AO_t removes = ~(AO_t)0; // the removes from the index before we claimed a slot, if we did; see index_sync
+
+    assert(key); assert(hash);
+    strace("%p %p :: [%s] = %s old: %s", map, kvs, (const char *)key, (const char *)val, (const char *)oldval);
+
+
+    // first we try to find the slot to update, or claim a new one
+    int reprobe_try = 0;
+    entry *e;
+    while (1) {
+        e = _load(kvs, idx);
+        if (!skipslot(kvs, idx, fp)) {
+            void *k = getkey(e);
+
+            if (k == null) { // we found an unclaimed slot; try to claim it
+                if (val == null && (oldval == IGNORE || oldval == null) && (!map->sink || resizing)) {
+                    // this means we are deleting a mapping that doesn't exit; so we don't have to do anything
+                    // (unless write-behind, then the delete must reach the sink)
+                    if (resizing) return DELETED; // when resizing, signal the key must be free'd
+                    // just make sure it is still really null before returning null
+                    if (cas(&e->_key, null, null)) {
+                        map->free_func(key);      // we no longer need the given key
+                        return null;
+                    }
+                }
+
+                // the key is not in the table, so this is a new mapping; decide before claiming, so a rejected
+                // key leaves no garbage slot behind
+                if (admit && (oldval == IGNORE || oldval == null)) {
+                    admit = 0;
+                    if (!_cache_admit(map, kvs, keyhash)) {
+                        map->free_func(key);
+                        return REJECTED;
+                    }
+                }
+
+                write_barrier();     // needed to ensure others can read our key fully
+                if (cas(&e->_key, key, null)) {
+                    flight(FLIGHT_CLAIM, kvs, idx);
+                    kvs->claimed++;
+                    // an ordered map indexes the key before writing the hash; a copy waits for the hash
+                    if (map->index && !resizing) {
+                        removes = map->index->_removes;
+                        index_insert(map->index, (unsigned long)key);
+                    }
+                    sethash(kvs, idx, hash); // so we claimed the slot, write the key
+                    flight(FLIGHT_HASH, kvs, idx);
+                    break;           // and go on to writing the value
+                }
+                if (!resizing) { _contended(map); latency_cause(HASHMAP_CAUSE_CAS); }
+                // we couldn't claim the empty slot, ensure we reread the no longer null key
+                // TODO if cas returned the new pointer, we didn't have to do this extra memory read
+                k = getkey(e);
+            }
+
+            assert(k);
+            if (k == SIZED) return SIZED;  // map is resizing
+            unsigned int h = fc_skip(kvs, k, fp)? 0 : gethash(kvs, idx);
+            if (h == hash && k != CLEARED) { // a cleared slot is never reused, it is dropped by the next resize
+                read_barrier();            // needed to ensure we can read the other key fully
+                if (map->equals_func(k, key)) { // keys are equal, we found the spot where we must update the value
+                    mustfreekey = k != key; // mark that key should be deleted, unless a copy moved our claim here
+                    break;
+                }
+            }
+        }
+
+        // if no map, we are in a resize; never return _resize when already resizing
+        ++reprobe_try;
+        if (!resizing && reprobe_try >= tuning.reprobe_limit) return _resize(map, kvs);
+        if (resizing && reprobe_try > kvs->probemask) fatal("resize: new table is full: %u", len); // a shrink was way off
+        idx = _next(kvs, idx);         // try next stot
+    }
+
+
+    // second we try to update the slots value
+    void *v = getval(e);               // first read the old value
+    if (v == SIZED) return _unclaim(resizing, e, key, mustfreekey);
+    void *stored = val;                // write-behind tags the new value dirty; a copy moves the tag along as it is
+    if (map->sink) {
+        if (!resizing) stored = (void *)((AO_t)val | DIRTY);
+        else val = _value(map, val);
+    }
+    void *cur = _value(map, v);
+    if (!resizing && mustfreekey && cur != null) {
+        // we quickly check if resize is in progress, to prevent wasting effort on old map; not when we claimed the slot
+        header *nkvs = (header *)map->_nkvs;
+        if (nkvs != 0 && nkvs != kvs) return SIZED;
+        if (map->_kvs != kvs) return SIZED;
+    }
+
+    while (1) {
+        if (oldval != IGNORE && cur != oldval) {
+            // we cannot update value, because it doesn't match passed in given value
+            if (resizing) fatal("resize: %s = %p != %p new: %p", (const char *)key, v, oldval, val);
+            return cur; // return the current value
+        }
+
+        if (admit && cur == null) { // a deleted mapping comes back
+            admit = 0;
+            if (!_cache_admit(map, kvs, keyhash)) {
+                if (mustfreekey) map->free_func(key);
+                return REJECTED;
+            }
+        }
+        if (kvs->log && !resizing && cur == null && val != null) olog_append(map, kvs, idx, getkey(e), keyhash);
+        if (cas(&e->_val, stored, v)) {
+            flight(resizing? FLIGHT_COPY : FLIGHT_VALUE, kvs, idx);
+            // we won the race to update the value; update map->size as needed
+            if (cur == null && val != null) _live(kvs, idx, 1);
+            if (cur != null && val == null) _live(kvs, idx, -1);
+            if (!resizing && cur == null && val != null) _size_update(map, 1);
+            if (!resizing && cur != null && val == null) _size_update(map, -1);
+            if (!resizing) map->changes++;
+            if (map->index && !resizing && (cur == null) != (val == null)) {
+                // a claim indexed the key already, unless a delete removed it meanwhile
+                if (removes == ~(AO_t)0 || removes != map->index->_removes) index_sync(map, getkey(e), keyhash);
+                header *cur = getkvs(map);
+                if (cur->_ngarbage > cur->len) hashmap_compact(map); // so the removed nodes can be free'd
+            }
+
+            if (mustfreekey) map->free_func(key); // we no longer need the given key
+            return cur;                           // return the previous value we just replaced
+        }
+
+        // we lost the race to update; try again with updated value
+        // TODO if cas returned the new pointer, we didn't have to do this extra memory read
+        flight(FLIGHT_VALUE_LOST, kvs, idx);
+        if (!resizing) { _contended(map); latency_cause(HASHMAP_CAUSE_CAS); }
+        v = getval(e);
+        if (v == SIZED) return _unclaim(resizing, e, key, mustfreekey); // map is resizing
+        cur = _value(map, v);
+    }
+}
+
+
+// ** bounded cache **
+//
+// When used as a cache, the map holds about capacity mappings, and an insert beyond that must evict a victim. To
+// prevent one-hit-wonders (like keys from a scan) from pushing out hot mappings, we use a TinyLFU admission filter: a
+// count-min sketch of how often keys are accessed. A new key is only admitted if it was seen more often than the
+// victim it would replace. Evicted values are handed to the evict function; a rejected value is handed back, as
+// @_putif returns REJECTED instead of storing it.
+//
+// The admission is decided in @_putif, once its probe found the mapping is new, so it costs no extra lookup: just
+// the sample the victim is picked from.
+//
+// The sketch packs 4 bit counters into words, and every row of the sketch shares the same words. Counters are only
+// updated using cas, so there is no lock. After reset_at increments all counters are halved, so old popularity fades.
+
+#define SKETCH_DEPTH 4
+#define SKETCH_SAMPLE 8                          // how many live mappings to consider when picking a victim
+#define SKETCH_COUNTERS (sizeof(AO_t) * 2)       // 4 bit counters per word
+#define SKETCH_AGE_MASK (((AO_t)-1 / 15) * 7)    // 0x7777...; clears the bits shifted in from the next counter
+
+static const unsigned int sketch_seeds[SKETCH_DEPTH] = { 0x97cb3127, 0xc3a5c85b, 0x85ebca6b, 0xb492b66f };
+
+static unsigned long sketch_index(cache *c, unsigned int hash, int row, int *shift) {
+    unsigned int h = (hash ^ (hash >> 16)) * sketch_seeds[row];
+    h ^= h >> 15;
+    *shift = (h % SKETCH_COUNTERS) * 4;
+    return (h / SKETCH_COUNTERS) & c->mask;
+}
+
+static int sketch_estimate(cache *c, unsigned int hash) {
+    int res = 15;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int shift;
+        unsigned long idx = sketch_index(c, hash, row, &shift);
+        int n = (c->sketch[idx] >> shift) & 15;
+        if (n < res) res = n;
+    }
+    return res;
+}
+
+// halve all counters; racing increments are not lost, they are just halved or not
+static void sketch_age(cache *c) {
+    strace("aging sketch: %p", c);
+    for (unsigned long i = 0; i <= c->mask; i++) {
+        while (1) {
+            AO_t w = c->sketch[i];
+            if (AO_compare_and_swap(&c->sketch[i], w, (w >> 1) & SKETCH_AGE_MASK)) break;
+        }
+    }
+    AO_fetch_and_add(&c->_additions, -(long)(c->reset_at / 2));
+}
+
+static void sketch_increment(cache *c, unsigned int hash) {
+    int added = 0;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int shift;
+        unsigned long idx = sketch_index(c, hash, row, &shift);
+        while (1) {
+            AO_t w = c->sketch[idx];
+            if (((w >> shift) & 15) == 15) break; // saturated
+            if (AO_compare_and_swap(&c->sketch[idx], w, w + ((AO_t)1 << shift))) { added = 1; break; }
+        }
+    }
+    // exactly one thread will observe reaching reset_at, that thread ages the sketch
+    if (added && AO_fetch_and_add(&c->_additions, 1) + 1 == c->reset_at) sketch_age(c);
+}
+
+// sample some live mappings starting at a random slot, and return the least frequently used one
+// notice in a sparse table we might have to look at many slots before we find enough live mappings
+static entry * _cache_victim(HashMap *map, header *kvs, int *freq, void **val) {
+    const unsigned int len = kvs->len;
+    int idx = fast_random() & (len - 1);
+
+    entry *victim = null;
+    int found = 0;
+    for (int i = 0; i < len && found < SKETCH_SAMPLE; i++, idx = (idx + 1) & (len - 1)) {
+        entry *e = _load(kvs, idx);
+        void *k = getkey(e);
+        if (k == null || k == SIZED) continue;
+        unsigned int h = peekhash(kvs, idx);
+        if (!h) continue;        // still partial, not worth waiting for
+        read_barrier();
+        void *v = getval(e);
+        if (v == null || v == SIZED) continue;
+        if (kvs->seed) h = _keyhash(map, k); // the sketch counts key hashes
+
+        found++;
+        int f = sketch_estimate(map->cache, h);
+        if (!victim || f < *freq) {
+            victim = e; *freq = f; *val = v;
+        }
+    }
+    return victim;
+}
+
+// decide if a new mapping with key hash @keyhash may enter the cache, evicting another from @kvs if needed
+// called by @_putif, which knows the mapping is new; returns 0 if the mapping was rejected
+static int _cache_admit(HashMap *map, header *kvs, const unsigned int keyhash) {
+    cache *c = map->cache;
+    for (int attempt = 0; attempt < 4; attempt++) {
+        // when over the memory budget, the cache is full, no matter its capacity
+        if (hashmap_size(map) < c->capacity && !budget_exceeded(map, 0)) return 1;
+
+        int vfreq = 0;
+        void *victimval = null;
+        entry *victim = _cache_victim(map, kvs, &vfreq, &victimval);
+        if (!victim) return 1; // cannot find anything to evict; just go over capacity a little
+
+        if (c->admit && sketch_estimate(c, keyhash) <= vfreq) {
+            strace("cache rejects: %u", keyhash);
+            return 0;
+        }
+
+        // evicting is just an update to null, that we race like any other update
+        if (cas(&victim->_val, null, victimval)) {
+            _live(kvs, _slot(kvs, victim), -1);
+            _size_update(map, -1);
+            map->changes++;
+            if (map->index) index_sync(map, getkey(victim), _keyhash(map, getkey(victim)));
+            if (c->evict_func) c->evict_func(victimval);
+            return 1;
+        }
+    }
+    return 1;
+}
+
+// a cache with a sketch sized for about @capacity keys
+static cache * cache_new(long capacity) {
+    unsigned long len = 8;
+    while (len < capacity) len *= 2; // about 16 counters per mapping keeps the estimates accurate
+
+    cache *c = malloc(sizeof(cache));
+    assert(c);
+    c->capacity = capacity;
+    c->admit = 1;
+    c->evict_func = null;
+    c->mask = len - 1;
+    c->reset_at = capacity * 10;
+    c->_additions = 0;
+    c->sketch = calloc(len, sizeof(AO_t));
+    assert(c->sketch);
+    return c;
+}
+
+/// turn @map into a bounded cache of about @capacity mappings
+/// Call this before sharing the map between threads. When full, a new mapping must evict another, but only if the
+/// new key was accessed more often than the victim, according to a frequency sketch updated in @hashmap_get.
+/// @evict  called with every value the map evicts; can be null. Rejected values are not passed, @hashmap_putif
+///         returns @REJECTED for those, and the caller keeps them
+void hashmap_set_cache(HashMap *map, long capacity, hashmap_value_evict *evict) {
+    api_assert(capacity > 0, "capacity must be positive: %ld", capacity);
+    api_assert(!map->cache, "map is already a cache");
+    api_assert(!map->dense, "dense maps cannot be caches");
+
+    cache *c = cache_new(capacity);
+    c->evict_func = evict;
+    write_barrier();
+    map->cache = c;
+}
+
+
+// ** memory budget **
+//
+// Many maps can share one budget, which accounts the bytes of all their tables, including retired tables still
+// waiting to be freed. When over budget, a resize that would double the table compacts it instead, as long as there is
+// garbage to remove. A cache evicts on every insert while over budget. But a plain map cannot refuse a mapping, so when
+// its table is really full, it doubles anyway; we count those as overruns.
+//
+// Registering reuses free nodes, or pushes a new node using cas, so budgets never lock either.
+
+/// create a new memory budget of @limit bytes, to share between maps
+HashBudget * hashbudget_new(unsigned long limit) {
+    HashBudget *b = malloc(sizeof(HashBudget));
+    assert(b);
+    b->limit = limit;
+    b->_used = 0;
+    b->_deferred = 0;
+    b->_overruns = 0;
+    return b;
+}
+
+/// free a @budget; only after all maps registered with it have been free'd
+void hashbudget_free(HashBudget *budget) {
+    api_assert(budget->_used == 0, "budget still in use: %lu", (unsigned long)budget->_used);
+    free(budget);
+}
+
+/// register @map with @budget; call this before sharing the map between threads
+void hashmap_set_budget(HashMap *map, HashBudget *budget) {
+    api_assert(!map->budget, "map already has a budget");
+
+    // while we set up the node, it looks in use, but its budget is null, so everybody skips it
+    budget_node *n = (budget_node *)_registry;
+    for (; n; n = n->next) {
+        if (n->_map == null && cas(&n->_map, kvs_promise, null)) break;
+    }
+    if (!n) {
+        n = malloc(sizeof(budget_node));
+        assert(n);
+        n->_map = (HashMap *)kvs_promise;
+        n->_busy = 0;
+        while (1) {
+            n->next = (budget_node *)_registry;
+            if (cas(&_registry, n, n->next)) break;
+        }
+    }
+    n->budget = null;
+    write_barrier();
+    n->_map = map;
+
+    unsigned long bytes = map->_bytes;
+    n->_bytes = bytes;
+    n->budget = budget;
+    AO_fetch_and_add(&budget->_used, bytes);
+    map->budget_node = n;
+    write_barrier();
+    map->budget = budget;
+}
+
+/// return the bytes all maps registered with @budget are using for their tables
+unsigned long hashbudget_used(HashBudget *budget) { return budget->_used; }
+
+/// return the bytes @map is using for its tables, including retired tables that are not yet free'd
+unsigned long hashmap_memory(HashMap *map) { return map->_bytes; }
+
+/// call @visit for every map registered with @budget, with the bytes it uses
+/// notice the map might be free'd concurrently, so only use the map pointer if you know it isn't
+void hashbudget_foreach(HashBudget *budget, hashbudget_visit *visit, void *data) {
+    for (budget_node *n = (budget_node *)_registry; n; n = n->next) {
+        HashMap *map = (HashMap *)n->_map;
+        if (map && map != (HashMap *)kvs_promise && n->budget == budget) visit(map, n->_bytes, data);
+    }
+}
+
+/// print some debugging info about the @budget
+void hashbudget_debug(HashBudget *budget) {
+    float mb = budget->_used / (float)(1024 * 1024);
+    float limit = budget->limit / (float)(1024 * 1024);
+    print("%.2fmb / %.2fmb; deferred: %lu; overruns: %lu", mb, limit, (unsigned long)budget->_deferred, (unsigned long)budget->_overruns);
+    for (budget_node *n = (budget_node *)_registry; n; n = n->next) {
+        if (n->_map && n->_map != (HashMap *)kvs_promise && n->budget == budget) print("  %p: %.2fmb", n->_map, n->_bytes / (float)(1024 * 1024));
+    }
+}
+
+
+// ** memory pressure **
+//
+// When memory runs low, every registered map can cooperate: free its retired tables once they are past the grace
+// period, instead of waiting for the next resize, and shrink tables that are mostly empty. Afterwards we ask malloc to
+// hand free memory back to the OS. Optionally a watcher thread polls the cgroup memory events and pressure stall
+// information, and calls this for us. The grace period stays, even under pressure: a thread stalled on paging might
+// still be reading a retired table.
+//
+// To work on a map, we set the _busy flag of its node, and only then read the map; hashmap_free clears the map, and
+// then waits until the node is no longer busy. Both use cas, so they cannot miss each other.
+
+/// compact @map: remove garbage and shrink the table if it is sparse
+/// This is a resize like any other, so other threads keep using the map, and help. A resize already running might
+/// not compact, and then clears the request; so we ask again, until a compacted table replaces the one we started at.
+void hashmap_compact(HashMap *map) {
+    header *from = getkvs(map);
+    while (1) {
+        header *kvs = getkvs(map);
+        if (kvs != from && kvs->compacted) break;
+        map->_compact = 1;
+        _resize(map, kvs);
+        _help_resize(map, kvs);
+    }
+    free_old_kvs(map, getkvs(map), RETIRE_GRACE);
+}
+
+/// react to memory pressure of @level on all maps registered with a budget
+/// @level HASHMAP_PRESSURE_MODERATE frees retired tables; HASHMAP_PRESSURE_CRITICAL also shrinks sparse tables
+void hashmap_on_memory_pressure(int level) {
+    strace("memory pressure: %d", level);
+    if (level <= 0) return;
+
+    for (budget_node *n = (budget_node *)_registry; n; n = n->next) {
+        if (!n->_map || n->_map == (HashMap *)kvs_promise) continue;
+        if (!AO_compare_and_swap(&n->_busy, 0, 1)) continue; // somebody else is already at it
+        HashMap *map = (HashMap *)n->_map;
+        if (map && map != (HashMap *)kvs_promise) {
+            if (level >= HASHMAP_PRESSURE_CRITICAL) {
+                header *kvs = getkvs(map);
+                if (kvs->len > INITIAL_SIZE && hashmap_size(map) * 8 < kvs->len) hashmap_compact(map);
+            }
+            free_old_kvs(map, getkvs(map), RETIRE_GRACE);
+        }
+        write_barrier();
+        n->_busy = 0;
+    }
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+// the watcher thread
+static volatile int watch_stop;
+static int watching;
+static pthread_t watch_thread;
+static char watch_events[256];
+static char watch_psi[256];
+static int watch_interval;
+
+// return the "high" count from a cgroup memory.events file
+static long read_memory_high(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char name[64];
+    long n, res = -1;
+    while (fscanf(f, "%63s %ld", name, &n) == 2) {
+        if (!strcmp(name, "high")) res = n;
+    }
+    fclose(f);
+    return res;
+}
+
+// return the avg10 for "some" or "full" from a pressure stall information file
+static float read_psi(const char *path, const char *kind) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    float res = -1;
+    while (fgets(line, sizeof(line), f)) {
+        float avg10;
+        if (!strncmp(line, kind, strlen(kind)) && sscanf(line + strlen(kind), " avg10=%f", &avg10) == 1) res = avg10;
+    }
+    fclose(f);
+    return res;
+}
+
+static void * _watch(void *data) {
+    long high = read_memory_high(watch_events);
+    while (!watch_stop) {
+        usleep(watch_interval * 1000);
+        int level = 0;
+
+        long nhigh = read_memory_high(watch_events);
+        if (nhigh > high) level = HASHMAP_PRESSURE_CRITICAL; // went over memory.high since last time
+        high = nhigh;
+
+        if (read_psi(watch_psi, "full") >= 5.0f) level = HASHMAP_PRESSURE_CRITICAL;
+        else if (!level && read_psi(watch_psi, "some") >= 10.0f) level = HASHMAP_PRESSURE_MODERATE;
+
+        if (level) hashmap_on_memory_pressure(level);
+    }
+    return null;
+}
+
+/// start a thread that watches memory pressure, and calls @hashmap_on_memory_pressure when needed
+/// @cgroup the cgroup directory to watch, null means /sys/fs/cgroup
+/// @interval_ms how often to check
+/// @returns 0 on success
+int hashmap_pressure_watch(const char *cgroup, int interval_ms) {
+    api_assert(!watching, "already watching memory pressure");
+    if (!cgroup) cgroup = "/sys/fs/cgroup";
+    snprintf(watch_events, sizeof(watch_events), "%s/memory.events", cgroup);
+    snprintf(watch_psi, sizeof(watch_psi), "%s/memory.pressure", cgroup);
+    if (access(watch_psi, R_OK)) snprintf(watch_psi, sizeof(watch_psi), "/proc/pressure/memory");
+    watch_interval = interval_ms > 0? interval_ms : 1000;
+    watch_stop = 0;
+
+    int r = pthread_create(&watch_thread, null, _watch, null);
+    if (r) return r;
+    watching = 1;
+    return 0;
+}
+
+/// stop the thread watching memory pressure
+void hashmap_pressure_unwatch() {
+    if (!watching) return;
+    watch_stop = 1;
+    pthread_join(watch_thread, null);
+    watching = 0;
+}
+
+
+// ** adaptive layout api **
+
+/// set the @layout of the tables of @map; a HASHMAP_LAYOUT_*
+/// The current table keeps its layout until the next resize, use @hashmap_adapt to switch right away.
+void hashmap_set_layout(HashMap *map, int layout) {
+    api_assert(layout >= HASHMAP_LAYOUT_ADAPTIVE && layout <= HASHMAP_LAYOUT_COMPACT, "unknown layout: %d", layout);
+    map->layout = layout;
+}
+
+/// return the layout of the current table of @map, and why it has that layout in @reason (if not null)
+int hashmap_layout(HashMap *map, const char **reason) {
+    if (reason) *reason = map->layout_reason;
+    return getkvs(map)->layout;
+}
+
+/// return the sampled counts an adaptive @map bases its decisions on; they decay at every resize
+void hashmap_layout_stats(HashMap *map, unsigned long *reads, unsigned long *writes, unsigned long *misses, unsigned long *contention) {
+    *reads = map->_reads;
+    *writes = map->_writes;
+    *misses = map->_misses;
+    *contention = map->_contention;
+}
+
+/// if @map would pick another layout than its current table has, switch now, using a resize
+/// @returns the layout of the current table
+int hashmap_adapt(HashMap *map) {
+    header *kvs = getkvs(map);
+    const char *reason;
+    if (_decide_layout(map, kvs, &reason) != kvs->layout) hashmap_compact(map);
+    return getkvs(map)->layout;
+}
+
+
+// ** huge pages **
+//
+// In a table of many gigabytes nearly every probe misses the dTLB as well as the cache. Large tables can be mapped on
+// huge pages, so one TLB entry covers 2MB or 1GB of slots. Explicit huge pages must be reserved by the administrator;
+// without them the map asks for transparent huge pages instead, which the kernel provides when it can.
+//
+// A paged map also keeps probe sequences within a huge page: the table is split in pages of a power of two slots,
+// and probing wraps around at the end of a page, instead of running into the next. The home slot is still
+// hash & (len - 1), so the page of a key is picked by the low bits above the page offset; on doubling, the keys of a
+// page go to the same offsets in two pages of the new table, and copying a block writes into just those two.
+
+/// back the large tables of @map with huge pages of 2^@shift bytes: HASHMAP_PAGES_2M or HASHMAP_PAGES_1G
+/// If @paged, probes in a large table never leave their page. Call this before sharing the map between threads; the
+/// current table is not remapped until the next resize.
+void hashmap_set_huge_pages(HashMap *map, int shift, int paged) {
+    api_assert(shift == HASHMAP_PAGES_2M || shift == HASHMAP_PAGES_1G, "unknown huge page size: 2^%d", shift);
+    map->huge = shift;
+    map->paged = paged;
+}
+
+// the bytes of the mapping holding @addr that the kernel backs with transparent huge pages, and in @len, the bytes of
+// the mapping; -1 if /proc/self/smaps does not tell
+static long anon_huge_bytes(void *addr, unsigned long *len) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) return -1;
+    char line[256];
+    int in = 0;
+    long res = -1;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long from, to, kb;
+        if (sscanf(line, "%lx-%lx ", &from, &to) == 2) { // the first line of a mapping
+            if (in) break;
+            in = from <= (unsigned long)addr && (unsigned long)addr < to;
+            if (in) *len = to - from;
+        } else if (in && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+            res = kb * 1024;
+        }
+    }
+    fclose(f);
+    return res;
+}
+
+/// return the size of the pages backing the current table of @map, 0 if it is malloc'd
+/// Whether the kernel backs a table with transparent huge pages is read from /proc/self/smaps, so this is not cheap;
+/// the table counts as backed by them once at least half of its mapping is.
+long hashmap_page_size(HashMap *map) {
+    header *kvs = getkvs(map);
+    if (kvs->advised) {
+        unsigned long len = 0;
+        long huge = anon_huge_bytes(kvs, &len);
+        if (huge > 0 && (unsigned long)huge * 2 >= len) return 1L << kvs->advised;
+    }
+    return kvs->pages? 1L << kvs->pages : 0;
+}
+
+
+inline static void * _hashmap_get(HashMap *map, void *key) {
+    header *dkvs = getkvs(map);
+    if (dkvs->layout == HASHMAP_LAYOUT_DENSE) {
+        // a dense table needs no hash; only resizes take the slow path
+        void *res = _get_dense(dkvs, key);
+        if (res != SIZED) {
+            _sample(map, 0, res == null);
+            return res;
+        }
+    }
+    unsigned int hash = map->hash_func(key);
+    if (!hash) hash = 1; // we cannot have 0 as a hash value
+    if (map->cache) sketch_increment(map->cache, hash);
+    else if (map->hot && (fast_random() & HOT_SAMPLE_MASK) == 0) sketch_increment(map->hot, hash);
+
+    header *kvs = getkvs(map);
+    void *res = _get(map, kvs, key, hash);
+    while (res == SIZED) {
+        _contended(map);
+        _help_resize(map, kvs);
+        kvs = getkvs(map);
+        res = _get(map, kvs, key, hash);
+    }
+    _sample(map, 0, res == null);
+    return res;
+}
+
+/// return the current mapping for @key
+/// @map the map to query
+/// @key the key for the value; the map will not own nor free this key
+void * hashmap_get(HashMap *map, void *key) {
+    const unsigned long long start = latency_begin();
+    void *res = _hashmap_get(map, key);
+    if (start) latency_end(HASHMAP_LATENCY_GET, start);
+    return res;
+}
+
+/// look up @n @keys at once, storing their values in @vals; like calling hashmap_get for each key, but all keys are
+/// hashed and their home slots prefetched first, so the cache misses of the batch overlap instead of adding up
+/// @map  the map to query
+/// @keys the keys to look up; the map will not own nor free these keys
+/// @n    how many keys
+/// @vals where to store the value of each key, null if it has none
+void hashmap_get_many(HashMap *map, void **keys, long n, void **vals) {
+    unsigned int hashes[GET_BATCH];
+    for (long base = 0; base < n; base += GET_BATCH) {
+        const long count = n - base < GET_BATCH? n - base : GET_BATCH;
+        header *kvs = getkvs(map);
+        for (long i = 0; i < count; i++) {
+            unsigned int hash = _keyhash(map, keys[base + i]);
+            if (map->cache) sketch_increment(map->cache, hash);
+            else if (map->hot && (fast_random() & HOT_SAMPLE_MASK) == 0) sketch_increment(map->hot, hash);
+            hashes[i] = hash;
+
+            if (kvs->layout == HASHMAP_LAYOUT_DENSE) {
+                const unsigned long idx = (unsigned long)keys[base + i] - kvs->base;
+                if (idx < kvs->len) __builtin_prefetch((void *)dense_slot(kvs, idx));
+                continue;
+            }
+            unsigned int idx = _home(kvs, tablehash(kvs, hash));
+            __builtin_prefetch(_load(kvs, idx));
+            if (kvs->hstride == 1) __builtin_prefetch((void *)(kvs->hashes + idx)); // compact tables keep hashes apart
+        }
+        for (long i = 0; i < count; i++) {
+            void *res = _get(map, kvs, keys[base + i], hashes[i]);
+            while (res == SIZED) {
+                _contended(map);
+                _help_resize(map, kvs);
+                kvs = getkvs(map);
+                res = _get(map, kvs, keys[base + i], hashes[i]);
+            }
+            _sample(map, 0, res == null);
+            vals[base + i] = res;
+        }
+    }
+}
+
+inline static void * _hashmap_putif(HashMap *map, void *key, const void *val, const void *oldval) {
+    api_assert(!map->sink || !((AO_t)val & DIRTY), "write-behind values must have the lowest bit clear: %p", val);
+    header *dkvs = getkvs(map);
+    if (dkvs->layout == HASHMAP_LAYOUT_DENSE) {
+        void *res = _putif_dense(map, 0, dkvs, key, (void *)val, (void *)oldval);
+        if (res != SIZED) {
+            _sample(map, 1, 0);
+            return res;
+        }
+    }
+    unsigned int hash = map->hash_func(key);
+    if (!hash) hash = 1;
+
+    header *kvs = getkvs(map);
+    void *res = _putif(map, 0, kvs, key, hash, (void *)val, (void *)oldval);
+    while (res == SIZED) {
+        _contended(map);
+        _help_resize(map, kvs);
+        kvs = getkvs(map);
+        res = _putif(map, 0, kvs, key, hash, (void *)val, (void *)oldval);
+    }
+    _sample(map, 1, 0);
+    return res;
+}
+
+/// update the mapping for @key to @val
+/// @map    the map to update
+/// @key    the key which mapping to update; the map owns this key and will free it when needed
+/// @val    the new value to put in map
+/// @oldval the value that must be currently in map for the update to succeed; use @IGNORE if the update must always succeed
+/// @returns the previous value; or @REJECTED if the map is a full cache that did not admit the new mapping
+void * hashmap_putif(HashMap *map, void *key, const void *val, const void *oldval) {
+    const unsigned long long start = latency_begin();
+    void *res = _hashmap_putif(map, key, val, oldval);
+    if (start) latency_end(HASHMAP_LATENCY_PUT, start);
+    return res;
+}
+
+// ** hash seeds **
+//
+// Keys whose hashes share their low bits probe the same slots; a client that can pick keys can make every insert
+// probe up to the reprobe limit, so the map resizes over and over, and lookups crawl. A seeded table mixes a random
+// seed into the hash of every key, so which keys cluster is no longer known outside the process.
+//
+// The seed belongs to the table. The map passes the plain hash of a key around, and every table mixes in its own
+// seed, so while a resize moves mappings to a table with another seed, a lookup finds its key in either table. The
+// copy hashes the keys of a seeded table again, since it only memoizes the mixed hashes. Keys whose hashes are equal
+// still collide under any seed; only a better hash function helps against that.
+
+static unsigned long random_seed() {
+    unsigned long seed = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) seed = 0;
+        close(fd);
+    }
+    if (!seed) seed = (unsigned long)current_time() * 0x9e3779b97f4a7c15UL ^ (unsigned long)&seed;
+    return seed;
+}
+
+/// rehash @map with a new random seed, for instance when hashmap_analyze shows its keys cluster
+/// Other threads go on using the map; they help the resize that moves the mappings, like any other resize.
+void hashmap_reseed(HashMap *map) {
+    unsigned long seed = random_seed();
+    while (!seed || seed == map->seed) seed = random_seed();
+    map->seed = seed;
+    while (1) {
+        header *kvs = getkvs(map);
+        if (kvs->seed == seed || map->seed != seed) return; // done, or reseeded again meanwhile
+        map->_compact = 1; // copy to a table of the same length, or shrink a sparse one
+        _resize(map, kvs);
+        _help_resize(map, kvs);
+    }
+}
+
+// ** slot handles **
+//
+// A handle remembers the slot of a mapping, so repeated updates skip hashing and probing. A resize moves the mapping
+// to another slot, and marks the old slot SIZED. Then the handle finds the new slot; it compares key pointers, not
+// keys: a copy moves the key pointer along, and the key of a dropped mapping might already be free'd. Once free'd,
+// a new key can get the same address, so it compares the memoized hashes too. The check that the handle is of the
+// current table comes before touching its slot, since a retired table is free'd eventually.
+
+// find the slot for @key in @kvs, by pointer and hash; returns 1 if found, 0 if not, or SIZED when resizing
+static void * _find_pinned(header *kvs, void *key, const unsigned int keyhash, unsigned long *slot) {
+    const unsigned int hash = tablehash(kvs, keyhash);
+    int idx = _home(kvs, hash);
+    for (int reprobe_try = 0; reprobe_try <= kvs->probemask; reprobe_try++) {
+        void *k = getkey(_load(kvs, idx));
+        if (k == null) return 0;
+        if (k == SIZED) return SIZED;
+        if (k == key && gethash(kvs, idx) == hash) { *slot = idx; return (void *)1; }
+        idx = _next(kvs, idx);
+    }
+    return 0;
+}
+
+// point @handle at the slot of its key in the current table
+static void _repin(HashHandle *handle) {
+    HashMap *map = handle->map;
+    while (1) {
+        header *kvs = getkvs(map);
+        unsigned long slot = 0;
+        void *res = _find_pinned(kvs, handle->key, handle->hash, &slot);
+        if (res == SIZED) { _help_resize(map, kvs); continue; }
+        handle->kvs = kvs;
+        handle->entry = res? _load(kvs, slot) : null;
+        return;
+    }
+}
+
+/// pin the slot of @key in @map into @handle, for hashmap_handle_cas
+/// Like hashmap_get, the map does not own the passed in key.
+/// @returns 1 if @key has a slot, possibly mapping to null; 0 if not, insert it first
+int hashmap_pin(HashMap *map, void *key, HashHandle *handle) {
+    api_assert(!map->cache, "cannot pin the mappings of a cache");
+    api_assert(!map->front_coded, "cannot pin the mappings of a front coded map, resizes move its keys");
+    api_assert(!map->dense, "cannot pin the mappings of a dense map, it has no slots for keys");
+    unsigned int hash = map->hash_func(key);
+    if (!hash) hash = 1;
+
+    while (1) {
+        header *kvs = getkvs(map);
+        const unsigned int th = tablehash(kvs, hash);
+        int idx = _home(kvs, th);
+        void *res = null;
+        for (int reprobe_try = 0; reprobe_try <= kvs->probemask; reprobe_try++) {
+            entry *e = _load(kvs, idx);
+            void *k = getkey(e);
+            if (k == null) break;
+            if (k == SIZED) { res = SIZED; break; }
+            if (k != CLEARED && gethash(kvs, idx) == th) {
+                read_barrier();
+                if (map->equals_func(k, key)) {
+                    handle->map = map;
+                    handle->kvs = kvs;
+                    handle->entry = e;
+                    handle->key = k;
+                    handle->hash = hash;
+                    return 1;
+                }
+            }
+            idx = _next(kvs, idx);
+        }
+        if (res != SIZED) return 0;
+        _help_resize(map, kvs);
+    }
+}
+
+/// return the current value of the mapping pinned by @handle
+/// @returns the value, or @IGNORE if a resize dropped the mapping, since it mapped to null; pin again
+void * hashmap_handle_get(HashHandle *handle) {
+    HashMap *map = handle->map;
+    while (1) {
+        if (handle->kvs != getkvs(map)) _repin(handle);
+        entry *e = handle->entry;
+        if (!e) return IGNORE;
+
+        void *v = getval(e);
+        if (v == SIZED) { _help_resize(map, handle->kvs); continue; }
+        if (getkey(e) != handle->key) { handle->entry = null; return IGNORE; } // cleared by a collector
+        return _value(map, v);
+    }
+}
+
+/// update the value of the mapping pinned by @handle to @val, if it currently maps to @oldval
+/// Works like hashmap_putif, without hashing or probing. After a resize the handle follows its mapping.
+/// @returns the previous value, or @IGNORE if a resize dropped the mapping, since it mapped to null; pin again
+void * hashmap_handle_cas(HashHandle *handle, const void *val, const void *oldval) {
+    HashMap *map = handle->map;
+    api_assert(!map->sink || !((AO_t)val & DIRTY), "write-behind values must have the lowest bit clear: %p", val);
+    while (1) {
+        if (handle->kvs != getkvs(map)) _repin(handle);
+        entry *e = handle->entry;
+        if (!e) return IGNORE;
+
+        void *v = getval(e);
+        if (v == SIZED) { _help_resize(map, handle->kvs); continue; }
+        if (getkey(e) != handle->key) { handle->entry = null; return IGNORE; } // cleared by a collector
+        void *cur = _value(map, v);
+        if (oldval != IGNORE && cur != oldval) return cur;
+
+        header *kvs = handle->kvs;
+        if (kvs->log && cur == null && val != null) olog_append(map, kvs, _slot(kvs, e), handle->key, handle->hash);
+        if (cas(&e->_val, map->sink? (void *)((AO_t)val | DIRTY) : val, v)) {
+            if (cur == null && val != null) { _live(handle->kvs, _slot(handle->kvs, e), 1); _size_update(map, 1); }
+            if (cur != null && val == null) { _live(handle->kvs, _slot(handle->kvs, e), -1); _size_update(map, -1); }
+            map->changes++;
+            _sample(map, 1, 0);
+            return cur;
+        }
+        _contended(map);
+    }
+}
+
+long hashmap_flush(HashMap *map);
+
+// ** windowed maps **
+//
+// For rate limiting and rolling aggregates, a map can hold a current and a previous window. Rotating starts a new
+// generation: like a resize it wins the promise, so no resize runs meanwhile, but then it publishes an empty table
+// instead of copying. The new table points to the previous generation, so a reader gets a consistent pair from one
+// read of map->_kvs. The generation before that is dropped: it goes on the list of retired tables, still owning its
+// keys, and is free'd with its keys after the usual grace period, by a later resize or rotation.
+//
+// A writer that found its slot just before a rotation, might still update the previous generation; so updates racing
+// a rotation count in the previous window.
+
+/// start a new generation in @map, the current one becomes the previous generation, and the previous one is dropped
+/// Lookups then see an empty map; use hashmap_get_window to also see the previous generation.
+void hashmap_rotate(HashMap *map) {
+    api_assert(!map->cache && !map->index && !map->insertion_ordered, "caches and ordered maps cannot rotate");
+    api_assert(!map->dense, "dense maps cannot rotate");
+    if (map->sink) hashmap_flush(map); // the generation about to be dropped must not keep dirty mappings
+    header *okvs;
+    while (1) {
+        okvs = getkvs(map);
+        if (map->_nkvs != null) { _help_resize(map, okvs); continue; }
+        if (!cas(&map->_nkvs, kvs_promise, null)) continue;
+        if (map->_kvs == okvs) break;
+        if (!cas(&map->_nkvs, null, kvs_promise)) fatal("unpublising late promise");
+    }
+    flight(FLIGHT_PROMISE, okvs, okvs->len);
+
+    // the new generation will probably see as much traffic as the last, but shrink if it was sparse
+    long size = hashmap_size(map);
+    unsigned int len = okvs->len;
+    while (len > INITIAL_SIZE && len / 2 >= size * 4) len /= 2;
+    int layout = _choose_layout(map, okvs);
+    // zeroed by the allocator; for large tables the os zeroes the pages lazily, so rotating stays cheap
+    header *nkvs = header_init(map, header_alloc(map, header_bytes(len, layout), 1), len, layout);
+    nkvs->window = okvs;
+
+    // move the list of retired tables to the new table, and add the dropped generation
+    while (!AO_compare_and_swap(&map->_reclaiming, 0, 1)) yield();
+    header *retired = okvs->prev;
+    okvs->prev = 0;
+    header *drop = okvs->window;
+    if (drop) {
+        drop->dropped = 1;
+        drop->prev = retired;
+        drop->_btodo = current_time();
+        retired = drop;
+    }
+    nkvs->prev = retired;
+    write_barrier();
+    map->_reclaiming = 0;
+
+    // the new generation starts empty; we take off what we saw, inserts that land in it meanwhile still count
+    long seen = map->_size;
+    AO_fetch_and_add(&map->_size, -seen);
+    map->changes = 0;
+    if (!cas(&map->_kvs, nkvs, okvs)) fatal("publishing new generation");
+    flight(FLIGHT_PUBLISH, nkvs, nkvs->len);
+    if (!cas(&map->_nkvs, null, kvs_promise)) fatal("unpublising rotation in progress");
+    free_old_kvs(map, nkvs, RETIRE_GRACE);
+}
+
+/// return the mapping for @key in the current generation of @map, and set @prev to the one in the previous generation
+/// Both are found from a single read of the current table, so they always come from adjacent generations.
+void * hashmap_get_window(HashMap *map, void *key, void **prev) {
+    unsigned int hash = map->hash_func(key);
+    if (!hash) hash = 1;
+
+    header *kvs = getkvs(map);
+    void *res = _get(map, kvs, key, hash);
+    while (res == SIZED) {
+        _help_resize(map, kvs);
+        kvs = getkvs(map);
+        res = _get(map, kvs, key, hash);
+    }
+    // a previous generation is never resized, so it has no SIZED slots
+    *prev = kvs->window? _get(map, kvs->window, key, hash) : null;
+    return res;
+}
+
+// ** overlay maps **
+//
+// A config system keeps a large base map that hardly changes, and a small stream of overrides. Copying the base into a
+// new map for every version is slow and doubles the memory; an overlay instead keeps the overrides in a small delta
+// map over the frozen base. A lookup hashes its key once, probes the delta, and only when the delta has no mapping for
+// it, the base. Deleting a key the base has writes a tombstone into the delta, which hides the mapping of the base.
+//
+// Compacting folds the delta into a new base, while lookups and writes go on. It publishes a layer with an empty delta
+// over the old delta, now frozen, over the old base; lookups probe all three, and writes go to the new delta. Writers
+// count themselves in the delta they write to, so once the count of the frozen delta drops to zero, nobody writes it
+// anymore, and the compactor merges both frozen maps into a new base. The keys move into the new base, they are not
+// copied. The replaced layers are free'd after a grace period, like retired tables, trusting that no lookup lingers in
+// a layer for seconds; the keys that did not move are free'd with them. Bases and deltas are never dense, so walking
+// their slots finds the keys.
+
+#define OVERLAY_GRACE 30           // seconds before a replaced layer is free'd
+
+static void *TOMBSTONE = "__TOMBSTONE__"; // marker in a delta, for a key deleted from the base
+
+void hashmap_reserve(HashMap *map, long size);
+
+typedef struct overlay_delta overlay_delta;
+struct overlay_delta {
+    HashMap *map;
+    volatile AO_t writers;         // writers that might still write to map
+};
+
+typedef struct overlay_layer overlay_layer;
+struct overlay_layer {
+    HashMap *base;                 // frozen
+    overlay_delta *frozen;         // a delta being folded into a new base, or null
+    overlay_delta *delta;          // where writes go
+    overlay_layer *prev;           // replaced layers, to free after the grace period
+    unsigned long retired;         // when it was replaced
+};
+
+typedef struct HashOverlay HashOverlay;
+struct HashOverlay {
+    volatile overlay_layer *_layer;
+    overlay_layer *retired;        // only the compactor touches it
+    volatile AO_t _compacting;     // a compaction runs
+    volatile AO_t _async;          // background compactions started, but not done
+};
+
+// the mapping of @key in @map, helping any resize along
+static void * _get_current(HashMap *map, void *key, const unsigned int hash) {
+    header *kvs = getkvs(map);
+    void *res = _get(map, kvs, key, hash);
+    while (res == SIZED) {
+        _help_resize(map, kvs);
+        kvs = getkvs(map);
+        res = _get(map, kvs, key, hash);
+    }
+    return res;
+}
+
+// the value of @key in the frozen layers of @l; a value, a TOMBSTONE, or null
+static void * overlay_lower(overlay_layer *l, void *key, const unsigned int hash) {
+    void *v = l->frozen? _get_current(l->frozen->map, key, hash) : null;
+    return v? v : _get_current(l->base, key, hash);
+}
+
+// a new map for the keys of @base: the same key functions, seed and budget
+static HashMap * overlay_map_new(HashMap *base) {
+    HashMap *map = hashmap_new(base->equals_func, base->hash_func, base->free_func);
+    map->seed = base->seed;
+    if (base->budget) hashmap_set_budget(map, base->budget);
+    return map;
+}
+
+static overlay_delta * overlay_delta_new(HashMap *base) {
+    overlay_delta *d = calloc(1, sizeof(overlay_delta));
+    assert(d);
+    d->map = overlay_map_new(base);
+    return d;
+}
+
+static overlay_layer * overlay_layer_new(HashMap *base, overlay_delta *frozen, overlay_delta *delta) {
+    overlay_layer *l = calloc(1, sizeof(overlay_layer));
+    assert(l);
+    l->base = base;
+    l->frozen = frozen;
+    l->delta = delta;
+    return l;
+}
+
+// free a replaced layer; one that had a frozen delta drops its base and that delta, and the keys that did not move
+static void overlay_layer_free(overlay_layer *l) {
+    if (l->frozen) {
+        HashMap *base = l->base, *frozen = l->frozen->map;
+        header *kvs = getkvs(base);
+        for (unsigned long i = 0; i < kvs->len; i++) {
+            entry *e = _load(kvs, i);
+            void *k = getkey(e);
+            if (!k || k == CLEARED) continue;
+            // a key the delta has a value or tombstone for was shadowed, it did not move
+            if (!getval(e) || _get_current(frozen, k, _keyhash(frozen, k))) base->free_func(k);
+        }
+        kvs = getkvs(frozen);
+        for (unsigned long i = 0; i < kvs->len; i++) {
+            entry *e = _load(kvs, i);
+            void *k = getkey(e), *v = getval(e);
+            if (k && k != CLEARED && (!v || v == TOMBSTONE)) frozen->free_func(k);
+        }
+        base->bulk_keys = frozen->bulk_keys = 1; // the other keys are in the new base now
+        hashmap_free(base);
+        hashmap_free(frozen);
+        free(l->frozen);
+    }
+    free(l);
+}
+
+// free the replaced layers from @l on that were replaced before @cutoff, the oldest first; freeing a dropped base looks
+// up its keys, so the keys that moved on into the next base must still be there
+static overlay_layer * overlay_free_retired(overlay_layer *l, unsigned long cutoff) {
+    if (!l) return null;
+    l->prev = overlay_free_retired(l->prev, cutoff);
+    if (l->retired >= cutoff) return l;
+    overlay_layer *prev = l->prev;
+    overlay_layer_free(l);
+    return prev;
+}
+
+static void overlay_retire(HashOverlay *o, overlay_layer *l) {
+    l->retired = current_time();
+    l->prev = o->retired;
+    o->retired = l;
+}
+
+/// make a map that reads through a delta to @base; the overlay owns @base, which must not be written anymore
+/// Only plain maps can be a base; not caches, ordered, weak, front coded, dense or write-behind maps. Nor maps with
+/// bulk keys: an overlay moves keys between maps, and frees the keys it drops one by one. The deltas and new bases
+/// get the seed and budget of @base.
+HashOverlay * hashmap_overlay_new(HashMap *base) {
+    api_assert(!base->cache && !base->index && !base->insertion_ordered && !base->weak, "base must be a plain map");
+    api_assert(!base->front_coded && !base->dense && !base->sink, "base must be a plain map");
+    api_assert(!base->bulk_keys, "an overlay frees the keys it drops, the base cannot have bulk keys");
+    HashOverlay *o = calloc(1, sizeof(HashOverlay));
+    assert(o);
+    o->_layer = overlay_layer_new(base, null, overlay_delta_new(base));
+    return o;
+}
+
+/// free @o, with its base and delta; waits for a compaction in progress
+void hashmap_overlay_free(HashOverlay *o) {
+    while (o->_compacting || o->_async) yield();
+    o->retired = overlay_free_retired(o->retired, ~0UL);
+    overlay_layer *l = (overlay_layer *)o->_layer;
+    hashmap_free(l->base);
+    hashmap_free(l->delta->map);
+    free(l->delta);
+    free(l);
+    free(o);
+}
+
+/// return the current mapping for @key in @o; from the delta if it has one, otherwise from the base
+/// @key the key for the value; the overlay will not own nor free this key
+void * hashmap_overlay_get(HashOverlay *o, void *key) {
+    overlay_layer *l = (overlay_layer *)o->_layer;
+    const unsigned int hash = _keyhash(l->base, key);
+    void *v = _get_current(l->delta->map, key, hash);
+    if (!v) v = overlay_lower(l, key, hash);
+    return v == TOMBSTONE? null : v;
+}
+
+// enter the current layer of @o as a writer, see overlay maps
+static overlay_layer * overlay_enter(HashOverlay *o) {
+    while (1) {
+        overlay_delta *d = ((overlay_layer *)o->_layer)->delta;
+        AO_fetch_and_add1(&d->writers);
+        AO_nop_full(); // a compactor publishes a new delta, then reads our count; we count, then read its delta
+        overlay_layer *l = (overlay_layer *)o->_layer;
+        if (l->delta == d) return l;
+        AO_fetch_and_add(&d->writers, (AO_t)-1);
+    }
+}
+
+/// update the mapping for @key in @o to @val, or delete it if @val is null; overrides are never conditional
+/// @key the key which mapping to update; the overlay owns this key and will free it when needed
+/// @returns the previous mapping
+void * hashmap_overlay_put(HashOverlay *o, void *key, const void *val) {
+    api_assert(val != TOMBSTONE, "cannot store the tombstone marker");
+    overlay_layer *l = overlay_enter(o);
+    HashMap *delta = l->delta->map;
+    const unsigned int hash = _keyhash(delta, key);
+    void *lower = overlay_lower(l, key, hash);
+    if (lower == TOMBSTONE) lower = null;
+    // a delete needs a tombstone only if a frozen layer has the key
+    void *res = hashmap_putif(delta, key, val? val : lower? TOMBSTONE : null, IGNORE);
+    AO_fetch_and_add(&l->delta->writers, (AO_t)-1);
+    if (res == TOMBSTONE) return null;
+    return res? res : lower;
+}
+
+/// the number of mappings in the delta of @o, tombstones included; to decide when to compact
+long hashmap_overlay_delta_size(HashOverlay *o) {
+    return hashmap_size(((overlay_layer *)o->_layer)->delta->map);
+}
+
+/// fold the delta of @o into a new base; lookups and writes go on meanwhile, and see the same mappings throughout
+/// @returns the number of mappings in the new base, or -1 if another compaction is running
+long hashmap_overlay_compact(HashOverlay *o) {
+    if (!AO_compare_and_swap(&o->_compacting, 0, 1)) return -1;
+    overlay_layer *old = (overlay_layer *)o->_layer;
+    overlay_layer *mid = overlay_layer_new(old->base, old->delta, overlay_delta_new(old->base));
+    write_barrier();
+    o->_layer = mid;
+    AO_nop_full();
+    int spins = 0;
+    while (mid->frozen->writers) backoff(&spins); // writers that entered the old layer are done
+
+    // both frozen maps are stable now; the base mappings the delta shadows are left out
+    HashMap *base = old->base, *frozen = mid->frozen->map;
+    HashMap *nbase = overlay_map_new(base);
+    hashmap_reserve(nbase, hashmap_size(base) + hashmap_size(frozen));
+    header *kvs = getkvs(base);
+    for (unsigned long i = 0; i < kvs->len; i++) {
+        entry *e = _load(kvs, i);
+        void *k = getkey(e), *v = getval(e);
+        if (!k || k == CLEARED || !v) continue;
+        if (_get_current(frozen, k, _keyhash(frozen, k))) continue;
+        hashmap_putif(nbase, k, v, IGNORE);
+    }
+    kvs = getkvs(frozen);
+    for (unsigned long i = 0; i < kvs->len; i++) {
+        entry *e = _load(kvs, i);
+        void *k = getkey(e), *v = getval(e);
+        if (!k || k == CLEARED || !v || v == TOMBSTONE) continue;
+        hashmap_putif(nbase, k, v, IGNORE);
+    }
+
+    write_barrier();
+    o->_layer = overlay_layer_new(nbase, null, mid->delta);
+    overlay_retire(o, old);
+    overlay_retire(o, mid); // drops the old base and the frozen delta, see overlay_layer_free
+    o->retired = overlay_free_retired(o->retired, current_time() - OVERLAY_GRACE);
+    write_barrier();
+    o->_compacting = 0;
+    return hashmap_size(nbase);
+}
+
+static void * _overlay_compact_async(void *data) {
+    HashOverlay *o = data;
+    hashmap_overlay_compact(o);
+    AO_fetch_and_add(&o->_async, (AO_t)-1);
+    return null;
+}
+
+/// compact @o in a background thread, see hashmap_overlay_compact; returns right away
+void hashmap_overlay_compact_async(HashOverlay *o) {
+    AO_fetch_and_add1(&o->_async);
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, _overlay_compact_async, o)) _overlay_compact_async(o); // no thread, do it now
+    pthread_attr_destroy(&attr);
+}
+
+// ** delegation **
+//
+// When many threads update the same keys, they fight over the same cache lines, even without locks. A delegate
+// partitions the keys by hash over owner threads; other threads send their updates to the owner of a key, and only
+// the owner writes to its partition, so its cache lines stay put. Each client and owner pair shares a single producer
+// single consumer ring. A client publishes its requests in batches, and an owner applies all it finds, and publishes
+// how far it got, so only the ring indexes cross cores, and not for every request.
+//
+// Owners still use cas to update values, a cas on a line only the owner writes is cheap. Plain stores are not
+// possible: any thread can help a resize, which marks values SIZED, and an owner must never overwrite those. Reads
+// go directly to the map.
+//
+// An owner without work yields for DELEGATE_IDLE rounds, and then parks on its condition variable. It announces that
+// with sleeping, then looks at its rings once more; a client publishes, then looks at sleeping. Both with a full
+// barrier in between, so either the owner sees the requests, or the client sees the owner asleep, and wakes it.
+// Owners are not pinned to cpus, unless asked for with hashdelegate_pin.
+
+#define DELEGATE_QUEUE 256   // requests per ring, a power of two
+#define DELEGATE_BATCH 32    // requests a client collects before publishing
+#define DELEGATE_IDLE 1000   // rounds without work an owner yields for, before it parks
+
+typedef void * (hashmap_value_update)(void *val, void *arg);
+
+typedef struct request request;
+struct request {
+    void *key;
+    unsigned int hash;
+    hashmap_value_update *update; // null means set to val
+    void *val;
+};
+
+typedef struct dqueue dqueue;
+struct dqueue {
+    volatile AO_t tail;          // written by the client
+    unsigned long pending;       // client private; requests written, but not yet published
+    char pad1[64 - 2 * sizeof(AO_t)];
+    volatile AO_t head;          // written by the owner
+    char pad2[64 - sizeof(AO_t)];
+    request ring[DELEGATE_QUEUE];
+};
+
+typedef struct dparking dparking;
+struct dparking {
+    volatile AO_t sleeping;      // set by the owner before it parks, cleared by whoever wakes it
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char pad[64];
+};
+
+typedef struct HashDelegate HashDelegate;
+struct HashDelegate {
+    HashMap *map;
+    int owners;
+    int clients;
+    volatile int stop;
+    pthread_t *threads;
+    dqueue *queues;              // clients * owners, the ring from client c to owner o is c * owners + o
+    dparking *parking;           // one per owner
+};
+
+typedef struct owner_arg owner_arg;
+struct owner_arg { HashDelegate *d; int owner; };
+
+static void _delegate_apply(HashMap *map, request *r) {
+    while (1) {
+        header *kvs = getkvs(map);
+        void *v = IGNORE;
+        if (r->update) {
+            v = _get(map, kvs, r->key, r->hash);
+            if (v == SIZED) { _help_resize(map, kvs); continue; }
+        }
+        void *n = r->update? r->update(v, r->val) : r->val;
+        void *res = _putif(map, 0, kvs, r->key, r->hash, n, v);
+        if (res == SIZED) { _help_resize(map, kvs); continue; }
+        if (v == IGNORE || res == v) break; // otherwise a write bypassed the delegate; retry
+    }
+    _sample(map, 1, 0);
+}
+
+// does owner @o have requests published to it
+static int _delegate_pending(HashDelegate *d, int o) {
+    for (int c = 0; c < d->clients; c++) {
+        dqueue *q = &d->queues[c * d->owners + o];
+        if (q->head != q->tail) return 1;
+    }
+    return 0;
+}
+
+// park owner @o until a client or hashdelegate_free wakes it
+static void _delegate_park(HashDelegate *d, int o) {
+    dparking *p = &d->parking[o];
+    p->sleeping = 1;
+    AO_nop_full(); // sleeping before looking at the tails; see _delegate_wake
+    if (_delegate_pending(d, o) || d->stop) {
+        p->sleeping = 0;
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    while (p->sleeping) pthread_cond_wait(&p->wake, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// wake owner @o if it is parked; call after publishing
+static void _delegate_wake(HashDelegate *d, int o) {
+    dparking *p = &d->parking[o];
+    AO_nop_full(); // the tail before looking at sleeping; see _delegate_park
+    if (!p->sleeping) return;
+    pthread_mutex_lock(&p->lock);
+    p->sleeping = 0;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void * _delegate_owner(void *data) {
+    owner_arg *a = data;
+    HashDelegate *d = a->d;
+    int o = a->owner;
+    free(a);
+
+    int idle = 0;
+    while (1) {
+        int stopping = d->stop; // read before looking for work, so we drain everything published before the stop
+        long work = 0;
+        for (int c = 0; c < d->clients; c++) {
+            dqueue *q = &d->queues[c * d->owners + o];
+            unsigned long head = q->head, tail = q->tail;
+            if (head == tail) continue;
+            read_barrier();
+            for (; head != tail; head++) _delegate_apply(d->map, &q->ring[head & (DELEGATE_QUEUE - 1)]);
+            AO_nop_full(); // done reading the requests, before the client may reuse their slots
+            q->head = head;
+            work++;
+        }
+        if (work) {
+            idle = 0;
+        } else if (stopping) {
+            break;
+        } else if (++idle < DELEGATE_IDLE) {
+            yield();
+        } else {
+            _delegate_park(d, o);
+            idle = 0;
+        }
+    }
+    return null;
+}
+
+/// create a delegate for @map, with @owners threads that own a partition of the keys each, and room for @clients
+/// Every thread sending updates must use its own client number, from 0 to @clients - 1. All writes to the map should
+/// go through the delegate, and the map cannot be a cache. Reads can go directly to the map.
+HashDelegate * hashdelegate_new(HashMap *map, int owners, int clients) {
+    api_assert(owners > 0 && clients > 0, "need owners and clients");
+    api_assert(!map->cache, "caches cannot be delegated");
+    HashDelegate *d = malloc(sizeof(HashDelegate));
+    assert(d);
+    d->map = map;
+    d->owners = owners;
+    d->clients = clients;
+    d->stop = 0;
+    d->queues = calloc(owners * clients, sizeof(dqueue));
+    d->threads = malloc(sizeof(pthread_t) * owners);
+    d->parking = calloc(owners, sizeof(dparking));
+    assert(d->queues); assert(d->threads); assert(d->parking);
+    for (int o = 0; o < owners; o++) {
+        pthread_mutex_init(&d->parking[o].lock, null);
+        pthread_cond_init(&d->parking[o].wake, null);
+    }
+    for (int o = 0; o < owners; o++) {
+        owner_arg *a = malloc(sizeof(owner_arg));
+        a->d = d; a->owner = o;
+        if (pthread_create(&d->threads[o], null, _delegate_owner, a)) fatal("starting delegate owner");
+    }
+    return d;
+}
+
+/// pin the owner threads of @d to a cpu each, owner o to cpu (@first + o) modulo the number of cpus, so each partition
+/// stays in the caches of one core; give the delegates of different maps different @first, or their owners share cpus
+/// Returns 0, or the error of pthread_setaffinity_np; ENOSYS where pinning is not supported.
+int hashdelegate_pin(HashDelegate *d, int first) {
+    api_assert(first >= 0, "negative cpu");
+#ifdef __GLIBC__
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    for (int o = 0; o < d->owners; o++) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((first + o) % ncpu, &cpus);
+        int err = pthread_setaffinity_np(d->threads[o], sizeof(cpus), &cpus);
+        if (err) return err;
+    }
+    return 0;
+#else
+    (void)d; (void)first;
+    return ENOSYS;
+#endif
+}
+
+// publish the pending requests of the ring from @client to owner @o, and wake the owner if it is parked
+static void _delegate_publish(HashDelegate *d, int client, int o) {
+    dqueue *q = &d->queues[client * d->owners + o];
+    if (!q->pending) return;
+    write_barrier(); // requests before the tail
+    q->tail += q->pending;
+    q->pending = 0;
+    _delegate_wake(d, o);
+}
+
+static void _delegate_send(HashDelegate *d, int client, void *key, hashmap_value_update *update, void *val) {
+    api_assert(client >= 0 && client < d->clients, "unknown client");
+    unsigned int hash = d->map->hash_func(key);
+    if (!hash) hash = 1;
+    // any bits of the hash partition the keys for good; skipping the low byte keeps a table of up to 256 slots from
+    // interleaving the owners slot by slot, in larger tables these bits are index bits too
+    int o = (hash >> 8) % d->owners;
+    dqueue *q = &d->queues[client * d->owners + o];
+
+    unsigned long at = q->tail + q->pending;
+    while (at - q->head >= DELEGATE_QUEUE) { // full; make sure the owner can see everything, and wait
+        _delegate_publish(d, client, o);
+        yield();
+    }
+    request *r = &q->ring[at & (DELEGATE_QUEUE - 1)];
+    r->key = key; r->hash = hash; r->update = update; r->val = val;
+    if (++q->pending >= DELEGATE_BATCH) _delegate_publish(d, client, o);
+}
+
+/// send an update of @key to @val to the owner of @key, as @client; like hashmap_putif, the map owns @key
+/// The update is applied later, in order with other updates of the same client; see hashdelegate_flush.
+void hashdelegate_put(HashDelegate *d, int client, void *key, void *val) {
+    _delegate_send(d, client, key, null, val);
+}
+
+/// send an update of @key to the owner of @key, as @client; the owner sets @key to @update(current value, @arg)
+/// The map owns @key, and @update runs on the owner thread.
+void hashdelegate_update(HashDelegate *d, int client, void *key, hashmap_value_update *update, void *arg) {
+    _delegate_send(d, client, key, update, arg);
+}
+
+/// publish all updates of @client, and wait until they were applied
+void hashdelegate_flush(HashDelegate *d, int client) {
+    for (int o = 0; o < d->owners; o++) {
+        dqueue *q = &d->queues[client * d->owners + o];
+        _delegate_publish(d, client, o);
+        while (q->head != q->tail) yield();
+    }
+}
+
+/// apply all updates, stop the owner threads, and free the delegate @d; the map is not free'd
+/// No client may use the delegate anymore.
+void hashdelegate_free(HashDelegate *d) {
+    for (int c = 0; c < d->clients; c++) for (int o = 0; o < d->owners; o++) _delegate_publish(d, c, o);
+    write_barrier();
+    d->stop = 1;
+    for (int o = 0; o < d->owners; o++) _delegate_wake(d, o);
+    for (int o = 0; o < d->owners; o++) {
+        pthread_join(d->threads[o], null);
+        pthread_mutex_destroy(&d->parking[o].lock);
+        pthread_cond_destroy(&d->parking[o].wake);
+    }
+    free(d->parking);
+    free(d->threads);
+    free(d->queues);
+    free(d);
+}
+
+// ** write-behind **
+//
+// A map fronting a slower store can write behind: an update tags its value dirty, in the same cas that stores it, and
+// a flusher later hands dirty mappings to a sink in batches. It cleans a slot with a cas from the dirty value it
+// handed over to the same value untagged; if an update raced it, the cas fails and the newer value stays dirty for
+// the next flush, so no update is lost. A delete stores DIRTY alone, a tombstone that keeps its key until the delete
+// is flushed. A resize copies values tag and all, so dirty mappings stay dirty in the new table.
+//
+// One thread flushes at a time, the dirty mappings of one block of slots of the table per batch, see kvs->block. When
+// it runs into a resize, it helps, and starts over in the new table, where the mappings it flushed already are clean.
+
+typedef struct flusher flusher;
+struct flusher {
+    HashMap *map;
+    int interval_ms;
+    volatile int stop;
+    pthread_t thread;
+};
+
+typedef struct flush_batch flush_batch;
+struct flush_batch {
+    unsigned long cap;             // slots a batch can hold
+    void **pairs;                  // keys and values, for the sink
+    entry **slots;
+    void **dirty;                  // the tagged values as read
+};
+
+// make sure @b holds a block of @kvs
+static void flush_batch_fit(flush_batch *b, header *kvs) {
+    if (b->cap >= kvs->block) return;
+    b->cap = kvs->block;
+    b->pairs = realloc(b->pairs, sizeof(void *) * 2 * b->cap);
+    b->slots = realloc(b->slots, sizeof(entry *) * b->cap);
+    b->dirty = realloc(b->dirty, sizeof(void *) * b->cap);
+    assert(b->pairs); assert(b->slots); assert(b->dirty);
+}
+
+// flush the dirty mappings in slots [@from, @end) of @kvs; sets @sized if the table is being resized
+// returns the number flushed, or -1 if the sink failed
+static long _flush_block(HashMap *map, header *kvs, unsigned long from, unsigned long end, flush_batch *b, int *sized) {
+    long n = 0;
+    for (unsigned long i = from; i < end; i++) {
+        entry *e = _load(kvs, i);
+        void *k = getkey(e);
+        if (k == null) continue;
+        if (k == SIZED) { *sized = 1; break; }
+        void *v = getval(e);
+        if (v == SIZED) { *sized = 1; break; }
+        if (!((AO_t)v & DIRTY)) continue;
+        b->pairs[2 * n] = k;
+        b->pairs[2 * n + 1] = _value(map, v);
+        b->slots[n] = e;
+        b->dirty[n] = v;
+        n++;
+    }
+    if (n == 0) return 0;
+    if (map->sink(b->pairs, n, map->sink_data)) return -1;
+    for (long i = 0; i < n; i++) {
+        // a failing cas means a newer value, which is still dirty
+        cas(&b->slots[i]->_val, (void *)((AO_t)b->dirty[i] & ~DIRTY), b->dirty[i]);
+    }
+    return n;
+}
+
+/// write all dirty mappings of the write-behind @map to its sink
+/// Mappings updated during the flush might be written by the next flush.
+/// @returns the number of mappings written, or -1 if the sink failed; the unwritten mappings stay dirty
+long hashmap_flush(HashMap *map) {
+    api_assert(map->sink, "map is not write-behind");
+    while (!AO_compare_and_swap(&map->_flushing, 0, 1)) yield();
+    flush_batch batch = { 0, null, null, null }, *b = &batch;
+
+    long total = 0;
+    header *kvs = getkvs(map);
+    // the previous generation of a windowed map never resizes, but it is dropped by the next rotate
+    header *window = kvs->window;
+    if (window) flush_batch_fit(b, window);
+    for (unsigned long from = 0; window && from < window->len && total >= 0; from += window->block) {
+        int sized = 0;
+        unsigned long end = from + window->block < window->len? from + window->block : window->len;
+        long n = _flush_block(map, window, from, end, b, &sized);
+        total = n < 0? -1 : total + n;
+    }
+    flush_batch_fit(b, kvs);
+    for (unsigned long from = 0; from < kvs->len && total >= 0;) {
+        int sized = 0;
+        unsigned long end = from + kvs->block < kvs->len? from + kvs->block : kvs->len;
+        long n = _flush_block(map, kvs, from, end, b, &sized);
+        total = n < 0? -1 : total + n;
+        if (sized) {
+            _help_resize(map, kvs);
+            kvs = getkvs(map);
+            flush_batch_fit(b, kvs);
+            from = 0;
+            continue;
+        }
+        from = end;
+    }
+
+    free(b->pairs); free(b->slots); free(b->dirty);
+    map->_flushing = 0;
+    return total;
+}
+
+static void * _flusher(void *data) {
+    flusher *f = data;
+    while (!f->stop) {
+        for (int i = 0; i < f->interval_ms && !f->stop; i++) usleep(1000);
+        if (hashmap_flush(f->map) < 0) strace("sink failed, retrying in %d ms", f->interval_ms);
+    }
+    return null;
+}
+
+/// put the empty @map in write-behind mode: updates are written to @sink later, not by the thread updating
+/// If @interval_ms > 0, a thread flushes dirty mappings at that interval, otherwise call hashmap_flush. Values must
+/// have the lowest bit clear, the map uses it to tag dirty values. Cannot be combined with caches, weak keys or
+/// sampling. Call this before sharing the map between threads.
+void hashmap_set_write_behind(HashMap *map, hashmap_sink *sink, void *data, int interval_ms) {
+    api_assert(sink, "need a sink");
+    api_assert(!map->sink, "map is already write-behind");
+    api_assert(!map->cache && !map->weak && !map->sampled, "caches, weak and sampled maps cannot write behind");
+    api_assert(!map->front_coded, "front coded maps cannot write behind");
+    api_assert(!map->dense, "dense maps cannot write behind");
+    api_assert(hashmap_size(map) == 0, "map must be empty");
+    map->sink = sink;
+    map->sink_data = data;
+    if (interval_ms <= 0) return;
+
+    flusher *f = calloc(1, sizeof(flusher));
+    assert(f);
+    f->map = map;
+    f->interval_ms = interval_ms;
+    if (pthread_create(&f->thread, null, _flusher, f)) fatal("starting flusher thread");
+    map->flusher = f;
+}
+
+// stop the flusher of @map, and write what is still dirty
+static void write_behind_stop(HashMap *map) {
+    if (map->flusher) {
+        map->flusher->stop = 1;
+        pthread_join(map->flusher->thread, null);
+        free(map->flusher);
+        map->flusher = null;
+    }
+    if (hashmap_flush(map) < 0) warning("write-behind sink failed, dropping dirty mappings of map: %p", map);
+}
+
+// ** insertion order **
+//
+// An insertion ordered map appends every new mapping to a log, so it can be iterated in insertion order, and evict its
+// oldest mappings first, without a lock or a second structure to keep in sync. A mapping is new when its value goes
+// from null to something; its slot then points to its log entry. Entries die when their mapping is deleted, or when
+// the key is inserted again, so an entry is live only if the slot of its key still points to it, and maps to a value.
+// The entry is appended before the value is written; if the write loses a race, the entry is just dead.
+//
+// Every table has its own log. _copy_block moves the log positions along with the mappings, and then the threads
+// helping the resize compact the log into the new table, keeping only the live entries, before it is published. Like
+// copying, compacting goes by blocks any thread can claim: first every block counts its live entries, then every block
+// copies them, to the position that the counts of the blocks before it leave. No thread writes the new table while
+// compacting, so both passes see the same live entries. An entry keeps its insertion sequence, so a walk that runs into
+// a resize can go on where it was in the new log.
+
+// claim the next block of the compaction of the log of @okvs, and count or copy its live entries
+// @returns 1 if there might be more work, 0 once every block is copied
+static int olog_compact_block(HashMap *map, header *okvs, header *nkvs) {
+    olog *o = okvs->log, *n = nkvs->log;
+    olog_job *j = o->job;
+    unsigned long block = AO_fetch_and_add1(&j->_ctodo);
+    if (block < j->blocks) {
+        unsigned long from = j->head + block * j->bsize, to = from + j->bsize < j->tail? from + j->bsize : j->tail;
+        unsigned long live = 0;
+        for (unsigned long pos = from; pos < to; pos++) {
+            olog_entry *le = olog_at(map, o, pos, 0);
+            void *k = le? le->key : null;
+            if (!k) continue;      // a writer that lost its race to the copy
+            read_barrier();
+            unsigned long slot;
+            if (_find_pinned(nkvs, k, le->hash, &slot) != (void *)1) continue;
+            if (nkvs->order[slot] != pos + 1 || !getval(_load(nkvs, slot))) continue;
+            // a block is a power of two positions, so it has whole words of the bitmap
+            const unsigned long bit = pos - j->head;
+            j->alive[bit / (sizeof(AO_t) * 8)] |= (AO_t)1 << (bit & (sizeof(AO_t) * 8 - 1));
+            live++;
+        }
+        j->counts[block] = live;
+        AO_fetch_and_add1(&j->_cdone);
+        return 1;
+    }
+
+    // copying needs the counts of all blocks before
+    int spins = 0;
+    while (j->_cdone < j->blocks) backoff(&spins);
+    block = AO_fetch_and_add1(&j->_wtodo);
+    if (block >= j->blocks) { // done with work, wait for all workers to finish
+        while (j->_wdone < j->blocks) backoff(&spins);
+        return 0;
+    }
+    unsigned long q = 0;
+    for (unsigned long b = 0; b < block; b++) q += j->counts[b];
+    unsigned long from = j->head + block * j->bsize, to = from + j->bsize < j->tail? from + j->bsize : j->tail;
+    for (unsigned long pos = from; pos < to; pos++) {
+        const unsigned long bit = pos - j->head;
+        if (!(j->alive[bit / (sizeof(AO_t) * 8)] & ((AO_t)1 << (bit & (sizeof(AO_t) * 8 - 1))))) continue;
+        olog_entry *le = olog_at(map, o, pos, 0);
+        unsigned long slot;
+        if (_find_pinned(nkvs, le->key, le->hash, &slot) != (void *)1) fatal("lost a live entry compacting");
+        // the bitmap says which entries are live, so a slot already pointing to its new position does no harm
+        olog_entry *ne = olog_at(map, n, q, 1);
+        ne->hash = le->hash;
+        ne->seq = le->seq;
+        ne->key = le->key;
+        nkvs->order[slot] = ++q;
+    }
+    AO_fetch_and_add1(&j->_wdone);
+    return 1;
+}
+
+// compact the log of @okvs into @nkvs, once every block is copied; helpers join in, see _help
+static void olog_compact(HashMap *map, header *okvs, header *nkvs) {
+    olog *o = okvs->log, *n = nkvs->log;
+    olog_job *j = calloc(1, sizeof(olog_job));
+    assert(j);
+    j->head = o->head;
+    j->tail = o->tail;
+    j->bsize = okvs->block;
+    j->blocks = (j->tail - j->head + j->bsize - 1) / j->bsize;
+    j->counts = calloc(j->blocks + 1, sizeof(unsigned long));
+    j->alive = calloc(j->blocks * j->bsize / 8 / sizeof(AO_t) + 1, sizeof(AO_t));
+    assert(j->counts); assert(j->alive);
+    _account(map, olog_job_bytes(j));
+    write_barrier();
+    o->job = j;
+
+    while (olog_compact_block(map, okvs, nkvs));
+    unsigned long live = 0;
+    for (unsigned long b = 0; b < j->blocks; b++) live += j->counts[b];
+    n->base = o->base + j->tail;
+    n->tail = live;
+    n->compacted = live;
+    strace("compacted insertion log: %lu -> %lu", j->tail - j->head, n->compacted);
+}
+
+// the first position in @log with a seq after @seq
+static unsigned long olog_after(HashMap *map, olog *log, unsigned long seq) {
+    unsigned long lo = 0, hi = log->compacted;
+    while (lo < hi) {
+        unsigned long mid = (lo + hi) / 2;
+        if (olog_at(map, log, mid, 0)->seq <= seq) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// the live slot of the entry at @pos in @kvs; returns 1 if live, 0 if dead, SIZED when resizing
+static void * olog_live(header *kvs, unsigned long pos, olog_entry *le, entry **e, void **v) {
+    void *k = le->key;
+    if (!k) return 0;
+    read_barrier();
+    unsigned long slot;
+    void *res = _find_pinned(kvs, k, le->hash, &slot);
+    if (res != (void *)1) return res;
+    if (kvs->order[slot] != pos + 1) return 0;
+    *e = _load(kvs, slot);
+    *v = getval(*e);
+    if (*v == SIZED) return SIZED;
+    return *v? (void *)1 : 0;
+}
+
+/// make the empty @map insertion ordered, see hashmap_visit_insertion_order and hashmap_evict_oldest
+/// A mapping is inserted when its key maps to a value after mapping to null. Call this before sharing the map.
+void hashmap_set_insertion_ordered(HashMap *map) {
+    api_assert(!map->cache && !map->weak && !map->sink, "caches, weak and write-behind maps cannot keep insertion order");
+    api_assert(!map->front_coded, "front coded maps cannot keep insertion order");
+    api_assert(!map->dense, "dense maps cannot keep insertion order");
+    api_assert(hashmap_size(map) == 0, "map must be empty");
+    if (map->insertion_ordered) return;
+    map->insertion_ordered = 1;
+    header *kvs = getkvs(map);
+    kvs->log = calloc(1, sizeof(olog));
+    kvs->order = calloc(kvs->len, sizeof(unsigned long));
+    assert(kvs->log); assert(kvs->order);
+    _account(map, sizeof(olog) + kvs->len * sizeof(unsigned long));
+}
+
+/// call @visit for every mapping of the insertion ordered @map, oldest first
+/// Concurrent updates might or might not be seen; a resize meanwhile does not visit mappings twice. @visit can be null.
+/// @returns the number of mappings visited
+long hashmap_visit_insertion_order(HashMap *map, hashmap_visit *visit, void *data) {
+    api_assert(map->insertion_ordered, "map is not insertion ordered");
+    header *kvs = getkvs(map);
+    unsigned long pos = kvs->log->head, last = 0;
+    long n = 0;
+    while (pos < kvs->log->tail) {
+        olog_entry *le = olog_at(map, kvs->log, pos, 0);
+        entry *e = null;
+        void *v = null;
+        void *res = le? olog_live(kvs, pos, le, &e, &v) : null;
+        if (res == SIZED) {
+            // go on after the last visited mapping in the new table
+            _help_resize(map, kvs);
+            kvs = getkvs(map);
+            pos = n? olog_after(map, kvs->log, last) : kvs->log->head;
+            continue;
+        }
+        if (res) {
+            if (visit) visit(le->key, _value(map, v), data);
+            last = le->seq;
+            n++;
+        }
+        pos++;
+    }
+    return n;
+}
+
+/// delete the @n oldest mappings of the insertion ordered @map, calling @evicted (if not null) for each
+/// The map still owns an evicted key, @evicted must not keep it. Threads can evict concurrently.
+/// @returns the number of mappings evicted, less than @n only if the map ran empty
+long hashmap_evict_oldest(HashMap *map, long n, hashmap_visit *evicted, void *data) {
+    api_assert(map->insertion_ordered, "map is not insertion ordered");
+    long done = 0;
+    header *kvs = getkvs(map);
+    while (done < n) {
+        olog *log = kvs->log;
+        unsigned long pos = log->head;
+        if (pos >= log->tail) break;
+        olog_entry *le = olog_at(map, log, pos, 0);
+        if (!le || !le->key) { yield(); continue; } // an insert is still writing its entry
+        entry *e = null;
+        void *v = null;
+        void *res = olog_live(kvs, pos, le, &e, &v);
+        if (res == SIZED) {
+            _help_resize(map, kvs);
+            kvs = getkvs(map);
+            continue;
+        }
+        if (res) {
+            if (!cas(&e->_val, null, v)) continue; // raced an update, look again
+            _live(kvs, _slot(kvs, e), -1);
+            _size_update(map, -1);
+            map->changes++;
+            if (map->index) index_sync(map, le->key, _keyhash(map, le->key));
+            if (evicted) evicted(le->key, v, data);
+            done++;
+        }
+        AO_compare_and_swap(&log->head, pos, pos + 1);
+    }
+    return done;
+}
+
+// ** warm start **
+//
+// To start warm after a deploy, a map can export its hottest mappings to a file, and a new process can load them
+// before taking traffic. Like a cache, a tracking map keeps a count-min sketch of key reads, but it only counts about
+// 1 in 8 reads, picked at random so regular access patterns cannot hide keys. An export picks the hottest mappings
+// with a min heap, and writes them hottest first.
+//
+// An import first reserves a table for the size the exporting map had, so it never resizes while loading; as far as
+// the file is to be trusted, a size no table can hold is clamped, a count the file cannot hold too. Then threads
+// decode the records, and afterwards insert them, taking ranges of IMPORT_CHUNK records at a time, so each record is
+// only looked at once; and if fewer threads could be started, the others just take more ranges. Inserts go through
+// hashmap_putif, so they are sampled and timed like any other, and a cache decides what to admit.
+//
+// The file is not portable between machines: a header, then records of a 4 byte length and the encoded mapping.
+
+#define HOT_MAGIC "nbhm-hot"
+#define HOT_VERSION 1
+#define HOT_MAX_RESERVE (1L << 29) // mappings; reserving more would need more slots than a table length can count
+#define IMPORT_CHUNK 1024           // records an import thread takes at a time
+
+typedef struct hot_header hot_header;
+struct hot_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int pad;
+    unsigned long size;            // size of the exporting map
+    unsigned long count;           // records that follow
+};
+
+typedef struct hot_entry hot_entry;
+struct hot_entry {
+    int freq;
+    unsigned int hash;
+    void *key;
+    void *val;
+};
+
+/// track how often keys of @map are read, to export the about @n hottest mappings later, see hashmap_export_hot
+/// Call this before sharing the map between threads. A cache already tracks its reads.
+void hashmap_track_hot(HashMap *map, long n) {
+    api_assert(n > 0, "need a positive number of keys to track: %ld", n);
+    api_assert(!map->dense, "dense maps cannot track hot keys");
+    if (map->cache || map->hot) return;
+    cache *c = cache_new(n);
+    write_barrier();
+    map->hot = c;
+}
+
+/// grow the table of @map to hold @size mappings without resizing
+void hashmap_reserve(HashMap *map, long size) {
+    unsigned long len = INITIAL_SIZE;
+    while (len < size * 4) len *= 2; // leave as much room as a resize would
+    while (1) {
+        header *kvs = getkvs(map);
+        if (kvs->len >= len || kvs->layout == HASHMAP_LAYOUT_DENSE) return; // a dense table grows as keys come
+        map->_reserve = len;
+        _resize(map, kvs);
+        _help_resize(map, kvs);
+    }
+}
+
+static void hot_sift(hot_entry *heap, long n, long i) {
+    while (1) {
+        long l = i * 2 + 1, r = l + 1, m = i;
+        if (l < n && heap[l].freq < heap[m].freq) m = l;
+        if (r < n && heap[r].freq < heap[m].freq) m = r;
+        if (m == i) return;
+        hot_entry t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+        i = m;
+    }
+}
+
+static int hot_compare(const void *l, const void *r) {
+    return ((const hot_entry *)r)->freq - ((const hot_entry *)l)->freq; // hottest first
+}
+
+// without an encoder, integer keys and values are written as they are
+static long hot_encode_int(void *key, void *val, char *buf, long len, void *data) {
+    if (len >= 2 * sizeof(void *)) {
+        memcpy(buf, &key, sizeof(void *));
+        memcpy(buf + sizeof(void *), &val, sizeof(void *));
+    }
+    return 2 * sizeof(void *);
+}
+
+static int hot_decode_int(const char *buf, long len, void **key, void **val, void *data) {
+    if (len != 2 * sizeof(void *)) return 0;
+    memcpy(key, buf, sizeof(void *));
+    memcpy(val, buf + sizeof(void *), sizeof(void *));
+    return 1;
+}
+
+/// write the about @n most read mappings of @map to the file at @path
+/// The map must track reads, see hashmap_track_hot, or be a cache. @encode writes a mapping into @buf of @len bytes,
+/// and returns the bytes it needs, it is called again with a larger buffer if that is more than @len; or it returns
+/// -1 to skip the mapping. Maps with integer keys can pass a null @encode. Keys must not be free'd during the export.
+/// @returns the number of mappings written, or -1 if the file could not be written
+long hashmap_export_hot(HashMap *map, long n, const char *path, hashmap_encode *encode, void *data) {
+    cache *c = map->hot? map->hot : map->cache;
+    api_assert(c, "map does not track reads, see hashmap_track_hot");
+    api_assert(n > 0, "need a positive number of mappings: %ld", n);
+    api_assert(encode || intkeys(map), "need an encoder for keys that are not integers");
+    if (!encode) encode = hot_encode_int;
+
+    // pick the hottest mappings in the current table
+    hot_entry *heap = malloc(sizeof(hot_entry) * n);
+    assert(heap);
+    long count = 0;
+    header *kvs = getkvs(map);
+    for (unsigned long i = 0; i < kvs->len; i++) {
+        entry *e = _load(kvs, i);
+        void *k = getkey(e);
+        if (!k || k == SIZED || k == CLEARED) continue;
+        unsigned int h = peekhash(kvs, i);
+        if (!h) continue;
+        void *v = _value(map, getval(e));
+        if (!v || v == SIZED) continue;
+        if (kvs->seed) h = _keyhash(map, k); // the sketch counts key hashes
+        hot_entry he = { sketch_estimate(c, h), h, k, v };
+        if (count < n) {
+            heap[count++] = he;
+            if (count == n) for (long j = n / 2; j >= 0; j--) hot_sift(heap, n, j);
+        } else if (he.freq > heap[0].freq) {
+            heap[0] = he;
+            hot_sift(heap, n, 0);
+        }
+    }
+    qsort(heap, count, sizeof(hot_entry), hot_compare);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) { free(heap); return -1; }
+    hot_header hh = { HOT_MAGIC, HOT_VERSION, 0, hashmap_size(map), 0 };
+    long blen = 256, written = 0;
+    char *buf = malloc(blen);
+    assert(buf);
+    int ok = fwrite(&hh, sizeof(hh), 1, f) == 1;
+    char *kbuf = map->front_coded? malloc(FC_MAX) : null;
+    for (long i = 0; ok && i < count; i++) {
+        void *key = kbuf? (void *)hashmap_decode_key(map, heap[i].key, kbuf, FC_MAX) : heap[i].key;
+        long len = encode(key, heap[i].val, buf, blen, data);
+        if (len > blen) {
+            while (blen < len) blen *= 2;
+            buf = realloc(buf, blen);
+            assert(buf);
+            len = encode(key, heap[i].val, buf, blen, data);
+        }
+        if (len < 0 || len > blen) continue;
+        unsigned int rlen = len;
+        ok = fwrite(&rlen, sizeof(rlen), 1, f) == 1 && fwrite(buf, 1, len, f) == len;
+        written++;
+    }
+    // the count goes in last, so a partial file never claims records it does not hold
+    hh.count = written;
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&hh, sizeof(hh), 1, f) == 1;
+    if (fclose(f)) ok = 0;
+    free(buf);
+    free(kbuf);
+    free(heap);
+    return ok? written : -1;
+}
+
+typedef struct importer importer;
+struct importer {
+    HashMap *map;
+    hashmap_decode *decode;
+    void *data;
+    int threads;
+    long count;
+    const char **records;          // start of each record, its length is just before it
+    hot_entry *entries;            // decoded records, a null key if decoding failed
+    volatile AO_t next;            // the first record not yet taken
+    volatile AO_t loaded;
+};
+
+// take the next range of records; returns 0 when all are taken
+static int _import_take(importer *im, long *from, long *to) {
+    *from = AO_fetch_and_add(&im->next, IMPORT_CHUNK);
+    if (*from >= im->count) return 0;
+    *to = *from + IMPORT_CHUNK < im->count? *from + IMPORT_CHUNK : im->count;
+    return 1;
+}
+
+static void * _import_decode(void *data) {
+    importer *im = data;
+    long from, to;
+    while (_import_take(im, &from, &to)) {
+        for (long i = from; i < to; i++) {
+            hot_entry *he = &im->entries[i];
+            unsigned int len;
+            memcpy(&len, im->records[i] - sizeof(len), sizeof(len));
+            if (!im->decode(im->records[i], len, &he->key, &he->val, im->data)) {
+                he->key = null;
+                continue;
+            }
+            if (!he->key || !he->val) { // decoded, but nothing to load; the key is ours
+                if (he->key) im->map->free_func(he->key);
+                he->key = null;
+            }
+        }
+    }
+    return null;
+}
+
+static void * _import_insert(void *data) {
+    importer *im = data;
+    HashMap *map = im->map;
+    long from, to;
+    while (_import_take(im, &from, &to)) {
+        for (long i = from; i < to; i++) {
+            hot_entry *he = &im->entries[i];
+            if (!he->key) continue;
+            if (hashmap_putif(map, he->key, he->val, IGNORE) != REJECTED) AO_fetch_and_add1(&im->loaded);
+            else if (map->cache->evict_func) map->cache->evict_func(he->val); // nobody else holds it
         }
     }
+    return null;
+}
 
-    unsigned long bdone = AO_fetch_and_add(&okvs->_bdone, 1);
-    if (bdone >= todo) return 0; // done
-    return 1;                    // more work todo
+// run @fn on up to @im->threads threads, including the calling thread
+static void _import_run(importer *im, void *(*fn)(void *)) {
+    api_assert(im->threads > 0, "need at least one thread: %d", im->threads);
+    int threads = im->threads;
+    long chunks = 1 + im->count / IMPORT_CHUNK;
+    if (threads > chunks) threads = chunks;
+    pthread_t helpers[threads];
+    int started = 0;
+    im->next = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&helpers[started], null, fn, im)) break; // do with fewer
+        started++;
+    }
+    fn(im);
+    for (int i = 0; i < started; i++) pthread_join(helpers[i], null);
 }
 
-void * _resize(HashMap *map, header *okvs);
+/// load the mappings written by hashmap_export_hot from the file at @path into @map, using @threads threads
+/// The table is first grown to the size of the exporting map. @decode is called with each record of @len bytes in
+/// @buf, and sets @key and @val and returns 1, or returns 0 to skip the record; the map owns the decoded keys. Maps
+/// with integer keys can pass a null @decode. Best done before the map is shared, loaded mappings replace others.
+/// @returns the number of mappings loaded, or -1 if the file could not be read
+long hashmap_import(HashMap *map, const char *path, hashmap_decode *decode, void *data, int threads) {
+    api_assert(threads > 0, "need at least one thread: %d", threads);
+    api_assert(decode || intkeys(map), "need a decoder for keys that are not integers");
+    api_assert(!map->dense, "cannot import into a dense map, use hashmap_putif");
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    char *buf = null;
+    long flen = -1;
+    if (fseek(f, 0, SEEK_END) == 0 && (flen = ftell(f)) >= (long)sizeof(hot_header) && fseek(f, 0, SEEK_SET) == 0) {
+        buf = malloc(flen);
+        if (buf && fread(buf, 1, flen, f) != flen) { free(buf); buf = null; }
+    }
+    fclose(f);
+    if (!buf) return -1;
 
-// when a resize is detected, try to help it along
-void _help_resize(HashMap *map, header *okvs) {
-    if (map->_kvs != okvs) return;
+    hot_header hh;
+    memcpy(&hh, buf, sizeof(hh));
+    if (memcmp(hh.magic, HOT_MAGIC, sizeof(hh.magic)) || hh.version != HOT_VERSION) { free(buf); return -1; }
+    unsigned long most = (flen - sizeof(hh)) / sizeof(unsigned int); // records the file can hold, each has a length
+    if (hh.count > most) hh.count = most;
+    if (hh.size > HOT_MAX_RESERVE) hh.size = HOT_MAX_RESERVE;
 
-    strace("help resize: %p, %p", map->_kvs, okvs);
-    header *nkvs = (header *)map->_nkvs;
-    while (nkvs == 0 || nkvs == kvs_promise) {
-        if (map->_kvs != okvs) return;
-        if (nkvs == 0) { // try to start a resize ourselves; this compensates for late promises
-            _resize(map, okvs);
-            return;
-        }
-        yield(); nkvs = (header *)map->_nkvs;
+    // find the records, a truncated file just has fewer
+    importer im = { map, decode? decode : hot_decode_int, data, threads, 0, null, null, 0, 0 };
+    im.records = malloc(sizeof(char *) * (hh.count + 1));
+    im.entries = malloc(sizeof(hot_entry) * (hh.count + 1));
+    assert(im.records); assert(im.entries);
+    long at = sizeof(hh);
+    while (im.count < hh.count && at + (long)sizeof(unsigned int) <= flen) {
+        unsigned int len;
+        memcpy(&len, buf + at, sizeof(len));
+        at += sizeof(len);
+        if (at + len > flen) break;
+        im.records[im.count++] = buf + at;
+        at += len;
     }
 
-    while (map->_kvs == okvs && _zero_block(nkvs));
-    while (map->_kvs == okvs && _copy_block(map, okvs, nkvs));
-    while (map->_kvs == okvs) yield(); // yield until a new map is promoted to current
-    strace("done: %p, %p", map->_kvs, okvs);
+    hashmap_reserve(map, hh.size > im.count? hh.size : im.count);
+    _import_run(&im, _import_decode);
+    _import_run(&im, _import_insert);
+    strace("imported %ld of %ld mappings: %s", (long)im.loaded, (long)hh.count, path);
+
+    free(im.records);
+    free(im.entries);
+    free(buf);
+    return im.loaded;
 }
 
-// when we need to resize
-void * _resize(HashMap *map, header *okvs) {
-    assert(map);
-    strace("maybe resize: %p, %p, %p", map->_kvs, okvs, map->_nkvs);
-    if (map->_nkvs != null) return SIZED; // somebody else already produced a new map
-    if (map->_kvs != okvs) return SIZED;  // somebody else alreay promoted a new map
+// ** range queries **
 
-    if (cas(&map->_nkvs, kvs_promise, null)) {
-        if (map->_kvs != okvs) {
-            if (!cas(&map->_nkvs, null, kvs_promise)) fatal("unpublising late promise");
-            return SIZED; // we are so late: we didn't actually win the race; the winner already moved on
-        }
+// whether @key maps to a value now, helping a resize if needed
+static int index_mapped(HashMap *map, void *key, const unsigned int keyhash) {
+    header *kvs = getkvs(map);
+    void *res = _get(map, kvs, key, keyhash);
+    while (res == SIZED) {
+        _help_resize(map, kvs);
+        kvs = getkvs(map);
+        res = _get(map, kvs, key, keyhash);
+    }
+    return res != null;
+}
 
-        // we won the race to produce new map
-        int size = hashmap_size(map);
-        unsigned int len = okvs->len;
+// make the index agree with the map, after a put changed whether @key maps to a value; see ordered index
+static void index_sync(HashMap *map, void *key, const unsigned int keyhash) {
+    int mapped = index_mapped(map, key, keyhash);
+    while (1) {
+        if (mapped) index_insert(map->index, (unsigned long)key);
+        else index_remove(map->index, (unsigned long)key, getkvs(map));
+        int now = index_mapped(map, key, keyhash);
+        if (now == mapped) break;
+        mapped = now;
+    }
+}
 
-        // calculate how large we want next map to be
-        header *nkvs = null;
-        if (map->changes > (len / 4) && size / (float)len < 0.3f) {
-            // if there have been plenty mutations, and our full ration is pretty bad, just copy to remove garbage
-            strace("resizing to remove garbage: %d", len);
-            nkvs = header_new(len);
-        } else {
-            strace("resizing: %d (%d <= %d && %.2f >= 0.3)", len * 2, map->changes, (len / 4), size / (float)len);
-            nkvs = header_new(len * 2);
-        }
-        assert(nkvs); assert(nkvs->len);
-        // when racing on many resizes, some threads doing _zero_block might loop until _bdone >= todo
-        // and we reset it to zero here; not such a big deal, since it will become >= todo after _copy_block
-        okvs->_btodo = 0;
-        okvs->_bdone = 0;
+/// call @visit for every mapping of @map with a key in [@from, @to), in order of the keys
+/// The map must be ordered, see @hashmap_set_ordered. Concurrent updates might or might not be seen.
+/// @returns the number of mappings visited
+long hashmap_range(HashMap *map, unsigned long from, unsigned long to, hashmap_visit *visit, void *data) {
+    api_assert(map->index, "map is not ordered");
+    inode *preds[INDEX_HEIGHT], *succs[INDEX_HEIGHT];
+    index_find(map->index, from, preds, succs);
 
-        write_barrier();  // publish results
-        map->_nkvs = nkvs; // expose new map so others can help
+    long count = 0;
+    for (inode *n = succs[0]; n && n->key < to; n = UNMARK(n->next[0])) {
+        if (MARKED(n->next[0])) continue; // deleted
+        void *val = hashmap_get(map, (void *)n->key);
+        if (!val) continue;
+        count++;
+        if (visit) visit((void *)n->key, val, data);
+    }
+    return count;
+}
 
-        while (_zero_block(nkvs));
-        while (_copy_block(map, okvs, nkvs));
 
-        // here we could free the map, but many threads might still need to read the SIZED markers
-        // so we keep all old lists and free only the really old; with a gc this is much better
-        push_old_kvs(nkvs, okvs);
-        free_old_kvs(nkvs);
+// ** garbage collector hooks **
+//
+// A runtime with a garbage collector can scan a map for roots, and clear weak keys in bulk, instead of running a
+// finalizer per dead key that deletes its mapping. It does so during its pause, in blocks of the table, so collector
+// threads can work in parallel. The pause must be at a safepoint, where no thread is inside a map call: then no
+// resize is in flight (the winner of a resize finishes all copying before it returns), so all mappings are in the
+// current table, or in the previous generation of a windowed map. A cleared key stays in its slot, marked CLEARED;
+// lookups skip it, and the next resize drops it.
 
-        // this is the required order: otherwise another thread might attempt to resize (when compensating for late promise)
-        // notice we compensate that we can now observe nkvs == kvs (in _putif)
-        if (!cas(&map->_kvs, nkvs, okvs))  fatal("publishing new map");
-        if (!cas(&map->_nkvs, null, nkvs)) fatal("unpublising resize in progress");
-        map->changes = 0;
-        strace("done resizing: %p[%lu].size: %ld", nkvs, nkvs->len, hashmap_size(map));
-        return SIZED; // always indicate we need to retry after resize
+/// make the keys of @map weak references, see hashmap_gc_clear
+/// Call this before sharing the map between threads.
+void hashmap_set_weak(HashMap *map) {
+    api_assert(map->hash_func != int_hash, "integer keys cannot be weak");
+    api_assert(!map->front_coded, "front coded keys cannot be weak");
+    map->weak = 1;
+}
+
+// find the table and the slots of @block; the blocks of a previous generation follow those of the current table
+static header * _gc_block(HashMap *map, long block, unsigned long *from, unsigned long *to) {
+    api_assert(map->_nkvs == null, "collect only while no thread is inside a map call");
+    header *kvs = getkvs(map);
+    long blocks = 1 + (kvs->len - 1) / kvs->block;
+    if (block >= blocks) { block -= blocks; kvs = kvs->window; }
+    *from = block * kvs->block;
+    *to = *from + kvs->block;
+    if (*to > kvs->len) *to = kvs->len;
+    return kvs;
+}
+
+/// return the number of blocks to pass to hashmap_gc_scan or hashmap_gc_clear
+/// Only call this while the collector pauses all threads, outside of any map call.
+long hashmap_gc_blocks(HashMap *map) {
+    api_assert(map->_nkvs == null, "collect only while no thread is inside a map call");
+    header *kvs = getkvs(map);
+    long blocks = 1 + (kvs->len - 1) / kvs->block;
+    if (kvs->window) blocks += 1 + (kvs->window->len - 1) / kvs->window->block;
+    return blocks;
+}
+
+/// call @visit with every mapping in @block of the tables of @map, and @data
+/// For a weak map the key is passed as null; only the values are roots.
+void hashmap_gc_scan(HashMap *map, long block, hashmap_visit *visit, void *data) {
+    unsigned long from, end;
+    header *kvs = _gc_block(map, block, &from, &end);
+    if (kvs->layout == HASHMAP_LAYOUT_DENSE) { // only values; integer keys are never weak
+        for (unsigned long i = from; i < end; i++) {
+            void *v = (void *)*dense_slot(kvs, i);
+            if (v) visit((void *)(kvs->base + i), v, data);
+        }
+        return;
+    }
+    for (unsigned long i = from; i < end; i++) {
+        entry *e = _load(kvs, i);
+        void *k = getkey(e);
+        if (k == null || k == CLEARED) continue;
+        void *v = _value(map, getval(e)); // untagged; a delete not yet written behind is null too
+        if (v == null) continue;
+        visit(map->weak? null : k, v, data);
     }
+}
 
-    // we lost the race to produce new map
-    return SIZED;
+/// clear the mappings in @block of the tables of the weak @map, for which @alive returns 0
+/// The map will not free a cleared key, the collector owns it. Collector threads can clear different blocks in
+/// parallel.
+/// @returns the number of mappings cleared
+long hashmap_gc_clear(HashMap *map, long block, hashmap_key_alive *alive, void *data) {
+    api_assert(map->weak, "only weak maps can be cleared");
+    unsigned long from, end;
+    header *kvs = _gc_block(map, block, &from, &end);
+    long cleared = 0;
+    for (unsigned long i = from; i < end; i++) {
+        entry *e = _load(kvs, i);
+        void *k = getkey(e);
+        if (k == null || k == CLEARED) continue;
+        if (alive(k, data)) continue;
+        // first the value, so the mapping is gone, then the key, so the dead key is never compared again
+        void *v = getval(e);
+        if (!cas(&e->_val, null, v)) fatal("clearing weak key: value changed during collection");
+        if (!cas(&e->_key, CLEARED, k)) fatal("clearing weak key: key changed during collection");
+        if (v != null) { _live(kvs, i, -1); cleared++; }
+    }
+    if (cleared && kvs == getkvs(map)) { // the size is of the current generation
+        _size_update(map, -cleared);
+        map->changes += cleared;
+    }
+    return cleared;
 }
 
-static void * _get(HashMap *map, header *kvs, void *key, const unsigned int hash) {
-    const unsigned int len = kvs->len;
-    int idx = hash & (len - 1);
+// ** random sampling **
+//
+// To sample a random mapping we start at a random slot and take the first live mapping from there; at a low load that
+// means skipping long runs of empty slots. A sampled map keeps a bitmap of live slots per group of 64 slots, and a
+// count of live slots per super group of 4096, so we skip empty regions without touching their slots. Within a group
+// we pick a random live bit. Mappings after a long empty run are sampled more often, which is fine for eviction.
+// Bits and counts are updated after the value, so they can lag a little; counts even below zero.
 
-    int reprobe_try = 0;
-    while (1) {
-        entry *e = _load(kvs, idx);
+// take a random live mapping in the group of slots at @start, from bitmap @bits, into @out
+// returns 1 when found, 0 if none, or SIZED when a resize is in flight
+static void * _pick_group(HashMap *map, header *kvs, unsigned long start, AO_t bits, void **out) {
+    while (bits) {
+        unsigned int r = fast_random() % LIVE_GROUP;
+        AO_t rot = r? (bits >> r) | (bits << (LIVE_GROUP - r)) : bits;
+        unsigned int bit = (r + __builtin_ctzl(rot)) % LIVE_GROUP;
+        bits &= ~((AO_t)1 << bit);
+
+        entry *e = _load(kvs, start + bit);
         void *k = getkey(e);
-        if (k == 0) return 0;         // finding an empty slot indicates the mapping doesn't exist
-        if (k == SIZED) return SIZED; // finding a SIZED slot indicates a map resize is in flight
-
-        unsigned int h = gethash(e);  // first check memoized hash, before doing full key compare
-        if (h == hash) {
-            read_barrier();           // needed to ensure we can read the other key fully
-            if (map->equals_func(k, key)) {
-                return getval(e);     // keys are equal, we found our mapping
+        if (k == SIZED) return SIZED;
+        void *v = _value(map, getval(e));
+        if (v == SIZED) return SIZED;
+        if (k == null || k == CLEARED || v == null) continue; // bit was just out of date
+        out[0] = k; out[1] = v;
+        return (void *)1;
+    }
+    return 0;
+}
+
+// pick a random live mapping from @kvs of @map into @out, key and value; a write-behind delete not yet flushed is
+// not a mapping
+// returns 1 when found, 0 if the table is empty, or SIZED when a resize is in flight
+static void * _pick(HashMap *map, header *kvs, void **out) {
+    const unsigned long len = kvs->len;
+    const unsigned long groups = (len + LIVE_GROUP - 1) / LIVE_GROUP;
+    unsigned long pos = fast_random() & (len - 1);
+    unsigned long seen = 0;
+    while (seen < len) {
+        if (kvs->live && (long)kvs->live[groups + pos / LIVE_SUPER] <= 0) {
+            unsigned long next = (pos / LIVE_SUPER + 1) * LIVE_SUPER;
+            seen += next - pos; pos = next & (len - 1);
+            continue;
+        }
+        unsigned long start = pos - pos % LIVE_GROUP, glen = LIVE_GROUP;
+        if (glen > len) glen = len;
+        if (kvs->live) {
+            void *res = _pick_group(map, kvs, start, kvs->live[pos / LIVE_GROUP], out);
+            if (res) return res;
+        } else {
+            unsigned int off = fast_random();
+            for (unsigned long i = 0; i < glen; i++) {
+                entry *e = _load(kvs, start + (off + i) % glen);
+                void *k = getkey(e);
+                if (k == null || k == CLEARED) continue;
+                if (k == SIZED) return SIZED;
+                void *v = _value(map, getval(e));
+                if (v == SIZED) return SIZED;
+                if (v == null) continue;
+                out[0] = k; out[1] = v;
+                return (void *)1;
             }
         }
+        seen += start + glen - pos; pos = (start + glen) & (len - 1);
+    }
+    return 0;
+}
 
-        if (++reprobe_try >= len) return 0; // going full circle, we know the mapping does not exist
-        idx = (idx + 1) & (len - 1);        // try next slot
+/// track the live slots of @map, so hashmap_sample can skip empty regions
+/// Call this before sharing the map between threads. It costs two atomic updates when a mapping is inserted or
+/// deleted, and about a bit per slot.
+void hashmap_set_sampled(HashMap *map) {
+    api_assert(!map->dense, "dense maps cannot be sampled");
+    if (map->sampled) return;
+    map->sampled = 1;
+    header *kvs = getkvs(map);
+    kvs->live = calloc(live_count(kvs->len), sizeof(AO_t));
+    assert(kvs->live);
+    _account(map, live_count(kvs->len) * sizeof(AO_t));
+    for (unsigned long i = 0; i < kvs->len; i++) {
+        entry *e = _load(kvs, i);
+        if (getkey(e) && getval(e)) _live(kvs, i, 1);
     }
 }
 
-static void * _putif(HashMap *map, int resizing, header *kvs, void *key, const unsigned int hash, void *val, void *oldval) {
-    assert(map); assert(kvs);
-    const unsigned int len = kvs->len;
-    int idx = hash & (len - 1);
-    int mustfreekey = 0; // used to mark if passed in key must be freed; if we return SIZED, we want to reuse the key...
+/// sample @k random live mappings of @map into @out, which must hold 2 * @k pointers: the key and value of each
+/// The same mapping might be sampled more than once. Safe while other threads update or resize the map, but like
+/// any mapping, a sampled key might be free'd once its mapping is deleted. Sampling is fast at any load for maps set
+/// up with hashmap_set_sampled; for other maps, it scans empty slots one by one.
+/// @returns the number of mappings sampled, less than @k only if the map is empty
+long hashmap_sample(HashMap *map, long k, void **out) {
+    header *kvs = getkvs(map);
+    long n = 0;
+    while (n < k) {
+        void *res = _pick(map, kvs, out + 2 * n);
+        if (res == SIZED) { _help_resize(map, kvs); kvs = getkvs(map); continue; }
+        if (!res) break;
+        n++;
+    }
+    return n;
+}
 
-    assert(key); assert(hash);
-    strace("%p %p :: [%s] = %s old: %s", map, kvs, (const char *)key, (const char *)val, (const char *)oldval);
+// ** hash analysis **
+//
+// To tell a weak hash from a high load, we look at a table like the map does: keys probe linearly from their home
+// slot, see _home, and wrap around within their page of the table, see _next. For a live map we analyse its current
+// table. For a sample of keys we insert their hashes in a simulated table, which is one page. For both we also
+// simulate inserting the hashes in tables of several sizes, and count how often an insert would reach the reprobe
+// limit, which is what makes the map resize. And we do all that again with the hashes mixed by a finalizer: if mixing
+// helps a lot, the low bits of the hash are poorly distributed.
 
+static unsigned int mix_hash(unsigned int h) { // murmur3 fmix32
+    h ^= h >> 16; h *= 0x85ebca6b;
+    h ^= h >> 13; h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
 
-    // first we try to find the slot to update, or claim a new one
-    int reprobe_try = 0;
-    entry *e;
-    while (1) {
-        e = _load(kvs, idx);
-        void *k = getkey(e);
+// insert @hashes in a simulated table of @len slots, slots hold a hash or 0 for empty
+// returns how many inserts hit the reprobe limit
+static long simulate(const unsigned int *hashes, long n, unsigned int *slots, unsigned long len) {
+    long hits = 0;
+    bzero(slots, sizeof(unsigned int) * len);
+    for (long i = 0; i < n; i++) {
+        unsigned long idx = hashes[i] & (len - 1);
+        int probes = 0;
+        while (slots[idx]) { idx = (idx + 1) & (len - 1); probes++; }
+        if (probes >= tuning.reprobe_limit) hits++;
+        slots[idx] = hashes[i];
+    }
+    return hits;
+}
 
-        if (k == null) { // we found an unclaimed slot; try to claim it
-            if (val == null && (oldval == IGNORE || oldval == null)) {
-                // this means we are deleting a mapping that doesn't exit; so we don't have to do anything
-                if (resizing) return DELETED; // when resizing, signal the key must be free'd
-                // just make sure it is still really null before returning null
-                if (cas(&e->_key, null, null)) {
-                    map->free_func(key);      // we no longer need the given key
-                    return null;
-                }
-            }
+// fill in the table statistics of @a from a table of @len slots holding hashes, 0 for empty, probing in pages of
+// @span slots
+static void analyze_slots(const unsigned int *slots, unsigned long len, unsigned long span, HashAnalysis *a) {
+    a->len = len;
+    bzero(a->probes, sizeof(a->probes));
+    a->max_probe = 0;
+    double probesum = 0;
+    long keys = 0;
 
-            write_barrier();     // needed to ensure others can read our key fully
-            if (cas(&e->_key, key, null)) {
-                e->_hash = hash; // so we claimed the slot, write the key
-                break;           // and go on to writing the value
-            }
-            // we couldn't claim the empty slot, ensure we reread the no longer null key
-            // TODO if cas returned the new pointer, we didn't have to do this extra memory read
-            k = getkey(e);
-        }
-
-        assert(k);
-        if (k == SIZED) return SIZED;  // map is resizing
-        unsigned int h = gethash(e);
-        if (h == hash) {
-            read_barrier();            // needed to ensure we can read the other key fully
-            if (map->equals_func(k, key)) { // keys are equal, we found the spot where we must update the value
-                mustfreekey = 1;       // mark that key should be deleted
-                break;
-            }
+    unsigned int *home = calloc(len, sizeof(unsigned int));
+    assert(home);
+    for (unsigned long i = 0; i < len; i++) {
+        if (!slots[i]) continue;
+        unsigned long h = slots[i] & (len - 1);
+        long d = (i - h) & (span - 1);
+        home[h]++;
+        keys++;
+        probesum += d;
+        if (d > a->max_probe) a->max_probe = d;
+        a->probes[d < HASHMAP_ANALYSIS_PROBES? d : HASHMAP_ANALYSIS_PROBES - 1]++;
+    }
+    a->mean_probe = keys? probesum / keys : 0;
+
+    // occupancy of home slots; for a uniform hash, keys per slot are poisson distributed, so variance == load
+    double load = keys / (double)len, var = 0;
+    for (unsigned long i = 0; i < len; i++) var += (home[i] - load) * (home[i] - load);
+    a->occupancy_variance = var / len;
+    a->expected_variance = load;
+    free(home);
+
+    // clusters are runs of occupied slots, within a page; start after an empty slot, so we don't count a wrapping run
+    // twice
+    a->clusters = 0; a->max_cluster = 0;
+    long runs = 0;
+    for (unsigned long page = 0; page < len; page += span) {
+        const unsigned int *ps = slots + page;
+        unsigned long start = 0;
+        while (start < span && ps[start]) start++;
+        if (start == span) {
+            a->clusters++; runs += span;
+            if ((long)span > a->max_cluster) a->max_cluster = span;
+            continue;
         }
+        long run = 0;
+        for (unsigned long j = 1; j <= span; j++) {
+            if (ps[(start + j) & (span - 1)]) { run++; continue; }
+            if (run) { a->clusters++; runs += run; if (run > a->max_cluster) a->max_cluster = run; }
+            run = 0;
+        }
+    }
+    a->mean_cluster = a->clusters? runs / (double)a->clusters : 0;
+}
 
-        // if no map, we are in a resize; never return _resize when already resizing
-        if (!resizing && ++reprobe_try >= REPROBE_LIMIT) return _resize(map, kvs);
-        idx = (idx + 1) & (len - 1);   // try next stot
+static int hash_compare(const void *l, const void *r) {
+    unsigned int x = *(const unsigned int *)l, y = *(const unsigned int *)r;
+    return x < y? -1 : x > y;
+}
+
+// fill in everything that only needs the hashes of the keys
+static void analyze_hashes(unsigned int *hashes, long n, HashAnalysis *a) {
+    a->keys = n;
+
+    // duplicate hashes; sort a copy
+    unsigned int *sorted = malloc(sizeof(unsigned int) * (n + 1));
+    assert(sorted);
+    memcpy(sorted, hashes, sizeof(unsigned int) * n);
+    qsort(sorted, n, sizeof(unsigned int), hash_compare);
+    a->duplicate_hashes = 0;
+    for (long i = 1; i < n; i++) if (sorted[i] == sorted[i - 1]) a->duplicate_hashes++;
+    free(sorted);
+
+    unsigned long len = INITIAL_SIZE;
+    while (len < n) len *= 2;
+    unsigned int *slots = malloc(sizeof(unsigned int) * (len << (HASHMAP_ANALYSIS_SIZES - 1)));
+    unsigned int *mixed = malloc(sizeof(unsigned int) * (n + 1));
+    assert(slots); assert(mixed);
+    for (long i = 0; i < n; i++) mixed[i] = mix_hash(hashes[i]);
+
+    a->recommended_len = 0;
+    for (int i = 0; i < HASHMAP_ANALYSIS_SIZES; i++) {
+        a->sizes[i] = len << i;
+        a->reprobe_hits[i] = simulate(hashes, n, slots, a->sizes[i]);
+        a->mixed_reprobe_hits[i] = simulate(mixed, n, slots, a->sizes[i]);
+        if (!a->recommended_len && !a->reprobe_hits[i]) a->recommended_len = a->sizes[i];
     }
+    if (!a->recommended_len) a->recommended_len = a->sizes[HASHMAP_ANALYSIS_SIZES - 1];
 
+    // compare the occupancy of the user hash against the mixed hash, at the recommended size
+    simulate(mixed, n, slots, a->recommended_len);
+    HashAnalysis m;
+    analyze_slots(slots, a->recommended_len, a->recommended_len, &m);
+    a->mixed_occupancy_variance = m.occupancy_variance;
+    free(slots);
+    free(mixed);
 
-    // second we try to update the slots value
-    void *v = getval(e);               // first read the old value
-    if (v == SIZED) return SIZED;
-    if (!resizing && v != null) {
-        // we quickly check if resize is in progress, to prevent wasting effort on old map
-        header *nkvs = (header *)map->_nkvs;
-        if (nkvs != 0 && nkvs != kvs) return SIZED;
-        if (map->_kvs != kvs) return SIZED;
+    long hits = 0, mhits = 0;
+    for (int i = 0; i < HASHMAP_ANALYSIS_SIZES; i++) { hits += a->reprobe_hits[i]; mhits += a->mixed_reprobe_hits[i]; }
+    if (a->duplicate_hashes * 100 > n) {
+        a->recommendation = "many keys share the exact same hash; the hash function ignores part of the key, hash all its bytes";
+    } else if (hits > mhits * 2 + tuning.reprobe_limit) {
+        a->recommendation = "the low bits of the hash are poorly distributed; mix the hash with a finalizer (like murmur3 fmix32)";
+    } else if (a->recommended_len > a->sizes[1]) {
+        a->recommendation = "the hash looks fine, but keys cluster at normal loads; a larger table helps";
+    } else {
+        a->recommendation = "the hash looks fine";
     }
+}
 
-    while (1) {
-        if (oldval != IGNORE && v != oldval) {
-            // we cannot update value, because it doesn't match passed in given value
-            if (resizing) fatal("resize: %s = %p != %p new: %p", (const char *)key, v, oldval, val);
-            return v; // return the current value
-        }
+/// analyse the table of a live @map, and the hashes of its keys, into @a
+/// Safe to use while other threads use the map, the result is a bit fuzzy then.
+void hashmap_analyze(HashMap *map, HashAnalysis *a) {
+    header *kvs = getkvs(map);
+    api_assert(kvs->layout != HASHMAP_LAYOUT_DENSE, "a dense table has no hashes to analyze");
+    unsigned long len = kvs->len;
+    unsigned int *slots = calloc(len, sizeof(unsigned int));
+    unsigned int *hashes = malloc(sizeof(unsigned int) * len);
+    assert(slots); assert(hashes);
 
-        if (cas(&e->_val, val, v)) {
-            // we won the race to update the value; update map->size as needed
-            if (!resizing && v == null && val != null) _size_update(map, 1);
-            if (!resizing && v != null && val == null) _size_update(map, -1);
-            if (!resizing) map->changes++;
+    // deleted mappings still take up their slots, so they count for the table, but not for the hashes
+    long n = 0;
+    a->garbage = 0;
+    for (unsigned long i = 0; i < len; i++) {
+        entry *e = _load(kvs, i);
+        void *k = getkey(e);
+        if (!k || k == SIZED) continue;
+        unsigned int h = peekhash(kvs, i);
+        if (!h) continue;
+        slots[i] = h;
+        void *v = _value(map, getval(e));
+        if (v && v != SIZED) hashes[n++] = h; else a->garbage++;
+    }
+    analyze_hashes(hashes, n, a);
+    analyze_slots(slots, len, kvs->probemask + 1, a);
+    free(slots);
+    free(hashes);
+}
 
-            if (mustfreekey) map->free_func(key); // we no longer need the given key
-            return v;                             // return the previous value we just replaced
+/// analyse how @hash spreads a sample of @n @keys, as if they were in a map, into @a
+void hashmap_analyze_keys(hashmap_key_hash *hash, void **keys, long n, HashAnalysis *a) {
+    unsigned int *hashes = malloc(sizeof(unsigned int) * (n + 1));
+    assert(hashes);
+    for (long i = 0; i < n; i++) {
+        hashes[i] = hash(keys[i]);
+        if (!hashes[i]) hashes[i] = 1; // like the map does
+    }
+    a->garbage = 0;
+    analyze_hashes(hashes, n, a);
+
+    unsigned int *slots = malloc(sizeof(unsigned int) * a->recommended_len);
+    assert(slots);
+    simulate(hashes, n, slots, a->recommended_len);
+    analyze_slots(slots, a->recommended_len, a->recommended_len, a);
+    free(slots);
+    free(hashes);
+}
+
+/// print an analysis @a
+void hashmap_analysis_print(HashAnalysis *a) {
+    printf("keys: %ld, garbage: %ld, table: %lu, load: %.2f\n", a->keys, a->garbage, a->len, (a->keys + a->garbage) / (float)a->len);
+    printf("duplicate hashes: %ld\n", a->duplicate_hashes);
+    printf("probe distance: mean %.2f, max %ld\n", a->mean_probe, a->max_probe);
+    for (int i = 0; i < HASHMAP_ANALYSIS_PROBES; i++) {
+        if (!a->probes[i]) continue;
+        printf("  %2d%s: %ld\n", i, i == HASHMAP_ANALYSIS_PROBES - 1? "+" : " ", a->probes[i]);
+    }
+    printf("clusters: %ld, mean length %.2f, max %ld\n", a->clusters, a->mean_cluster, a->max_cluster);
+    printf("home slot occupancy variance: %.3f (uniform: %.3f, mixed: %.3f)\n",
+            a->occupancy_variance, a->expected_variance, a->mixed_occupancy_variance);
+    printf("inserts hitting the reprobe limit (%d):\n", tuning.reprobe_limit);
+    for (int i = 0; i < HASHMAP_ANALYSIS_SIZES; i++) {
+        printf("  %10lu: %ld (mixed: %ld)\n", a->sizes[i], a->reprobe_hits[i], a->mixed_reprobe_hits[i]);
+    }
+    printf("recommended table: %lu\n", a->recommended_len);
+    printf("recommendation: %s\n", a->recommendation);
+}
+
+// ** tuning **
+//
+// How large a block of slots a resizing thread claims, whether to spin before yielding, how far to probe before
+// resizing, and how far ahead a resize prefetches, all depend on the machine: its caches, its cores and how costly a
+// syscall is. hashmap_tune measures them once per process with short runs of the map itself, trying one parameter at a
+// time and keeping a default unless another value is clearly faster, since these runs are noisy. Tuning takes a few
+// hundred milliseconds, so it can write what it picked to a profile, to load by later processes on the same machine.
+
+#define TUNE_KEYS (1 << 17)
+#define TUNE_ROUNDS 2              // best of
+#define TUNE_GAIN 0.95             // a value must beat the current one by 5% to replace it
+#define TUNE_HANDOFFS 2000
+
+typedef struct tuner tuner;
+struct tuner {
+    HashMap *map;
+    long from, to;
+    volatile AO_t *turn;           // for handoffs
+    int id;
+};
+
+static double tune_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void * _tune_insert(void *data) {
+    tuner *t = data;
+    for (long i = t->from; i < t->to; i++) hashmap_putif(t->map, (void *)i, (void *)i, IGNORE);
+    return null;
+}
+
+// seconds to insert TUNE_KEYS keys using @threads threads, and to look up each key, and as many missing keys
+static double tune_map(int threads, int lookups) {
+    double best = 0;
+    for (int round = 0; round < TUNE_ROUNDS; round++) {
+        HashMap *map = hashmap_new(null, null, null);
+        tuner ts[threads];
+        pthread_t ids[threads];
+        double start = tune_clock();
+        for (int t = 0; t < threads; t++) {
+            ts[t] = (tuner){ map, 1 + t * (long)TUNE_KEYS / threads, 1 + (t + 1) * (long)TUNE_KEYS / threads, null, t };
+            if (t) pthread_create(&ids[t], null, _tune_insert, &ts[t]);
+        }
+        _tune_insert(&ts[0]);
+        for (int t = 1; t < threads; t++) pthread_join(ids[t], null);
+        if (lookups) {
+            for (long i = 1; i <= 2 * TUNE_KEYS; i++) {
+                if (hashmap_get(map, (void *)i) != (i <= TUNE_KEYS? (void *)i : null)) fatal("tuning lookup failed");
+            }
         }
+        double took = tune_clock() - start;
+        hashmap_free(map);
+        if (!round || took < best) best = took;
+    }
+    return best;
+}
 
-        // we lost the race to update; try again with updated value
-        // TODO if cas returned the new pointer, we didn't have to do this extra memory read
-        v = getval(e);
-        if (v == SIZED) return SIZED;  // map is resizing
+static void * _tune_handoff(void *data) {
+    tuner *t = data;
+    for (int i = 0; i < TUNE_HANDOFFS; i++) {
+        int spins = 0;
+        while (*t->turn % 2 != t->id) backoff(&spins);
+        AO_fetch_and_add1(t->turn);
     }
+    return null;
 }
 
+// seconds for two threads to hand a turn back and forth, waiting like a resize does
+static double tune_handoff() {
+    double best = 0;
+    for (int round = 0; round < TUNE_ROUNDS; round++) {
+        volatile AO_t turn = 0;
+        tuner t0 = { null, 0, 0, &turn, 0 }, t1 = { null, 0, 0, &turn, 1 };
+        pthread_t id;
+        double start = tune_clock();
+        pthread_create(&id, null, _tune_handoff, &t1);
+        _tune_handoff(&t0);
+        pthread_join(id, null);
+        double took = tune_clock() - start;
+        if (!round || took < best) best = took;
+    }
+    return best;
+}
 
-/// return the current mapping for @key
-/// @map the map to query
-/// @key the key for the value; the map will not own nor free this key
-void * hashmap_get(HashMap *map, void *key) {
-    unsigned int hash = map->hash_func(key);
-    if (!hash) hash = 1; // we cannot have 0 as a hash value
+// try @n @values for the parameter at @param, keeping the current value unless another is clearly faster
+static void tune_param(int *param, const int *values, int n, const char *name, int threads, int lookups) {
+    double best = tune_map(threads, lookups);
+    int pick = *param;
+    for (int i = 0; i < n; i++) {
+        if (values[i] == pick) continue;
+        *param = values[i];
+        double took = tune_map(threads, lookups);
+        strace("tuning %s: %d: %.4fs (best %d: %.4fs)", name, values[i], took, pick, best);
+        if (took < best * TUNE_GAIN) { best = took; pick = values[i]; }
+    }
+    *param = pick;
+}
 
-    header *kvs = getkvs(map);
-    void *res = _get(map, kvs, key, hash);
-    while (res == SIZED) {
-        _help_resize(map, kvs);
-        kvs = getkvs(map);
-        res = _get(map, kvs, key, hash);
+// the processors of this machine, to tell if a profile was tuned for it
+static void tune_cpu(char *buf, int len) {
+    char model[48] = "unknown";
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            char *c = strchr(line, ':');
+            if (!c || strncmp(line, "model name", 10)) continue;
+            c += 1 + strspn(c + 1, " \t");
+            c[strcspn(c, "\n")] = 0;
+            snprintf(model, sizeof(model), "%s", c);
+            break;
+        }
+        fclose(f);
     }
-    return res;
+    snprintf(buf, len, "%s x%ld", model, sysconf(_SC_NPROCESSORS_ONLN));
 }
 
-/// update the mapping for @key to @val
-/// @map    the map to update
-/// @key    the key which mapping to update; the map owns this key and will free it when needed
-/// @val    the new value to put in map
-/// @oldval the value that must be currently in map for the update to succeed; use @IGNORE if the update must always succeed
-void * hashmap_putif(HashMap *map, void *key, const void *val, const void *oldval) {
-    unsigned int hash = map->hash_func(key);
-    if (!hash) hash = 1;
+static int tune_load(const char *path, HashTuning *t) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    char line[128];
+    int version = 0, fields = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (sscanf(line, "nbhashmap-tuning %d", &version) == 1) continue;
+        if (!strncmp(line, "cpu ", 4)) { snprintf(t->cpu, sizeof(t->cpu), "%.63s", line + 4); continue; }
+        fields += sscanf(line, "block_size %d", &t->block_size);
+        fields += sscanf(line, "spin %d", &t->spin);
+        fields += sscanf(line, "reprobe_limit %d", &t->reprobe_limit);
+        fields += sscanf(line, "prefetch %d", &t->prefetch);
+    }
+    fclose(f);
+    return version == 1 && fields == 4;
+}
 
-    header *kvs = getkvs(map);
-    void *res = _putif(map, 0, kvs, key, hash, (void *)val, (void *)oldval);
-    while (res == SIZED) {
-        _help_resize(map, kvs);
-        kvs = getkvs(map);
-        res = _putif(map, 0, kvs, key, hash, (void *)val, (void *)oldval);
+static int tune_save(const char *path, const HashTuning *t) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    fprintf(f, "nbhashmap-tuning 1\ncpu %s\nblock_size %d\nspin %d\nreprobe_limit %d\nprefetch %d\n",
+            t->cpu, t->block_size, t->spin, t->reprobe_limit, t->prefetch);
+    return fclose(f)? -1 : 0;
+}
+
+// can the map use @t; blocks are a power of two slots, and within bounds, so a batch of a block stays small
+static int tuning_valid(const HashTuning *t) {
+    const int b = t->block_size;
+    return b >= BLOCK_MIN && b <= BLOCK_MAX && !(b & (b - 1)) && t->reprobe_limit > 0 && t->spin >= 0 && t->prefetch >= 0;
+}
+
+/// pick the block size, wait strategy, reprobe limit and prefetch distance for this machine, see hashmap_tuning
+/// If @profile is not null and holds a profile for the processors of this machine, it is loaded; otherwise the
+/// parameters are measured, which takes a few hundred milliseconds, and written to @profile. Tune at process start,
+/// before using any map; tables keep the block size they were created with.
+/// @returns HASHMAP_TUNING_MEASURED or HASHMAP_TUNING_LOADED, or -1 if the profile could not be written
+int hashmap_tune(const char *profile) {
+    HashTuning t = tuning;
+    tune_cpu(t.cpu, sizeof(t.cpu));
+    if (profile) {
+        HashTuning loaded = t;
+        if (tune_load(profile, &loaded) && !strcmp(loaded.cpu, t.cpu)) {
+            api_assert(tuning_valid(&loaded), "corrupt tuning profile: %s", profile);
+            loaded.source = HASHMAP_TUNING_LOADED;
+            tuning = loaded;
+            return tuning.source;
+        }
     }
-    return res;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1? 1 : cpus > 4? 4 : cpus;
+
+    // spinning only pays when the thread we wait on runs at the same time
+    static const int spins[] = { 0, 64, 512, 4096 };
+    tuning.spin = 0;
+    if (cpus > 1) {
+        double best = tune_handoff();
+        for (int i = 1; i < sizeof(spins) / sizeof(spins[0]); i++) {
+            int prev = tuning.spin;
+            tuning.spin = spins[i];
+            double took = tune_handoff();
+            strace("tuning spin: %d: %.4fs (best %d: %.4fs)", spins[i], took, prev, best);
+            if (took < best * TUNE_GAIN) best = took;
+            else tuning.spin = prev;
+        }
+    }
+    static const int blocks[] = { 2048, 4096, 8192, 16384, 32768 };
+    tune_param(&tuning.block_size, blocks, sizeof(blocks) / sizeof(blocks[0]), "block size", threads, 0);
+    static const int prefetches[] = { 0, 4, 8, 16 };
+    tune_param(&tuning.prefetch, prefetches, sizeof(prefetches) / sizeof(prefetches[0]), "prefetch", threads, 0);
+    // a longer limit makes tables fuller, so it must pay for itself in lookups too
+    static const int limits[] = { 9, 17, 33 };
+    tune_param(&tuning.reprobe_limit, limits, sizeof(limits) / sizeof(limits[0]), "reprobe limit", threads, 1);
+
+    snprintf(tuning.cpu, sizeof(tuning.cpu), "%s", t.cpu);
+    tuning.source = HASHMAP_TUNING_MEASURED;
+    strace("tuned for %s: block size %d, spin %d, reprobe limit %d, prefetch %d",
+            tuning.cpu, tuning.block_size, tuning.spin, tuning.reprobe_limit, tuning.prefetch);
+    if (profile && tune_save(profile, &tuning)) return -1;
+    return tuning.source;
+}
+
+/// the parameters in use, the defaults unless hashmap_tune or hashmap_set_tuning changed them
+const HashTuning * hashmap_tuning() { return &tuning; }
+
+/// use the parameters @t, like a profile hashmap_tune wrote would; call before using any map
+/// The block size must be a power of two from BLOCK_MIN to BLOCK_MAX.
+void hashmap_set_tuning(const HashTuning *t) {
+    api_assert(tuning_valid(t), "invalid tuning: block size %d, reprobe limit %d, spin %d, prefetch %d",
+            t->block_size, t->reprobe_limit, t->spin, t->prefetch);
+    tuning = *t;
 }
 
 /// print some debugging info about the @map
@@ -562,7 +5277,7 @@ void hashmap_debug(HashMap *map) {
     const int size = hashmap_size(map);
 
     float ratio = size / (float)len;
-    float mb = (sizeof(entry) * len) / (float) (1024 * 1024);
+    float mb = header_bytes(len, getkvs(map)->layout) / (float) (1024 * 1024);
     print("%f (%d / %d) = %.0fmb", ratio, size, len, mb);
 }
 
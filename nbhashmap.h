@@ -34,14 +34,30 @@ typedef unsigned int (hashmap_key_hash)(void *key);
 /// Equals function the map must use to compare keys. Notice it is
 /// important for this function to behave (run without errors) when
 /// the passed in key is corrupt. (@hashmap_key_free has been called
-/// on the key.)
+/// on the key; see there for when, a thread would have to stall for the
+/// whole grace period.)
 typedef int (hashmap_key_equals)(void *left, void *right);
 
 /// A function to free keys when the map no longer uses them.
+///
+/// Deleting a mapping does not free its key. The key stays in its slot, and
+/// the next resize drops it; but even then the key is only free'd together
+/// with the old table, after its grace period of 30 seconds, since other
+/// threads might still compare the key, or be about to insert it. So keys
+/// of deleted mappings live on for a while, and are free'd by whatever thread
+/// frees the old table. The key passed in to update a mapping that exists is
+/// free'd right away, and @hashmap_free frees all keys that are left.
 typedef void (hashmap_key_free)(void *key);
 
 
 /// Create a new hashmap using a @equals, @hash and @free function.
+///
+/// If all three functions are null, the map uses integer keys: a key is just
+/// an integer cast to a pointer, equal keys are equal integers, and nothing is
+/// free'd. Notice 0 cannot be a key.
+///
+/// The map owns the keys put in, and frees them with @free; keys of deleted
+/// mappings only after a resize and a grace period, see @hashmap_key_free.
 /// @returns a new hashmap
 HashMap * hashmap_new(hashmap_key_equals *equals, hashmap_key_hash *hash, hashmap_key_free *free);
 
@@ -50,6 +66,19 @@ HashMap * hashmap_new(hashmap_key_equals *equals, hashmap_key_hash *hash, hashma
 /// internal resources. It will not free any still referenced values.
 void hashmap_free(HashMap *map);
 
+/// Free a @map like @hashmap_free, but use up to @threads threads, at least
+/// one, to free the keys of a large map.
+void hashmap_free_parallel(HashMap *map, int threads);
+
+/// Free a @map like @hashmap_free, in a background thread; returns right away.
+/// The key free function is then called from that thread.
+void hashmap_free_async(HashMap *map);
+
+/// Declare that the user frees all keys of @map at once, after freeing the
+/// map, as from an arena. Freeing the map then skips freeing every key. The
+/// map still frees the keys it drops while in use.
+void hashmap_set_bulk_keys(HashMap *map);
+
 /// Return the current count of mappings in the @map. Notice, updating a
 /// mapping to null is equivalent to deleting it. So only values mapping keys
 /// to non-zero values are counted.
@@ -60,17 +89,578 @@ int hashmap_size(HashMap *map);
 /// Notice, unlike the @hashmap_putif, the map does not own the key.
 void * hashmap_get(HashMap *map, const void *key);
 
+/// Look up @n @keys in @map at once, storing the value of each in @vals, as
+/// if calling @hashmap_get for every key. All keys of a batch are hashed and
+/// their slots prefetched before the first is compared, so for tables larger
+/// than the caches, the misses overlap instead of adding up.
+void hashmap_get_many(HashMap *map, void **keys, long n, void **vals);
+
 /// A marker to pass into @hashmap_putif to indicate you don't care about the
 /// current mapped value.
 extern void *IGNORE;
 
+/// The marker @hashmap_putif returns when a cache rejects a new mapping.
+extern void *REJECTED;
+
 /// Update the mapping for @key to @val in @map. Notice, the map own's the key
 /// you pass in. Also note that passing in null as the new value is equivalent
 /// to deleting the mapping. (As all mappings return null if they don't exist.)
 ///
 /// @oldval the value that must be currently in map for the update to succeed;
 /// use @IGNORE if the update must always succeed.
+///
+/// @returns the previous value; or @REJECTED if @map is a full cache, that did
+/// not admit the new mapping, see @hashmap_set_cache.
 void * hashmap_putif(HashMap *map, void *key, const void *val, const void *oldval);
 
-#endif
 
+/// When used as a cache, the map drops values by itself. It hands those values
+/// to this function, so the user can free them.
+typedef void (hashmap_value_evict)(void *val);
+
+/// Turn @map into a bounded cache, holding about @capacity mappings. Call this
+/// before the map is shared between threads.
+///
+/// When the cache is full, a new mapping must evict an older one. A TinyLFU
+/// admission filter decides: the new key is admitted only if it was accessed
+/// (through @hashmap_get) more often than the victim it would evict. So a scan
+/// of keys that are seen only once, will not push out the hot mappings.
+///
+/// A rejected mapping is not inserted; @hashmap_putif frees the key and returns
+/// @REJECTED. The value of a rejected mapping stays with the caller; evicted
+/// values are passed to @evict.
+void hashmap_set_cache(HashMap *map, long capacity, hashmap_value_evict *evict);
+
+
+/// public type for a memory budget, shared by many maps.
+typedef struct HashBudget HashBudget;
+
+/// Create a memory budget of @limit bytes.
+///
+/// The budget accounts the tables of all maps registered with it, including
+/// old tables that are retired after a resize, but not yet free'd. When over
+/// budget, a map that would double its table compacts it instead, if there is
+/// garbage (deleted mappings) to remove. A cache evicts a mapping for each
+/// insert while over budget. A plain map cannot refuse a mapping, so if its
+/// table is really full, it still doubles; this is counted as an overrun.
+/// Retired tables count until their grace period of 30 seconds is over;
+/// other threads might still read them, so a map rather goes over budget.
+HashBudget * hashbudget_new(unsigned long limit);
+
+/// Free a @budget. Only do this after all its maps have been free'd.
+void hashbudget_free(HashBudget *budget);
+
+/// Register @map with @budget. Call this before the map is shared between
+/// threads. @hashmap_free unregisters the map.
+void hashmap_set_budget(HashMap *map, HashBudget *budget);
+
+/// Return the bytes used by all maps registered with @budget.
+unsigned long hashbudget_used(HashBudget *budget);
+
+/// Return the bytes used by the tables of @map, including retired tables.
+unsigned long hashmap_memory(HashMap *map);
+
+/// A function to visit each map registered with a budget, with its usage.
+typedef void (hashbudget_visit)(HashMap *map, unsigned long bytes, void *data);
+
+/// Call @visit for each map registered with @budget, passing in the bytes the
+/// map uses, and @data. Notice a map might be free'd concurrently.
+void hashbudget_foreach(HashBudget *budget, hashbudget_visit *visit, void *data);
+
+
+/// Compact @map: remove deleted mappings, and shrink the table if it is
+/// mostly empty. Other threads can keep using the map meanwhile.
+void hashmap_compact(HashMap *map);
+
+/// Rehash @map with a new random seed, mixed into the hash of every key, so
+/// keys a client picked to collide in the table spread out again. Like a
+/// compaction, a resize moves the mappings to a new table, with the new seed,
+/// hashing every key again; other threads keep using the map meanwhile. Keys
+/// with fully equal hashes keep colliding, whatever the seed.
+void hashmap_reseed(HashMap *map);
+
+/// Make the empty @map store its string keys compactly: every resize copies
+/// the keys into chunks of the new table, where keys sharing a prefix up to
+/// their last '/' share one copy of it, like urls and paths do. Keys must be
+/// malloc'd nul terminated strings; the map hashes, compares and frees them
+/// itself from now on. Keys the map hands out, like from @hashmap_sample, can
+/// be coded, read them with @hashmap_decode_key. Cannot be combined with weak
+/// keys, write-behind, insertion order or handles.
+void hashmap_set_front_coded(HashMap *map);
+
+/// The string of a @key handed out by the front coded @map; either @key
+/// itself, or @buf of @len bytes, holding as much of the key as fits.
+const char * hashmap_decode_key(HashMap *map, void *key, char *buf, long len);
+
+/// Memory pressure levels for @hashmap_on_memory_pressure.
+#define HASHMAP_PRESSURE_MODERATE 1
+#define HASHMAP_PRESSURE_CRITICAL 2
+
+/// Tell all maps registered with a budget that memory runs low. At
+/// @HASHMAP_PRESSURE_MODERATE, maps free their retired tables that are past
+/// the grace period of 30 seconds, without waiting for their next resize. At
+/// @HASHMAP_PRESSURE_CRITICAL, maps also shrink sparse tables. Afterwards free
+/// memory is handed back to the OS, if the C library supports that.
+void hashmap_on_memory_pressure(int level);
+
+/// Start a thread that polls the memory.events and memory.pressure files of
+/// @cgroup (null means /sys/fs/cgroup) every @interval_ms, and calls
+/// @hashmap_on_memory_pressure when memory.high was exceeded, or when the
+/// pressure stall averages are high. Falls back to /proc/pressure/memory.
+/// @returns 0 on success
+int hashmap_pressure_watch(const char *cgroup, int interval_ms);
+
+/// Stop the thread started by @hashmap_pressure_watch.
+void hashmap_pressure_unwatch();
+
+
+/// Table layouts for @hashmap_set_layout.
+/// - plain: entries of key, value and hash; a write touches one cache line
+/// - fingerprint: plain plus a byte of the hash per slot; lookups, and misses
+///   in particular, skip slots of other keys without loading them
+/// - compact: entries of key and value, with the hashes kept apart; a third
+///   less memory
+/// - adaptive: sample reads, writes, misses and contention; at every resize
+///   pick a layout for the new table, based on the current workload
+/// - dense: only returned by @hashmap_layout, see @hashmap_set_dense
+#define HASHMAP_LAYOUT_ADAPTIVE   -1
+#define HASHMAP_LAYOUT_PLAIN       0
+#define HASHMAP_LAYOUT_FINGERPRINT 1
+#define HASHMAP_LAYOUT_COMPACT     2
+#define HASHMAP_LAYOUT_DENSE       3
+
+/// Set the @layout for new tables of @map. The current table keeps its layout
+/// until the next resize; call @hashmap_adapt to switch right away.
+void hashmap_set_layout(HashMap *map, int layout);
+
+/// Return the layout of the current table of @map. If @reason is not null, it
+/// is set to a description of why the table got this layout.
+int hashmap_layout(HashMap *map, const char **reason);
+
+/// Let @map, created with integer keys, switch to a dense table when its keys
+/// are nearly contiguous: an array of values indexed by the key minus the
+/// smallest key, and a bitmap of the keys present. Lookups and updates then
+/// neither hash nor probe, and the keys take no memory. Every resize checks
+/// how dense the keys are; inserting a key beyond the array widens it, or goes
+/// back to a hashed table when the keys would fill fewer than 1 in 8 slots.
+/// Deleting keys until fewer than 1 in 8 slots hold one goes back too.
+/// Cannot be combined with caches, ordered, sampled, insertion ordered,
+/// write-behind, windowed or hot tracking maps, nor with handles.
+void hashmap_set_dense(HashMap *map);
+
+/// Return the sampled counts an adaptive @map bases its decisions on. Only
+/// about 1 in 64 reads and writes are counted, and counts halve at a resize.
+void hashmap_layout_stats(HashMap *map, unsigned long *reads, unsigned long *writes, unsigned long *misses, unsigned long *contention);
+
+/// Switch @map to the layout it would pick now, if that differs from the
+/// layout of its current table; this resizes the map.
+/// @returns the layout of the current table
+int hashmap_adapt(HashMap *map);
+
+/// Huge page sizes for @hashmap_set_huge_pages, as log2 of the page size.
+#define HASHMAP_PAGES_2M          21
+#define HASHMAP_PAGES_1G          30
+
+/// Map the large tables of @map on huge pages of 2^@shift bytes, so a lookup
+/// rarely misses the dTLB. Without reserved huge pages, the map falls back to
+/// transparent huge pages. If @paged, probing wraps around within the largest
+/// power of two slots that fit in a page, so the entries of a probe sequence
+/// span at most two huge pages. Call this before sharing the map between
+/// threads.
+void hashmap_set_huge_pages(HashMap *map, int shift, int paged);
+
+/// Return the size of the pages backing the current table of @map, or 0 if
+/// the table is small enough to be malloc'd. For transparent huge pages this
+/// asks the kernel, in /proc/self/smaps, so it is not cheap; the answer can
+/// change as the kernel faults in or collapses pages.
+long hashmap_page_size(HashMap *map);
+
+
+/// A handle to the slot of a mapping, see @hashmap_pin. Its fields are private.
+typedef struct HashHandle {
+    HashMap *map;
+    void *kvs;
+    void *entry;
+    void *key;
+    unsigned int hash;
+} HashHandle;
+
+/// Pin the slot of @key in @map into @handle. Updates through the handle skip
+/// hashing and probing. Like @hashmap_get, the map does not own @key. Caches
+/// cannot be pinned.
+/// @returns 1 if @key has a slot, even if it maps to null; 0 if it has none,
+/// insert it with @hashmap_putif first
+int hashmap_pin(HashMap *map, void *key, HashHandle *handle);
+
+/// Return the value of the mapping pinned by @handle, like @hashmap_get.
+/// @returns the value; or @IGNORE if a resize dropped the mapping
+void * hashmap_handle_get(HashHandle *handle);
+
+/// Update the mapping pinned by @handle to @val, if it currently maps to
+/// @oldval (or use @IGNORE), like @hashmap_putif. When a resize moved the
+/// mapping, the handle follows it.
+/// @returns the previous value; or @IGNORE if a resize dropped the mapping,
+/// because it mapped to null, then pin the key again
+void * hashmap_handle_cas(HashHandle *handle, const void *val, const void *oldval);
+
+/// Start a new generation of @map, for rate limiting or rolling aggregates.
+/// The current mappings become the previous generation, and the previous
+/// generation is dropped. Rotating is about as cheap as a resize of an empty
+/// map; the dropped generation and its keys are free'd later, by another
+/// resize or rotation. Updates racing a rotation may land in the previous
+/// generation. Caches and ordered maps cannot rotate.
+void hashmap_rotate(HashMap *map);
+
+/// Return the mapping for @key in the current generation of @map, like
+/// @hashmap_get, and set @prev to its mapping in the previous generation.
+void * hashmap_get_window(HashMap *map, void *key, void **prev);
+
+/// public type for an overlay, a small delta map of overrides over a large
+/// frozen base map.
+typedef struct HashOverlay HashOverlay;
+
+/// Make an overlay over @base. The overlay owns @base, which must not be
+/// written anymore; writes go to the delta. Only plain maps can be a base;
+/// not caches, ordered, weak, front coded, dense or write-behind maps, nor
+/// maps with bulk keys. The deltas and the bases compacting makes get the
+/// seed and the budget of @base.
+HashOverlay * hashmap_overlay_new(HashMap *base);
+
+/// Free @o, its base and its delta; waits for a compaction in progress.
+void hashmap_overlay_free(HashOverlay *o);
+
+/// Return the mapping for @key in @o: from the delta if it has one,
+/// otherwise from the base. The key is hashed only once.
+void * hashmap_overlay_get(HashOverlay *o, void *key);
+
+/// Map @key to @val in the delta of @o, or delete it if @val is null; a
+/// delete of a key in the base leaves a tombstone in the delta. Overrides are
+/// unconditional. The overlay owns @key, like @hashmap_putif.
+/// @returns the previous mapping
+void * hashmap_overlay_put(HashOverlay *o, void *key, const void *val);
+
+/// The number of mappings in the delta of @o, tombstones included.
+long hashmap_overlay_delta_size(HashOverlay *o);
+
+/// Fold the delta of @o into a new base, moving the keys. Lookups and writes
+/// go on meanwhile, to a fresh delta, and see the same mappings throughout.
+/// The replaced base is free'd after a grace period of 30 seconds.
+/// @returns the number of mappings in the new base, or -1 if another
+/// compaction is running
+long hashmap_overlay_compact(HashOverlay *o);
+
+/// Compact @o like @hashmap_overlay_compact, in a background thread.
+void hashmap_overlay_compact_async(HashOverlay *o);
+
+/// public type for a delegate, that funnels all updates of a map through a few
+/// owner threads.
+typedef struct HashDelegate HashDelegate;
+
+/// A function computing a new value from the current value @val, and @arg.
+typedef void * (hashmap_value_update)(void *val, void *arg);
+
+/// Create a delegate for @map, with @owners threads and room for @clients.
+///
+/// The keys are partitioned by hash over the owners, and only the owner of a
+/// key updates it, so updates of the same keys do not fight over cache lines.
+/// Other threads send updates through a ring per client and owner pair, in
+/// batches. Every thread sending updates must use its own client number, from
+/// 0 to @clients - 1. All writes should go through the delegate; reads can go
+/// directly to the map with @hashmap_get. Caches cannot be delegated. Owners
+/// without work park, until a client sends them updates.
+HashDelegate * hashdelegate_new(HashMap *map, int owners, int clients);
+
+/// Send an update of @key to @val, as @client. Like @hashmap_putif, the map
+/// owns @key. The update is applied later, in the order the client sent it.
+void hashdelegate_put(HashDelegate *d, int client, void *key, void *val);
+
+/// Send an update of @key, as @client; the owner sets @key to the result of
+/// @update, called with the current value and @arg. The map owns @key.
+void hashdelegate_update(HashDelegate *d, int client, void *key, hashmap_value_update *update, void *arg);
+
+/// Pin the owners of @d to a cpu each, owner o to cpu (@first + o) modulo the
+/// number of cpus. Owners are not pinned otherwise. Give the delegates of
+/// different maps a different @first, or their owners share the same cpus.
+/// Returns 0, or an error number.
+int hashdelegate_pin(HashDelegate *d, int first);
+
+/// Publish the updates @client sent, and wait until they were applied.
+void hashdelegate_flush(HashDelegate *d, int client);
+
+/// Apply all updates sent, stop the owners, and free @d, but not its map. No
+/// client may use the delegate anymore.
+void hashdelegate_free(HashDelegate *d);
+
+/// A function to visit mappings, passed the key, the value and user @data.
+typedef void (hashmap_visit)(void *key, void *val, void *data);
+
+/// Keep an ordered index of the keys of @map, for @hashmap_range. Only maps
+/// with integer keys can be ordered, and they must still be empty.
+///
+/// The index is a lock free skip list next to the table, of the keys that map
+/// to a value. Point lookups do not use it, but every insert of a new key also
+/// inserts it in the index, and every delete removes it. That makes inserts of
+/// new keys three to four times slower than into a map that is not ordered (see
+/// bench ordered), and deletes look the key up once more.
+void hashmap_set_ordered(HashMap *map);
+
+/// Call @visit for every mapping of the ordered @map, with a key in the range
+/// [@from, @to), in the order of the keys. Concurrent updates might or might
+/// not be seen. @visit can be null, to just count.
+/// @returns the number of mappings visited
+long hashmap_range(HashMap *map, unsigned long from, unsigned long to, hashmap_visit *visit, void *data);
+
+/// Make the keys of @map weak references, for a runtime with a garbage
+/// collector; the collector then clears mappings of dead keys in bulk with
+/// @hashmap_gc_clear. Keys cannot be integers. Call this before sharing the
+/// map between threads.
+void hashmap_set_weak(HashMap *map);
+
+/// Return the number of blocks of @map, for @hashmap_gc_scan and
+/// @hashmap_gc_clear. These functions must only be called while the collector
+/// pauses all threads at a point where none is inside a map call; then no
+/// resize is in flight. Collector threads can work on different blocks in
+/// parallel. The blocks include the previous generation of a windowed map.
+long hashmap_gc_blocks(HashMap *map);
+
+/// Call @visit for every mapping in @block of @map, passing @data; use it to
+/// find the keys and values the map keeps alive. For a weak map the key is
+/// passed as null.
+void hashmap_gc_scan(HashMap *map, long block, hashmap_visit *visit, void *data);
+
+/// A function telling if the collector found @key alive.
+typedef int (hashmap_key_alive)(void *key, void *data);
+
+/// Clear every mapping in @block of the weak @map, for which @alive returns 0.
+/// The map does not free cleared keys, and never compares them again; their
+/// slots are reclaimed by the next resize.
+/// @returns the number of mappings cleared
+long hashmap_gc_clear(HashMap *map, long block, hashmap_key_alive *alive, void *data);
+
+/// Count the live mappings per group of slots in @map, so @hashmap_sample can
+/// skip empty regions of the table. Inserts and deletes then cost an extra
+/// atomic update. Call this before sharing the map between threads.
+void hashmap_set_sampled(HashMap *map);
+
+/// Sample @k random live mappings of @map into @out, which must have room for
+/// 2 * @k pointers: the key and the value of each mapping. Sampling is roughly
+/// uniform, and might return the same mapping twice. Other threads can update
+/// and resize the map meanwhile. Without @hashmap_set_sampled, sampling scans
+/// empty slots one by one, which is slow in a sparse table.
+/// @returns the number sampled, less than @k only when the map is empty
+long hashmap_sample(HashMap *map, long k, void **out);
+
+/// Start recording the state transitions of all maps in every thread, into
+/// per thread rings of binary events with cycle counter timestamps. Much
+/// cheaper than STRACE, so races still happen while recording. On a fatal
+/// error, a crash, or SIGUSR1, the rings are dumped to the file at @path;
+/// decode it with ./flight. Installs handlers for SIGABRT, SIGSEGV, SIGBUS
+/// and SIGUSR1, which call the handlers they replaced after dumping.
+/// @returns 0, or -1 if @path is too long
+int hashmap_flight_start(const char *path);
+
+/// Stop recording, and restore the signal handlers @hashmap_flight_start
+/// replaced.
+void hashmap_flight_stop();
+
+/// Dump the rings to the file at @path; safe to call in a signal handler.
+/// @returns 0, or -1 if the file could not be written
+int hashmap_flight_dump(const char *path);
+
+/// Sampled latencies, by operation, and by the worst slow path the operation
+/// ran into. Every histogram has 8 buckets per power of two cycles.
+#define HASHMAP_LATENCY_GET 0
+#define HASHMAP_LATENCY_PUT 1
+#define HASHMAP_LATENCY_RESIZE 2        // starting or helping a resize, in any operation
+#define HASHMAP_LATENCY_OPS 3
+#define HASHMAP_CAUSE_NONE 0            // no slow path; cache misses, or preemption
+#define HASHMAP_CAUSE_CAS 1             // lost a cas race and retried
+#define HASHMAP_CAUSE_WAIT_HASH 2       // waited for another thread to publish a hash
+#define HASHMAP_CAUSE_WAIT 3            // waited for other threads in a resize
+#define HASHMAP_CAUSE_RESIZE 4          // helped a resize, or started one
+#define HASHMAP_CAUSES 5
+#define HASHMAP_LATENCY_BUCKETS 496
+typedef struct HashLatency HashLatency;
+struct HashLatency {
+    double ticks_per_ns;
+    unsigned long count[HASHMAP_LATENCY_OPS][HASHMAP_CAUSES][HASHMAP_LATENCY_BUCKETS];
+};
+
+/// Start sampling latencies: every thread times 1 in @every of its
+/// @hashmap_get and @hashmap_putif calls, on any map, with the cycle counter,
+/// and all resizes it starts or helps. Samples go into histograms of the
+/// thread, so sampling shares no cache lines; calls that are not sampled cost
+/// a thread local countdown. Takes 10ms to calibrate the clock the first time.
+///
+/// Sampled calls read the cycle counter twice, which is not free: in the
+/// latency bench, inserts and lookups take a few percent longer sampling 1 in
+/// 64, and about 40% longer sampling all of them.
+void hashmap_latency_start(unsigned int every);
+
+/// Stop sampling; the histograms keep their counts.
+void hashmap_latency_stop();
+
+/// Zero the histograms; samples counted meanwhile might be lost. Samples
+/// from before the reset are never counted again.
+void hashmap_latency_reset();
+
+/// Merge the histograms of all threads into @lat, while they go on sampling.
+void hashmap_latency(HashLatency *lat);
+
+/// The number of samples of operation @op in @lat.
+unsigned long hashmap_latency_samples(const HashLatency *lat, int op);
+
+/// The latency in nanoseconds that a fraction @q of the samples of @op stay
+/// below, rounded up to the end of its bucket; 0 without samples.
+double hashmap_latency_quantile(const HashLatency *lat, int op, double q);
+
+/// Blame the samples of @op from quantile @q up: set @share[cause] to the
+/// fraction of them that ran into that HASHMAP_CAUSE_* as their worst.
+void hashmap_latency_tail(const HashLatency *lat, int op, double q, double *share);
+
+/// Print the percentiles of each operation in @lat, and what the samples
+/// beyond the 99th percentile ran into.
+void hashmap_latency_print(const HashLatency *lat);
+
+/// A function writing @n mappings to a backing store; @pairs holds the key
+/// and value of each, a null value means the key was deleted.
+/// @returns 0 if written; otherwise the mappings stay dirty
+typedef int (hashmap_sink)(void **pairs, long n, void *data);
+
+/// Put the empty @map in write-behind mode: an update only marks its mapping
+/// dirty, and dirty mappings are written to @sink in batches later, by a
+/// thread flushing every @interval_ms, or by @hashmap_flush if that is 0.
+/// Values must have the lowest bit clear; the map uses it as the dirty bit.
+/// Deletes are written too. Freeing the map flushes it one last time. Cannot
+/// be combined with caches, weak keys or sampling. Call this before sharing
+/// the map between threads.
+void hashmap_set_write_behind(HashMap *map, hashmap_sink *sink, void *data, int interval_ms);
+
+/// Write the dirty mappings of the write-behind @map to its sink. Updates
+/// racing the flush are never lost, they are written by the next flush.
+/// @returns the number of mappings written, or -1 if the sink failed
+long hashmap_flush(HashMap *map);
+
+/// Make the empty @map remember the order its keys were inserted in; a key is
+/// inserted when it maps to a value after mapping to null, so deleting a key
+/// and putting it again moves it to the end. New keys are appended to a log
+/// next to the table, which a resize compacts. Cannot be combined with caches,
+/// weak keys, write-behind or rotation. Call this before sharing the map.
+void hashmap_set_insertion_ordered(HashMap *map);
+
+/// Call @visit for every mapping of the insertion ordered @map, oldest first.
+/// Concurrent updates might or might not be seen, but no mapping is visited
+/// twice, even if the map resizes meanwhile. @visit can be null, to just
+/// count.
+/// @returns the number of mappings visited
+long hashmap_visit_insertion_order(HashMap *map, hashmap_visit *visit, void *data);
+
+/// Delete the @n oldest mappings of the insertion ordered @map, calling
+/// @evicted, if not null, for each; like a FIFO cache would. The map keeps
+/// owning the evicted keys, @evicted must not free them. Threads can evict
+/// concurrently, every mapping is evicted once.
+/// @returns the number of mappings evicted, less than @n if the map ran empty
+long hashmap_evict_oldest(HashMap *map, long n, hashmap_visit *evicted, void *data);
+
+/// Track how often the keys of @map are read, sampling about 1 in 8 reads,
+/// so @hashmap_export_hot can find the about @n hottest mappings. A cache
+/// tracks its reads already. Call this before sharing the map between threads.
+void hashmap_track_hot(HashMap *map, long n);
+
+/// Grow the table of @map so it holds @size mappings without resizing.
+void hashmap_reserve(HashMap *map, long size);
+
+/// A function writing the mapping of @key to @val into @buf of @len bytes.
+/// @returns the bytes needed, or -1 to skip the mapping
+typedef long (hashmap_encode)(void *key, void *val, char *buf, long len, void *data);
+
+/// A function reading a mapping from @buf of @len bytes into @key and @val.
+/// @returns 1, or 0 to skip the record
+typedef int (hashmap_decode)(const char *buf, long len, void **key, void **val, void *data);
+
+/// Write the about @n most read mappings of @map to the file at @path, hottest
+/// first, with the size of the map; so a new process can start warm. The map
+/// must track reads, see @hashmap_track_hot. Maps with integer keys can pass
+/// a null @encode. Keys must not be free'd during the export.
+/// @returns the number of mappings written, or -1 on an I/O error
+long hashmap_export_hot(HashMap *map, long n, const char *path, hashmap_encode *encode, void *data);
+
+/// Load a file written by @hashmap_export_hot into @map, using @threads
+/// threads, including the calling thread. The table is first grown to the
+/// size of the exporting map, then the threads decode and insert ranges of
+/// the records; if a thread cannot be started, the others do its share. The
+/// map owns the decoded keys. Maps with integer keys can pass a null @decode.
+/// @returns the number of mappings loaded, or -1 on an I/O or format error
+long hashmap_import(HashMap *map, const char *path, hashmap_decode *decode, void *data, int threads);
+
+/// The result of @hashmap_analyze or @hashmap_analyze_keys. Keys probe
+/// linearly from their home slot, hash & (len - 1), and wrap around within
+/// their page of a table on huge pages; how far they probe, and how long the
+/// runs of occupied slots get, tells how well the hash spreads the keys.
+/// Mixed counts are for the same hashes put through a finalizer.
+#define HASHMAP_ANALYSIS_PROBES 32
+#define HASHMAP_ANALYSIS_SIZES 6
+typedef struct HashAnalysis HashAnalysis;
+struct HashAnalysis {
+    long keys;                      // keys analysed
+    long garbage;                   // slots taken by deleted mappings
+    long duplicate_hashes;          // keys with the exact same hash as another key
+    unsigned long len;              // length of the analysed table
+    long probes[HASHMAP_ANALYSIS_PROBES]; // keys per probe distance, the last counts all further keys
+    double mean_probe;
+    long max_probe;
+    long clusters;                  // runs of occupied slots
+    double mean_cluster;
+    long max_cluster;
+    double occupancy_variance;      // variance of the keys per home slot
+    double expected_variance;       // the same, for a uniform hash
+    double mixed_occupancy_variance;
+    unsigned long sizes[HASHMAP_ANALYSIS_SIZES]; // simulated table lengths
+    long reprobe_hits[HASHMAP_ANALYSIS_SIZES];   // inserts that would make the map resize, per size
+    long mixed_reprobe_hits[HASHMAP_ANALYSIS_SIZES];
+    unsigned long recommended_len;  // smallest simulated table without resizes
+    const char *recommendation;     // what to do about the hash, in words
+};
+
+/// Analyse the current table of @map, and the hashes of its keys, into @a.
+/// Other threads can use the map meanwhile, the results are a bit fuzzy then.
+void hashmap_analyze(HashMap *map, HashAnalysis *a);
+
+/// Analyse how @hash spreads a sample of @n @keys into @a, as if they were
+/// inserted in a map with a table of the recommended length.
+void hashmap_analyze_keys(hashmap_key_hash *hash, void **keys, long n, HashAnalysis *a);
+
+/// Print the analysis @a.
+void hashmap_analysis_print(HashAnalysis *a);
+
+/// The parameters of the map that depend on the machine; see @hashmap_tune.
+#define HASHMAP_TUNING_DEFAULT 0
+#define HASHMAP_TUNING_MEASURED 1
+#define HASHMAP_TUNING_LOADED 2
+typedef struct HashTuning HashTuning;
+struct HashTuning {
+    int block_size;                 // slots a thread claims at once when resizing, a power of two, 256 to 65536
+    int spin;                       // spins before yielding, when waiting for another thread
+    int reprobe_limit;              // probes an insert makes before it resizes the table
+    int prefetch;                   // mappings a resize looks ahead to prefetch their new slot; 0 if it does not
+    int source;                     // HASHMAP_TUNING_*
+    char cpu[64];                   // the processors tuned for
+};
+
+/// Pick the parameters of the map for this machine. If @profile is not null
+/// and holds a profile written on a machine with the same processors, load
+/// it; otherwise measure them with short runs of the map, which takes a few
+/// hundred milliseconds, and write them to @profile. So a profile can be made
+/// offline, or by the first process to start. Tune before using any map.
+/// @returns HASHMAP_TUNING_MEASURED or HASHMAP_TUNING_LOADED, or -1 if the
+/// profile could not be written
+int hashmap_tune(const char *profile);
+
+/// The parameters in use; the defaults, unless tuned or set.
+const HashTuning * hashmap_tuning();
+
+/// Use the parameters @t instead; before using any map. The block size must
+/// be a power of two, from 256 to 65536 slots.
+void hashmap_set_tuning(const HashTuning *t);
+
+#endif
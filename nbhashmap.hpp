@@ -0,0 +1,256 @@
+#ifndef _nbhashmap_hpp_
+#define _nbhashmap_hpp_
+
+/**
+ *
+ * Static maps for C++ callers.
+ *
+ * A table known at compile time, like a protocol dispatch table, does not need
+ * to be built at startup. A StaticMap is constructed by the compiler into read
+ * only data, with the hashes and the probing of the concurrent map: the home
+ * slot of a key is its hash modulo the power of two capacity, and collisions
+ * take the next free slot. Lookups are plain loads, no atomics.
+ *
+ * A PromotingMap starts out as a StaticMap, and copies it into a concurrent
+ * HashMap on the first write. From then on all reads and writes go to the
+ * HashMap; until then a read costs one extra load of the promoted pointer.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "nbhashmap.h"
+}
+
+namespace nbhashmap {
+
+/// The hash of integer keys, as a map created without key functions has it:
+/// the murmur3 finalizer, of which the low 32 bits are kept.
+constexpr unsigned int int_hash(unsigned long key) {
+    unsigned long long k = key;
+    k ^= k >> 33; k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (unsigned int)k;
+}
+
+/// The murmurhash2a of @len bytes at @data, that the tests and tools hash
+/// string keys with, see murmurhash.h. Reads the bytes one by one, so it is
+/// the same as theirs on little endian machines, and can run at compile time.
+constexpr unsigned int murmurhash2a(const char *data, std::size_t len) {
+    const unsigned int m = 0x5bd1e995;
+    const int r = 24;
+    unsigned int h = 33, l = (unsigned int)len;
+    auto mix = [&](unsigned int k) { k *= m; k ^= k >> r; k *= m; h *= m; h ^= k; };
+    std::size_t i = 0;
+    for (; len - i >= 4; i += 4) {
+        mix((unsigned char)data[i] | (unsigned char)data[i + 1] << 8 |
+            (unsigned char)data[i + 2] << 16 | (unsigned int)(unsigned char)data[i + 3] << 24);
+    }
+    unsigned int t = 0;
+    switch (len - i) {
+        case 3: t ^= (unsigned char)data[i + 2] << 16; [[fallthrough]];
+        case 2: t ^= (unsigned char)data[i + 1] << 8; [[fallthrough]];
+        case 1: t ^= (unsigned char)data[i];
+    }
+    mix(t);
+    mix(l);
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+}
+
+/// Integer keys; like the concurrent map, 0 cannot be a key.
+struct IntKeys {
+    using key_type = unsigned long;
+    static constexpr unsigned int hash(key_type key) { return int_hash(key); }
+    static constexpr bool equals(key_type l, key_type r) { return l == r; }
+    static constexpr bool valid(key_type key) { return key != 0; }
+
+    // as a HashMap has them
+    static HashMap * new_map() { return hashmap_new(nullptr, nullptr, nullptr); }
+    static void * own(key_type key) { return (void *)(std::uintptr_t)key; }
+    template <typename F> static auto probe(key_type key, F f) { return f((void *)(std::uintptr_t)key); }
+};
+
+/// String keys, hashed with murmurhash2a. A HashMap owns malloc'd copies.
+struct StringKeys {
+    using key_type = std::string_view;
+    static constexpr unsigned int hash(key_type key) { return murmurhash2a(key.data(), key.size()); }
+    static constexpr bool equals(key_type l, key_type r) { return l == r; }
+    static constexpr bool valid(key_type key) { return true; }
+
+    static unsigned int map_hash(void *key) { return murmurhash2a((const char *)key, std::strlen((const char *)key)); }
+    static int map_equals(void *l, void *r) { return std::strcmp((const char *)l, (const char *)r) == 0; }
+    static void map_free(void *key) { std::free(key); }
+    static HashMap * new_map() { return hashmap_new(map_equals, map_hash, map_free); }
+    static void * own(key_type key) { return strndup(key.data(), key.size()); }
+    template <typename F> static auto probe(key_type key, F f) { return f((void *)std::string(key).c_str()); }
+};
+
+/// A fixed map of @N mappings, built at compile time. @Value must be a literal
+/// type; @Keys is @IntKeys or @StringKeys, or alike. For example:
+///
+///     constexpr nbhashmap::StaticMap<handler *, 2, nbhashmap::StringKeys>
+///         dispatch({{ {"get", on_get}, {"set", on_set} }});
+///
+/// Duplicate and invalid keys fail the compilation.
+template <typename Value, std::size_t N, typename Keys = IntKeys>
+class StaticMap {
+public:
+    using key_type = typename Keys::key_type;
+    using entry = std::pair<key_type, Value>;
+
+    /// At least twice @N slots, so a miss stops at an empty slot soon.
+    static constexpr std::size_t capacity = [] {
+        std::size_t len = 4; // INITIAL_SIZE
+        while (len < N * 2) len *= 2;
+        return len;
+    }();
+
+    constexpr StaticMap(const entry (&entries)[N]) : slots_() {
+        for (std::size_t i = 0; i < N; i++) {
+            const key_type &key = entries[i].first;
+            if (!Keys::valid(key)) throw "invalid key";
+            const unsigned int h = slot_hash(key);
+            std::size_t idx = h & (capacity - 1);
+            while (slots_[idx].hash) {
+                if (slots_[idx].hash == h && Keys::equals(slots_[idx].key, key)) throw "duplicate key";
+                idx = (idx + 1) & (capacity - 1);
+            }
+            slots_[idx].key = key;
+            slots_[idx].value = entries[i].second;
+            slots_[idx].hash = h;
+        }
+    }
+
+    /// Return the value of @key, or null if it has none.
+    constexpr const Value * find(key_type key) const {
+        const unsigned int h = slot_hash(key);
+        for (std::size_t idx = h & (capacity - 1);; idx = (idx + 1) & (capacity - 1)) {
+            const slot &s = slots_[idx];
+            if (!s.hash) return nullptr;
+            if (s.hash == h && Keys::equals(s.key, key)) return &s.value;
+        }
+    }
+
+    /// Return the value of @key, or @missing if it has none.
+    constexpr Value get(key_type key, Value missing = Value()) const {
+        const Value *v = find(key);
+        return v? *v : missing;
+    }
+
+    constexpr std::size_t size() const { return N; }
+
+    /// Call @visit with every key and value, in slot order.
+    template <typename F> constexpr void each(F visit) const {
+        for (const slot &s : slots_) if (s.hash) visit(s.key, s.value);
+    }
+
+private:
+    // like the map, 0 marks an empty slot, so no hash is 0
+    static constexpr unsigned int slot_hash(key_type key) {
+        unsigned int h = Keys::hash(key);
+        return h? h : 1;
+    }
+
+    struct slot {
+        key_type key = key_type();
+        Value value = Value();
+        unsigned int hash = 0;
+    };
+    slot slots_[capacity];
+};
+
+/// A StaticMap that becomes a concurrent HashMap on its first write. The
+/// values are stored as the values of the HashMap, so @Value must be a pointer
+/// or an integer no larger than one; a null or 0 value means no mapping.
+///
+/// A PromotingMap of static storage is initialized at compile time too. It
+/// holds a copy of the StaticMap, so building it from a temporary is fine.
+/// Reads before the first write go to the copy. The first writers each
+/// copy it into a new HashMap, one of them installs its copy, and the others
+/// free theirs and write to the installed one.
+template <typename Value, std::size_t N, typename Keys = IntKeys>
+class PromotingMap {
+    static_assert(std::is_pointer<Value>::value || std::is_integral<Value>::value || std::is_enum<Value>::value,
+                  "values must be pointers or integers");
+    static_assert(sizeof(Value) <= sizeof(void *), "values must fit a pointer");
+
+public:
+    using key_type = typename Keys::key_type;
+
+    constexpr PromotingMap(const StaticMap<Value, N, Keys> &base) : base_(base), map_(nullptr) {}
+    PromotingMap(const PromotingMap &) = delete;
+    PromotingMap & operator=(const PromotingMap &) = delete;
+    ~PromotingMap() {
+        if (HashMap *m = map_.load(std::memory_order_acquire)) hashmap_free(m);
+    }
+
+    /// Return the value of @key, or null if it has none.
+    Value get(key_type key) const {
+        HashMap *m = map_.load(std::memory_order_acquire);
+        if (!m) return base_.get(key);
+        return Keys::probe(key, [m](void *k) { return from_map(hashmap_get(m, k)); });
+    }
+
+    /// Map @key to @val, if it currently maps to @oldval; like @hashmap_putif,
+    /// returns the value it mapped to before. Setting a null value deletes.
+    Value putif(key_type key, Value val, Value oldval) {
+        return from_map(hashmap_putif(promote(), Keys::own(key), to_map(val), to_map(oldval)));
+    }
+
+    /// Map @key to @val, whatever it maps to now; returns the previous value.
+    Value put(key_type key, Value val) {
+        return from_map(hashmap_putif(promote(), Keys::own(key), to_map(val), IGNORE));
+    }
+
+    /// Remove the mapping of @key; returns the value it had.
+    Value remove(key_type key) { return put(key, Value()); }
+
+    /// Whether a write made this a HashMap.
+    bool promoted() const { return map_.load(std::memory_order_acquire) != nullptr; }
+
+    /// The HashMap, making it if no write did yet.
+    HashMap * map() { return promote(); }
+
+private:
+    static void * to_map(Value v) {
+        if constexpr (std::is_pointer<Value>::value) return (void *)v;
+        else return (void *)(std::uintptr_t)v;
+    }
+    static Value from_map(void *v) {
+        if constexpr (std::is_pointer<Value>::value) return (Value)v;
+        else return (Value)(std::uintptr_t)v;
+    }
+
+    HashMap * promote() {
+        HashMap *m = map_.load(std::memory_order_acquire);
+        if (m) return m;
+        m = Keys::new_map();
+        hashmap_reserve(m, N);
+        base_.each([m](const key_type &key, const Value &val) {
+            if (to_map(val)) hashmap_putif(m, Keys::own(key), to_map(val), IGNORE);
+        });
+        HashMap *expected = nullptr;
+        if (map_.compare_exchange_strong(expected, m, std::memory_order_acq_rel)) return m;
+        hashmap_free(m); // another writer was first
+        return expected;
+    }
+
+    const StaticMap<Value, N, Keys> base_;
+    std::atomic<HashMap *> map_;
+};
+
+} // namespace nbhashmap
+
+#endif
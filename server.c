@@ -0,0 +1,623 @@
+#include "nbhashmap.c"
+#include "murmurhash.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// a memcached style cache server around the map; run as: ./server address [threads] [-f]
+// address is host:port, :port or unix:path; threads defaults to one per core; with -f the keys are front coded
+//
+// Both memcached protocols are spoken, picked per connection by its first byte. Text: get, set, delete, quit. Binary:
+// get, getq, getk, getkq, set, setq, delete, deleteq, noop, quit, quitq. Flags are kept, expiry times are ignored.
+//
+// Every worker thread runs its own epoll loop over the connections it accepted. All requests a read delivers are parsed
+// at once: consecutive gets are looked up as one batch with hashmap_get_many, straight from the receive buffer, the
+// keys terminated in place for the duration; and all responses of a read leave in one write.
+//
+// Values are immutable items. A set or delete retires the item it replaced, which is freed once every worker started a
+// new batch since, or is waiting for events; so a lookup never reads a freed item.
+
+static unsigned int makehash(void *key) { return murmurhash2a(key, strlen(key)); }
+static int keyequals(void *left, void *right) { return strcmp((const char *)left, (const char *)right) == 0; }
+
+#define MAX_KEY 250              // as memcached
+#define MAX_VALUE (1024 * 1024)  // as memcached
+#define MAX_LINE 2048            // a text command line longer than this is garbage
+#define IN_SIZE (16 * 1024)      // initial receive buffer; grows to hold a single large set
+#define MAX_EVENTS 64
+#define BATCH 64                 // gets looked up together
+#define LIMBO_BATCH 64           // retired items a worker collects before trying to free them
+#define QUIESCENT (~(AO_t)0)     // the epoch of a worker waiting for events
+
+#define BIN_REQUEST 0x80
+#define BIN_RESPONSE 0x81
+#define BIN_HEADER 24
+
+enum { OP_GET = 0x00, OP_SET = 0x01, OP_DELETE = 0x04, OP_QUIT = 0x07, OP_GETQ = 0x09, OP_NOOP = 0x0a, OP_GETK = 0x0c,
+       OP_GETKQ = 0x0d, OP_SETQ = 0x11, OP_DELETEQ = 0x14, OP_QUITQ = 0x17, OP_TEXT_GET = 0xff };
+enum { ST_OK = 0x00, ST_NOT_FOUND = 0x01, ST_TOO_LARGE = 0x03, ST_INVALID = 0x04, ST_UNKNOWN = 0x81 };
+
+typedef struct item item;
+struct item {
+    item *next;             // in the limbo list, once retired
+    AO_t retired;           // the epoch it was retired in
+    unsigned int flags;
+    unsigned int len;
+    char data[];
+};
+
+typedef struct conn conn;
+struct conn {
+    int fd;
+    int binary;             // -1 until the first byte tells
+    int closing;
+    int writing;            // waiting for the socket to drain, not reading meanwhile
+    char *in;               // always one byte spare, so the last key can be terminated in place
+    long inlen, incap;
+    char *out;
+    long outlen, outoff, outcap;
+};
+
+// a get waiting in the batch; key points into the receive buffer
+typedef struct pending pending;
+struct pending {
+    char *key;
+    int len;
+    unsigned char op;       // binary opcode, or OP_TEXT_GET
+    unsigned char last;     // the last key of a text get, END follows it
+    unsigned int opaque;    // binary, echoed as is
+};
+
+typedef struct worker worker;
+struct worker {
+    pthread_t thread;
+    int epfd;
+    volatile AO_t epoch;    // the global epoch when this worker started its current batch, or QUIESCENT
+    item *limbo;
+    long nlimbo;
+    long requests;
+    pending batch[BATCH];
+    void *keys[BATCH];
+    void *vals[BATCH];
+    int n;
+    char pad[64];
+};
+
+static HashMap *map;
+static int listener;
+static worker *workers;
+static int nworkers;
+static volatile AO_t epoch = 1;
+static volatile int stopping;
+
+
+// ** items and their reclamation **
+
+static item * item_new(unsigned int flags, const char *data, long len) {
+    item *it = malloc(sizeof(item) + len);
+    it->next = null;
+    it->retired = 0;
+    it->flags = flags;
+    it->len = len;
+    memcpy(it->data, data, len);
+    return it;
+}
+
+// free retired items no worker can still be reading; a worker that announced an epoch later than the one an item was
+// retired in, found the map without the item
+static void reclaim(worker *w) {
+    AO_t min = QUIESCENT;
+    for (int i = 0; i < nworkers; i++) {
+        AO_t e = workers[i].epoch;
+        if (e < min) min = e;
+    }
+    item **prev = &w->limbo;
+    for (item *it = w->limbo; it; it = *prev) {
+        if (it->retired < min) {
+            *prev = it->next;
+            free(it);
+            w->nlimbo--;
+        } else {
+            prev = &it->next;
+        }
+    }
+}
+
+static void retire(worker *w, item *it) {
+    if (!it) return;
+    it->retired = AO_fetch_and_add1(&epoch);
+    it->next = w->limbo;
+    w->limbo = it;
+    w->nlimbo++;
+}
+
+static item * store(worker *w, const char *key, int keylen, item *it) {
+    item *old = hashmap_putif(map, strndup(key, keylen), it, IGNORE);
+    retire(w, old);
+    return old;
+}
+
+
+// ** responses **
+
+static void out_reserve(conn *c, long n) {
+    if (c->outlen + n <= c->outcap) return;
+    while (c->outlen + n > c->outcap) c->outcap = c->outcap? c->outcap * 2 : IN_SIZE;
+    c->out = realloc(c->out, c->outcap);
+}
+
+static void out_put(conn *c, const void *data, long n) {
+    if (!n) return;
+    out_reserve(c, n);
+    memcpy(c->out + c->outlen, data, n);
+    c->outlen += n;
+}
+
+static void out_str(conn *c, const char *s) { out_put(c, s, strlen(s)); }
+
+static void put16(unsigned char *p, unsigned int v) { p[0] = v >> 8; p[1] = v; }
+static void put32(unsigned char *p, unsigned int v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static unsigned int get16(const unsigned char *p) { return p[0] << 8 | p[1]; }
+static unsigned int get32(const unsigned char *p) { return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+
+// a response; a hit passes its item, to put the flags in the extras
+static void bin_respond(conn *c, int op, int status, unsigned int opaque, const item *it,
+                        const char *key, int keylen, const char *val, long vlen) {
+    const int extlen = it? 4 : 0;
+    unsigned char h[BIN_HEADER + 4];
+    memset(h, 0, sizeof(h));
+    h[0] = BIN_RESPONSE;
+    h[1] = op;
+    put16(h + 2, keylen);
+    h[4] = extlen;
+    put16(h + 6, status);
+    put32(h + 8, extlen + keylen + vlen);
+    memcpy(h + 12, &opaque, 4);
+    if (it) put32(h + BIN_HEADER, it->flags);
+    out_put(c, h, BIN_HEADER + extlen);
+    out_put(c, key, keylen);
+    out_put(c, val, vlen);
+}
+
+static void bin_error(conn *c, int op, int status, unsigned int opaque, const char *msg) {
+    bin_respond(c, op, status, opaque, null, null, 0, msg, strlen(msg));
+}
+
+
+// ** batched lookups **
+
+// look up all pending gets at once, and write their responses in order
+static void flush_gets(worker *w, conn *c) {
+    const int n = w->n;
+    if (!n) return;
+    w->n = 0;
+
+    char saved[BATCH];
+    for (int i = 0; i < n; i++) {
+        pending *p = &w->batch[i];
+        saved[i] = p->key[p->len];
+        p->key[p->len] = 0;
+        w->keys[i] = p->key;
+    }
+    hashmap_get_many(map, w->keys, n, w->vals);
+    for (int i = n - 1; i >= 0; i--) w->batch[i].key[w->batch[i].len] = saved[i];
+
+    for (int i = 0; i < n; i++) {
+        pending *p = &w->batch[i];
+        const item *it = w->vals[i];
+        if (p->op == OP_TEXT_GET) {
+            if (it) {
+                char line[MAX_KEY + 64];
+                out_put(c, line, snprintf(line, sizeof(line), "VALUE %.*s %u %u\r\n", p->len, p->key, it->flags, it->len));
+                out_put(c, it->data, it->len);
+                out_put(c, "\r\n", 2);
+            }
+            if (p->last) out_put(c, "END\r\n", 5);
+            continue;
+        }
+        const int withkey = p->op == OP_GETK || p->op == OP_GETKQ;
+        if (it) {
+            bin_respond(c, p->op, ST_OK, p->opaque, it, p->key, withkey? p->len : 0, it->data, it->len);
+        } else if (p->op == OP_GET || p->op == OP_GETK) {
+            bin_respond(c, p->op, ST_NOT_FOUND, p->opaque, null, p->key, withkey? p->len : 0, "Not found", 9);
+        }
+    }
+}
+
+static void push_get(worker *w, conn *c, char *key, int len, int op, int last, unsigned int opaque) {
+    if (w->n == BATCH) flush_gets(w, c);
+    pending *p = &w->batch[w->n++];
+    p->key = key;
+    p->len = len;
+    p->op = op;
+    p->last = last;
+    p->opaque = opaque;
+}
+
+
+// ** request parsing **
+
+static int parse_num(const char *s, int len, unsigned long *out) {
+    if (len <= 0 || len > 19) return 0;
+    unsigned long v = 0;
+    for (int i = 0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return 0;
+        v = v * 10 + (s[i] - '0');
+    }
+    *out = v;
+    return 1;
+}
+
+#define MAX_TOKENS 8
+
+// split a command line into at most MAX_TOKENS tokens; returns how many, or MAX_TOKENS + 1 if there are more
+static int tokenize(char *p, char *end, char **tok, int *toklen) {
+    int n = 0;
+    while (1) {
+        while (p < end && *p == ' ') p++;
+        if (p == end) return n;
+        if (n == MAX_TOKENS) return n + 1;
+        tok[n] = p;
+        while (p < end && *p != ' ') p++;
+        toklen[n] = p - tok[n];
+        n++;
+    }
+}
+
+static int token_is(const char *tok, int len, const char *s) { return len == strlen(s) && !memcmp(tok, s, len); }
+
+// handle one text request at @p; returns the bytes it took, 0 if it is not complete yet, -1 to close the connection
+static long text_request(worker *w, conn *c, char *p, char *end) {
+    char *eol = memchr(p, '\n', end - p);
+    if (!eol) return end - p > MAX_LINE? -1 : 0;
+    const long linelen = eol + 1 - p;
+    char *line = eol;
+    if (line > p && line[-1] == '\r') line--;
+
+    if (line - p > 4 && !memcmp(p, "get ", 4)) {
+        // a get can list any number of keys; all are checked before any is looked up
+        char *q = p + 3, *last = null;
+        int keys = 0;
+        while (q < line) {
+            while (q < line && *q == ' ') q++;
+            if (q == line) break;
+            char *k = q;
+            while (q < line && *q != ' ') q++;
+            if (q - k > MAX_KEY) keys = -1;
+            if (keys < 0) break;
+            keys++;
+            last = k;
+        }
+        if (keys <= 0) {
+            flush_gets(w, c);
+            out_str(c, keys? "CLIENT_ERROR bad command line format\r\n" : "ERROR\r\n");
+            return linelen;
+        }
+        for (q = p + 3; q < line;) {
+            while (q < line && *q == ' ') q++;
+            if (q == line) break;
+            char *k = q;
+            while (q < line && *q != ' ') q++;
+            push_get(w, c, k, q - k, OP_TEXT_GET, k == last, 0);
+        }
+        return linelen;
+    }
+
+    char *tok[MAX_TOKENS];
+    int toklen[MAX_TOKENS];
+    const int n = tokenize(p, line, tok, toklen);
+    flush_gets(w, c); // anything but a get answers right away, after the gets before it
+
+    if (n >= 5 && n <= 6 && token_is(tok[0], toklen[0], "set")) {
+        unsigned long flags, exptime, bytes;
+        const int noreply = n == 6 && token_is(tok[5], toklen[5], "noreply");
+        if (toklen[1] > MAX_KEY || !parse_num(tok[2], toklen[2], &flags) || flags > 0xffffffffUL ||
+                !parse_num(tok[3], toklen[3], &exptime) || !parse_num(tok[4], toklen[4], &bytes) || (n == 6 && !noreply)) {
+            out_str(c, "CLIENT_ERROR bad command line format\r\n");
+            return linelen;
+        }
+        if (bytes > MAX_VALUE) {
+            out_str(c, "SERVER_ERROR object too large for cache\r\n");
+            return -1;
+        }
+        if (end - p < linelen + (long)bytes + 2) return 0;
+        const char *data = p + linelen;
+        if (memcmp(data + bytes, "\r\n", 2)) {
+            out_str(c, "CLIENT_ERROR bad data chunk\r\n");
+            return -1;
+        }
+        store(w, tok[1], toklen[1], item_new(flags, data, bytes));
+        if (!noreply) out_str(c, "STORED\r\n");
+        return linelen + bytes + 2;
+    }
+    if (n >= 2 && n <= 3 && token_is(tok[0], toklen[0], "delete")) {
+        const int noreply = n == 3 && token_is(tok[2], toklen[2], "noreply");
+        if (toklen[1] > MAX_KEY || (n == 3 && !noreply)) {
+            out_str(c, "CLIENT_ERROR bad command line format\r\n");
+            return linelen;
+        }
+        item *old = store(w, tok[1], toklen[1], null);
+        if (!noreply) out_str(c, old? "DELETED\r\n" : "NOT_FOUND\r\n");
+        return linelen;
+    }
+    if (n == 1 && token_is(tok[0], toklen[0], "quit")) {
+        c->closing = 1;
+        return linelen;
+    }
+    out_str(c, "ERROR\r\n");
+    return linelen;
+}
+
+// handle one binary request at @p; returns the bytes it took, 0 if it is not complete yet, -1 to close the connection
+static long binary_request(worker *w, conn *c, char *p, char *end) {
+    if (end - p < BIN_HEADER) return 0;
+    const unsigned char *h = (const unsigned char *)p;
+    if (h[0] != BIN_REQUEST) return -1;
+    const int op = h[1];
+    const int keylen = get16(h + 2);
+    const int extlen = h[4];
+    const unsigned long bodylen = get32(h + 8);
+    unsigned int opaque;
+    memcpy(&opaque, h + 12, 4);
+    if (bodylen > MAX_VALUE + MAX_KEY + 255 || keylen + extlen > bodylen) return -1;
+    if (end - p < BIN_HEADER + (long)bodylen) return 0;
+
+    char *key = p + BIN_HEADER + extlen;
+    const char *val = key + keylen;
+    const long vlen = bodylen - extlen - keylen;
+    const long total = BIN_HEADER + bodylen;
+
+    if (op == OP_GET || op == OP_GETQ || op == OP_GETK || op == OP_GETKQ) {
+        if (keylen > 0 && keylen <= MAX_KEY && !extlen && !vlen) {
+            push_get(w, c, key, keylen, op, 0, opaque);
+            return total;
+        }
+        flush_gets(w, c);
+        bin_error(c, op, ST_INVALID, opaque, "Invalid arguments");
+        return total;
+    }
+
+    flush_gets(w, c);
+    switch (op) {
+        case OP_SET: case OP_SETQ:
+            if (extlen != 8 || !keylen || keylen > MAX_KEY) {
+                bin_error(c, op, ST_INVALID, opaque, "Invalid arguments");
+            } else if (vlen > MAX_VALUE) {
+                bin_error(c, op, ST_TOO_LARGE, opaque, "Too large");
+            } else {
+                store(w, key, keylen, item_new(get32(h + BIN_HEADER), val, vlen));
+                if (op == OP_SET) bin_respond(c, op, ST_OK, opaque, null, null, 0, null, 0);
+            }
+            return total;
+        case OP_DELETE: case OP_DELETEQ:
+            if (extlen || !keylen || keylen > MAX_KEY || vlen) {
+                bin_error(c, op, ST_INVALID, opaque, "Invalid arguments");
+            } else if (!store(w, key, keylen, null)) {
+                bin_error(c, op, ST_NOT_FOUND, opaque, "Not found");
+            } else if (op == OP_DELETE) {
+                bin_respond(c, op, ST_OK, opaque, null, null, 0, null, 0);
+            }
+            return total;
+        case OP_NOOP:
+            bin_respond(c, op, ST_OK, opaque, null, null, 0, null, 0);
+            return total;
+        case OP_QUIT: case OP_QUITQ:
+            if (op == OP_QUIT) bin_respond(c, op, ST_OK, opaque, null, null, 0, null, 0);
+            c->closing = 1;
+            return total;
+    }
+    bin_error(c, op, ST_UNKNOWN, opaque, "Unknown command");
+    return total;
+}
+
+// handle all complete requests in the receive buffer, keeping what is left of an incomplete one
+static void conn_process(worker *w, conn *c) {
+    char *p = c->in, *end = c->in + c->inlen;
+    if (c->binary < 0) c->binary = (unsigned char)*p == BIN_REQUEST;
+    while (p < end && !c->closing) {
+        long n = c->binary? binary_request(w, c, p, end) : text_request(w, c, p, end);
+        if (n < 0) { c->closing = 1; break; }
+        if (!n) break;
+        w->requests++;
+        p += n;
+    }
+    flush_gets(w, c); // the keys point into the buffer, look them up before moving it
+    c->inlen = end - p;
+    memmove(c->in, p, c->inlen);
+}
+
+
+// ** connections **
+
+static void conn_close(worker *w, conn *c) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, null);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void conn_watch(worker *w, conn *c, int writing) {
+    struct epoll_event ev = { .events = writing? EPOLLOUT : EPOLLIN, .data.ptr = c };
+    c->writing = writing;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// write what we can; a connection that cannot take it all stops reading until it does, so slow readers push back
+static int conn_flush(worker *w, conn *c) {
+    while (c->outoff < c->outlen) {
+        ssize_t n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        c->outoff += n;
+    }
+    if (c->outoff < c->outlen) {
+        if (!c->writing) conn_watch(w, c, 1);
+        return 0;
+    }
+    c->outoff = c->outlen = 0;
+    if (c->writing) conn_watch(w, c, 0);
+    return 0;
+}
+
+static void conn_event(worker *w, conn *c, unsigned int events) {
+    if (events & EPOLLIN) {
+        if (c->incap - 1 == c->inlen) {
+            // a single request does not fit, it must be a large set
+            if (c->incap > 2 * (MAX_VALUE + MAX_LINE)) { conn_close(w, c); return; }
+            c->incap *= 2;
+            c->in = realloc(c->in, c->incap);
+        }
+        ssize_t n = recv(c->fd, c->in + c->inlen, c->incap - 1 - c->inlen, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) { conn_close(w, c); return; }
+        if (n > 0) {
+            c->inlen += n;
+            conn_process(w, c);
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(w, c);
+        return;
+    }
+    if (conn_flush(w, c) < 0 || (c->closing && c->outoff == c->outlen)) conn_close(w, c);
+}
+
+static void accept_all(worker *w) {
+    while (1) {
+        int fd = accept4(listener, null, null, SOCK_NONBLOCK);
+        if (fd < 0) return; // another worker took it, or nothing left
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on unix sockets
+        conn *c = calloc(1, sizeof(conn));
+        c->fd = fd;
+        c->binary = -1;
+        c->incap = IN_SIZE;
+        c->in = malloc(c->incap);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void * worker_run(void *arg) {
+    worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopping) {
+        w->epoch = QUIESCENT;
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, 200);
+        w->epoch = epoch;
+        AO_nop_full(); // announce the epoch before reading any item
+        for (int i = 0; i < n; i++) {
+            if (!events[i].data.ptr) accept_all(w);
+            else conn_event(w, events[i].data.ptr, events[i].events);
+        }
+        if (w->nlimbo >= LIMBO_BATCH) reclaim(w);
+    }
+    w->epoch = QUIESCENT;
+    return null;
+}
+
+
+// ** setup **
+
+static int listen_on(const char *address) {
+    int fd;
+    if (!strncmp(address, "unix:", 5)) {
+        struct sockaddr_un un = { .sun_family = AF_UNIX };
+        if (strlen(address + 5) >= sizeof(un.sun_path)) return -1;
+        strcpy(un.sun_path, address + 5);
+        unlink(un.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0) return -1;
+    } else {
+        const char *colon = strrchr(address, ':');
+        if (!colon) return -1;
+        char host[256];
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE }, *ai;
+        if (getaddrinfo(host[0]? host : null, colon + 1, &hints, &ai)) return -1;
+        fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        int ok = fd >= 0 && bind(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        freeaddrinfo(ai);
+        if (!ok) return -1;
+    }
+    if (listen(fd, 1024) < 0) return -1;
+    return fd;
+}
+
+static void on_stop(int sig) { stopping = 1; }
+
+int main(int argc, char **argv) {
+    const char *address = null;
+    int threads = 0, front_coded = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f")) front_coded = 1;
+        else if (!address) address = argv[i];
+        else threads = atoi(argv[i]);
+    }
+    if (!address) {
+        fprintf(stderr, "usage: %s address [threads] [-f]\n", argv[0]);
+        return 1;
+    }
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+
+    listener = listen_on(address);
+    if (listener < 0) {
+        fprintf(stderr, "cannot listen on %s: %s\n", address, strerror(errno));
+        return 1;
+    }
+    map = hashmap_new(keyequals, makehash, free);
+    if (front_coded) hashmap_set_front_coded(map);
+
+    signal(SIGINT, on_stop);
+    signal(SIGTERM, on_stop);
+    nworkers = threads;
+    workers = calloc(nworkers, sizeof(worker));
+    for (int i = 0; i < nworkers; i++) {
+        worker *w = &workers[i];
+        w->epoch = QUIESCENT;
+        w->epfd = epoll_create1(0);
+        // every worker watches the listener, exclusive wakes one of them per connection
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = null };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, listener, &ev) < 0) fatal("epoll: %s", strerror(errno));
+    }
+    for (int i = 0; i < nworkers; i++) pthread_create(&workers[i].thread, null, worker_run, &workers[i]);
+    print("serving %s with %d threads%s", address, nworkers, front_coded? ", front coded keys" : "");
+
+    while (!stopping) pause();
+
+    long requests = 0;
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, null);
+        requests += workers[i].requests;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        reclaim(&workers[i]); // all quiescent now
+        close(workers[i].epfd);
+    }
+    print("served %ld requests, %ld items", requests, hashmap_size(map));
+    close(listener);
+    if (!strncmp(address, "unix:", 5)) unlink(address + 5);
+
+    // nothing uses the map anymore, free the items still in it
+    header *kvs = getkvs(map);
+    for (unsigned long i = 0; i < kvs->len; i++) {
+        void *v = getval(_load(kvs, i));
+        if (v && v != SIZED) free(v);
+    }
+    hashmap_free(map);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include "nbhashmap.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+using namespace nbhashmap;
+
+// built by the compiler; nothing runs at startup
+static constexpr StaticMap<int, 5, StringKeys> commands({{
+    {"get", 1}, {"set", 2}, {"delete", 3}, {"quit", 4}, {"stats", 5},
+}});
+static_assert(commands.get("get") == 1 && commands.get("stats") == 5);
+static_assert(commands.get("gets") == 0 && commands.find("") == nullptr);
+static_assert(commands.capacity == 16);
+
+static constexpr StaticMap<long, 4> squares({{ {1, 1}, {2, 4}, {3, 9}, {1000000007, 7} }});
+static_assert(squares.get(3) == 9 && squares.get(1000000007) == 7 && squares.get(4, -1) == -1);
+
+// the same hashes as the C side
+static_assert(murmurhash2a("hello world", 11) != murmurhash2a("hello worle", 11));
+static_assert(int_hash(0) == 0);
+
+static PromotingMap<int, 5, StringKeys> routes(commands);
+static PromotingMap<long, 4> numbers(squares);
+static PromotingMap<long, 2> cubes(StaticMap<long, 2>({{ {2, 8}, {3, 27} }}));
+
+static void test_static() {
+    // lookups at run time, on a table only the compiler wrote
+    const char *names[] = { "get", "set", "delete", "quit", "stats", "flush_all" };
+    for (int i = 0; i < 6; i++) assert(commands.get(names[i]) == (i < 5? i + 1 : 0));
+    int seen = 0;
+    commands.each([&](std::string_view, int v) { seen += v; });
+    assert(seen == 15);
+}
+
+static void test_promote() {
+    assert(!routes.promoted());
+    assert(routes.get("delete") == 3);
+    assert(routes.put("touch", 6) == 0);
+    assert(routes.promoted());
+    assert(routes.get("touch") == 6 && routes.get("stats") == 5);
+    assert(routes.putif("get", 7, 2) == 1 && routes.get("get") == 1);
+    assert(routes.putif("get", 7, 1) == 1 && routes.get("get") == 7);
+    assert(routes.remove("quit") == 4 && routes.get("quit") == 0);
+    assert(hashmap_size(routes.map()) == 5);
+
+    // built from a temporary, it reads its own copy
+    assert(cubes.get(3) == 27 && cubes.get(4) == 0 && !cubes.promoted());
+
+    // racing first writes all land in the one map
+    std::vector<std::thread> threads;
+    for (long t = 0; t < 4; t++) {
+        threads.emplace_back([t] {
+            for (long k = 1; k <= 1000; k++) if (k % 4 == t) numbers.put(100 + k, k);
+        });
+    }
+    for (std::thread &t : threads) t.join();
+    assert(numbers.get(2) == 4 && numbers.get(1000000007) == 7);
+    for (long k = 1; k <= 1000; k++) assert(numbers.get(100 + k) == k);
+    assert(hashmap_size(numbers.map()) == 1004);
+}
+
+int main(int argc, char **argv) {
+    test_static();
+    test_promote();
+    std::printf("ok\n");
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "nbhashmap.c"
+#include "murmurhash.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,33 +14,6 @@
 #define WRAP    200000
 
 // good hash function is essential; this is murmurhash2a
-#define mmix(h,k) { k *= m; k ^= k >> r; k *= m; h *= m; h ^= k; }
-static unsigned int murmurhash2a(const void * key, int len) {
-    const unsigned int seed = 33;
-    const unsigned int m = 0x5bd1e995;
-    const int r = 24;
-    unsigned int l = len;
-    const unsigned char * data = (const unsigned char *)key;
-    unsigned int h = seed;
-    while(len >= 4) {
-        unsigned int k = *(unsigned int*)data;
-        mmix(h,k);
-        data += 4;
-        len -= 4;
-    }
-    unsigned int t = 0;
-    switch(len) {
-        case 3: t ^= data[2] << 16;
-        case 2: t ^= data[1] << 8;
-        case 1: t ^= data[0];
-    }
-    mmix(h,t);
-    mmix(h,l);
-    h ^= h >> 13;
-    h *= m;
-    h ^= h >> 15;
-    return h;
-}
 static unsigned int makehash(void *key) { return murmurhash2a(key, strlen(key)); }
 
 static int equals(const char *left, const char *right) {
@@ -179,6 +153,1523 @@ void * tester(void *data) {
     return null;
 }
 
+static volatile long evicted = 0;
+static void countevict(void *val) { evicted++; }
+
+void test_cache() {
+    print("testing cache...");
+    HashMap *cache = hashmap_new(keyequals, makehash, free);
+    hashmap_set_cache(cache, 100, countevict);
+
+    char buf[100];
+    for (int i = 0; i < 100; i++) {
+        snprintf(buf, 100, "hot-%d", i);
+        hashmap_putif(cache, strdup(buf), "hot", IGNORE);
+        for (int j = 0; j < 5; j++) hashmap_get(cache, buf);
+    }
+    assert(hashmap_size(cache) == 100);
+
+    // a scan of keys seen only once must not push out the hot keys
+    long rejected = 0;
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, 100, "hot-%d", i % 100);
+        hashmap_get(cache, buf);
+        snprintf(buf, 100, "scan-%d", i);
+        hashmap_get(cache, buf);
+        void *res = hashmap_putif(cache, strdup(buf), "scan", IGNORE);
+        assert(res == null || res == REJECTED);
+        if (res == REJECTED) rejected++;
+    }
+    int hot = 0;
+    for (int i = 0; i < 100; i++) {
+        snprintf(buf, 100, "hot-%d", i);
+        if (hashmap_get(cache, buf)) hot++;
+    }
+    print("cache: %ld, hot: %d, evicted: %ld, rejected: %ld", hashmap_size(cache), hot, evicted, rejected);
+    assert(hashmap_size(cache) <= 100);
+    assert(hot >= 90);
+    assert(rejected > 0);
+    assert(evicted + rejected >= 9900); // every scan insert either got rejected, or evicted another
+
+    // updates of cached keys are never rejected
+    for (int i = 0; i < 100; i++) {
+        snprintf(buf, 100, "hot-%d", i);
+        if (hashmap_get(cache, buf)) { assert(hashmap_putif(cache, strdup(buf), "hotter", IGNORE) != REJECTED); break; }
+    }
+    hashmap_free(cache);
+}
+
+// integer keys, with hash functions of our choosing
+static int intequals(void *l, void *r) { return l == r; }
+static void intfree(void *key) { }
+
+// keys chosen to share the low bits of their hash, like a client that knows the hash function could
+static unsigned int clusterhash(void *key) { return (unsigned int)(long)key << 10; }
+
+static void sumbytes(HashMap *map, unsigned long bytes, void *data) { *(unsigned long *)data += bytes; }
+
+void test_budget() {
+    print("testing budget...");
+    HashBudget *budget = hashbudget_new(64 * 1024);
+    HashMap *m1 = hashmap_new(keyequals, makehash, free);
+    HashMap *m2 = hashmap_new(keyequals, makehash, free);
+    hashmap_set_budget(m1, budget);
+    hashmap_set_budget(m2, budget);
+
+    char buf[100];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(buf, 100, "m1-%d", i);
+        hashmap_putif(m1, strdup(buf), "v", IGNORE);
+    }
+    // over budget; constantly adding and removing must not grow the table
+    for (int i = 0; i < 400; i++) {
+        snprintf(buf, 100, "m2-live-%d", i);
+        hashmap_putif(m2, strdup(buf), "v", IGNORE);
+    }
+    unsigned long before = getkvs(m2)->len;
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, 100, "m2-%d", i);
+        hashmap_putif(m2, strdup(buf), "v", IGNORE);
+        hashmap_putif(m2, strdup(buf), null, IGNORE);
+    }
+    unsigned long total = 0;
+    hashbudget_foreach(budget, sumbytes, &total);
+    hashbudget_debug(budget);
+    assert(total == hashbudget_used(budget));
+    assert(total == hashmap_memory(m1) + hashmap_memory(m2));
+    assert(budget->_deferred > 0);
+    assert(getkvs(m2)->len == before);
+
+    hashmap_free(m1);
+    assert(hashbudget_used(budget) == hashmap_memory(m2));
+    hashmap_free(m2);
+    assert(hashbudget_used(budget) == 0);
+    hashbudget_free(budget);
+
+    // clustered keys in a sparse table, without deletes: there is no garbage to compact, so the table must grow
+    budget = hashbudget_new(1);
+    HashMap *m = hashmap_new(intequals, clusterhash, intfree);
+    hashmap_set_budget(m, budget);
+    for (long i = 1; i <= 300; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    assert(hashmap_size(m) == 300);
+    assert(budget->_overruns > 0);
+    hashmap_free(m);
+    hashbudget_free(budget);
+}
+
+static void write_file(const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+    assert(f);
+    fputs(text, f);
+    fclose(f);
+}
+
+void test_pressure() {
+    print("testing memory pressure...");
+    HashBudget *budget = hashbudget_new(1024 * 1024 * 1024);
+    HashMap *m = hashmap_new(keyequals, makehash, free);
+    hashmap_set_budget(m, budget);
+
+    char buf[100];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(buf, 100, "p-%d", i);
+        hashmap_putif(m, strdup(buf), "v", IGNORE);
+    }
+    for (int i = 100; i < 20000; i++) {
+        snprintf(buf, 100, "p-%d", i);
+        hashmap_putif(m, strdup(buf), null, IGNORE);
+    }
+    unsigned long len = getkvs(m)->len;
+    assert(getkvs(m)->prev);
+
+    // a fake cgroup; going over memory.high must shrink the map, and free its retired tables
+    char dir[] = "/tmp/nbhashmap-XXXXXX";
+    assert(mkdtemp(dir));
+    snprintf(buf, 100, "%s/memory.events", dir);
+    write_file(buf, "low 0\nhigh 0\nmax 0\noom 0\n");
+    assert(hashmap_pressure_watch(dir, 10) == 0);
+    usleep(100000); // the watcher reads memory.events first
+    write_file(buf, "low 0\nhigh 1\nmax 0\noom 0\n");
+    for (int i = 0; i < 100 && getkvs(m)->len == len; i++) usleep(10000);
+    hashmap_pressure_unwatch();
+    print("pressure: %lu -> %lu", len, getkvs(m)->len);
+    assert(getkvs(m)->len <= len / 8);
+    assert(hashmap_size(m) == 100);
+    for (int i = 0; i < 100; i++) {
+        snprintf(buf, 100, "p-%d", i);
+        assert(hashmap_get(m, buf));
+    }
+    // pressure or not, retired tables are kept for the grace period; a reader might still be in them
+    hashmap_on_memory_pressure(HASHMAP_PRESSURE_MODERATE);
+    assert(getkvs(m)->prev && getkvs(m)->prev->prev);
+
+    unlink(buf);
+    rmdir(dir);
+    hashmap_free(m);
+    hashbudget_free(budget);
+}
+
+static void check_layout(int layout) {
+    HashMap *m = hashmap_new(keyequals, makehash, free);
+    hashmap_set_layout(m, layout);
+    char buf[100];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(buf, 100, "l-%d", i);
+        hashmap_putif(m, strdup(buf), (void *)(long)(i + 1), IGNORE);
+        if (i % 3 == 0) hashmap_putif(m, strdup(buf), null, IGNORE);
+    }
+    assert(hashmap_layout(m, null) == layout);
+    for (int i = 0; i < 5000; i++) {
+        snprintf(buf, 100, "l-%d", i);
+        void *expect = (i % 3 == 0)? null : (void *)(long)(i + 1);
+        assert(hashmap_get(m, buf) == expect);
+    }
+    assert(hashmap_get(m, "l-none") == null);
+    hashmap_free(m);
+}
+
+void test_layouts() {
+    print("testing layouts...");
+    check_layout(HASHMAP_LAYOUT_PLAIN);
+    check_layout(HASHMAP_LAYOUT_FINGERPRINT);
+    check_layout(HASHMAP_LAYOUT_COMPACT);
+
+    // an adaptive map follows the workload
+    HashMap *m = hashmap_new(keyequals, makehash, free);
+    hashmap_set_layout(m, HASHMAP_LAYOUT_ADAPTIVE);
+    char buf[100];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, 100, "a-%d", i);
+        hashmap_putif(m, strdup(buf), "v", IGNORE);
+    }
+    const char *reason;
+    assert(hashmap_adapt(m) == HASHMAP_LAYOUT_PLAIN);
+    for (int i = 0; i < 100000; i++) {
+        snprintf(buf, 100, "a-%d", i % 20000);
+        hashmap_get(m, buf);
+    }
+    assert(hashmap_adapt(m) == HASHMAP_LAYOUT_FINGERPRINT);
+    hashmap_layout(m, &reason);
+    print("adapted: %s", reason);
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, 100, "a-%d", i);
+        assert(hashmap_get(m, buf));
+    }
+
+    // running out of budget
+    HashBudget *budget = hashbudget_new(hashmap_memory(m) * 5 / 4);
+    hashmap_set_budget(m, budget);
+    assert(hashmap_adapt(m) == HASHMAP_LAYOUT_COMPACT);
+    hashmap_layout(m, &reason);
+    print("adapted: %s", reason);
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, 100, "a-%d", i);
+        assert(hashmap_get(m, buf));
+    }
+    hashmap_free(m);
+    hashbudget_free(budget);
+}
+
+static void checkorder(void *key, void *val, void *data) {
+    unsigned long *last = data;
+    assert((unsigned long)key > *last);
+    assert(val == key);
+    *last = (unsigned long)key;
+}
+
+static void * orderhammer(void *data) {
+    HashMap *m = data;
+    for (int round = 0; round < 20; round++) {
+        for (long i = 1; i < 2000; i++) {
+            long k = 10000 + (fast_random() % 5000);
+            hashmap_putif(m, (void *)k, (i % 2)? (void *)k : null, IGNORE);
+        }
+    }
+    return null;
+}
+
+void test_ordered() {
+    print("testing ordered...");
+    HashMap *m = hashmap_new(null, null, null);
+    hashmap_set_ordered(m);
+    for (long i = 1; i <= 10000; i++) hashmap_putif(m, (void *)(i * 3), (void *)(i * 3), IGNORE);
+    for (long i = 1; i <= 10000; i += 2) hashmap_putif(m, (void *)(i * 3), null, IGNORE);
+    assert(hashmap_get(m, (void *)30) == (void *)30);
+    assert(m->index->_nodes == 5000); // deletes leave the index right away
+
+    unsigned long last = 0;
+    assert(hashmap_range(m, 0, 100000, checkorder, &last) == 5000);
+    assert(last == 30000);
+    assert(hashmap_range(m, 300, 600, null, null) == 50);
+    assert(hashmap_range(m, 301, 307, null, null) == 1);
+
+    // concurrent inserts and deletes, with resizes dropping deleted keys from the index
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) pthread_create(&threads[i], null, orderhammer, m);
+    for (int i = 0; i < 100; i++) {
+        last = 0;
+        hashmap_range(m, 0, 1000000, checkorder, &last);
+    }
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], null);
+    assert(hashmap_range(m, 1, 10000, null, null) == 1666);
+    assert(hashmap_range(m, 0, 1000000, null, null) == hashmap_size(m));
+    assert(m->index->_nodes == hashmap_size(m));
+
+    // deleting and inserting the same key over and over retires the table before its removed nodes pile up
+    for (int i = 0; i < 100000; i++) {
+        hashmap_putif(m, (void *)3, null, IGNORE);
+        hashmap_putif(m, (void *)3, (void *)3, IGNORE);
+    }
+    assert(getkvs(m)->_ngarbage <= getkvs(m)->len);
+    assert(m->index->_nodes == hashmap_size(m));
+    hashmap_free(m);
+
+    // evicting from an ordered cache removes the key from the index
+    m = hashmap_new(null, null, null);
+    hashmap_set_ordered(m);
+    hashmap_set_cache(m, 100, null);
+    for (long i = 1; i <= 1000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    assert(m->index->_nodes == hashmap_size(m));
+    hashmap_free(m);
+}
+
+static unsigned int lowbitshash(void *key) { return (unsigned int)(unsigned long)key << 12; }
+
+void test_analyze() {
+    print("testing analyze...");
+    HashMap *m = hashmap_new(null, null, null);
+    for (long i = 1; i <= 1000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    for (long i = 1; i <= 100; i++) hashmap_putif(m, (void *)i, null, IGNORE);
+
+    HashAnalysis a;
+    hashmap_analyze(m, &a);
+    assert(a.keys == 900);
+    long n = 0;
+    for (int i = 0; i < HASHMAP_ANALYSIS_PROBES; i++) n += a.probes[i];
+    assert(n == a.keys + a.garbage);
+    assert(a.duplicate_hashes == 0);
+    assert(a.recommended_len >= 1024);
+    hashmap_free(m);
+
+    // a hash that leaves the low bits empty: every key has the same home slot in small tables
+    void *keys[1000];
+    for (long i = 0; i < 1000; i++) keys[i] = (void *)(i + 1);
+    hashmap_analyze_keys(lowbitshash, keys, 1000, &a);
+    assert(a.keys == 1000);
+    assert(a.reprobe_hits[0] > a.mixed_reprobe_hits[0]);
+    assert(strstr(a.recommendation, "low bits"));
+}
+
+// a pretend collector: keys with an odd number are dead
+static int weakalive(void *key, void *data) {
+    if (atoi((char *)key + 2) & 1) { AO_fetch_and_add1((AO_t *)data); return 0; }
+    return 1;
+}
+static void weakroot(void *key, void *val, void *data) {
+    assert(key == null);
+    AO_fetch_and_add1((AO_t *)data);
+}
+
+typedef struct { HashMap *map; volatile AO_t block; volatile AO_t count; int clear; } collector;
+static void * collect(void *data) {
+    collector *c = data;
+    long blocks = hashmap_gc_blocks(c->map);
+    while (1) {
+        long b = AO_fetch_and_add1(&c->block);
+        if (b >= blocks) break;
+        if (c->clear) hashmap_gc_clear(c->map, b, weakalive, (void *)&c->count);
+        else hashmap_gc_scan(c->map, b, weakroot, (void *)&c->count);
+    }
+    return null;
+}
+
+void test_weak() {
+    print("testing weak...");
+    HashMap *m = hashmap_new(keyequals, makehash, free);
+    hashmap_set_weak(m);
+    char buf[100];
+    char **keys = malloc(sizeof(char *) * 20000);
+    for (int i = 0; i < 20000; i++) {
+        snprintf(buf, 100, "w-%d", i);
+        keys[i] = strdup(buf);
+        hashmap_putif(m, keys[i], "v", IGNORE);
+    }
+    assert(hashmap_gc_blocks(m) > 1);
+
+    // parallel root scan, then parallel clear
+    collector c = { m, 0, 0, 0 };
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) pthread_create(&threads[i], null, collect, &c);
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], null);
+    assert(c.count == 20000);
+    c.block = 0; c.count = 0; c.clear = 1;
+    for (int i = 0; i < 4; i++) pthread_create(&threads[i], null, collect, &c);
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], null);
+    assert(c.count == 10000);
+    assert(hashmap_size(m) == 10000);
+
+    // the collector frees dead keys; the map must never look at them again
+    for (int i = 1; i < 20000; i += 2) { memset(keys[i], 'x', strlen(keys[i])); free(keys[i]); }
+    snprintf(buf, 100, "w-%d", 41);
+    assert(hashmap_get(m, buf) == null);
+    snprintf(buf, 100, "w-%d", 42);
+    assert(hashmap_get(m, buf) != null);
+    hashmap_putif(m, strdup("w-41"), "again", IGNORE);
+    assert(hashmap_get(m, "w-41") == (void *)"again");
+
+    // a resize drops the cleared slots
+    hashmap_compact(m);
+    HashAnalysis a;
+    hashmap_analyze(m, &a);
+    assert(a.garbage == 0);
+    assert(a.keys == 10001);
+    hashmap_free(m);
+    free(keys);
+}
+
+static void * handlehammer(void *data) {
+    HashMap *m = data;
+    HashHandle h;
+    assert(hashmap_pin(m, "counter", &h));
+    for (int i = 0; i < 20000; i++) {
+        while (1) {
+            void *v = hashmap_handle_get(&h);
+            if (v == IGNORE) fatal("counter dropped");
+            if (hashmap_handle_cas(&h, (void *)((long)v + 1), v) == v) break;
+        }
+    }
+    return null;
+}
+
+static void * handleresizer(void *data) {
+    HashMap *m = data;
+    char buf[100];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(buf, 100, "r-%d", i);
+        hashmap_putif(m, strdup(buf), "r", IGNORE);
+        if (i % 3 == 0) hashmap_putif(m, strdup(buf), null, IGNORE);
+    }
+    return null;
+}
+
+// string keys that share their home slot, but not their hash
+static unsigned int homehash(void *key) { return (unsigned int)*(char *)key << 16; }
+
+void test_handles() {
+    print("testing handles...");
+    HashMap *m = hashmap_new(keyequals, makehash, free);
+    HashHandle h;
+    assert(!hashmap_pin(m, "a", &h));
+    hashmap_putif(m, strdup("a"), "1", IGNORE);
+    assert(hashmap_pin(m, "a", &h));
+    assert(hashmap_handle_cas(&h, "2", "1") == (void *)"1");
+    assert(hashmap_handle_cas(&h, "3", "1") == (void *)"2");
+    assert(hashmap_handle_get(&h) == (void *)"2");
+
+    // deleting through a handle keeps the slot, until a resize drops it
+    assert(hashmap_handle_cas(&h, null, IGNORE) == (void *)"2");
+    assert(hashmap_size(m) == 0);
+    assert(hashmap_handle_cas(&h, "4", null) == null);
+    assert(hashmap_size(m) == 1);
+    assert(hashmap_handle_cas(&h, null, IGNORE) == (void *)"4");
+    hashmap_compact(m);
+    assert(hashmap_handle_get(&h) == IGNORE);
+    assert(hashmap_handle_cas(&h, "5", IGNORE) == IGNORE);
+    assert(!hashmap_pin(m, "a", &h));
+
+    // a resize drops a deleted mapping and frees its key; a new key at the same address is not the pinned mapping
+    char key[2] = "x";
+    HashMap *reused = hashmap_new(keyequals, homehash, intfree);
+    hashmap_putif(reused, key, "1", IGNORE);
+    assert(hashmap_pin(reused, "x", &h));
+    hashmap_putif(reused, key, null, IGNORE);
+    hashmap_compact(reused);
+    key[0] = 'y';
+    hashmap_putif(reused, key, "2", IGNORE);
+    assert(hashmap_handle_get(&h) == IGNORE);
+    assert(hashmap_handle_cas(&h, "3", IGNORE) == IGNORE);
+    assert(hashmap_get(reused, "y") == (void *)"2");
+    hashmap_free(reused);
+
+    // concurrent increments through handles, while resizes move the counter around
+    hashmap_putif(m, strdup("counter"), (void *)1, IGNORE);
+    pthread_t threads[4];
+    for (int i = 0; i < 3; i++) pthread_create(&threads[i], null, handlehammer, m);
+    pthread_create(&threads[3], null, handleresizer, m);
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], null);
+    assert(hashmap_get(m, "counter") == (void *)(1 + 3 * 20000));
+    hashmap_free(m);
+}
+
+static void * samplehammer(void *data) {
+    HashMap *m = data;
+    for (long i = 1; i < 200000; i++) {
+        hashmap_putif(m, (void *)(100000 + i), (void *)i, IGNORE);
+        if (i % 4) hashmap_putif(m, (void *)(100000 + i), null, IGNORE);
+    }
+    return null;
+}
+
+void test_sample() {
+    print("testing sample...");
+    HashMap *m = hashmap_new(null, null, null);
+    hashmap_set_sampled(m);
+    void *out[2 * 1000];
+    assert(hashmap_sample(m, 10, out) == 0);
+    for (long i = 1; i <= 10000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    for (long i = 1; i <= 10000; i++) if (i % 100) hashmap_putif(m, (void *)i, null, IGNORE);
+    assert(hashmap_size(m) == 100);
+
+    // the live bits and counts add up
+    header *kvs = getkvs(m);
+    unsigned long groups = (kvs->len + LIVE_GROUP - 1) / LIVE_GROUP;
+    long live = 0, counted = 0;
+    for (unsigned long g = 0; g < groups; g++) live += __builtin_popcountl(kvs->live[g]);
+    for (unsigned long g = 0; g < (kvs->len + LIVE_SUPER - 1) / LIVE_SUPER; g++) counted += kvs->live[groups + g];
+    assert(live == 100);
+    assert(counted == 100);
+
+    // sparse, but every mapping gets sampled
+    int seen[101] = {0};
+    for (int r = 0; r < 100; r++) {
+        assert(hashmap_sample(m, 1000, out) == 1000);
+        for (int i = 0; i < 1000; i++) {
+            assert(out[2 * i] == out[2 * i + 1]);
+            long k = (long)out[2 * i];
+            assert(k / 100 * 100 == k);
+            seen[k / 100]++;
+        }
+    }
+    for (int i = 1; i <= 100; i++) assert(seen[i] > 0);
+
+    // while other threads insert, delete and resize
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) pthread_create(&threads[i], null, samplehammer, m);
+    for (int r = 0; r < 2000; r++) {
+        long n = hashmap_sample(m, 100, out);
+        assert(n == 100);
+        for (int i = 0; i < n; i++) assert(out[2 * i + 1] && out[2 * i + 1] != SIZED);
+    }
+    for (int i = 0; i < 2; i++) pthread_join(threads[i], null);
+    hashmap_free(m);
+
+    // without live counts it still works
+    m = hashmap_new(null, null, null);
+    hashmap_putif(m, (void *)7, (void *)8, IGNORE);
+    assert(hashmap_sample(m, 3, out) == 3);
+    assert(out[4] == (void *)7);
+    hashmap_free(m);
+}
+
+static volatile AO_t windowfrees = 0;
+static void windowfree(void *key) { AO_fetch_and_add1(&windowfrees); free(key); }
+
+static volatile int windowstop = 0;
+static void * windowhammer(void *data) {
+    HashMap *m = data;
+    long n = 0;
+    while (!windowstop) {
+        void *key = (void *)(1 + (long)(fast_random() & 1023));
+        while (1) {
+            void *v = hashmap_get(m, key);
+            if (hashmap_putif(m, key, (void *)((long)v + 1), v) == v) break;
+        }
+        void *prev;
+        long cur = (long)hashmap_get_window(m, key, &prev);
+        assert(cur >= 0 && (long)prev >= 0);
+        n++;
+    }
+    return (void *)n;
+}
+
+void test_window() {
+    print("testing window...");
+    HashMap *m = hashmap_new(null, null, null);
+    void *prev;
+    for (long i = 1; i <= 1000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    hashmap_rotate(m);
+    assert(hashmap_size(m) == 0);
+    assert(hashmap_get(m, (void *)5) == null);
+    assert(hashmap_get_window(m, (void *)5, &prev) == null && prev == (void *)5);
+    for (long i = 1; i <= 10; i++) hashmap_putif(m, (void *)i, (void *)(i * 2), IGNORE);
+    for (long i = 2000; i <= 10000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE); // resize, keep the window
+    assert(hashmap_get_window(m, (void *)5, &prev) == (void *)10 && prev == (void *)5);
+    hashmap_rotate(m);
+    assert(hashmap_get_window(m, (void *)5, &prev) == null && prev == (void *)10);
+    assert(hashmap_get_window(m, (void *)500, &prev) == null && prev == null);
+
+    // counting in windows while rotating
+    pthread_t threads[3];
+    for (int i = 0; i < 3; i++) pthread_create(&threads[i], null, windowhammer, m);
+    for (int i = 0; i < 50; i++) { usleep(2000); hashmap_rotate(m); }
+    windowstop = 1;
+    long n = 0;
+    for (int i = 0; i < 3; i++) { void *r; pthread_join(threads[i], &r); n += (long)r; }
+    long total = 0;
+    for (long i = 1; i <= 1024; i++) total += (long)hashmap_get_window(m, (void *)i, &prev) + (long)prev;
+    print("window: %ld increments, %ld in the last two windows", n, total);
+    assert(total <= n);
+    long live = 0;
+    for (long i = 1; i <= 1024; i++) live += hashmap_get(m, (void *)i) != null;
+    assert(hashmap_size(m) >= live); // a rotation never takes inserts into the new generation off the size
+    hashmap_free(m);
+
+    // dropped generations still own their keys
+    m = hashmap_new(keyequals, makehash, windowfree);
+    char buf[100];
+    for (int g = 0; g < 3; g++) {
+        for (int i = 0; i < 100; i++) {
+            snprintf(buf, 100, "key-%d", i);
+            hashmap_putif(m, strdup(buf), "v", IGNORE);
+        }
+        hashmap_rotate(m);
+    }
+    assert(windowfrees == 0);
+    hashmap_free(m);
+    assert(windowfrees == 300);
+}
+
+static void * addcount(void *val, void *arg) { return (void *)((long)val + (long)arg); }
+
+typedef struct { HashDelegate *d; int client; } delegatearg;
+static void * delegatehammer(void *data) {
+    delegatearg *a = data;
+    for (long i = 0; i < 20000; i++) {
+        hashdelegate_update(a->d, a->client, (void *)(1 + i % 16), addcount, (void *)1);
+        if (a->client == 0) hashdelegate_put(a->d, a->client, (void *)100, (void *)(i + 1));
+    }
+    hashdelegate_flush(a->d, a->client);
+    return null;
+}
+
+void test_delegate() {
+    print("testing delegate...");
+    HashMap *m = hashmap_new(null, null, null);
+    HashDelegate *d = hashdelegate_new(m, 3, 4);
+    delegatearg args[4];
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        args[i].d = d; args[i].client = i;
+        pthread_create(&threads[i], null, delegatehammer, &args[i]);
+    }
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], null);
+    long total = 0;
+    for (long k = 1; k <= 16; k++) total += (long)hashmap_get(m, (void *)k);
+    assert(total == 4 * 20000);
+    assert(hashmap_get(m, (void *)100) == (void *)20000); // in order of one client
+
+    // owners park when idle, and sending wakes them
+    assert(hashdelegate_pin(d, 1) == 0);
+    usleep(100000);
+    hashdelegate_put(d, 0, (void *)2000, (void *)1);
+    hashdelegate_flush(d, 0);
+    assert(hashmap_get(m, (void *)2000) == (void *)1);
+
+    // free applies what is still pending
+    for (long k = 1000; k < 1100; k++) hashdelegate_put(d, 0, (void *)k, (void *)k);
+    hashdelegate_free(d);
+    assert(hashmap_size(m) == 118);
+    hashmap_free(m);
+}
+
+static volatile AO_t teardownfrees = 0;
+static void teardownfree(void *key) { AO_fetch_and_add1(&teardownfrees); free(key); }
+
+static HashMap * teardownmap(char **keys) {
+    HashMap *m = hashmap_new(keyequals, makehash, teardownfree);
+    char buf[100];
+    for (int i = 0; i < 100000; i++) {
+        snprintf(buf, 100, "t-%d", i);
+        if (keys) keys[i] = strdup(buf);
+        hashmap_putif(m, keys? keys[i] : strdup(buf), "v", IGNORE);
+    }
+    if (!keys) for (int i = 0; i < 50000; i++) { // some garbage, and a retired table
+        snprintf(buf, 100, "t-%d", i);
+        hashmap_putif(m, strdup(buf), null, IGNORE);
+    }
+    hashmap_compact(m);
+    return m;
+}
+
+void test_teardown() {
+    print("testing teardown...");
+    HashMap *m = teardownmap(null);
+    assert(getkvs(m)->mapped);
+    teardownfrees = 0;
+    hashmap_free_parallel(m, 4);
+    assert(teardownfrees == 100000); // the keys, and the garbage keys dropped by the compaction, with its old table
+
+    // bulk keys are free'd by the user
+    char **keys = malloc(sizeof(char *) * 100000);
+    m = teardownmap(keys);
+    hashmap_set_bulk_keys(m);
+    teardownfrees = 0;
+    hashmap_free(m);
+    assert(teardownfrees == 0);
+    for (int i = 0; i < 100000; i++) free(keys[i]);
+    free(keys);
+
+    m = teardownmap(null);
+    teardownfrees = 0;
+    hashmap_free_async(m);
+    for (int i = 0; i < 1000 && teardownfrees < 100000; i++) usleep(1000);
+    assert(teardownfrees == 100000);
+}
+
+static long hotencode(void *key, void *val, char *buf, long len, void *data) {
+    long n = strlen(key) + 1;
+    if (n <= len) memcpy(buf, key, n);
+    return n;
+}
+
+static int hotdecode(const char *buf, long len, void **key, void **val, void *data) {
+    *key = strndup(buf, len);
+    *val = "warm";
+    return 1;
+}
+
+static int nulldecode(const char *buf, long len, void **key, void **val, void *data) {
+    *key = strndup(buf, len);
+    *val = null;
+    return 1;
+}
+
+void test_hot() {
+    print("testing warm start...");
+    const char *path = "/tmp/nbhashmap-test.hot";
+    HashMap *m = hashmap_new(null, null, null);
+    hashmap_track_hot(m, 1000);
+    for (long i = 1; i <= 10000; i++) hashmap_putif(m, (void *)i, (void *)(i * 2), IGNORE);
+    for (int r = 0; r < 200; r++) {
+        for (long i = 1; i <= 50; i++) hashmap_get(m, (void *)(i * 100));
+    }
+    assert(hashmap_export_hot(m, 50, path, null, null) == 50);
+
+    HashMap *w = hashmap_new(null, null, null);
+    assert(hashmap_import(w, path, null, null, 4) == 50);
+    assert(getkvs(w)->len >= 40000); // sized like the exporting map
+    assert(hashmap_size(w) == 50);
+    for (long i = 1; i <= 50; i++) assert(hashmap_get(w, (void *)(i * 100)) == (void *)(i * 200));
+    hashmap_free(w);
+
+    // threads share the records in ranges, and insert like hashmap_putif, sampled and all
+    assert(hashmap_export_hot(m, 5000, path, null, null) == 5000);
+    w = hashmap_new(null, null, null);
+    hashmap_latency_reset();
+    hashmap_latency_start(1);
+    latency_countdown = 0;
+    assert(hashmap_import(w, path, null, null, 3) == 5000);
+    hashmap_latency_stop();
+    HashLatency *lat = malloc(sizeof(HashLatency));
+    hashmap_latency(lat);
+    assert(hashmap_latency_samples(lat, HASHMAP_LATENCY_PUT) == 5000);
+    free(lat);
+    assert(hashmap_size(w) == 5000);
+    for (long i = 100; i <= 5000; i += 100) assert(hashmap_get(w, (void *)i) == (void *)(i * 2));
+    hashmap_free(w);
+    hashmap_free(m);
+
+    // string keys need an encoder, the import owns the decoded keys
+    m = hashmap_new(keyequals, makehash, free);
+    hashmap_track_hot(m, 10);
+    char key[32];
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key-%d", i);
+        hashmap_putif(m, strdup(key), "cold", IGNORE);
+    }
+    for (int r = 0; r < 100; r++) hashmap_get(m, "key-42");
+    assert(hashmap_export_hot(m, 1, path, hotencode, null) == 1);
+    w = hashmap_new(keyequals, makehash, free);
+    assert(hashmap_import(w, path, hotdecode, null, 2) == 1);
+    assert(!strcmp(hashmap_get(w, "key-42"), "warm"));
+    hashmap_free(w);
+    hashmap_free(m);
+
+    // a record decoded without a value is skipped, and its key free'd
+    w = hashmap_new(keyequals, makehash, teardownfree);
+    teardownfrees = 0;
+    assert(hashmap_import(w, path, nulldecode, null, 1) == 0);
+    assert(teardownfrees == 1);
+    hashmap_free(w);
+
+    // a header claiming more records than the file can hold loads the records it has
+    FILE *f = fopen(path, "r+b");
+    hot_header hh;
+    assert(fread(&hh, sizeof(hh), 1, f) == 1);
+    hh.count = 1L << 60;
+    assert(fseek(f, 0, SEEK_SET) == 0 && fwrite(&hh, sizeof(hh), 1, f) == 1);
+    fclose(f);
+    w = hashmap_new(keyequals, makehash, free);
+    assert(hashmap_import(w, path, hotdecode, null, 2) == 1);
+    hashmap_free(w);
+
+    assert(hashmap_import(w = hashmap_new(null, null, null), "/nonexistent/nbhashmap.hot", null, null, 1) == -1);
+    hashmap_free(w);
+    unlink(path);
+}
+
+// ten keys share the home slot at the very end of the first page of slots
+static unsigned int pagedhash(void *key) { return (long)key <= 10? 65535 : (unsigned int)(long)key * 2654435761u; }
+
+void test_huge_pages() {
+    print("testing huge pages...");
+    HashMap *m = hashmap_new(intequals, pagedhash, intfree);
+    hashmap_set_huge_pages(m, HASHMAP_PAGES_2M, 1);
+    for (long i = 1; i <= 100000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    header *kvs = getkvs(m);
+    unsigned long span = kvs->probemask + 1;
+    assert(span <= kvs->len && (span & kvs->probemask) == 0);
+    long page = hashmap_page_size(m); // reserved or transparent huge pages, if the kernel has them
+    assert(page == 4096 || page == 2 * 1024 * 1024);
+    if (page == 2 * 1024 * 1024) assert(span == 65536 && kvs->len > 65536);
+    if (kvs->advised) assert(span == 65536); // laid out for the pages asked for, whatever backs them
+    for (long i = 1; i <= 100000; i++) assert(hashmap_get(m, (void *)i) == (void *)i);
+
+    // probes wrap around within their page; without huge pages, the page is the whole table
+    assert(_next(kvs, span - 1) == 0);
+    if (span < kvs->len) assert(_next(kvs, span + span - 1) == span);
+    for (unsigned long i = span; i < kvs->len; i++) {
+        long k = (long)getkey(_load(kvs, i));
+        assert(k < 1 || k > 10);
+    }
+    // the analysis counts probes within the page too, the ten keys wrapped around to its first slots
+    HashAnalysis a;
+    hashmap_analyze(m, &a);
+    assert(a.max_probe >= 9 && a.max_probe < span);
+    assert(a.max_cluster <= span);
+    for (long i = 1; i <= 10; i++) assert(hashmap_putif(m, (void *)i, null, IGNORE) == (void *)i);
+    for (long i = 1; i <= 10; i++) assert(hashmap_get(m, (void *)i) == null);
+    hashmap_free(m);
+
+    // a table without huge pages probes the whole table
+    m = hashmap_new(null, null, null);
+    for (long i = 1; i <= 100000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    assert(getkvs(m)->probemask == getkvs(m)->len - 1);
+    assert(hashmap_page_size(m) == 4096);
+    hashmap_free(m);
+}
+
+// the backing store of the write-behind tests: a log file, or an array
+static int filesink(void **pairs, long n, void *data) {
+    for (long i = 0; i < n; i++) fprintf((FILE *)data, "%ld %ld\n", (long)pairs[2 * i], (long)pairs[2 * i + 1]);
+    return 0;
+}
+
+#define WB_KEYS 20000
+static long wbstore[WB_KEYS + 1];
+static volatile int wbfail;
+static int arraysink(void **pairs, long n, void *data) {
+    if (wbfail) return 1;
+    for (long i = 0; i < n; i++) wbstore[(long)pairs[2 * i]] = (long)pairs[2 * i + 1];
+    return 0;
+}
+
+static void * wbhammer(void *data) {
+    HashMap *m = data;
+    unsigned int r = (unsigned int)(long)pthread_self();
+    for (int i = 0; i < 200000; i++) {
+        r = r * 1103515245 + 12345;
+        long k = 1 + (r >> 8) % WB_KEYS;
+        hashmap_putif(m, (void *)k, (r & 15) == 0? null : (void *)(long)(r & ~1), IGNORE);
+    }
+    return null;
+}
+
+// a pretend collector scanning a write-behind map, in which every value is twice its key
+static void wbroot(void *key, void *val, void *data) {
+    assert((long)val == (long)key * 2);
+    (*(long *)data)++;
+}
+
+void test_write_behind() {
+    print("testing write-behind...");
+    const char *path = "/tmp/nbhashmap-test.wb";
+    FILE *f = fopen(path, "w");
+    assert(f);
+    HashMap *m = hashmap_new(null, null, null);
+    hashmap_set_write_behind(m, filesink, f, 0);
+    for (long i = 1; i <= 1000; i++) hashmap_putif(m, (void *)i, (void *)(i * 2), IGNORE);
+    for (long i = 1; i <= 1000; i += 2) hashmap_putif(m, (void *)i, null, IGNORE);
+    hashmap_putif(m, (void *)5000, null, IGNORE); // deleting a key the map never had still reaches the store
+    assert(hashmap_size(m) == 500);
+    assert(hashmap_get(m, (void *)2) == (void *)4);
+    assert(hashmap_get(m, (void *)1) == null);
+    long roots = 0; // dirty values are passed untagged, and deletes not yet written behind are no roots
+    for (long b = 0; b < hashmap_gc_blocks(m); b++) hashmap_gc_scan(m, b, wbroot, &roots);
+    assert(roots == 500);
+    void *sample[200]; // and so are sampled values
+    assert(hashmap_sample(m, 100, sample) == 100);
+    for (int i = 0; i < 100; i++) assert(!((long)sample[2 * i] & 1) && sample[2 * i + 1] == (void *)((long)sample[2 * i] * 2));
+    assert(hashmap_flush(m) == 1001);
+    assert(hashmap_flush(m) == 0);
+    hashmap_putif(m, (void *)2, (void *)6, IGNORE);
+    hashmap_free(m); // flushes the last update
+    fclose(f);
+
+    long store[5001] = { 0 }, k, v, lines = 0;
+    f = fopen(path, "r");
+    while (fscanf(f, "%ld %ld", &k, &v) == 2) { store[k] = v; lines++; }
+    fclose(f);
+    unlink(path);
+    assert(lines == 1002);
+    assert(store[2] == 6 && store[4] == 8 && store[1] == 0 && store[1000] == 2000);
+
+    // updates racing the flusher and resizes are never lost
+    m = hashmap_new(null, null, null);
+    hashmap_set_write_behind(m, arraysink, null, 1);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) pthread_create(&threads[i], null, wbhammer, m);
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], null);
+    wbfail = 1;
+    hashmap_putif(m, (void *)1, (void *)42, IGNORE);
+    usleep(5000);
+    assert(hashmap_flush(m) == -1); // a failing sink keeps mappings dirty
+    wbfail = 0;
+    assert(hashmap_flush(m) > 0);
+    for (long i = 1; i <= WB_KEYS; i++) assert(wbstore[i] == (long)hashmap_get(m, (void *)i));
+    hashmap_free(m);
+}
+
+static void * flighthammer(void *data) {
+    for (long i = 1; i <= 1000; i++) hashmap_putif(data, (void *)i, (void *)i, IGNORE); // fits in a ring
+    return null;
+}
+
+// count the events of each kind in a flight recorder dump
+static long flightcount(const char *path, long *counts) {
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    flight_header h;
+    assert(fread(&h, sizeof(h), 1, f) == 1);
+    assert(!memcmp(h.magic, FLIGHT_MAGIC, 8));
+    assert(h.ticks_per_us > 0);
+    static flight_event ring[FLIGHT_EVENTS];
+    long n = 0;
+    for (unsigned int r = 0; r < h.rings; r++) {
+        unsigned long meta[2];
+        assert(fread(meta, sizeof(meta), 1, f) == 1);
+        assert(fread(ring, sizeof(ring), 1, f) == 1);
+        for (unsigned long i = 0; i < meta[1] && i < FLIGHT_EVENTS; i++) counts[ring[i].tag >> 24]++, n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static volatile int usr1s;
+static void onusr1(int sig) { usr1s++; }
+
+void test_flight() {
+    print("testing flight recorder...");
+    const char *path = "/tmp/nbhashmap-test.flight";
+    signal(SIGUSR1, onusr1);
+    assert(hashmap_flight_start(path) == 0);
+    HashMap *m = hashmap_new(null, null, null);
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) pthread_create(&threads[i], null, flighthammer, m);
+    for (int i = 0; i < 2; i++) pthread_join(threads[i], null);
+    hashmap_putif(m, (void *)1, (void *)2, IGNORE);
+    // the hammers copied so much their rings wrapped, resize a small map here so the ring keeps the resize
+    HashMap *s = hashmap_new(null, null, null);
+    for (long i = 1; i <= 100; i++) hashmap_putif(s, (void *)i, (void *)i, IGNORE);
+    raise(SIGUSR1); // dumps, and goes on to the handler we had
+    assert(usr1s == 1);
+    hashmap_flight_stop();
+    raise(SIGUSR1); // only our handler again
+    assert(usr1s == 2);
+    signal(SIGUSR1, SIG_DFL);
+    hashmap_free(s);
+    hashmap_free(m);
+
+    long counts[256] = { 0 };
+    assert(flightcount(path, counts) > 0);
+    assert(counts[FLIGHT_CLAIM] > 0 && counts[FLIGHT_HASH] > 0 && counts[FLIGHT_VALUE] > 0);
+    assert(counts[FLIGHT_PROMISE] > 0 && counts[FLIGHT_PUBLISH] > 0);
+    unlink(path);
+}
+
+static void orderrecord(void *key, void *val, void *data) {
+    long *seen = data;
+    seen[++seen[0]] = (long)key;
+}
+
+#define IO_KEYS 20000
+static volatile long ioevicted[IO_KEYS + 1];
+static volatile AO_t iothreads;
+
+static void ioevict(void *key, void *val, void *data) {
+    AO_fetch_and_add1((volatile AO_t *)&ioevicted[(long)key]);
+    assert((long)val == (long)key);
+}
+
+static void * iohammer(void *data) {
+    HashMap *m = data;
+    long id = AO_fetch_and_add1(&iothreads);
+    for (long i = id * IO_KEYS / 4 + 1; i <= (id + 1) * IO_KEYS / 4; i++) {
+        hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+        if (i % 8 == 0) hashmap_evict_oldest(m, 4, ioevict, null);
+    }
+    return null;
+}
+
+void test_insertion_order() {
+    print("testing insertion order...");
+    HashMap *m = hashmap_new(null, null, null);
+    hashmap_set_insertion_ordered(m);
+    // keys in descending order, so the order is not that of the hashes, across many resizes
+    for (long i = 5000; i >= 1; i--) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    for (long i = 1; i <= 5000; i += 2) hashmap_putif(m, (void *)i, (void *)(i + 1), IGNORE); // updates keep their place
+    static long seen[8002];
+    seen[0] = 0;
+    assert(hashmap_visit_insertion_order(m, orderrecord, seen) == 5000);
+    for (long i = 1; i <= 5000; i++) assert(seen[i] == 5001 - i);
+
+    // deleting and inserting again moves a key to the end, also after deleted keys are dropped by a resize
+    for (long i = 5000; i > 4000; i--) hashmap_putif(m, (void *)i, null, IGNORE);
+    hashmap_putif(m, (void *)1, null, IGNORE);
+    hashmap_putif(m, (void *)1, (void *)1, IGNORE);
+    for (long i = 5001; i <= 9000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    seen[0] = 0;
+    assert(hashmap_visit_insertion_order(m, orderrecord, seen) == 8000);
+    for (long i = 1; i < 4000; i++) assert(seen[i] == 4001 - i);
+    assert(seen[4000] == 1);
+    for (long i = 4001; i <= 8000; i++) assert(seen[i] == i + 1000);
+
+    // the oldest go first
+    seen[0] = 0;
+    assert(hashmap_evict_oldest(m, 10, orderrecord, seen) == 10);
+    for (long i = 1; i <= 10; i++) assert(seen[i] == 4001 - i && hashmap_get(m, (void *)seen[i]) == null);
+    assert(hashmap_size(m) == 7990);
+    assert(hashmap_evict_oldest(m, 10000, null, null) == 7990);
+    assert(hashmap_size(m) == 0);
+    assert(hashmap_visit_insertion_order(m, null, null) == 0);
+    hashmap_free(m);
+
+    // threads evicting while inserting and resizing evict every mapping at most once, and only the oldest
+    m = hashmap_new(null, null, null);
+    hashmap_set_insertion_ordered(m);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) pthread_create(&threads[i], null, iohammer, m);
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], null);
+    long evicted = 0;
+    for (long i = 1; i <= IO_KEYS; i++) {
+        assert(ioevicted[i] <= 1);
+        assert(ioevicted[i] == (hashmap_get(m, (void *)i) == null));
+        evicted += ioevicted[i];
+    }
+    assert(evicted + hashmap_size(m) == IO_KEYS);
+    hashmap_free(m);
+
+    // small blocks compact a log of many blocks, in order
+    HashTuning defaults = *hashmap_tuning(), small = defaults;
+    small.block_size = BLOCK_MIN;
+    hashmap_set_tuning(&small);
+    m = hashmap_new(null, null, null);
+    hashmap_set_insertion_ordered(m);
+    for (long i = IO_KEYS; i >= 1; i--) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    for (long i = 1; i <= IO_KEYS; i += 3) hashmap_putif(m, (void *)i, null, IGNORE);
+    hashmap_compact(m);
+    static long all[IO_KEYS + 1];
+    all[0] = 0;
+    assert(hashmap_visit_insertion_order(m, orderrecord, all) == hashmap_size(m));
+    for (long i = 1; i <= all[0]; i++) assert(hashmap_get(m, (void *)all[i]) && (i == 1 || all[i] < all[i - 1]));
+    hashmap_free(m);
+    hashmap_set_tuning(&defaults);
+}
+
+static void * tunehammer(void *data) {
+    for (long i = 1; i <= 50000; i++) hashmap_putif(data, (void *)i, (void *)i, IGNORE);
+    return null;
+}
+
+void test_tuning() {
+    print("testing tuning...");
+    HashTuning defaults = *hashmap_tuning();
+    assert(defaults.source == HASHMAP_TUNING_DEFAULT);
+    assert(defaults.block_size == BLOCK_SIZE && defaults.reprobe_limit == REPROBE_LIMIT);
+
+    // measure and save, then load
+    const char *path = "/tmp/nbhashmap-test.tuning";
+    unlink(path);
+    assert(hashmap_tune(path) == HASHMAP_TUNING_MEASURED);
+    HashTuning measured = *hashmap_tuning();
+    assert(measured.block_size > 0 && measured.reprobe_limit > 0 && measured.cpu[0]);
+    hashmap_set_tuning(&defaults);
+    assert(hashmap_tune(path) == HASHMAP_TUNING_LOADED);
+    const HashTuning *loaded = hashmap_tuning();
+    assert(loaded->block_size == measured.block_size && loaded->spin == measured.spin);
+    assert(loaded->reprobe_limit == measured.reprobe_limit && loaded->prefetch == measured.prefetch);
+    assert(!strcmp(loaded->cpu, measured.cpu));
+
+    // a profile of other processors is measured again
+    FILE *f = fopen(path, "w");
+    fprintf(f, "nbhashmap-tuning 1\ncpu some other machine\nblock_size 64\nspin 1\nreprobe_limit 5\nprefetch 2\n");
+    fclose(f);
+    assert(hashmap_tune(path) == HASHMAP_TUNING_MEASURED);
+    unlink(path);
+
+    // tiny blocks, a short reprobe limit and prefetching still resize right, with threads helping
+    HashTuning odd = defaults;
+    odd.block_size = BLOCK_MIN; odd.spin = 100; odd.reprobe_limit = 5; odd.prefetch = 3;
+    hashmap_set_tuning(&odd);
+    HashMap *m = hashmap_new(null, null, null);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) pthread_create(&threads[i], null, tunehammer, m);
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], null);
+    assert(hashmap_size(m) == 50000);
+    for (long i = 1; i <= 50000; i++) assert(hashmap_get(m, (void *)i) == (void *)i);
+    hashmap_free(m);
+
+    // flushing and gc walk a table by its own block size, whatever the tuning is now
+    HashMap *small = hashmap_new(null, null, null);
+    hashmap_set_write_behind(small, arraysink, null, 0);
+    for (long i = 1; i <= WB_KEYS; i++) hashmap_putif(small, (void *)i, (void *)(i * 2), IGNORE);
+    hashmap_set_tuning(&defaults);
+    HashMap *large = hashmap_new(null, null, null);
+    hashmap_set_write_behind(large, arraysink, null, 0);
+    for (long i = 1; i <= WB_KEYS; i++) hashmap_putif(large, (void *)i, (void *)(i * 2), IGNORE);
+    memset(wbstore, 0, sizeof(wbstore));
+    assert(hashmap_flush(large) == WB_KEYS);
+    assert(hashmap_flush(small) == WB_KEYS);
+    for (long i = 1; i <= WB_KEYS; i++) assert(wbstore[i] == i * 2);
+    assert(hashmap_gc_blocks(small) == getkvs(small)->len / BLOCK_MIN);
+    assert(hashmap_gc_blocks(large) == getkvs(large)->len / BLOCK_SIZE);
+    long roots = 0;
+    for (long b = 0; b < hashmap_gc_blocks(small); b++) hashmap_gc_scan(small, b, wbroot, &roots);
+    assert(roots == WB_KEYS);
+    hashmap_free(small);
+    hashmap_free(large);
+}
+
+static volatile int reseeding;
+
+static void * seedhammer(void *data) {
+    HashMap *m = data;
+    for (int round = 0; reseeding; round++) {
+        for (long i = 1; i <= 2000; i++) {
+            hashmap_putif(m, (void *)i, (void *)(i + round), IGNORE);
+            void *v = hashmap_get(m, (void *)i);
+            assert(v != null);
+        }
+    }
+    return null;
+}
+
+void test_reseed() {
+    print("testing reseeding...");
+    HashMap *m = hashmap_new(intequals, clusterhash, intfree);
+    for (long i = 1; i <= 500; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    unsigned long clustered = getkvs(m)->len;
+    assert(clustered >= 500 * 64); // grown until the clustered keys spread out
+
+    hashmap_reseed(m);
+    assert(getkvs(m)->seed && getkvs(m)->seed == m->seed);
+    assert(getkvs(m)->len < clustered);
+    assert(hashmap_size(m) == 500);
+    for (long i = 1; i <= 500; i++) assert(hashmap_get(m, (void *)i) == (void *)i);
+    for (long i = 501; i <= 1000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    assert(getkvs(m)->len <= 1000 * 16);
+    for (long i = 1; i <= 1000; i++) assert(hashmap_get(m, (void *)i) == (void *)i);
+
+    // handles follow their mapping to a table with another seed; the insertion order is kept
+    HashHandle handle;
+    assert(hashmap_pin(m, (void *)7, &handle));
+    hashmap_reseed(m);
+    assert(hashmap_handle_cas(&handle, (void *)70, (void *)7) == (void *)7);
+    assert(hashmap_get(m, (void *)7) == (void *)70);
+    hashmap_free(m);
+
+    m = hashmap_new(null, null, null);
+    hashmap_set_insertion_ordered(m);
+    for (long i = 300; i >= 1; i--) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    hashmap_reseed(m);
+    hashmap_reseed(m);
+    long seen[302] = { 0 };
+    assert(hashmap_visit_insertion_order(m, orderrecord, seen) == 300);
+    for (long i = 1; i <= 300; i++) assert(seen[i] == 301 - i);
+    hashmap_free(m);
+
+    // reseeding while other threads read and write
+    m = hashmap_new(null, null, null);
+    for (long i = 1; i <= 2000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    reseeding = 1;
+    pthread_t threads[3];
+    for (int i = 0; i < 3; i++) pthread_create(&threads[i], null, seedhammer, m);
+    for (int i = 0; i < 20; i++) { hashmap_reseed(m); usleep(1000); }
+    reseeding = 0;
+    for (int i = 0; i < 3; i++) pthread_join(threads[i], null);
+    assert(hashmap_size(m) == 2000);
+    for (long i = 1; i <= 2000; i++) assert(hashmap_get(m, (void *)i) != null);
+    hashmap_free(m);
+}
+
+static void * fchammer(void *data) {
+    HashMap *m = data;
+    char key[128];
+    for (long i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "https://example.com/static/images/%ld.png", i % 5000);
+        hashmap_putif(m, strdup(key), (void *)(i % 5000 + 1), IGNORE);
+        long j = (i * 7) % 5000;
+        snprintf(key, sizeof(key), "https://example.com/static/images/%ld.png", j);
+        void *v = hashmap_get(m, key);
+        assert(v == null || v == (void *)(j + 1));
+    }
+    return null;
+}
+
+void test_front_coded() {
+    print("testing front coded keys...");
+    HashMap *m = hashmap_new(keyequals, makehash, free);
+    hashmap_set_front_coded(m);
+    char key[FC_MAX + 16];
+    for (long i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "/var/cache/app/users/%ld/profile/%s%ld", i % 100, i % 3? "avatar-" : "", i);
+        hashmap_putif(m, strdup(key), (void *)(i + 1), IGNORE);
+    }
+    hashmap_putif(m, strdup("short"), (void *)1, IGNORE);
+    memset(key, 'x', FC_MAX + 8); key[FC_MAX + 8] = 0;
+    hashmap_putif(m, strdup(key), (void *)2, IGNORE); // too long to code
+    hashmap_compact(m); // copies every key into chunks
+
+    long coded_keys = 0;
+    header *kvs = getkvs(m);
+    for (unsigned long i = 0; i < kvs->len; i++) if (getkey(_load(kvs, i)) && coded(getkey(_load(kvs, i)))) coded_keys++;
+    assert(coded_keys == 10001);
+    for (unsigned long i = 0; i < kvs->len; i++) { // coded keys carry the fingerprint of their hash
+        void *k = getkey(_load(kvs, i));
+        if (k && coded(k)) assert((unsigned char)((AO_t)k >> FC_FP_SHIFT) == fingerprint(gethash(kvs, i)));
+    }
+    assert(kvs->dict->count - 1 - (kvs->dict->spare != 0) <= 101); // a prefix per user; hardly any ids lost to races
+    long chunked = 0;
+    for (fc_chunk *c = kvs->keys; c; c = c->next) chunked += 1L << c->shift;
+    assert(chunked < 10000 * 30); // as given, a key takes 44 bytes, most of it a prefix 100 keys share
+    assert(hashmap_size(m) == 10002);
+    assert(hashmap_get(m, key) == (void *)2);
+    assert(hashmap_get(m, "short") == (void *)1);
+    assert(hashmap_get(m, "shor") == null && hashmap_get(m, "shorts") == null);
+    for (long i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "/var/cache/app/users/%ld/profile/%s%ld", i % 100, i % 3? "avatar-" : "", i);
+        assert(hashmap_get(m, key) == (void *)(i + 1));
+    }
+    assert(hashmap_get(m, "/var/cache/app/users/1/profile/") == null);
+
+    // updating with an equal key frees the new key, deleting drops a coded key at the next resize
+    assert(hashmap_putif(m, strdup("/var/cache/app/users/6/profile/6"), (void *)70, IGNORE) == (void *)7);
+    assert(hashmap_get(m, "/var/cache/app/users/6/profile/6") == (void *)70);
+    hashmap_putif(m, strdup("/var/cache/app/users/6/profile/6"), null, IGNORE);
+    hashmap_compact(m);
+    assert(hashmap_get(m, "/var/cache/app/users/6/profile/6") == null);
+    assert(hashmap_size(m) == 10001);
+
+    // keys handed out decode to the original strings
+    void *out[2];
+    char buf[256];
+    assert(hashmap_sample(m, 1, out) == 1);
+    const char *s = hashmap_decode_key(m, out[0], buf, sizeof(buf));
+    assert(hashmap_get(m, (void *)s) == out[1]);
+    hashmap_free(m);
+
+    // threads inserting while resizes code keys
+    m = hashmap_new(keyequals, makehash, free);
+    hashmap_set_front_coded(m);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) pthread_create(&threads[i], null, fchammer, m);
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], null);
+    assert(hashmap_size(m) == 5000);
+    for (long i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "https://example.com/static/images/%ld.png", i);
+        assert(hashmap_get(m, key) == (void *)(i + 1));
+    }
+    hashmap_free(m);
+}
+
+void test_get_many() {
+    // batches longer than one prefetch round, of keys that are there and not, while compact layouts resize
+    HashMap *m = hashmap_new(keyequals, makehash, free);
+    hashmap_set_layout(m, HASHMAP_LAYOUT_COMPACT);
+    char *keys[100];
+    void *vals[100];
+    for (long i = 0; i < 100; i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "key-%ld", i);
+        keys[i] = strdup(buf);
+        if (i % 3) hashmap_putif(m, strdup(buf), (void *)(i + 1), IGNORE);
+    }
+    hashmap_get_many(m, (void **)keys, 100, vals);
+    for (long i = 0; i < 100; i++) {
+        void *want = i % 3? (void *)(i + 1) : null;
+        assert(vals[i] == want);
+    }
+    hashmap_get_many(m, (void **)keys, 0, vals);
+    for (long i = 0; i < 100; i++) free(keys[i]);
+    hashmap_free(m);
+}
+
+static void * densehammer(void *data) {
+    HashMap *m = ((void **)data)[0];
+    long t = (long)((void **)data)[1];
+    for (long i = t + 1; i <= 40000; i += 4) {
+        assert(hashmap_putif(m, (void *)i, (void *)i, null) == null);
+        assert(hashmap_putif(m, (void *)i, (void *)(i * 2), (void *)i) == (void *)i);
+        if (i % 10 == 0) assert(hashmap_putif(m, (void *)i, null, IGNORE) == (void *)(i * 2));
+    }
+    return null;
+}
+
+// a pretend collector scanning a dense table, in which every value is its key
+static void denseroot(void *key, void *val, void *data) {
+    assert(key == val);
+    (*(long *)data)++;
+}
+
+void test_dense() {
+    print("testing dense keys...");
+    HashMap *m = hashmap_new(null, null, null);
+    hashmap_set_dense(m);
+    for (long i = 1; i <= 10000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    hashmap_compact(m);
+    assert(hashmap_layout(m, null) == HASHMAP_LAYOUT_DENSE);
+    assert(hashmap_size(m) == 10000);
+    for (long i = 1; i <= 10000; i++) assert(hashmap_get(m, (void *)i) == (void *)i);
+    assert(hashmap_get(m, (void *)20000) == null);
+
+    // the same semantics as a hashed table
+    assert(hashmap_putif(m, (void *)5, (void *)6, (void *)7) == (void *)5);
+    assert(hashmap_putif(m, (void *)5, (void *)6, (void *)5) == (void *)5);
+    assert(hashmap_putif(m, (void *)5, null, IGNORE) == (void *)6);
+    assert(hashmap_get(m, (void *)5) == null);
+    assert(hashmap_putif(m, (void *)5, null, IGNORE) == null);
+    assert(hashmap_putif(m, (void *)20000, null, IGNORE) == null);
+    assert(hashmap_size(m) == 9999);
+
+    // a collector finds the values of a dense table, with their keys
+    long roots = 0;
+    for (long b = 0; b < hashmap_gc_blocks(m); b++) hashmap_gc_scan(m, b, denseroot, &roots);
+    assert(roots == 9999);
+
+    // appending keys widens the table; a far away key makes it hashed again, until it is gone
+    for (long i = 10001; i <= 30000; i++) hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+    assert(hashmap_layout(m, null) == HASHMAP_LAYOUT_DENSE);
+    hashmap_putif(m, (void *)(1L << 40), (void *)1, IGNORE);
+    assert(hashmap_layout(m, null) != HASHMAP_LAYOUT_DENSE);
+    assert(hashmap_get(m, (void *)(1L << 40)) == (void *)1);
+    for (long i = 1; i <= 30000; i++) assert(hashmap_get(m, (void *)i) == (i == 5? null : (void *)i));
+    hashmap_putif(m, (void *)(1L << 40), null, IGNORE);
+    hashmap_compact(m);
+    assert(hashmap_layout(m, null) == HASHMAP_LAYOUT_DENSE);
+    assert(hashmap_size(m) == 29999);
+
+    // deleting most keys makes it sparse, and hashed
+    for (long i = 1; i <= 30000; i++) if (i % 100) hashmap_putif(m, (void *)i, null, IGNORE);
+    assert(hashmap_layout(m, null) != HASHMAP_LAYOUT_DENSE);
+    assert(hashmap_size(m) == 300);
+    for (long i = 100; i <= 30000; i += 100) assert(hashmap_get(m, (void *)i) == (void *)i);
+    hashmap_free(m);
+
+    // threads inserting, updating and deleting, while the table goes dense and widens
+    m = hashmap_new(null, null, null);
+    hashmap_set_dense(m);
+    pthread_t threads[4];
+    void *args[4][2];
+    for (long t = 0; t < 4; t++) {
+        args[t][0] = m; args[t][1] = (void *)t;
+        pthread_create(&threads[t], null, densehammer, args[t]);
+    }
+    for (int t = 0; t < 4; t++) pthread_join(threads[t], null);
+    assert(hashmap_layout(m, null) == HASHMAP_LAYOUT_DENSE);
+    assert(hashmap_size(m) == 36000);
+    for (long i = 1; i <= 40000; i++) {
+        void *want = i % 10? (void *)(i * 2) : null;
+        assert(hashmap_get(m, (void *)i) == want);
+    }
+    void *keys[3] = { (void *)1, (void *)10, (void *)50000 }, *vals[3];
+    hashmap_get_many(m, keys, 3, vals);
+    assert(vals[0] == (void *)2 && vals[1] == null && vals[2] == null);
+    hashmap_free(m);
+}
+
+static void * latencyhammer(void *data) {
+    HashMap *m = data;
+    for (long i = 1; i <= 1000; i++) {
+        hashmap_putif(m, (void *)i, (void *)i, IGNORE);
+        hashmap_get(m, (void *)i);
+    }
+    return null;
+}
+
+static void test_latency() {
+    print("testing latency sampling...");
+    // buckets are exact below 8, then 8 per power of two
+    for (unsigned long long v = 0; v < 8; v++) assert(latency_bucket(v) == v);
+    unsigned long long ticks[] = { 8, 15, 16, 17, 1000, 123456789, 1ULL << 40, 1ULL << 62 };
+    for (int i = 0; i < 8; i++) {
+        unsigned int b = latency_bucket(ticks[i]);
+        assert(b < HASHMAP_LATENCY_BUCKETS);
+        assert(latency_bucket_end(b) > ticks[i] && latency_bucket_end(b - 1) <= ticks[i]);
+        assert(latency_bucket_end(b) <= ticks[i] * 1.125 + 1);
+    }
+
+    hashmap_latency_reset();
+    hashmap_latency_start(1);
+    HashMap *m = hashmap_new(null, null, null);
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++) pthread_create(&threads[t], null, latencyhammer, m);
+    for (int t = 0; t < 4; t++) pthread_join(threads[t], null);
+    hashmap_latency_stop();
+    hashmap_putif(m, (void *)1, (void *)2, IGNORE); // not sampled
+    hashmap_free(m);
+
+    HashLatency *lat = malloc(sizeof(HashLatency));
+    hashmap_latency(lat);
+    assert(lat->ticks_per_ns > 0);
+    assert(hashmap_latency_samples(lat, HASHMAP_LATENCY_GET) == 4000);
+    assert(hashmap_latency_samples(lat, HASHMAP_LATENCY_PUT) == 4000);
+    assert(hashmap_latency_samples(lat, HASHMAP_LATENCY_RESIZE) > 0); // the map grew from its initial size
+    double p50 = hashmap_latency_quantile(lat, HASHMAP_LATENCY_PUT, 0.5);
+    double p99 = hashmap_latency_quantile(lat, HASHMAP_LATENCY_PUT, 0.99);
+    assert(p50 > 0 && p50 <= p99 && p99 <= hashmap_latency_quantile(lat, HASHMAP_LATENCY_PUT, 1));
+    // puts that resized are blamed on it
+    unsigned long resized = 0;
+    for (int b = 0; b < HASHMAP_LATENCY_BUCKETS; b++) resized += lat->count[HASHMAP_LATENCY_PUT][HASHMAP_CAUSE_RESIZE][b];
+    assert(resized > 0);
+    double share[HASHMAP_CAUSES], sum = 0;
+    hashmap_latency_tail(lat, HASHMAP_LATENCY_PUT, 0.99, share);
+    for (int c = 0; c < HASHMAP_CAUSES; c++) sum += share[c];
+    assert(sum > 0.999 && sum < 1.001);
+    hashmap_latency_print(lat);
+
+    // 1 in 4 sampled, under the worst cause seen
+    hashmap_latency_reset();
+    hashmap_latency_start(4);
+    latency_countdown = 0;
+    m = hashmap_new(null, null, null);
+    for (long i = 1; i <= 100; i++) hashmap_get(m, (void *)i);
+    hashmap_free(m);
+    unsigned long long start = latency_begin();
+    assert(start);
+    latency_cause(HASHMAP_CAUSE_CAS);
+    latency_cause(HASHMAP_CAUSE_WAIT_HASH);
+    latency_end(HASHMAP_LATENCY_PUT, start);
+    hashmap_latency_stop();
+    hashmap_latency(lat);
+    assert(hashmap_latency_samples(lat, HASHMAP_LATENCY_GET) == 25);
+    assert(hashmap_latency_samples(lat, HASHMAP_LATENCY_PUT) == 1);
+    hashmap_latency_tail(lat, HASHMAP_LATENCY_PUT, 0, share);
+    assert(share[HASHMAP_CAUSE_WAIT_HASH] == 1);
+    hashmap_latency_reset();
+    hashmap_latency(lat);
+    assert(hashmap_latency_samples(lat, HASHMAP_LATENCY_GET) == 0);
+    assert(hashmap_latency_quantile(lat, HASHMAP_LATENCY_GET, 0.5) == 0);
+    // the next sample after a reset starts from zero
+    hashmap_latency_start(1);
+    latency_countdown = 0;
+    m = hashmap_new(null, null, null);
+    hashmap_get(m, (void *)1);
+    hashmap_free(m);
+    hashmap_latency_stop();
+    hashmap_latency(lat);
+    assert(hashmap_latency_samples(lat, HASHMAP_LATENCY_GET) == 1);
+    assert(hashmap_latency_samples(lat, HASHMAP_LATENCY_PUT) == 0);
+    free(lat);
+}
+
+static HashOverlay *overlay;
+static volatile int overlaydone;
+
+static void * overlayhammer(void *data) {
+    long t = (long)data;
+    for (long k = 1; k <= 20000; k++) {
+        if (k % 4 != t) continue;
+        if (k % 7 == 0) hashmap_overlay_put(overlay, (void *)k, null);
+        else hashmap_overlay_put(overlay, (void *)k, (void *)(k * 2));
+        void *v = hashmap_overlay_get(overlay, (void *)k);
+        void *want = k % 7? (void *)(k * 2) : null;
+        assert(v == want);
+    }
+    return null;
+}
+
+static void * overlayreader(void *data) {
+    while (!overlaydone) {
+        for (long k = 1; k <= 20000; k += 13) {
+            void *v = hashmap_overlay_get(overlay, (void *)k);
+            assert(v == null || v == (void *)(k * 2) || (k <= 10000 && v == (void *)k));
+        }
+    }
+    return null;
+}
+
+static void test_overlay() {
+    print("testing overlay...");
+    HashMap *base = hashmap_new(keyequals, makehash, free);
+    char buf[32];
+    for (long i = 0; i < 1000; i++) {
+        sprintf(buf, "key%ld", i);
+        hashmap_putif(base, strdup(buf), (void *)(i + 1), IGNORE);
+    }
+    HashBudget *budget = hashbudget_new(1 << 20);
+    hashmap_set_budget(base, budget);
+    hashmap_reseed(base);
+    unsigned long seed = base->seed;
+    HashOverlay *o = hashmap_overlay_new(base);
+    assert(hashmap_overlay_get(o, "key5") == (void *)6);
+    assert(hashmap_overlay_get(o, "nokey") == null);
+
+    // overrides, a deleted base key, a new key; deleting a key nobody has leaves nothing
+    assert(hashmap_overlay_put(o, strdup("key5"), (void *)500) == (void *)6);
+    assert(hashmap_overlay_put(o, strdup("key6"), null) == (void *)7);
+    assert(hashmap_overlay_put(o, strdup("new"), (void *)1) == null);
+    assert(hashmap_overlay_put(o, strdup("nokey"), null) == null);
+    assert(hashmap_overlay_delta_size(o) == 3);
+    assert(hashmap_overlay_get(o, "key5") == (void *)500);
+    assert(hashmap_overlay_get(o, "key6") == null);
+    assert(hashmap_overlay_get(o, "new") == (void *)1);
+    assert(hashmap_overlay_put(o, strdup("key6"), null) == null);
+    assert(hashmap_overlay_put(o, strdup("key6"), (void *)60) == null);
+    assert(hashmap_overlay_get(o, "key6") == (void *)60);
+    assert(hashmap_overlay_put(o, strdup("new"), null) == (void *)1);
+
+    // compacting folds the delta into the base, moving the keys
+    assert(hashmap_overlay_compact(o) == 1000);
+    assert(hashmap_overlay_delta_size(o) == 0);
+    assert(hashmap_overlay_get(o, "key5") == (void *)500);
+    assert(hashmap_overlay_get(o, "key6") == (void *)60);
+    assert(hashmap_overlay_get(o, "key7") == (void *)8);
+    assert(hashmap_overlay_get(o, "new") == null);
+    assert(hashmap_overlay_put(o, strdup("key7"), null) == (void *)8);
+    assert(hashmap_overlay_compact(o) == 999);
+    assert(hashmap_overlay_get(o, "key7") == null);
+    overlay_layer *l = (overlay_layer *)o->_layer; // the new base and delta keep the seed and the budget
+    assert(l->base->seed == seed && l->delta->map->seed == seed);
+    assert(l->base->budget == budget && l->delta->map->budget == budget);
+    hashmap_overlay_free(o);
+    assert(hashbudget_used(budget) == 0);
+    hashbudget_free(budget);
+
+    // writers and readers while compacting over and over
+    base = hashmap_new(null, null, null);
+    for (long k = 1; k <= 10000; k++) hashmap_putif(base, (void *)k, (void *)k, IGNORE);
+    overlay = hashmap_overlay_new(base);
+    overlaydone = 0;
+    pthread_t writers[4], reader;
+    pthread_create(&reader, null, overlayreader, null);
+    for (long t = 0; t < 4; t++) pthread_create(&writers[t], null, overlayhammer, (void *)t);
+    for (int i = 0; i < 20; i++) {
+        if (i % 2) hashmap_overlay_compact_async(overlay);
+        else hashmap_overlay_compact(overlay);
+        usleep(1000);
+    }
+    for (int t = 0; t < 4; t++) pthread_join(writers[t], null);
+    overlaydone = 1;
+    pthread_join(reader, null);
+    while (hashmap_overlay_compact(overlay) < 0) yield();
+    assert(hashmap_overlay_delta_size(overlay) == 0);
+    for (long k = 1; k <= 20000; k++) {
+        void *want = k % 7? (void *)(k * 2) : null;
+        assert(hashmap_overlay_get(overlay, (void *)k) == want);
+    }
+    hashmap_overlay_free(overlay);
+}
+
 void freekey(void *key) {
     print("FREEING: %s", (const char *)key);
     free(key);
@@ -186,8 +1677,33 @@ void freekey(void *key) {
 
 int main(int argc, char **argv) {
     print("starting...");
+    test_cache();
+    test_budget();
+    test_pressure();
+    test_layouts();
+    test_ordered();
+    test_analyze();
+    test_weak();
+    test_handles();
+    test_sample();
+    test_window();
+    test_delegate();
+    test_teardown();
+    test_hot();
+    test_huge_pages();
+    test_write_behind();
+    test_flight();
+    test_insertion_order();
+    test_tuning();
+    test_reseed();
+    test_front_coded();
+    test_get_many();
+    test_dense();
+    test_latency();
+    test_overlay();
 
     map = hashmap_new(keyequals, makehash, free);
+    hashmap_set_layout(map, HASHMAP_LAYOUT_ADAPTIVE);
     hashmap_putif(map, strdup("hello world"), "bye world", IGNORE);
     hashmap_putif(map, strdup("hello world"), "see you soon", IGNORE);
     print("%ld", hashmap_size(map));